@@ -49,7 +49,7 @@ class InstructionListHolder {
   }
 
   InstructionHolder Instruction(size_t index) {
-    return *new InstructionHolder(handle_, instrs_ + index);
+    return InstructionHolder(handle_, instrs_ + index);
   }
 
  private:
@@ -17,10 +17,10 @@
 #include "CLRDataTarget.h"
 
 static const wchar_t* ProfilerPipeName = L"\\\\.\\pipe\\PEXProfilerPipe";
+static const wchar_t* SharedMemoryRingVariable = L"PEX_SHARED_MEMORY_RING";
 
 CComPtr<ISOSDacInterface> dac_;
-std::unordered_set<UINT_PTR> recordedAddrs_;
-std::mutex lock_;
+std::unordered_set<UINT_PTR> recordedAddrs_;  // Used only by the export thread.
 bool sessionEnded_;
 
 HRESULT __stdcall CoreProfiler::QueryInterface(REFIID riid, void** ppvObject) {
@@ -190,7 +190,9 @@ HRESULT CoreProfiler::Initialize(IUnknown* pICorProfilerInfoUnk) {
       // COR_PRF_MONITOR_CLASS_LOADS |
       // COR_PRF_MONITOR_THREADS |
       // COR_PRF_MONITOR_EXCEPTIONS |
-      COR_PRF_MONITOR_JIT_COMPILATION, COR_PRF_HIGH_MONITOR_EVENT_PIPE);
+      COR_PRF_MONITOR_JIT_COMPILATION,
+      COR_PRF_HIGH_MONITOR_EVENT_PIPE |
+          COR_PRF_HIGH_MONITOR_DYNAMIC_FUNCTION_UNLOADS);
 
   /*while (!::IsDebuggerPresent())
   {
@@ -212,6 +214,21 @@ HRESULT CoreProfiler::Initialize(IUnknown* pICorProfilerInfoUnk) {
 
   Log("PEX: Connected to pipe for proc %d\n", processId_);
 
+  // The ring is offered only if enabled in Profile Explorer,
+  // older versions never reply to the offer.
+  wchar_t ringValue[8];
+
+  if (GetEnvironmentVariableW(SharedMemoryRingVariable, ringValue, 8) == 1 &&
+      ringValue[0] == L'1') {
+    ringEnabled_ = true;
+  }
+
+  if (ringEnabled_) {
+    OfferSharedMemoryRing();
+  }
+
+  StartExportThread();
+
   pipeClientThread_ = new std::thread([this]() {
     Log("PEX: Started pipe thread\n");
     bool canceled = false;
@@ -231,6 +248,15 @@ HRESULT CoreProfiler::Initialize(IUnknown* pICorProfilerInfoUnk) {
               }
               break;
             }
+            case PipeMessageKind::SharedMemoryRing: {
+              // A reply after the offer timed out is ignored.
+              auto reply = (SharedMemoryRingMessage*)messageBody.get();
+              auto expected = RingState::Pending;
+              ringState_.compare_exchange_strong(
+                  expected,
+                  reply->Accepted ? RingState::Accepted : RingState::Rejected);
+              break;
+            }
             case PipeMessageKind::EndSession: {
               sessionEnded_.store(true);
               pipeClient_->Disconnect();
@@ -252,6 +278,9 @@ HRESULT CoreProfiler::Initialize(IUnknown* pICorProfilerInfoUnk) {
         },
         canceled);
 
+    // Nobody is reading anymore, stop the export thread from
+    // waiting on a full shared memory ring.
+    sessionEnded_.store(true);
     Log(">PEX: Stop pipe thread\n");
   });
 
@@ -317,41 +346,48 @@ bool CoreProfiler::SendRequestedFunctionCode(
   }
 
   for (auto&& rejit : rejitIds) {
-    if (rejit != request.ReJITId) {
-      continue;
+    if (rejit == request.ReJITId) {
+      QueueFunctionCode(request.FunctionId, rejit);
     }
+  }
 
-    // Log("PEX: Handle RejitID %d\n", rejit);
-    ULONG32 addrs = 0;
-    profilerInfo_->GetNativeCodeStartAddresses(request.FunctionId, rejit, 0,
-                                               &addrs, nullptr);
-    std::vector<UINT_PTR> addr(addrs);
-    profilerInfo_->GetNativeCodeStartAddresses(request.FunctionId, rejit, addrs,
-                                               &addrs, addr.data());
-
-    for (int rejit = 0; rejit < addrs; rejit++) {
-      ULONG32 cCodeInfos2;
-      profilerInfo_->GetCodeInfo4(addr[rejit], 0, &cCodeInfos2, nullptr);
-      std::vector<COR_PRF_CODE_INFO> codeInfos2(cCodeInfos2);
-      profilerInfo_->GetCodeInfo4(addr[rejit], cCodeInfos2, &cCodeInfos2,
-                                  codeInfos2.data());
-
-      for (auto&& codeInfo : codeInfos2) {
-        //? TODO: Lock could be moved down if R/W
-        //?   also not needed after adding
-        std::lock_guard<std::mutex> lock(lock_);
-
-        if (recordedAddrs_.find(codeInfo.startAddress) !=
-            recordedAddrs_.end()) {
-          continue;
-        }
+  return true;
+}
+
+bool CoreProfiler::QueueFunctionCode(uint64_t funcId, ReJITID rejitId) {
+  if (exportThread_ == nullptr) {
+    return false;
+  }
 
-        recordedAddrs_.insert(codeInfo.startAddress);
-        SendLoadedFunctionCode(request.FunctionId, codeInfo.startAddress, rejit,
-                               (uint32_t)codeInfo.size,
-                               (char*)codeInfo.startAddress);
-        SendCallTargets(request.FunctionId, rejit, (uint32_t)codeInfo.size,
-                        (char*)codeInfo.startAddress);
+  ULONG32 addrs = 0;
+  profilerInfo_->GetNativeCodeStartAddresses(funcId, rejitId, 0, &addrs,
+                                             nullptr);
+  std::vector<UINT_PTR> addr(addrs);
+  profilerInfo_->GetNativeCodeStartAddresses(funcId, rejitId, addrs, &addrs,
+                                             addr.data());
+
+  for (int rejit = 0; rejit < addrs; rejit++) {
+    ULONG32 cCodeInfos2;
+    profilerInfo_->GetCodeInfo4(addr[rejit], 0, &cCodeInfos2, nullptr);
+    std::vector<COR_PRF_CODE_INFO> codeInfos2(cCodeInfos2);
+    profilerInfo_->GetCodeInfo4(addr[rejit], cCodeInfos2, &cCodeInfos2,
+                                codeInfos2.data());
+
+    for (auto&& codeInfo : codeInfos2) {
+      // Copy the code now, the export thread sends it later
+      // without having to suspend the runtime.
+      auto record = new FunctionCodeRecord(funcId, codeInfo.startAddress, rejit,
+                                           (int32_t)codeInfo.size);
+      memcpy(record->CodeBytes.get(), (void*)codeInfo.startAddress,
+             codeInfo.size);
+
+      // Counted before the push so the export thread doesn't go to sleep
+      // while a record is being added. Wake it up only if it may be waiting.
+      bool wasEmpty = pendingExports_.fetch_add(1) == 0;
+      exportQueue_.Push(record);
+
+      if (wasEmpty) {
+        SetEvent(exportEvent_);
       }
     }
   }
@@ -359,26 +395,189 @@ bool CoreProfiler::SendRequestedFunctionCode(
   return true;
 }
 
-bool CoreProfiler::SendLoadedFunctionCode(uint64_t funcId,
-                                          uint64_t address,
-                                          uint32_t rejitId,
-                                          uint32_t codeSize,
-                                          char* codeByes) {
-  if (pipeClient_ != nullptr) {
+void CoreProfiler::StartExportThread() {
+  exportEvent_ = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+  stopExport_.store(false);
+
+  exportThread_ = new std::thread([this]() {
+    Log("PEX: Started export thread\n");
+
+    while (true) {
+      if (pendingExports_.load() == 0) {
+        if (stopExport_.load()) {
+          break;
+        }
+
+        WaitForSingleObject(exportEvent_, INFINITE);
+        continue;
+      }
+
+      if (!SendQueuedFunctionCode()) {
+        // A producer is in the middle of a push, retry shortly.
+        SwitchToThread();
+      }
+    }
+
+    Log("PEX: Stop export thread\n");
+  });
+}
+
+void CoreProfiler::StopExportThread() {
+  if (exportThread_ == nullptr) {
+    return;
+  }
+
+  stopExport_.store(true);
+  SetEvent(exportEvent_);
+  exportThread_->join();
+
+  delete exportThread_;
+  exportThread_ = nullptr;
+  CloseHandle(exportEvent_);
+  exportEvent_ = nullptr;
+}
+
+bool CoreProfiler::SendQueuedFunctionCode() {
+  bool sentAny = false;
+  FunctionCodeRecord* next;
+
+  // Drain the queue into large pipe writes, a batch is sent
+  // when full or once no more records are queued.
+  while ((next = exportQueue_.Pop()) != nullptr) {
+    std::unique_ptr<FunctionCodeRecord> record(next);
+
+    if (exportBatch_.IsEmpty()) {
+      UpdateExportTransport();
+    }
+
+    pendingExports_.fetch_sub(1);
+    sentAny = true;
+
+    if (sessionEnded_.load() ||
+        recordedAddrs_.find(record->Address) != recordedAddrs_.end()) {
+      continue;
+    }
+
+    recordedAddrs_.insert(record->Address);
     Log("PEX: Sending code for funcId %llu, IP %llu, code size %d\n",
-        funcId, address, codeSize);
-    SendFunctionCode(*pipeClient_, funcId, address, rejitId, processId_,
-                     codeSize, codeByes);
-    Log("PEX: Sent code for funcId %llu, IP %llu, code size %d\n",
-        funcId, address, codeSize);
+        record->FunctionId, record->Address, record->CodeSize);
+    exportBatch_.AppendFunctionCode(record->FunctionId, record->Address,
+                                    record->ReJITId, processId_,
+                                    record->CodeSize, record->CodeBytes.get());
+    SendCallTargets(record.get());
+
+    if (exportBatch_.Size() >= ExportBatchSize) {
+      SendExportBatch();
+    }
   }
 
-  return true;
+  if (sessionEnded_.load()) {
+    exportBatch_.Clear();
+    BatchTargetNamesSent(false);
+  } else {
+    SendExportBatch();
+  }
+
+  return sentAny;
+}
+
+bool CoreProfiler::SendExportBatch() {
+  bool result;
+
+  if (!useRing_) {
+    result = exportBatch_.Send(*pipeClient_);
+  } else {
+    result = exportBatch_.IsEmpty() ||
+             ring_.Write(exportBatch_.Data(), exportBatch_.Size(),
+                         sessionEnded_);
+    exportBatch_.Clear();
+  }
+
+  BatchTargetNamesSent(result);
+  return result;
+}
+
+void CoreProfiler::BatchTargetNamesSent(bool sent) {
+  std::lock_guard<std::mutex> lock(callTargetLock_);
+
+  // Names in a dropped batch never reached Profile Explorer,
+  // include them again the next time their target is sent.
+  if (!sent) {
+    for (auto target : batchTargetNames_) {
+      auto it = callTargetNames_.find(target);
+
+      if (it != callTargetNames_.end()) {
+        it->second.Sent = false;
+      }
+    }
+  }
+
+  batchTargetNames_.clear();
+}
+
+void CoreProfiler::OfferSharedMemoryRing() {
+  if (!ring_.Create(processId_, SharedMemoryRing::DefaultCapacity)) {
+    Log("PEX: Failed to create shared memory ring\n");
+    return;
+  }
+
+  ringOfferTime_ = GetTickCount64();
+  ringState_.store(RingState::Pending);
+
+  SharedMemoryRingMessage message;
+  message.ProcessId = processId_;
+  message.Accepted = 0;
+  message.Capacity = SharedMemoryRing::DefaultCapacity;
+
+  if (!pipeClient_->SendMessage(PipeMessageKind::SharedMemoryRing, message)) {
+    ringState_.store(RingState::Rejected);
+  }
+}
+
+void CoreProfiler::UpdateExportTransport() {
+  // Called before a new batch is started. Code is sent over the pipe
+  // while the offer is pending, the export thread never waits for the reply.
+  if (useRing_ || !ring_.IsOpen()) {
+    return;
+  }
+
+  auto state = ringState_.load();
+
+  if (state == RingState::Pending) {
+    if (GetTickCount64() - ringOfferTime_ < RingReplyTimeout) {
+      return;
+    }
+
+    // No reply, give up on the ring unless it was just accepted.
+    if (ringState_.compare_exchange_strong(state, RingState::Rejected)) {
+      state = RingState::Rejected;
+    }
+  }
+
+  if (state != RingState::Accepted) {
+    Log("PEX: Shared memory ring not accepted, using pipe\n");
+    ring_.Close();
+    return;
+  }
+
+  // The ring and pipe are read by different threads in Profile Explorer,
+  // messages on the ring must not refer to names sent over the pipe.
+  {
+    std::lock_guard<std::mutex> lock(callTargetLock_);
+
+    for (auto& pair : callTargetNames_) {
+      pair.second.Sent = false;
+    }
+  }
+
+  useRing_ = true;
+  Log("PEX: Switched to sending code over shared memory\n");
 }
 
 HRESULT CoreProfiler::Shutdown() {
   Log("PEX: Shutdown");
 
+  StopExportThread();
   profilerInfo_.Release();
   return S_OK;
 }
@@ -461,9 +660,62 @@ HRESULT CoreProfiler::ClassUnloadFinished(ClassID classId, HRESULT hrStatus) {
 }
 
 HRESULT CoreProfiler::FunctionUnloadStarted(FunctionID functionId) {
+  InvalidateCallTargets(functionId, 0);
+  return S_OK;
+}
+
+HRESULT CoreProfiler::DynamicMethodUnloaded(FunctionID functionId) {
+  // The code info can't be queried anymore, use the ranges
+  // recorded when the dynamic method was compiled.
+  std::lock_guard<std::mutex> lock(callTargetLock_);
+  auto it = dynamicMethodCode_.find(functionId);
+
+  if (it != dynamicMethodCode_.end()) {
+    InvalidateCallTargets(it->second);
+    dynamicMethodCode_.erase(it);
+  }
+
   return S_OK;
 }
 
+bool CoreProfiler::GetFunctionCodeInfo(FunctionID functionId, ReJITID rejitId,
+                                       std::vector<COR_PRF_CODE_INFO>& codeInfos) {
+  ULONG32 count = 0;
+
+  if (FAILED(profilerInfo_->GetCodeInfo3(functionId, rejitId, 0, &count,
+                                         nullptr)) ||
+      count == 0) {
+    return false;
+  }
+
+  codeInfos.resize(count);
+  return SUCCEEDED(profilerInfo_->GetCodeInfo3(functionId, rejitId, count,
+                                               &count, codeInfos.data()));
+}
+
+void CoreProfiler::InvalidateCallTargets(FunctionID functionId,
+                                         ReJITID rejitId) {
+  std::vector<COR_PRF_CODE_INFO> codeInfos;
+
+  if (GetFunctionCodeInfo(functionId, rejitId, codeInfos)) {
+    std::lock_guard<std::mutex> lock(callTargetLock_);
+    InvalidateCallTargets(codeInfos);
+  }
+}
+
+void CoreProfiler::InvalidateCallTargets(
+    const std::vector<COR_PRF_CODE_INFO>& codeInfos) {
+  // Called with callTargetLock_ taken. The names of the targets in the code
+  // are removed, a name still in the batch being built is sent anyway
+  // and replaced on the Profile Explorer side when the name is sent again.
+  for (auto&& codeInfo : codeInfos) {
+    auto start = callTargetNames_.lower_bound(codeInfo.startAddress);
+    auto end =
+        callTargetNames_.lower_bound(codeInfo.startAddress + codeInfo.size);
+    callTargetNames_.erase(start, end);
+  }
+}
+
 HRESULT CoreProfiler::JITCompilationStarted(FunctionID functionId,
                                             BOOL fIsSafeToBlock) {
   // Logger::Debug("JIT compilation started: %s",
@@ -474,58 +726,106 @@ HRESULT CoreProfiler::JITCompilationStarted(FunctionID functionId,
 HRESULT CoreProfiler::JITCompilationFinished(FunctionID functionId,
                                              HRESULT hrStatus,
                                              BOOL fIsSafeToBlock) {
-  Log("PEX: JITCompilationFinished: %s",
-      GetMethodName(functionId).c_str());
+  HandleLoadedFunction(functionId);
+  return S_OK;
+}
+
+CoreProfiler::CallTargetName& CoreProfiler::GetCallTargetName(uint64_t ip) {
+  auto it = callTargetNames_.find(ip);
 
-  if (fIsSafeToBlock) {
-    profilerInfo_->SuspendRuntime();
+  if (it != callTargetNames_.end()) {
+    return it->second;
   }
 
-  HandleLoadedFunction(functionId);
+  // Most immediates are not call targets, cache failed lookups too
+  // so each address is queried from the DAC only once.
+  auto& targetName = callTargetNames_[ip];
+  targetName.Sent = false;
 
-  if (fIsSafeToBlock) {
-    profilerInfo_->ResumeRuntime();
+  if (dac_ == nullptr) {
+    return targetName;
   }
 
-  return S_OK;
-}
-
-bool CoreProfiler::SendCallTargetName(uint64_t ip,
-                                      uint64_t funcId,
-                                      uint32_t rejitId) {
   auto md = GetMethodHandleForIP(ip);
 
   if (md != 0) {
-    unsigned needed;
-    if (SUCCEEDED(dac_->GetMethodDescName(md, 0, nullptr, &needed))) {
-      auto buffer = std::make_unique<std::wstring>(needed - 1, 0);
-
-      if (SUCCEEDED(dac_->GetMethodDescName(
-              md, needed, (wchar_t*)buffer->c_str(), &needed))) {
-        //? Hacky conversion to UTF8.
-        auto result = std::make_unique<std::string>(needed - 1, 0);
-        for (size_t i = 0; i < needed; i++) {
-          (*result)[i] = (char)(*buffer)[i];
-        }
+    // Try with a stack buffer first, most names fit and this
+    // avoids a second DAC call just to query the name length.
+    const unsigned BUFFER_SIZE = 512;
+    wchar_t stackBuffer[BUFFER_SIZE];
+    std::unique_ptr<wchar_t[]> dynamicBuffer;
+    wchar_t* buffer = stackBuffer;
+    unsigned needed = 0;
+
+    if (FAILED(dac_->GetMethodDescName(md, BUFFER_SIZE, stackBuffer,
+                                       &needed)) ||
+        needed > BUFFER_SIZE) {
+      if (needed <= BUFFER_SIZE) {
+        return targetName;
+      }
+
+      dynamicBuffer = std::make_unique<wchar_t[]>(needed);
+      buffer = dynamicBuffer.get();
 
-        SendFunctionCallTarget(*pipeClient_, funcId, ip, rejitId, processId_,
-                               result->size() + 1, result->c_str());
+      if (FAILED(dac_->GetMethodDescName(md, needed, buffer, &needed))) {
+        return targetName;
       }
     }
+
+    int length = WideCharToMultiByte(CP_UTF8, 0, buffer, -1, nullptr, 0,
+                                     nullptr, nullptr);
+
+    if (length > 1) {
+      targetName.Name.resize(length - 1);  // Exclude null terminator.
+      WideCharToMultiByte(CP_UTF8, 0, buffer, -1, targetName.Name.data(),
+                          length, nullptr, nullptr);
+    }
   } else {
-    unsigned needed;
-    if (SUCCEEDED(dac_->GetJitHelperFunctionName(ip, 0, nullptr, &needed))) {
-      char buffer[1024];
-
-      if (SUCCEEDED(
-              dac_->GetJitHelperFunctionName(ip, needed, buffer, &needed))) {
-        SendFunctionCallTarget(*pipeClient_, funcId, ip, rejitId, processId_,
-                               needed, buffer);
-      }
+    char buffer[1024];
+    unsigned needed = 0;
+
+    if (SUCCEEDED(dac_->GetJitHelperFunctionName(ip, sizeof(buffer), buffer,
+                                                 &needed)) &&
+        needed > 1 && needed <= sizeof(buffer)) {
+      targetName.Name.assign(buffer, needed - 1);
     }
   }
 
-  return true;
+  return targetName;
+}
+
+CapstoneDisasm* CoreProfiler::GetDisassembler() {
+  if (disasm_ != nullptr) {
+    return disasm_.get();
+  }
+
+  switch (machineType_) {
+    case IMAGE_FILE_MACHINE_AMD64: {
+      disasm_ = std::make_unique<CapstoneDisasm>(
+          cs_arch::CS_ARCH_X86,
+          cs_mode::CS_MODE_LITTLE_ENDIAN | cs_mode::CS_MODE_64);
+      break;
+    }
+    case IMAGE_FILE_MACHINE_ARM64: {
+      disasm_ = std::make_unique<CapstoneDisasm>(
+          cs_arch::CS_ARCH_AARCH64,
+          cs_mode::CS_MODE_THUMB | cs_mode::CS_MODE_LITTLE_ENDIAN);
+      break;
+    }
+    case IMAGE_FILE_MACHINE_I386: {
+      disasm_ = std::make_unique<CapstoneDisasm>(
+          cs_arch::CS_ARCH_X86,
+          cs_mode::CS_MODE_LITTLE_ENDIAN | cs_mode::CS_MODE_32);
+      break;
+    }
+    default: {
+      return nullptr;
+    }
+  }
+
+  disasm_->SetDetail(cs_opt_value::CS_OPT_ON);
+  disasm_->SetSyntax(cs_opt_value::CS_OPT_SYNTAX_INTEL);
+  return disasm_.get();
 }
 
 bool CoreProfiler::HandleLoadedFunction(uint64_t functionId) {
@@ -561,69 +861,60 @@ bool CoreProfiler::HandleLoadedFunction(uint64_t functionId) {
   }
 
   for (auto&& rejit : rejitIds) {
-    ULONG32 addrs = 0;
-    profilerInfo_->GetNativeCodeStartAddresses(functionId, rejit, 0, &addrs,
-                                               nullptr);
-    std::vector<UINT_PTR> addr(addrs);
-    profilerInfo_->GetNativeCodeStartAddresses(functionId, rejit, addrs, &addrs,
-                                               addr.data());
-
-    for (int rejit = 0; rejit < addrs; rejit++) {
-      ULONG32 cCodeInfos2;
-      profilerInfo_->GetCodeInfo4(addr[rejit], 0, &cCodeInfos2, nullptr);
-      std::vector<COR_PRF_CODE_INFO> codeInfos2(cCodeInfos2);
-      profilerInfo_->GetCodeInfo4(addr[rejit], cCodeInfos2, &cCodeInfos2,
-                                  codeInfos2.data());
-
-      for (auto&& codeInfo : codeInfos2) {
-        //? TODO: Lock could be moved down if R/W
-        //?   also not needed after adding
-        std::lock_guard<std::mutex> lock(lock_);
-
-        if (recordedAddrs_.find(codeInfo.startAddress) !=
-            recordedAddrs_.end()) {
-          continue;
-        }
-
-        recordedAddrs_.insert(codeInfo.startAddress);
-        SendLoadedFunctionCode(functionId, codeInfo.startAddress, rejit,
-                               (uint32_t)codeInfo.size,
-                               (char*)codeInfo.startAddress);
-        SendCallTargets(functionId, rejit, (uint32_t)codeInfo.size,
-                        (char*)codeInfo.startAddress);
-      }
-    }
+    QueueFunctionCode(functionId, rejit);
   }
 
   return true;
 }
 
-bool CoreProfiler::SendCallTargets(uint64_t funcId,
-                                   uint32_t rejitId,
-                                   uint32_t codeSize,
-                                   char* codeBytes) {
+bool CoreProfiler::SendCallTargets(FunctionCodeRecord* record) {
   if (sessionEnded_.load()) {
     return true;
   }
 
-  __try {
-    switch (machineType_) {
-      case IMAGE_FILE_MACHINE_AMD64: {
-        CollectCallTargets(true, funcId, rejitId, codeBytes, codeSize);
-        break;
-      }
-      case IMAGE_FILE_MACHINE_ARM64: {
-        CollectCallTargetsArm64(funcId, rejitId, codeBytes, codeSize);
-        break;
-      }
-      case IMAGE_FILE_MACHINE_I386: {
-        CollectCallTargets(false, funcId, rejitId, codeBytes, codeSize);
-        break;
-      }
+  if (!FindCallTargets(record)) {
+    return false;
+  }
+
+  // All targets of the function go into one message, with the name
+  // included only the first time a target address is sent.
+  std::lock_guard<std::mutex> lock(callTargetLock_);
+  auto messageOffset = exportBatch_.BeginFunctionCallTargets(
+      record->FunctionId, record->ReJITId, processId_);
+  int32_t targetCount = 0;
+
+  for (auto target : callTargets_) {
+    auto& targetName = GetCallTargetName(target);
+
+    if (targetName.Name.empty()) {
+      continue;
+    }
+
+    if (targetName.Sent) {
+      exportBatch_.AppendCallTarget(target, -1, nullptr);
+    } else {
+      exportBatch_.AppendCallTarget(target, (int32_t)targetName.Name.size(),
+                                    targetName.Name.data());
+      // Later messages in the same batch refer to the name by address,
+      // the flag is reset if the batch is not sent.
+      targetName.Sent = true;
+      batchTargetNames_.push_back(target);
     }
+
+    targetCount++;
+  }
+
+  exportBatch_.EndFunctionCallTargets(messageOffset, targetCount);
+  return true;
+}
+
+bool CoreProfiler::FindCallTargets(FunctionCodeRecord* record) {
+  __try {
+    CollectCallTargets(record->Address, record->CodeBytes.get(),
+                       record->CodeSize);
   } __except (EXCEPTION_EXECUTE_HANDLER) {
-    // Log("Exception disassembling: %llx, size %d\n", codeInfo.startAddress,
-    // codeSize);
+    // Log("Exception disassembling: %llx, size %d\n", record->Address,
+    // record->CodeSize);
     return false;
   }
 
@@ -900,6 +1191,12 @@ HRESULT CoreProfiler::InitializeForAttach(IUnknown* pCorProfilerInfoUnk,
                                           void* pvClientData,
                                           UINT cbClientData) {
   Log("PEX: InitializeForAttach, data %d\n", cbClientData);
+
+  // The first byte of the attach data enables the shared memory ring.
+  if (cbClientData >= 1 && ((BYTE*)pvClientData)[0] != 0) {
+    ringEnabled_ = true;
+  }
+
   return Initialize(pCorProfilerInfoUnk);
 }
 
@@ -932,6 +1229,11 @@ HRESULT CoreProfiler::ReJITCompilationFinished(FunctionID functionId,
                                                ReJITID rejitId,
                                                HRESULT hrStatus,
                                                BOOL fIsSafeToBlock) {
+  // The new code may be at an address that was used by unloaded code.
+  if (SUCCEEDED(hrStatus)) {
+    InvalidateCallTargets(functionId, rejitId);
+  }
+
   return S_OK;
 }
 
@@ -983,6 +1285,15 @@ HRESULT CoreProfiler::DynamicMethodJITCompilationStarted(FunctionID functionId,
 HRESULT CoreProfiler::DynamicMethodJITCompilationFinished(FunctionID functionId,
                                                           HRESULT hrStatus,
                                                           BOOL fIsSafeToBlock) {
+  // Keep the code ranges, used to remove the call targets
+  // in the dynamic method once it's unloaded.
+  std::vector<COR_PRF_CODE_INFO> codeInfos;
+
+  if (SUCCEEDED(hrStatus) && GetFunctionCodeInfo(functionId, 0, codeInfos)) {
+    std::lock_guard<std::mutex> lock(callTargetLock_);
+    dynamicMethodCode_[functionId] = std::move(codeInfos);
+  }
+
   return S_OK;
 }
 
@@ -4,15 +4,21 @@
 #pragma once
 #include <cor.h>
 #include <corprof.h>
+#include <algorithm>
 #include <atomic>
+#include <map>
+#include <mutex>
 #include <shared_mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "CapstoneWrappers.h"
 #include "Common.h"
+#include "FunctionCodeQueue.h"
 #include "NamedPipeClient.h"
+#include "SharedMemoryRing.h"
 
 #undef min
 #undef max
@@ -258,9 +264,7 @@ class CoreProfiler : public ICorProfilerCallback10 {
       HRESULT hrStatus,
       BOOL fIsSafeToBlock) override;
   HRESULT STDMETHODCALLTYPE
-  DynamicMethodUnloaded(FunctionID functionId) override {
-    return S_OK;
-  }
+  DynamicMethodUnloaded(FunctionID functionId) override;
 
   HRESULT STDMETHODCALLTYPE
   EventPipeEventDelivered(EVENTPIPE_PROVIDER provider,
@@ -291,39 +295,80 @@ class CoreProfiler : public ICorProfilerCallback10 {
   std::string GetTypeName(mdTypeDef type, ModuleID module) const;
   std::string GetMethodName(FunctionID function) const;
 
+  // Function code copied in the JIT callbacks and sent over the pipe
+  // in batches by the export thread, so that the callbacks never wait
+  // on the pipe or suspend the runtime.
+  static const size_t ExportBatchSize = 256 * 1024;
+  MpscQueue<FunctionCodeRecord> exportQueue_;
+  std::atomic<int> pendingExports_{0};
+  std::atomic<bool> stopExport_{false};
+  HANDLE exportEvent_{nullptr};
+  std::thread* exportThread_{nullptr};
+  PipeMessageBatch exportBatch_{ExportBatchSize};
+
+  // Optional transport for the exported code, offered only if enabled
+  // with the PEX_SHARED_MEMORY_RING environment variable or the attach data.
+  // Code is sent over the pipe until Profile Explorer accepts the ring,
+  // the pipe still carries control messages.
+  enum class RingState { Pending, Accepted, Rejected };
+  static const ULONGLONG RingReplyTimeout = 5000;
+  SharedMemoryRing ring_;
+  std::atomic<RingState> ringState_{RingState::Rejected};
+  ULONGLONG ringOfferTime_{0};
+  bool ringEnabled_{false};
+  bool useRing_{false};
+
+  struct CallTargetName {
+    std::string Name;  // Empty if the target couldn't be resolved.
+    bool Sent;         // Name sent before, later messages refer to it by address.
+  };
+
+  // Call target state used by the export thread, which keeps
+  // a single disassembler and resolves each target address only once
+  // for the entire process instead of once per function.
+  // The names are guarded by callTargetLock_, they are removed by the unload
+  // and rejit callbacks when the code at the target address is replaced,
+  // then resolved and sent again with the name if the address is reused.
+  // Ordered by address to remove all the targets in a code range.
+  std::unique_ptr<CapstoneDisasm> disasm_;
+  std::mutex callTargetLock_;
+  std::map<uint64_t, CallTargetName> callTargetNames_;
+  std::vector<uint64_t> batchTargetNames_;  // Names first sent in the current batch.
+  std::unordered_map<FunctionID, std::vector<COR_PRF_CODE_INFO>> dynamicMethodCode_;
+  std::vector<uint64_t> callTargets_;
+
   bool HandleLoadedFunction(uint64_t functionId);
-  bool SendLoadedFunctionCode(uint64_t funcId,
-                              uint64_t address,
-                              uint32_t rejitId,
-                              uint32_t codeSize,
-                              char* codeByes);
-  bool SendCallTargets(uint64_t funcId,
-                       uint32_t rejitId,
-                       uint32_t codeSize,
-                       char* codeByes);
-  bool SendCallTargetName(uint64_t ip, uint64_t funcId, uint32_t rejitId);
+  bool QueueFunctionCode(uint64_t funcId, ReJITID rejitId);
+  void StartExportThread();
+  void StopExportThread();
+  bool SendQueuedFunctionCode();
+  bool SendExportBatch();
+  void BatchTargetNamesSent(bool sent);
+  void OfferSharedMemoryRing();
+  void UpdateExportTransport();
+  bool SendCallTargets(FunctionCodeRecord* record);
+  bool FindCallTargets(FunctionCodeRecord* record);
+  CallTargetName& GetCallTargetName(uint64_t ip);
+  void InvalidateCallTargets(FunctionID functionId, ReJITID rejitId);
+  void InvalidateCallTargets(const std::vector<COR_PRF_CODE_INFO>& codeInfos);
+  bool GetFunctionCodeInfo(FunctionID functionId, ReJITID rejitId,
+                           std::vector<COR_PRF_CODE_INFO>& codeInfos);
+  CapstoneDisasm* GetDisassembler();
   bool SendRequestedFunctionCode(RequestFunctionCodeMessage& request);
 
-  void CollectCallTargets(bool is64BitCode,
-                          uint64_t funcId,
-                          uint32_t rejitId,
-                          void* buffer,
-                          size_t size) {
-    auto mode = cs_mode::CS_MODE_LITTLE_ENDIAN |
-                (is64BitCode ? cs_mode::CS_MODE_64 : cs_mode::CS_MODE_32);
-    auto dis = CapstoneDisasm(cs_arch::CS_ARCH_X86, mode);
-    dis.SetDetail(cs_opt_value::CS_OPT_ON);
-    dis.SetSyntax(cs_opt_value::CS_OPT_SYNTAX_INTEL);
-    int64_t startRva = (int64_t)buffer;
-
-    std::unique_ptr<InstructionListHolder> instrs(
-        dis.Disassemble(buffer, size, startRva));
+  void CollectCallTargets(uint64_t address, void* buffer, size_t size) {
+    callTargets_.clear();
+    auto dis = GetDisassembler();
 
-    if (instrs->Count == 0) {
+    if (dis == nullptr) {
       return;
     }
 
-    std::unique_ptr<std::unordered_set<uint64_t>> sentTargets;
+    // Disassemble the copy at the original address of the code
+    // so that the call target operands are absolute addresses.
+    std::unique_ptr<InstructionListHolder> instrs(
+        dis->Disassemble(buffer, size, address));
+    bool isArm64 = machineType_ == IMAGE_FILE_MACHINE_ARM64;
 
     for (size_t i = 0; i < instrs->Count; i++) {
       auto instr = instrs->Instruction(i);
@@ -331,64 +376,24 @@ class CoreProfiler : public ICorProfilerCallback10 {
       if (!instr->detail)
         continue;
 
-      for (int i = 0; i < instr->detail->x86.op_count; i++) {
-        if (instr->detail->x86.operands[i].type == X86_OP_IMM) {
-          auto targetAddr = instr->detail->x86.operands[i].imm;
-
-          // Sent each unique call target only once.
-          if (sentTargets == nullptr) {
-            sentTargets = std::make_unique<std::unordered_set<uint64_t>>();
-          }
-
-          if (sentTargets->find(targetAddr) == sentTargets->end()) {
-            SendCallTargetName(targetAddr, funcId, rejitId);
-            sentTargets->insert(targetAddr);
+      if (isArm64) {
+        for (int i = 0; i < instr->detail->aarch64.op_count; i++) {
+          if (instr->detail->aarch64.operands[i].type == AArch64_OP_IMM) {
+            callTargets_.push_back(instr->detail->aarch64.operands[i].imm);
           }
         }
-      }
-    }
-  }
-
-  void CollectCallTargetsArm64(uint64_t funcId,
-                               uint32_t rejitId,
-                               void* buffer,
-                               size_t size) {
-    auto mode = cs_mode::CS_MODE_THUMB | cs_mode::CS_MODE_LITTLE_ENDIAN;
-    auto dis = CapstoneDisasm(cs_arch::CS_ARCH_AARCH64, mode);
-    dis.SetDetail(cs_opt_value::CS_OPT_ON);
-    dis.SetSyntax(cs_opt_value::CS_OPT_SYNTAX_INTEL);
-    int64_t startRva = (int64_t)buffer;
-
-    std::unique_ptr<InstructionListHolder> instrs(
-        dis.Disassemble(buffer, size, startRva));
-
-    if (instrs->Count == 0) {
-      return;
-    }
-
-    std::unique_ptr<std::unordered_set<uint64_t>> sentTargets;
-
-    for (size_t i = 0; i < instrs->Count; i++) {
-      auto instr = instrs->Instruction(i);
-      // Log("%s %s\n", instr->mnemonic, instr->op_str);
-      if (!instr->detail)
-        continue;
-
-      // Sent each unique call target only once.
-      if (sentTargets == nullptr) {
-        sentTargets = std::make_unique<std::unordered_set<uint64_t>>();
-      }
-
-      for (int i = 0; i < instr->detail->aarch64.op_count; i++) {
-        if (instr->detail->aarch64.operands[i].type == AArch64_OP_IMM) {
-          auto targetAddr = instr->detail->aarch64.operands[i].imm;
-
-          if (sentTargets->find(targetAddr) == sentTargets->end()) {
-            SendCallTargetName(targetAddr, funcId, rejitId);
-            sentTargets->insert(targetAddr);
+      } else {
+        for (int i = 0; i < instr->detail->x86.op_count; i++) {
+          if (instr->detail->x86.operands[i].type == X86_OP_IMM) {
+            callTargets_.push_back(instr->detail->x86.operands[i].imm);
           }
         }
       }
     }
+
+    // Sent each unique call target only once.
+    std::sort(callTargets_.begin(), callTargets_.end());
+    callTargets_.erase(std::unique(callTargets_.begin(), callTargets_.end()),
+                       callTargets_.end());
   }
 };
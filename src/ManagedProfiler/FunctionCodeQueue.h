@@ -0,0 +1,100 @@
+// Copyright (c) Microsoft Corporation
+// The Microsoft Corporation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+struct QueueNode {
+  std::atomic<QueueNode*> Next{nullptr};
+};
+
+// Copy of the native code of a JIT'd function, made in the JIT callback
+// so that it can be sent over the pipe later by the export thread.
+struct FunctionCodeRecord : QueueNode {
+  FunctionCodeRecord(int64_t functionId,
+                     int64_t address,
+                     int32_t reJITId,
+                     int32_t codeSize)
+      : FunctionId(functionId),
+        Address(address),
+        ReJITId(reJITId),
+        CodeSize(codeSize),
+        CodeBytes(std::make_unique<char[]>(codeSize)) {}
+
+  int64_t FunctionId;
+  int64_t Address;
+  int32_t ReJITId;
+  int32_t CodeSize;
+  std::unique_ptr<char[]> CodeBytes;
+};
+
+// Intrusive multi-producer single-consumer queue (D. Vyukov's algorithm).
+// Push is a single atomic exchange and never blocks, so it can be used
+// from runtime callbacks on any thread. Pop must be called from one thread only.
+template <typename T>
+class MpscQueue {
+  std::atomic<QueueNode*> head_;  // Last pushed node, updated by producers.
+  QueueNode* tail_;               // Next node to pop, owned by the consumer.
+  QueueNode stub_;
+
+ public:
+  MpscQueue() : head_(&stub_), tail_(&stub_) {}
+
+  ~MpscQueue() {
+    while (auto node = Pop()) {
+      delete node;
+    }
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  void Push(T* node) { PushNode(node); }
+
+  // Returns nullptr if the queue is empty or if a producer is in the
+  // middle of a push, in which case the node shows up on a later call.
+  T* Pop() {
+    auto tail = tail_;
+    auto next = tail->Next.load(std::memory_order_acquire);
+
+    if (tail == &stub_) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+
+      tail_ = next;
+      tail = next;
+      next = next->Next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      tail_ = next;
+      return static_cast<T*>(tail);
+    }
+
+    if (tail != head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    // Last node in the queue, put the stub back behind it
+    // so the node can be unlinked.
+    PushNode(&stub_);
+    next = tail->Next.load(std::memory_order_acquire);
+
+    if (next != nullptr) {
+      tail_ = next;
+      return static_cast<T*>(tail);
+    }
+
+    return nullptr;
+  }
+
+ private:
+  void PushNode(QueueNode* node) {
+    node->Next.store(nullptr, std::memory_order_relaxed);
+    auto prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->Next.store(node, std::memory_order_release);
+  }
+};
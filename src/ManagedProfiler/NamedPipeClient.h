@@ -5,6 +5,7 @@
 #include <windows.h>
 #include <memory>
 #include <mutex>
+#include <vector>
 #pragma once
 
 enum class PipeMessageKind : int32_t {
@@ -13,6 +14,8 @@ enum class PipeMessageKind : int32_t {
   FunctionCode,
   FunctionCallTarget,
   RequestFunctionCode,
+  FunctionCallTargets,
+  SharedMemoryRing,
 };
 
 #pragma pack(push, 1)
@@ -44,6 +47,29 @@ struct FunctionCallTargetMessage {
 };
 #pragma pack(pop)
 
+// All call targets of a function in one message. Each target is
+// an int64 address, an int32 name length and the UTF-8 name bytes.
+// A name length of -1 means the name of the address was sent before.
+#pragma pack(push, 1)
+struct FunctionCallTargetsMessage {
+  int64_t FunctionId;
+  int32_t ReJITId;
+  int32_t ProcessId;
+  int32_t TargetCount;
+  char Targets[];
+};
+#pragma pack(pop)
+
+// Sent by the profiler to offer the shared memory ring transport,
+// the reply has Accepted set if Profile Explorer opened the ring.
+#pragma pack(push, 1)
+struct SharedMemoryRingMessage {
+  int32_t ProcessId;
+  int32_t Accepted;
+  int64_t Capacity;
+};
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 struct RequestFunctionCodeMessage {
   int64_t FunctionId;
@@ -127,7 +153,7 @@ class NamedPipeClient {
     if (!WriteMessageHeader(kind, sizeof(T)))
       return false;
 
-    return WriteOverlapped(data, sizeof(T));
+    return WriteOverlapped((void*)&data, sizeof(T));
   }
 
   bool SendMessage(PipeMessageKind kind, void* data, size_t dataSize) {
@@ -138,6 +164,12 @@ class NamedPipeClient {
     return WriteOverlapped(data, dataSize);
   }
 
+  // Writes a buffer of already formatted messages.
+  bool SendBuffer(void* data, size_t dataSize) {
+    std::unique_lock<std::mutex> lock(lock_);
+    return WriteOverlapped(data, dataSize);
+  }
+
   bool WriteMessageHeader(PipeMessageKind kind, size_t dataSize) {
     PipeMessageHeader header;
     header.Kind = kind;
@@ -190,76 +222,97 @@ class NamedPipeClient {
   }
 };
 
-static bool SendFunctionCode(NamedPipeClient& client,
-                             int64_t functionId,
-                             int64_t address,
-                             int32_t reJITId,
-                             int32_t processId,
-                             int32_t codeSize,
-                             void* codeBytes) {
-  const size_t BUFFER_SIZE = 4 * 1024;
-
-  char stackBuffer[BUFFER_SIZE];
-  std::unique_ptr<char[]> dynamicBuffer;
-  FunctionCodeMessage* message;
-  size_t messageSize = sizeof(FunctionCodeMessage) + codeSize;
-
-  if (messageSize < BUFFER_SIZE) {
-    message = (FunctionCodeMessage*)stackBuffer;
-  } else {
-    dynamicBuffer =
-        std::make_unique<char[]>(sizeof(FunctionCodeMessage) + codeSize);
-    message = (FunctionCodeMessage*)dynamicBuffer.get();
+// Messages appended into one buffer and written to the pipe with a single
+// write, avoiding a pipe round-trip for each function and call target.
+class PipeMessageBatch {
+  std::vector<char> buffer_;
+
+ public:
+  PipeMessageBatch(size_t capacity) { buffer_.reserve(capacity); }
+
+  const char* Data() const { return buffer_.data(); }
+  size_t Size() const { return buffer_.size(); }
+  bool IsEmpty() const { return buffer_.empty(); }
+  void Clear() { buffer_.clear(); }
+
+  void AppendFunctionCode(int64_t functionId,
+                          int64_t address,
+                          int32_t reJITId,
+                          int32_t processId,
+                          int32_t codeSize,
+                          const void* codeBytes) {
+    auto message = (FunctionCodeMessage*)AppendMessage(
+        PipeMessageKind::FunctionCode, sizeof(FunctionCodeMessage) + codeSize);
+    message->FunctionId = functionId;
+    message->Address = address;
+    message->ReJITId = reJITId;
+    message->ProcessId = processId;
+    message->CodeSize = codeSize;
+    memcpy(message->CodeBytes, codeBytes, codeSize);
   }
 
-  message->FunctionId = functionId;
-  message->Address = address;
-  message->ReJITId = reJITId;
-  message->ProcessId = processId;
-  message->CodeSize = codeSize;
-  memcpy(message->CodeBytes, codeBytes, codeSize);
-  return client.SendMessage(PipeMessageKind::FunctionCode, message,
-                            messageSize);
-}
-
-static bool SendFunctionCallTarget(NamedPipeClient& client,
-                                   int64_t functionId,
-                                   int64_t address,
-                                   int32_t reJITId,
-                                   int32_t processId,
-                                   int32_t nameLength,
-                                   const char* name) {
-  const size_t BUFFER_SIZE = 4 * 1024;
-
-  char stackBuffer[BUFFER_SIZE];
-  std::unique_ptr<char[]> dynamicBuffer;
-  FunctionCallTargetMessage* message;
-  size_t messageSize = sizeof(FunctionCallTargetMessage) + nameLength;
-
-  if (messageSize < BUFFER_SIZE) {
-    message = (FunctionCallTargetMessage*)stackBuffer;
-  } else {
-    dynamicBuffer = std::make_unique<char[]>(sizeof(FunctionCallTargetMessage) +
-                                             nameLength);
-    message = (FunctionCallTargetMessage*)dynamicBuffer.get();
+  // Starts a message with the call targets of a function, the targets are
+  // added with AppendCallTarget and the message completed with
+  // EndFunctionCallTargets. Returns the offset of the message.
+  size_t BeginFunctionCallTargets(int64_t functionId,
+                                  int32_t reJITId,
+                                  int32_t processId) {
+    size_t offset = buffer_.size();
+    auto message = (FunctionCallTargetsMessage*)AppendMessage(
+        PipeMessageKind::FunctionCallTargets,
+        sizeof(FunctionCallTargetsMessage));
+    message->FunctionId = functionId;
+    message->ReJITId = reJITId;
+    message->ProcessId = processId;
+    message->TargetCount = 0;
+    return offset;
   }
 
-  message->FunctionId = functionId;
-  message->Address = address;
-  message->ReJITId = reJITId;
-  message->ProcessId = processId;
-  message->NameLength = nameLength;
-  memcpy(message->Name, name, nameLength);
-  return client.SendMessage(PipeMessageKind::FunctionCallTarget, message,
-                            messageSize);
-}
-
-static bool SendFunctionCallTarget(NamedPipeClient& client,
-                                   int64_t functionId,
-                                   int64_t address,
-                                   int32_t reJITId,
-                                   int32_t processId,
-                                   const char* name) {
-  return SendFunctionCallTarget(client, functionId, address, reJITId, processId,
-                                (int32_t)strlen(name) + 1, name);
-}
+  void AppendCallTarget(int64_t address, int32_t nameLength, const char* name) {
+    size_t offset = buffer_.size();
+    size_t nameSize = nameLength > 0 ? nameLength : 0;
+    buffer_.resize(offset + sizeof(int64_t) + sizeof(int32_t) + nameSize);
+
+    auto data = buffer_.data() + offset;
+    memcpy(data, &address, sizeof(int64_t));
+    memcpy(data + sizeof(int64_t), &nameLength, sizeof(int32_t));
+
+    if (nameSize > 0) {
+      memcpy(data + sizeof(int64_t) + sizeof(int32_t), name, nameSize);
+    }
+  }
+
+  // Completes the message, or drops it if no targets were added.
+  void EndFunctionCallTargets(size_t messageOffset, int32_t targetCount) {
+    if (targetCount == 0) {
+      buffer_.resize(messageOffset);
+      return;
+    }
+
+    auto header = (PipeMessageHeader*)(buffer_.data() + messageOffset);
+    header->Size = (int32_t)(buffer_.size() - messageOffset);
+    auto message = (FunctionCallTargetsMessage*)(header + 1);
+    message->TargetCount = targetCount;
+  }
+
+  bool Send(NamedPipeClient& client) {
+    if (buffer_.empty()) {
+      return true;
+    }
+
+    bool result = client.SendBuffer(buffer_.data(), buffer_.size());
+    buffer_.clear();
+    return result;
+  }
+
+ private:
+  void* AppendMessage(PipeMessageKind kind, size_t dataSize) {
+    size_t offset = buffer_.size();
+    buffer_.resize(offset + sizeof(PipeMessageHeader) + dataSize);
+
+    auto header = (PipeMessageHeader*)(buffer_.data() + offset);
+    header->Kind = kind;
+    header->Size = (int32_t)(dataSize + sizeof(PipeMessageHeader));
+    return buffer_.data() + offset + sizeof(PipeMessageHeader);
+  }
+};
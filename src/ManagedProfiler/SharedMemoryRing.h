@@ -0,0 +1,144 @@
+// Copyright (c) Microsoft Corporation
+// The Microsoft Corporation licenses this file to you under the MIT license.
+// See the LICENSE file in the project root for more information.
+#pragma once
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Layout of the shared memory, must match SharedMemoryRingReader in
+// ProfileExplorerCore. The positions are byte counts since the start,
+// the offset in the data area is position % Capacity. Each position is
+// written by one side only and placed on its own cache line.
+struct SharedMemoryRingHeader {
+  uint32_t Magic;
+  uint32_t Version;
+  int64_t Capacity;
+  alignas(64) std::atomic<int64_t> WritePosition;  // Written by the profiler.
+  int64_t WriteCount;  // Writes, for throughput counters.
+  int64_t WriteWaits;  // Times the profiler found the ring full.
+  alignas(64) std::atomic<int64_t> ReadPosition;  // Written by the reader.
+  char Reserved[120];
+};
+
+static_assert(sizeof(SharedMemoryRingHeader) == 256 &&
+                  offsetof(SharedMemoryRingHeader, WritePosition) == 64 &&
+                  offsetof(SharedMemoryRingHeader, ReadPosition) == 128,
+              "Shared memory ring header layout changed");
+
+// Single-producer, single-consumer byte ring in a named file mapping,
+// carrying the same framed messages as the pipe. Only the export thread
+// writes, the reader in Profile Explorer consumes the messages.
+class SharedMemoryRing {
+  static const uint32_t RingMagic = 0x52584550;  // "PEXR"
+  static const uint32_t RingVersion = 1;
+
+  HANDLE mapping_;
+  SharedMemoryRingHeader* header_;
+  char* data_;
+  int64_t capacity_;
+
+ public:
+  static const int64_t DefaultCapacity = 16 * 1024 * 1024;
+
+  SharedMemoryRing() : mapping_(nullptr), header_(nullptr), data_(nullptr) {}
+
+  ~SharedMemoryRing() { Close(); }
+
+  static std::wstring MakeName(int processId) {
+    return L"Local\\PEXProfilerRing_" + std::to_wstring(processId);
+  }
+
+  bool Create(int processId, int64_t capacity) {
+    auto name = MakeName(processId);
+    int64_t mappingSize = sizeof(SharedMemoryRingHeader) + capacity;
+    mapping_ = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+                                 (DWORD)(mappingSize >> 32),
+                                 (DWORD)mappingSize, name.c_str());
+
+    if (mapping_ == nullptr) {
+      return false;
+    }
+
+    header_ = (SharedMemoryRingHeader*)MapViewOfFile(
+        mapping_, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)mappingSize);
+
+    if (header_ == nullptr) {
+      Close();
+      return false;
+    }
+
+    // Pages of a new mapping are zero, only the non-zero fields are set.
+    data_ = (char*)header_ + sizeof(SharedMemoryRingHeader);
+    capacity_ = capacity;
+    header_->Capacity = capacity;
+    header_->Version = RingVersion;
+    header_->Magic = RingMagic;
+    return true;
+  }
+
+  bool IsOpen() const { return header_ != nullptr; }
+
+  void Close() {
+    if (header_ != nullptr) {
+      UnmapViewOfFile(header_);
+      header_ = nullptr;
+      data_ = nullptr;
+    }
+
+    if (mapping_ != nullptr) {
+      CloseHandle(mapping_);
+      mapping_ = nullptr;
+    }
+  }
+
+  // Copies the data into the ring, waiting for the reader to free space
+  // when it's full. Messages larger than the ring are written in parts,
+  // the reader copies them out as they arrive. Returns false if canceled.
+  bool Write(const void* data, size_t size, const std::atomic<bool>& canceled) {
+    auto source = (const char*)data;
+    auto writePosition = header_->WritePosition.load(std::memory_order_relaxed);
+    int spinCount = 0;
+    header_->WriteCount++;
+
+    while (size > 0) {
+      auto readPosition =
+          header_->ReadPosition.load(std::memory_order_acquire);
+      auto available = capacity_ - (writePosition - readPosition);
+
+      if (available == 0) {
+        if (canceled.load()) {
+          return false;
+        }
+
+        if (spinCount++ == 0) {
+          header_->WriteWaits++;
+        }
+
+        // Reader is behind, back off progressively.
+        if (spinCount < 64) {
+          YieldProcessor();
+        } else {
+          Sleep(spinCount < 128 ? 0 : 1);
+        }
+
+        continue;
+      }
+
+      spinCount = 0;
+      auto offset = writePosition % capacity_;
+      auto length = (int64_t)size < available ? (int64_t)size : available;
+      length = length < capacity_ - offset ? length : capacity_ - offset;
+      memcpy(data_ + offset, source, (size_t)length);
+
+      source += length;
+      size -= (size_t)length;
+      writePosition += length;
+      header_->WritePosition.store(writePosition, std::memory_order_release);
+    }
+
+    return true;
+  }
+};
@@ -570,11 +570,11 @@ public static class ProfileTools
     // one that was actually executing. When we have a disassembly map, shift each
     // sample's weight to the preceding valid instruction offset (same as UI's
     // TryFindElementForOffset with InitialMultiplier=1).
-    var adjustedWeights = data.InstructionWeight;
-    if (disasmMap != null && data.InstructionWeight != null)
+    var adjustedWeights = data.Instructions.Weights.ToDictionary(w => w.Offset, w => w.Weight);
+    if (disasmMap != null)
     {
       var adjusted = new Dictionary<long, TimeSpan>();
-      foreach (var kv in data.InstructionWeight)
+      foreach (var kv in adjustedWeights)
       {
         long adjustedOffset = kv.Key;
         // Search backwards (up to 16 bytes) for the nearest valid instruction
@@ -657,7 +657,7 @@ public static class ProfileTools
       TotalTime = data.Weight.ToString(),
       SelfPct = totalWeightMs > 0 ? Math.Round(data.ExclusiveWeight.TotalMilliseconds / totalWeightMs * 100, 2) : 0,
       HasDisassembly = disasmMap != null,
-      InstructionCount = data.InstructionWeight?.Count ?? 0,
+      InstructionCount = data.Instructions.WeightCount,
       InstructionWeights = instructionWeights,
       Timestamp = DateTime.UtcNow
     };
@@ -0,0 +1,95 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Concurrent;
+using System.Threading;
+using ProfileExplorer.Core.Providers;
+
+namespace ProfileExplorer.Core.Binary;
+
+// Cache of demangled function names, keyed by the mangled name and
+// the demangling options, with the Shared instance used process-wide. The same names are demangled over and over
+// by the function lists, call tree, flame graph and name lookups, while
+// the DbgHelp undecorator must run under a global lock, so a cache hit
+// must not take any lock. Entries are spread over shards by the name hash,
+// each shard being a lock-free-read dictionary with its own size limit,
+// so that a full shard is reset without dropping the entire cache.
+public sealed class DemangledNameCache {
+  private const int ShardCount = 32; // Power of two.
+  private const int MaxShardEntries = 16 * 1024;
+  private readonly ConcurrentDictionary<DemangledNameKey, string>[] shards_;
+  private readonly int[] shardCounts_; // Avoids ConcurrentDictionary.Count taking all locks.
+  private long missCount_;
+
+  public DemangledNameCache() {
+    shards_ = new ConcurrentDictionary<DemangledNameKey, string>[ShardCount];
+    shardCounts_ = new int[ShardCount];
+
+    for (int i = 0; i < ShardCount; i++) {
+      shards_[i] = new ConcurrentDictionary<DemangledNameKey, string>();
+    }
+  }
+
+  public static DemangledNameCache Shared { get; } = new DemangledNameCache();
+  public long MissCount => Interlocked.Read(ref missCount_);
+
+  // Approximate while names are being added, it doesn't lock the shards.
+  public int Count {
+    get {
+      int count = 0;
+
+      for (int i = 0; i < ShardCount; i++) {
+        count += Volatile.Read(ref shardCounts_[i]);
+      }
+
+      return count;
+    }
+  }
+
+  public string GetOrAdd(string mangledName, FunctionNameDemanglingOptions options,
+                                Func<string, FunctionNameDemanglingOptions, string> demangler) {
+    var key = new DemangledNameKey(mangledName, options);
+    int shardIndex = key.GetHashCode() & (ShardCount - 1);
+    var shard = shards_[shardIndex];
+
+    if (shard.TryGetValue(key, out string demangledName)) {
+      return demangledName;
+    }
+
+    // Demangle outside the dictionary so that other threads can still
+    // look up names in the shard, if two threads race on the same name
+    // the first added result is returned to both.
+    Interlocked.Increment(ref missCount_);
+    demangledName = demangler(mangledName, options);
+
+    if (!shard.TryAdd(key, demangledName)) {
+      return shard.TryGetValue(key, out string existingName) ? existingName : demangledName;
+    }
+
+    if (Interlocked.Increment(ref shardCounts_[shardIndex]) > MaxShardEntries) {
+      shard.Clear();
+      Interlocked.Exchange(ref shardCounts_[shardIndex], 0);
+    }
+
+    return demangledName;
+  }
+
+  public void Clear() {
+    for (int i = 0; i < ShardCount; i++) {
+      shards_[i].Clear();
+      Interlocked.Exchange(ref shardCounts_[i], 0);
+    }
+
+    Interlocked.Exchange(ref missCount_, 0);
+  }
+
+  private readonly record struct DemangledNameKey(string MangledName, FunctionNameDemanglingOptions Options) {
+    public bool Equals(DemangledNameKey other) {
+      return Options == other.Options && string.Equals(MangledName, other.MangledName, StringComparison.Ordinal);
+    }
+
+    public override int GetHashCode() {
+      return HashCode.Combine(MangledName.GetHashCode(), (int)Options);
+    }
+  }
+}
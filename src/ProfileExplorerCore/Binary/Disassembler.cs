@@ -1,6 +1,7 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.Reflection.PortableExecutable;
@@ -59,8 +60,21 @@ public class DisassemberResult {
   public string DebugInfoFilePath { get; set; }
 }
 
+// Location in the disassembly text of an instruction and its parts,
+// used by ASMParser to build the IR without parsing back the text.
+// The target name is set when a call/jump target address was replaced by a function name.
+public readonly record struct DisassembledInstruction(long Address, int Size, TextLocation Location,
+                                                      int AddressLength, int OpcodeOffset, int OpcodeLength,
+                                                      int OperandsOffset, int OperandsLength,
+                                                      int TargetNameOffset, int TargetNameLength) {
+  public bool HasTargetName => TargetNameLength > 0;
+  public int EndOffset => OperandsOffset + OperandsLength;
+}
+
 public class Disassembler : IDisposable {
+  public const int DefaultInstructionBatchSize = 512;
   public delegate string SymbolNameResolverDelegate(long address);
+  private delegate void InstructionHandler(in Interop.Instruction instr);
   private PEBinaryInfoProvider peInfo_;
   private List<(ReadOnlyMemory<byte> Data, long StartRVA)> codeSectionData_;
   private long baseAddress_;
@@ -72,6 +86,7 @@ public class Disassembler : IDisposable {
   private FunctionNameFormatter funcNameFormatter_;
   private object sectionLock_;
   private Dictionary<long, string> iatSymbolCache_;
+  private static readonly SearchValues<byte> addressStartLetters_ = SearchValues.Create("[#0"u8);
 
   private Disassembler(Machine architecture,
                        PEBinaryInfoProvider peInfo,
@@ -89,6 +104,10 @@ public class Disassembler : IDisposable {
     Initialize(true);
   }
 
+  // Max. number of instructions decoded by a native call,
+  // a value of 1 decodes one instruction at a time.
+  public int InstructionBatchSize { get; set; } = DefaultInstructionBatchSize;
+
   public void Dispose() {
     Dispose(true);
     GC.SuppressFinalize(this);
@@ -125,24 +144,33 @@ public class Disassembler : IDisposable {
     return DisassembleToText(funcInfo.StartRVA, funcInfo.Size);
   }
 
-  public string DisassembleToText(byte[] data, long startRVA) {
+  // Also records the location of each instruction in the text,
+  // which allows building the function IR without parsing the text.
+  public string DisassembleToText(FunctionDebugInfo funcInfo, List<DisassembledInstruction> instructions) {
+    return DisassembleToText(funcInfo.StartRVA, funcInfo.Size, instructions);
+  }
+
+  public string DisassembleToText(byte[] data, long startRVA, List<DisassembledInstruction> instructions = null) {
     codeSectionData_ = new List<(ReadOnlyMemory<byte> Data, long StartRVA)> {(data.AsMemory(), startRVA)};
-    string result = DisassembleToText(startRVA, data.Length);
+    string result = DisassembleToText(startRVA, data.Length, instructions);
     codeSectionData_ = null;
     return result;
   }
 
-  public string DisassembleToText(long startRVA, long size) {
+  public string DisassembleToText(long startRVA, long size, List<DisassembledInstruction> instructions = null) {
     if (startRVA == 0 || size == 0) {
       return "";
     }
 
     var builder = new StringBuilder((int)(size / 4) + 1);
+    char[] mnemonicBuffer = new char[Interop.Instruction.MnemonicLength];
+    int line = 0;
 
     try {
-      DisassembleInstructions(startRVA, size, startRVA + baseAddress_, (instr) => {
-        string addressString = $"{instr.Address:X}:    ";
-        builder.Append(addressString);
+      DisassembleInstructions(startRVA, size, startRVA + baseAddress_, (in Interop.Instruction instr) => {
+        int lineOffset = builder.Length;
+        builder.Append($"{instr.Address:X}:    ");
+        int addressLength = builder.Length - lineOffset;
         int startIndex = 0;
         bool appendBytes = false; //? TODO: Add UI option
 
@@ -151,18 +179,28 @@ public class Disassembler : IDisposable {
           builder.Append("  ");
         }
 
-        AppendMnemonic(instr, builder);
+        int opcodeOffset = builder.Length;
+        var mnemonic = AppendMnemonic(instr, mnemonicBuffer, builder);
+        int opcodeLength = builder.Length - opcodeOffset;
         builder.Append("  ");
 
-        AppendOperands(instr, startRVA, size, builder);
+        int operandsOffset = builder.Length;
+        var targetName = AppendOperands(instr, mnemonic, startRVA, size, builder);
+        instructions?.Add(new DisassembledInstruction(instr.Address, instr.Size,
+                                                      new TextLocation(lineOffset, line, 0),
+                                                      addressLength - 5, opcodeOffset, opcodeLength,
+                                                      operandsOffset, builder.Length - operandsOffset,
+                                                      targetName.Offset, targetName.Length));
         builder.AppendLine();
+        line++;
 
         if (appendBytes) {
           // For longer instructions, append up to 6 bytes per line.
           while (startIndex < instr.Size) {
-            builder.Append(' ', addressString.Length); // Align right.
+            builder.Append(' ', addressLength); // Align right.
             startIndex += AppendBytes(instr, startIndex, builder);
             builder.AppendLine();
+            line++;
           }
         }
       });
@@ -171,6 +209,7 @@ public class Disassembler : IDisposable {
 #if DEBUG
       Trace.TraceError($"Failed to disassemble code at RVA {startRVA}, size {size}: {ex.Message}");
 #endif
+      instructions?.Clear();
       return "";
     }
 
@@ -182,78 +221,108 @@ public class Disassembler : IDisposable {
     disasmHandle_ = Interop.Create(architecture_);
   }
 
-  private unsafe void AppendMnemonic(Interop.Instruction instr, StringBuilder builder) {
-    byte* letterPtr = instr.Mnemonic;
-    int index = 0;
+  // Returns the mnemonic text, copied to the buffer for the opcode lookups.
+  private static ReadOnlyMemory<char> AppendMnemonic(in Interop.Instruction instr, char[] buffer,
+                                                     StringBuilder builder) {
+    int length = Encoding.Latin1.GetChars(instr.MnemonicSpan, buffer);
+    builder.Append(buffer, 0, length);
+    return buffer.AsMemory(0, length);
+  }
 
-    while (index < Interop.Instruction.MnemonicLength && letterPtr[index] != 0) {
-      builder.Append((char)letterPtr[index]);
-      index++;
-    }
+  private static void AppendText(ReadOnlySpan<byte> text, StringBuilder builder) {
+    Span<char> chars = stackalloc char[text.Length];
+    Encoding.Latin1.GetChars(text, chars);
+    builder.Append(chars);
   }
 
-  private unsafe void AppendOperands(Interop.Instruction instr, long startRVA, long size, StringBuilder builder) {
-    bool isArm = architecture_ == Machine.Arm || architecture_ == Machine.Arm64;
+  // Returns the location in the text of the function name
+  // that replaced a call/jump target address, if any.
+  private (int Offset, int Length) AppendOperands(in Interop.Instruction instr, ReadOnlyMemory<char> mnemonic,
+                                                  long startRVA, long size, StringBuilder builder) {
+    var operands = instr.OperandSpan;
     bool isJump = false;
-    bool sawBracket = false;
-    bool lookupName = ShouldLookupAddressByName(instr, ref isJump);
 
-    byte* letterPtr = instr.Operand;
+    if (!ShouldLookupAddressByName(mnemonic, ref isJump)) {
+      AppendText(operands, builder);
+      return (0, 0);
+    }
+
+    bool isArm = architecture_ == Machine.Arm || architecture_ == Machine.Arm64;
+    bool sawBracket = false;
+    (int Offset, int Length) targetName = (0, 0);
     int index = 0;
 
-    while (index < Interop.Instruction.OperandLength && letterPtr[index] != 0) {
-      char letter = (char)letterPtr[index];
-
-      if (lookupName) {
-        // Try to replace a call target address by the function name.
-        int hexLength = 0;
-        bool skippedSharp = false;
-        long hexValue = 0;
-
-        if (letter == '[') {
-          // For x64, try to resolve RIP-relative [rip + 0xN] / [rip - 0xN]
-          // memory operands, which are typically IAT slots for indirect
-          // calls/jumps through imported functions. The PDB has public
-          // symbols (e.g., _imp_FunctionName) at these slot addresses.
-          if (architecture_ == Machine.Amd64 && !sawBracket &&
-              TryResolveRipRelativeOperand(instr, letterPtr, index, builder,
-                                           out int consumedLength)) {
-            index += consumedLength;
-            continue;
-          }
+    while (index < operands.Length) {
+      // Copy the text up to the next char that may start an address.
+      int nextIndex = operands.Slice(index).IndexOfAny(addressStartLetters_);
 
-          sawBracket = true; // Reject lookups for call ptr [rax + 0xN] and similar.
-        }
-        else if (letter == '#' && isArm && !sawBracket) {
-          hexLength = FindHexNumber(letterPtr, index + 1, out hexValue); // Skip over #
-          skippedSharp = true;
-        }
-        else if (letter == '0' && !sawBracket) {
-          hexLength = FindHexNumber(letterPtr, index, out hexValue);
+      if (nextIndex < 0) {
+        AppendText(operands.Slice(index), builder);
+        break;
+      }
+
+      AppendText(operands.Slice(index, nextIndex), builder);
+      index += nextIndex;
+      char letter = (char)operands[index];
+
+      // Try to replace a call target address by the function name.
+      int hexLength = 0;
+      bool skippedSharp = false;
+      long hexValue = 0;
+
+      if (letter == '[') {
+        // For x64, try to resolve RIP-relative [rip + 0xN] / [rip - 0xN]
+        // memory operands, which are typically IAT slots for indirect
+        // calls/jumps through imported functions. The PDB has public
+        // symbols (e.g., _imp_FunctionName) at these slot addresses.
+        int nameOffset = builder.Length;
+
+        if (architecture_ == Machine.Amd64 && !sawBracket &&
+            TryResolveRipRelativeOperand(instr, operands, index, builder,
+                                         out int consumedLength)) {
+          targetName = (nameOffset + 1, builder.Length - nameOffset - 2); // Name without [].
+          index += consumedLength;
+          continue;
         }
 
-        if (IsValidCallAddress(hexLength, hexValue)) {
-          long rva = hexValue - baseAddress_;
-          bool replaced = false;
+        sawBracket = true; // Reject lookups for call ptr [rax + 0xN] and similar.
+      }
+      else if (letter == '#' && isArm && !sawBracket) {
+        hexLength = FindHexNumber(operands, index + 1, out hexValue); // Skip over #
+        skippedSharp = true;
+      }
+      else if (letter == '0' && !sawBracket) {
+        hexLength = FindHexNumber(operands, index, out hexValue);
+      }
+
+      if (IsValidCallAddress(hexLength, hexValue)) {
+        long rva = hexValue - baseAddress_;
+        bool replaced = false;
 
-          // For jumps, use the name only if it's to another function.
-          if (!isJump || rva < startRVA || rva >= startRVA + size) {
-            replaced = TryAppendFunctionName(builder, rva);
-          }
+        // For jumps, use the name only if it's to another function.
+        if (!isJump || rva < startRVA || rva >= startRVA + size) {
+          int nameOffset = builder.Length;
+          replaced = TryAppendFunctionName(builder, rva);
 
-          if (!replaced) {
-            if (skippedSharp) builder.Append('#');
-            builder.Append($"0x{hexValue:X}");
+          if (replaced) {
+            targetName = (nameOffset, builder.Length - nameOffset);
           }
+        }
 
-          index += hexLength + (skippedSharp ? 1 : 0);
-          continue;
+        if (!replaced) {
+          if (skippedSharp) builder.Append('#');
+          builder.Append($"0x{hexValue:X}");
         }
+
+        index += hexLength + (skippedSharp ? 1 : 0);
+        continue;
       }
 
       builder.Append(letter);
       index++;
     }
+
+    return targetName;
   }
 
   private bool IsValidCallAddress(int hexLength, long hexValue) {
@@ -313,32 +382,29 @@ public class Disassembler : IDisposable {
   // set to the number of characters that should be skipped in the operand
   // text (including the leading '[' and trailing ']'). On failure leaves the
   // builder unchanged and returns false.
-  private unsafe bool TryResolveRipRelativeOperand(Interop.Instruction instr, byte* letterPtr,
-                                                   int startIdx, StringBuilder builder,
-                                                   out int consumedLength) {
+  private bool TryResolveRipRelativeOperand(in Interop.Instruction instr, ReadOnlySpan<byte> operands,
+                                            int startIdx, StringBuilder builder,
+                                            out int consumedLength) {
     consumedLength = 0;
 
-    if (letterPtr[startIdx] != (byte)'[') {
+    if (operands[startIdx] != (byte)'[') {
       return false;
     }
 
     int idx = startIdx + 1;
-    SkipOperandWhitespace(letterPtr, ref idx);
+    SkipOperandWhitespace(operands, ref idx);
 
     // Match "rip".
-    if (idx + 2 >= Interop.Instruction.OperandLength ||
-        letterPtr[idx] != (byte)'r' ||
-        letterPtr[idx + 1] != (byte)'i' ||
-        letterPtr[idx + 2] != (byte)'p') {
+    if (!operands.Slice(idx).StartsWith("rip"u8)) {
       return false;
     }
 
     idx += 3;
-    SkipOperandWhitespace(letterPtr, ref idx);
+    SkipOperandWhitespace(operands, ref idx);
 
     long signedOffset = 0;
 
-    if (idx < Interop.Instruction.OperandLength && letterPtr[idx] == (byte)']') {
+    if (idx < operands.Length && operands[idx] == (byte)']') {
       // Bare [rip] with no displacement.
       idx++;
     }
@@ -346,14 +412,14 @@ public class Disassembler : IDisposable {
       // Expect + or -, then a hex number, then ].
       int sign;
 
-      if (idx >= Interop.Instruction.OperandLength) {
+      if (idx >= operands.Length) {
         return false;
       }
 
-      if (letterPtr[idx] == (byte)'+') {
+      if (operands[idx] == (byte)'+') {
         sign = 1;
       }
-      else if (letterPtr[idx] == (byte)'-') {
+      else if (operands[idx] == (byte)'-') {
         sign = -1;
       }
       else {
@@ -361,9 +427,9 @@ public class Disassembler : IDisposable {
       }
 
       idx++;
-      SkipOperandWhitespace(letterPtr, ref idx);
+      SkipOperandWhitespace(operands, ref idx);
 
-      int hexLen = FindHexNumber(letterPtr, idx, out long hexValue);
+      int hexLen = FindHexNumber(operands, idx, out long hexValue);
 
       if (hexLen <= 0) {
         return false;
@@ -371,9 +437,9 @@ public class Disassembler : IDisposable {
 
       idx += hexLen;
       signedOffset = sign * hexValue;
-      SkipOperandWhitespace(letterPtr, ref idx);
+      SkipOperandWhitespace(operands, ref idx);
 
-      if (idx >= Interop.Instruction.OperandLength || letterPtr[idx] != (byte)']') {
+      if (idx >= operands.Length || operands[idx] != (byte)']') {
         return false;
       }
 
@@ -434,13 +500,13 @@ public class Disassembler : IDisposable {
     return name;
   }
 
-  private static unsafe void SkipOperandWhitespace(byte* letterPtr, ref int idx) {
-    while (idx < Interop.Instruction.OperandLength && letterPtr[idx] == (byte)' ') {
+  private static void SkipOperandWhitespace(ReadOnlySpan<byte> operands, ref int idx) {
+    while (idx < operands.Length && operands[idx] == (byte)' ') {
       idx++;
     }
   }
 
-  private bool ShouldLookupAddressByName(Interop.Instruction instr, ref bool isJump) {
+  private bool ShouldLookupAddressByName(ReadOnlyMemory<char> mnemonic, ref bool isJump) {
     if (debugInfo_ == null && symbolNameResolver_ == null) {
       return false;
     }
@@ -448,7 +514,7 @@ public class Disassembler : IDisposable {
     switch (architecture_) {
       case Machine.I386:
       case Machine.Amd64: {
-        if (x86Opcodes.GetOpcodeInfo(instr.MnemonicString, out var info)) {
+        if (x86Opcodes.GetOpcodeInfo(mnemonic, out var info)) {
           isJump = info.Kind == InstructionKind.Goto;
           return info.Kind == InstructionKind.Call || isJump;
         }
@@ -457,7 +523,7 @@ public class Disassembler : IDisposable {
       }
       case Machine.Arm:
       case Machine.Arm64: {
-        if (ARM64Opcodes.GetOpcodeInfo(instr.MnemonicString, out var info)) {
+        if (ARM64Opcodes.GetOpcodeInfo(mnemonic, out var info)) {
           isJump = info.Kind == InstructionKind.Goto;
           return info.Kind == InstructionKind.Call || isJump;
         }
@@ -469,11 +535,11 @@ public class Disassembler : IDisposable {
     return false;
   }
 
-  private unsafe int FindHexNumber(byte* letterPtr, int index, out long value) {
+  private static int FindHexNumber(ReadOnlySpan<byte> operands, int index, out long value) {
     // Expect star with 0x and skip.
-    if (letterPtr[index] != '0' ||
-        index + 1 >= Interop.Instruction.OperandLength ||
-        !(letterPtr[index + 1] == 'x' || letterPtr[index + 1] == 'X')) {
+    if (index + 1 >= operands.Length ||
+        operands[index] != '0' ||
+        !(operands[index + 1] == 'x' || operands[index + 1] == 'X')) {
       value = 0;
       return 0;
     }
@@ -482,8 +548,8 @@ public class Disassembler : IDisposable {
     index += 2;
     value = 0;
 
-    while (index < Interop.Instruction.OperandLength && letterPtr[index] != 0) {
-      char c = (char)letterPtr[index];
+    while (index < operands.Length) {
+      char c = (char)operands[index];
 
       if (c >= '0' && c <= '9') {
         value = value << 4 | c - '0';
@@ -505,10 +571,10 @@ public class Disassembler : IDisposable {
     return length > 3 ? length : 0;
   }
 
-  private unsafe int AppendBytes(Interop.Instruction instr, int startIndex, StringBuilder builder) {
+  private static int AppendBytes(in Interop.Instruction instr, int startIndex, StringBuilder builder) {
     // Append at most 6 bytes per line.
     int count = Math.Min(6, instr.Size - startIndex);
-    byte* bytes = instr.Bytes;
+    var bytes = instr.BytesSpan.Slice(startIndex);
 
     switch (count) {
       case 0: {
@@ -569,7 +635,7 @@ public class Disassembler : IDisposable {
   }
 
   private unsafe void DisassembleInstructions(long startRVA, long size, long startAddress,
-                                              Action<Interop.Instruction> action) {
+                                              InstructionHandler handler) {
     var codeSection = FindCodeSection(startRVA);
 
     if (codeSection.Data.IsEmpty) {
@@ -577,35 +643,35 @@ public class Disassembler : IDisposable {
       return;
     }
 
-    // Allocate a buffer for storing the instruction,
-    // gets reused during iteration.
-    using var instrBuffer = Interop.AllocateInstruction(disasmHandle_);
     long offset = startRVA - codeSection.StartRVA;
     using var dataBuffer = codeSection.Data.Pin();
-    IntPtr dataBufferPtr = (IntPtr)dataBuffer.Pointer;
-
-    // Disassemble the entire range of the code data buffer.
-    IntPtr dataIteratorPtr = (IntPtr)(dataBufferPtr.ToInt64() + offset);
-    IntPtr dataEndPtr = (IntPtr)(dataBufferPtr.ToInt64() + offset + size);
-
-    while (dataIteratorPtr.ToInt64() < dataEndPtr.ToInt64()) {
-      IntPtr remainingLength = (IntPtr)(dataEndPtr.ToInt64() - dataIteratorPtr.ToInt64());
+    byte* dataPtr = (byte*)dataBuffer.Pointer + offset;
+    long remainingLength = size;
 
-      // Handles one instruction at a time.
-      // dataIteratorPtr is being incremented by the native API.
-      if (Interop.Iterate(disasmHandle_, ref dataIteratorPtr, ref remainingLength, ref startAddress, instrBuffer)) {
-        IntPtr instrPtr = instrBuffer.DangerousGetHandle();
+    // Disassemble the entire range of the code data buffer,
+    // with a native call per batch of instructions instead of one per instruction.
+    while (remainingLength > 0) {
+      using var batch = Interop.DisassembleBatch(disasmHandle_, dataPtr, remainingLength,
+                                                 startAddress, InstructionBatchSize);
+      var instrs = batch.Instructions;
 
-        if (instrPtr == IntPtr.Zero) {
-          return;
-        }
-
-        var instruction = (Interop.Instruction)Marshal.PtrToStructure(instrPtr, typeof(Interop.Instruction));
-        action(instruction);
+      if (instrs.IsEmpty) {
+        break; // Invalid instruction.
       }
-      else {
-        break;
+
+      foreach (ref readonly var instr in instrs) {
+        // Copy to a stack local, the handler takes spans of its text.
+        var localInstr = instr;
+        handler(localInstr);
       }
+
+      // Continue after the last instruction, the batch stops early
+      // at an invalid instruction, which ends the next batch.
+      ref readonly var lastInstr = ref instrs[^1];
+      long length = lastInstr.Address + lastInstr.Size - startAddress;
+      dataPtr += length;
+      remainingLength -= length;
+      startAddress += length;
     }
   }
 
@@ -804,6 +870,34 @@ public class Disassembler : IDisposable {
       return new InstructionHandle(CreateInstruction(handle));
     }
 
+    public static unsafe InstructionBatch DisassembleBatch(DisassemblerHandle handle, byte* code, long codeSize,
+                                                           long startAddress, int maxCount) {
+      IntPtr instrsPtr = IntPtr.Zero;
+      var count = Disassemble(handle, (IntPtr)code, (IntPtr)codeSize, startAddress,
+                              (IntPtr)Math.Max(1, maxCount), ref instrsPtr);
+      return new InstructionBatch(instrsPtr, (int)count);
+    }
+
+    // Array of instructions allocated by Capstone, accessed in place
+    // instead of marshaling a copy of each instruction.
+    public readonly unsafe struct InstructionBatch : IDisposable {
+      private readonly IntPtr instrsPtr_;
+      private readonly int count_;
+
+      public InstructionBatch(IntPtr instrsPtr, int count) {
+        instrsPtr_ = instrsPtr;
+        count_ = instrsPtr != IntPtr.Zero ? count : 0;
+      }
+
+      public ReadOnlySpan<Instruction> Instructions => new((void*)instrsPtr_, count_);
+
+      public void Dispose() {
+        if (instrsPtr_ != IntPtr.Zero) {
+          FreeInstructions(instrsPtr_, count_);
+        }
+      }
+    }
+
     // Must be kept in sync with the definition of cs_insn from Capstone.
     [StructLayout(LayoutKind.Explicit, Size = 256)]
     public unsafe struct Instruction {
@@ -830,6 +924,33 @@ public class Disassembler : IDisposable {
       [FieldOffset(248)]
       public IntPtr Details;
 
+      // The span accessors point into the instruction itself and must be used
+      // only on stack locals, which are not moved by the GC, like the copy
+      // passed to the InstructionHandler.
+      internal readonly ReadOnlySpan<byte> BytesSpan {
+        get {
+          fixed (byte* pinned = Bytes) {
+            return new ReadOnlySpan<byte>(pinned, Size);
+          }
+        }
+      }
+
+      internal readonly ReadOnlySpan<byte> MnemonicSpan {
+        get {
+          fixed (byte* pinned = Mnemonic) {
+            return TrimAtNull(new ReadOnlySpan<byte>(pinned, MnemonicLength));
+          }
+        }
+      }
+
+      internal readonly ReadOnlySpan<byte> OperandSpan {
+        get {
+          fixed (byte* pinned = Operand) {
+            return TrimAtNull(new ReadOnlySpan<byte>(pinned, OperandLength));
+          }
+        }
+      }
+
       public byte[] BytesArray {
         get {
           fixed (byte* pinned = Bytes) {
@@ -855,6 +976,11 @@ public class Disassembler : IDisposable {
           }
         }
       }
+
+      private static ReadOnlySpan<byte> TrimAtNull(ReadOnlySpan<byte> text) {
+        int length = text.IndexOf((byte)0);
+        return length >= 0 ? text.Slice(0, length) : text;
+      }
     }
 
     public class DisassemblerHandle : SafeHandleMinusOneIsInvalid {
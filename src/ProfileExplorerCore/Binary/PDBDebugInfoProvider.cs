@@ -38,6 +38,7 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
   private static readonly string authRecordPath_ = Path.Combine(Path.GetTempPath(), "ProfileExplorer", "auth_record.bin");
   private static readonly object credentialLock_ = new();
   private static object undecorateLock_ = new(); // Global lock for undname.
+  private static readonly StringBuilder undecorateBuffer_ = new(MaxDemangledFunctionNameLength);
   private ConcurrentDictionary<long, SourceFileDebugInfo> sourceFileByRvaCache_ = new();
   private ConcurrentDictionary<string, SourceFileDebugInfo> sourceFileByNameCache_ = new();
   private ConcurrentDictionary<uint, List<SourceStackFrame>> inlineeByRvaCache_ = new();
@@ -321,10 +322,10 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
     string binaryName = symbolFile_?.FileName ?? "Unknown";
     
     try {
-      if (sortedFuncList_ != null) {
+      if (HasFunctionIndex) {
         // Query the function list first. If not found, then still query the actual PDB
         // because DIA has special lookup for functions split into multiple chunks by PGO for ex.
-        var result = FunctionDebugInfo.BinarySearch(sortedFuncList_, rva, sortedFuncListOverlapping_);
+        var result = FindFunctionInIndex(rva);
 
         if (result != null) {
           if (shouldLog) {
@@ -336,15 +337,15 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
 
       // Preload the function list only when there are enough queries
       // to justify the time spent in reading the entire PDB.
-      if (sortedFuncList_ == null &&
+      if (!HasFunctionIndex &&
           Interlocked.Increment(ref funcCacheMisses_) >= FunctionCacheMissThreshold) {
         if (shouldLog) {
           DiagnosticLogger.LogInfo($"[PDBDebugInfo] Binary: {binaryName}, cache miss threshold reached, loading function list");
         }
-        GetSortedFunctions();
+        LoadFunctionIndex();
 
-        if (sortedFuncList_ != null) {
-          var result = FunctionDebugInfo.BinarySearch(sortedFuncList_, rva, sortedFuncListOverlapping_);
+        if (HasFunctionIndex) {
+          var result = FindFunctionInIndex(rva);
 
           if (result != null) {
             if (shouldLog) {
@@ -395,10 +396,31 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
     }
 
     lock (cacheLock_) {
-      var result = Utils.RunSync(GetSortedFunctionsAsync);
+      if (sortedFuncList_ != null) {
+        return sortedFuncList_;
+      }
+
+      List<FunctionDebugInfo> result;
+      var symbolCache = symbolCache_?.AddReference();
+
+      if (symbolCache != null) {
+        try {
+          result = symbolCache.CreateFunctionList();
+          sortedFuncListOverlapping_ = symbolCache.HasOverlappingFunctions;
+        }
+        finally {
+          symbolCache.Dispose();
+        }
+      }
+      else {
+        result = CreateSortedFunctions();
+      }
 #if DEBUG
-      ValidateSortedList(result);
+      if (result != null) {
+        ValidateSortedList(result);
+      }
 #endif
+      sortedFuncList_ = result;
       return result;
     }
   }
@@ -662,7 +684,15 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
       return name;
     }
 
-    var sb = new StringBuilder(MaxDemangledFunctionNameLength);
+    return DemangledNameCache.Shared.GetOrAdd(name, options, UndecorateFunctionName);
+  }
+
+  public static string DemangleFunctionName(IRTextFunction function, FunctionNameDemanglingOptions options =
+                                              FunctionNameDemanglingOptions.Default) {
+    return DemangleFunctionName(function.Name, options);
+  }
+
+  private static string UndecorateFunctionName(string name, FunctionNameDemanglingOptions options) {
     var flags = NativeMethods.UnDecorateFlags.UNDNAME_COMPLETE;
     flags |= NativeMethods.UnDecorateFlags.UNDNAME_NO_ACCESS_SPECIFIERS |
              NativeMethods.UnDecorateFlags.UNDNAME_NO_ALLOCATION_MODEL |
@@ -682,17 +712,13 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
     }
 
     // DbgHelp UnDecorateSymbolName is not thread safe and can
-    // return bogus function names if not under a global lock.
+    // return bogus function names if not under a global lock,
+    // which also guards the output buffer reused across calls.
     lock (undecorateLock_) {
-      NativeMethods.UnDecorateSymbolName(name, sb, MaxDemangledFunctionNameLength, flags);
+      undecorateBuffer_.Clear();
+      NativeMethods.UnDecorateSymbolName(name, undecorateBuffer_, MaxDemangledFunctionNameLength, flags);
+      return undecorateBuffer_.ToString();
     }
-
-    return sb.ToString();
-  }
-
-  public static string DemangleFunctionName(IRTextFunction function, FunctionNameDemanglingOptions options =
-                                              FunctionNameDemanglingOptions.Default) {
-    return DemangleFunctionName(function.Name, options);
   }
 
   private bool LoadDebugInfo(string debugFilePath, IDebugInfoProvider other = null) {
@@ -745,8 +771,10 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
     if (other is PDBDebugInfoProvider otherPdb) {
       // Copy the already loaded function list from another PDB
       // provider that was created on another thread and is unusable otherwise.
-      symbolCache_ = otherPdb.symbolCache_;
+      // The mapped symbol cache is shared, each provider disposing its own reference.
+      symbolCache_ = otherPdb.symbolCache_?.AddReference();
       sortedFuncList_ = otherPdb.sortedFuncList_;
+      sortedFuncListOverlapping_ = otherPdb.sortedFuncListOverlapping_;
     }
 
     // Check if PDB has source file information (not stripped)
@@ -833,47 +861,71 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
     return true;
   }
 
-  private async Task<List<FunctionDebugInfo>> GetSortedFunctionsAsync() {
-    // This method assumes lock is taken by caller.
-    if (sortedFuncList_ != null) {
-      return sortedFuncList_;
-    }
+  private bool HasFunctionIndex => symbolCache_ != null || sortedFuncList_ != null;
 
-    if (settings_.CacheSymbolFiles) {
-      // Try to load a previous cached function list file.
-      symbolCache_ = await SymbolFileCache.DeserializeAsync(symbolFile_, settings_.SymbolCacheDirectoryPath).
-        ConfigureAwait(false);
-    }
+  private FunctionDebugInfo FindFunctionInIndex(long rva) {
+    // Hold a reference during the lookup so that a concurrent Dispose
+    // doesn't unmap the symbol cache while it's being read.
+    var symbolCache = symbolCache_?.AddReference();
 
-    if (symbolCache_ != null) {
-      Trace.WriteLine($"PDB cache loaded for {symbolFile_.FileName}");
-      sortedFuncList_ = symbolCache_.FunctionList;
+    if (symbolCache != null) {
+      try {
+        return symbolCache.FindFunctionByRVA(rva);
+      }
+      finally {
+        symbolCache.Dispose();
+      }
     }
-    else {
-      // Create sorted list of functions and public symbols.
-      sortedFuncList_ = CollectFunctionDebugInfo();
 
-      if (sortedFuncList_ == null) {
-        return null;
+    var sortedFuncList = sortedFuncList_;
+    return sortedFuncList != null ?
+      FunctionDebugInfo.BinarySearch(sortedFuncList, rva, sortedFuncListOverlapping_) : null;
+  }
+
+  private void LoadFunctionIndex() {
+    lock (cacheLock_) {
+      if (HasFunctionIndex) {
+        return;
       }
 
-      if (settings_.CacheSymbolFiles) {
-        // Save symbol cache file.
-        symbolCache_ = new SymbolFileCache() {
-          SymbolFile = symbolFile_,
-          FunctionList = sortedFuncList_
-        };
+      if (settings_.CacheSymbolFiles && symbolFile_ != null) {
+        // Try to map a previous cached function list file, the functions
+        // are looked up in the file directly instead of being deserialized.
+        var symbolCache = SymbolFileCache.Open(symbolFile_, settings_.SymbolCacheDirectoryPath);
 
-        await SymbolFileCache.SerializeAsync(symbolCache_, settings_.SymbolCacheDirectoryPath).
-          ConfigureAwait(false);
-        Trace.WriteLine($"PDB cache created for {symbolFile_.FileName}");
+        if (symbolCache != null) {
+          Trace.WriteLine($"PDB cache loaded for {symbolFile_.FileName}");
+          symbolCache_ = symbolCache;
+          return;
+        }
       }
+
+      sortedFuncList_ = CreateSortedFunctions();
+    }
+  }
+
+  private List<FunctionDebugInfo> CreateSortedFunctions() {
+    // This method assumes lock is taken by caller.
+    // Create sorted list of functions and public symbols.
+    var sortedFuncList = CollectFunctionDebugInfo();
+
+    if (sortedFuncList == null) {
+      return null;
     }
 
     // Sorting needed for binary search later.
-    sortedFuncList_.Sort();
-    sortedFuncListOverlapping_ = HasOverlappingFunctions(sortedFuncList_);
-    return sortedFuncList_;
+    sortedFuncList.Sort();
+    sortedFuncListOverlapping_ = HasOverlappingFunctions(sortedFuncList);
+
+    if (settings_.CacheSymbolFiles && symbolFile_ != null) {
+      // Save symbol cache file.
+      if (SymbolFileCache.Serialize(symbolFile_, sortedFuncList, sortedFuncListOverlapping_,
+                                    settings_.SymbolCacheDirectoryPath)) {
+        Trace.WriteLine($"PDB cache created for {symbolFile_.FileName}");
+      }
+    }
+
+    return sortedFuncList;
   }
 
   private bool HasOverlappingFunctions(List<FunctionDebugInfo> sortedFuncList) {
@@ -909,6 +961,8 @@ public sealed class PDBDebugInfoProvider : IDebugInfoProvider {
       symbolReaderLog_?.Dispose();
       symbolReaderPDB_ = null;
       symbolReader_ = null;
+
+      symbolCache_?.Dispose();
       symbolCache_ = null;
       sortedFuncList_ = null;
     }
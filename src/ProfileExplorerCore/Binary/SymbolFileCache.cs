@@ -1,92 +1,395 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.IO;
-using System.Threading.Tasks;
-using ProfileExplorer.Core.FileFormat;
+using System.IO.MemoryMappedFiles;
+using System.Text;
+using System.Threading;
+using ProfileExplorer.Core.Collections;
 using ProfileExplorer.Core.Utilities;
-using ProtoBuf;
 
 namespace ProfileExplorer.Core.Binary;
 
-[ProtoContract]
-public class SymbolFileCache {
-  private static int CurrentFileVersion = 2;
-  private static int MinSupportedFileVersion = 2;
-  [ProtoMember(1)]
-  public int Version { get; set; }
-  [ProtoMember(2)]
-  public SymbolFileDescriptor SymbolFile { get; set; }
-  [ProtoMember(3)]
-  public List<FunctionDebugInfo> FunctionList { get; set; }
+// Function list of a symbol file saved in a flat layout that is used directly
+// from a memory-mapped view, without deserializing it. Function lookup by RVA
+// is a binary search over the mapped arrays and the FunctionDebugInfo objects
+// are created only for the functions that are actually queried.
+//
+// File layout, all values little-endian, arrays aligned to 8 bytes:
+//   header (HeaderSize bytes)
+//   symbol file name (UTF-8)
+//   long[count] function start RVAs, sorted
+//   uint[count] function sizes
+//   int[count + 1] function name offsets into the name pool
+//   byte[] name pool (UTF-8)
+public sealed unsafe class SymbolFileCache : IDisposable {
+  private const uint FileMagic = 0x43534550; // "PESC"
+  private const int CurrentFileVersion = 3;
+  private const int MinSupportedFileVersion = 3;
+  private const int HeaderSize = 64;
+  private const int OverlappingFunctionsFlag = 1;
+  private MemoryMappedFile mappedFile_;
+  private MemoryMappedViewAccessor view_;
+  private byte* basePtr_;
+  private long rvasOffset_;
+  private long sizesOffset_;
+  private long nameOffsetsOffset_;
+  private long namePoolOffset_;
+  private FunctionDebugInfo[] functions_;
+  private int referenceCount_ = 1; // The mapping is released by the last Dispose.
+
+  private SymbolFileCache(SymbolFileDescriptor symbolFile) {
+    SymbolFile = symbolFile;
+  }
+
+  ~SymbolFileCache() {
+    Dispose(false);
+  }
+
   public static string DefaultCacheDirectoryPath => Path.Combine(Path.GetTempPath(), "ProfileExplorer", "symcache");
+  public SymbolFileDescriptor SymbolFile { get; }
+  public int FunctionCount { get; private set; }
+  public bool HasOverlappingFunctions { get; private set; }
+  private ReadOnlySpan<long> RVAs => new(basePtr_ + rvasOffset_, FunctionCount);
+  private ReadOnlySpan<uint> Sizes => new(basePtr_ + sizesOffset_, FunctionCount);
+  private ReadOnlySpan<int> NameOffsets => new(basePtr_ + nameOffsetsOffset_, FunctionCount + 1);
 
-  public static async Task<bool> SerializeAsync(SymbolFileCache symCache, string directoryPath) {
-    try {
-      symCache.Version = CurrentFileVersion;
-      var outStream = new MemoryStream();
-      Serializer.Serialize(outStream, symCache);
-      outStream.Position = 0;
+  public static bool Serialize(SymbolFileDescriptor symbolFile, List<FunctionDebugInfo> sortedFuncList,
+                               bool hasOverlappingFunctions, string directoryPath) {
+    string cachePath = Path.Combine(directoryPath, MakeCacheFilePath(symbolFile));
+    string tempPath = $"{cachePath}.{Environment.ProcessId}.tmp";
 
+    try {
       if (!Directory.Exists(directoryPath)) {
         Directory.CreateDirectory(directoryPath);
       }
 
-      string cacheFile = MakeCacheFilePath(symCache.SymbolFile);
-      string cachePath = Path.Combine(directoryPath, cacheFile);
+      var encoding = Encoding.UTF8;
+      int count = sortedFuncList.Count;
+      int[] nameOffsets = new int[count + 1];
+      long namePoolSize = 0;
+
+      for (int i = 0; i < count; i++) {
+        nameOffsets[i] = (int)namePoolSize;
+        namePoolSize += sortedFuncList[i].Name != null ? encoding.GetByteCount(sortedFuncList[i].Name) : 0;
+
+        if (namePoolSize > int.MaxValue) {
+          Trace.WriteLine($"Symbol file cache name pool too large for {symbolFile.FileName}");
+          return false;
+        }
+      }
+
+      nameOffsets[count] = (int)namePoolSize;
+      byte[] fileNameBytes = encoding.GetBytes(symbolFile.FileName ?? "");
 
-      //? TODO: Convert everything to RunSync or add the support in the FileArchive
-      return await FileArchive.CreateFromStreamAsync(outStream, cacheFile, cachePath).ConfigureAwait(false);
+      // Write to a temporary file first so that a partially written cache
+      // is never mapped by another instance loading the same symbol file.
+      using (var stream = new FileStream(tempPath, FileMode.Create, FileAccess.Write, FileShare.None, 64 * 1024))
+      using (var writer = new BinaryWriter(stream)) {
+        writer.Write(FileMagic);
+        writer.Write(CurrentFileVersion);
+        writer.Write(count);
+        writer.Write(hasOverlappingFunctions ? OverlappingFunctionsFlag : 0);
+        writer.Write(symbolFile.Id.ToByteArray());
+        writer.Write(symbolFile.Age);
+        writer.Write(fileNameBytes.Length);
+        writer.Write(namePoolSize);
+        writer.Write(new byte[HeaderSize - (int)stream.Position]);
+        writer.Write(fileNameBytes);
+        WritePadding(writer);
+
+        foreach (var func in sortedFuncList) {
+          writer.Write(func.RVA);
+        }
+
+        foreach (var func in sortedFuncList) {
+          writer.Write(func.Size);
+        }
+
+        WritePadding(writer);
+
+        foreach (int offset in nameOffsets) {
+          writer.Write(offset);
+        }
+
+        WritePadding(writer);
+        byte[] nameBuffer = ArrayPool<byte>.Shared.Rent(1024);
+
+        try {
+          foreach (var func in sortedFuncList) {
+            if (func.Name == null) {
+              continue;
+            }
+
+            int maxLength = encoding.GetMaxByteCount(func.Name.Length);
+
+            if (maxLength > nameBuffer.Length) {
+              ArrayPool<byte>.Shared.Return(nameBuffer);
+              nameBuffer = ArrayPool<byte>.Shared.Rent(maxLength);
+            }
+
+            int length = encoding.GetBytes(func.Name, nameBuffer);
+            writer.Write(nameBuffer, 0, length);
+          }
+        }
+        finally {
+          ArrayPool<byte>.Shared.Return(nameBuffer);
+        }
+      }
+
+      File.Move(tempPath, cachePath, true);
+      return true;
     }
     catch (Exception ex) {
       Trace.WriteLine($"Failed to save symbol file cache: {ex.Message}");
+
+      try {
+        File.Delete(tempPath);
+      }
+      catch {
+        // Ignore cleanup failures.
+      }
+
       return false;
     }
   }
 
-  public static async Task<SymbolFileCache> DeserializeAsync(SymbolFileDescriptor symbolFile, string directoryPath) {
+  public static SymbolFileCache Open(SymbolFileDescriptor symbolFile, string directoryPath) {
+    SymbolFileCache symCache = null;
+
     try {
-      string cacheFile = MakeCacheFilePath(symbolFile);
-      string cachePath = Path.Combine(directoryPath, cacheFile);
+      string cachePath = Path.Combine(directoryPath, MakeCacheFilePath(symbolFile));
 
       if (!File.Exists(cachePath)) {
         return null;
       }
 
-      using var archive = await FileArchive.LoadAsync(cachePath).ConfigureAwait(false);
-
-      if (archive != null) {
-        using var stream = await archive.ExtractFileToMemoryAsync(cacheFile);
+      // Allow other instances to map the same file and the cache directory to be cleared.
+      var stream = new FileStream(cachePath, FileMode.Open, FileAccess.Read,
+                                  FileShare.Read | FileShare.Delete);
 
-        if (stream != null) {
-          var symCache = Serializer.Deserialize<SymbolFileCache>(stream);
+      if (stream.Length < HeaderSize) {
+        stream.Dispose();
+        Trace.WriteLine($"Invalid symbol file cache {cachePath}");
+        return null;
+      }
 
-          if (symCache.Version < MinSupportedFileVersion) {
-            Trace.WriteLine($"File version mismatch in deserialized symbol file cache");
-            Trace.WriteLine($"  actual: {symCache.Version} vs min supported {MinSupportedFileVersion}");
-            return null;
-          }
+      symCache = new SymbolFileCache(symbolFile);
+      symCache.mappedFile_ = MemoryMappedFile.CreateFromFile(stream, null, 0, MemoryMappedFileAccess.Read,
+                                                             HandleInheritability.None, false);
+      symCache.view_ = symCache.mappedFile_.CreateViewAccessor(0, 0, MemoryMappedFileAccess.Read);
+      byte* ptr = null;
+      symCache.view_.SafeMemoryMappedViewHandle.AcquirePointer(ref ptr);
+      symCache.basePtr_ = ptr + symCache.view_.PointerOffset;
 
-          // Ensure it's a cache for the same symbol file.
-          if (symCache.SymbolFile.Equals(symbolFile)) {
-            return symCache;
-          }
-
-          Trace.WriteLine($"Symbol file mismatch in deserialized symbol file cache");
-          Trace.WriteLine($"  actual: {symCache.SymbolFile} vs expected {symbolFile}");
-        }
+      if (symCache.ReadHeader(stream.Length)) {
+        return symCache;
       }
     }
     catch (Exception ex) {
       Trace.WriteLine($"Failed to load symbol file cache: {ex.Message}");
     }
 
+    symCache?.Dispose();
     return null;
   }
 
+  public FunctionDebugInfo FindFunctionByRVA(long rva) {
+    int index = FindFunctionIndex(rva);
+    return index >= 0 ? GetFunction(index) : null;
+  }
+
+  public FunctionDebugInfo GetFunction(int index) {
+    var func = Volatile.Read(ref functions_[index]);
+
+    if (func != null) {
+      return func;
+    }
+
+    func = new FunctionDebugInfo(ReadFunctionName(index), RVAs[index], Sizes[index]);
+
+    // If another thread created the object first, use that one
+    // so that all queries see the same FunctionDebugInfo instance.
+    return Interlocked.CompareExchange(ref functions_[index], func, null) ?? func;
+  }
+
+  public List<FunctionDebugInfo> CreateFunctionList() {
+    var list = new List<FunctionDebugInfo>(FunctionCount);
+
+    for (int i = 0; i < FunctionCount; i++) {
+      list.Add(GetFunction(i));
+    }
+
+    return list;
+  }
+
+  // Returns the cache with one more reference to the mapping, used by debug info providers
+  // sharing the function list of the same file, each one disposing its reference.
+  // Returns null if the mapping was already released.
+  public SymbolFileCache AddReference() {
+    int count;
+
+    do {
+      count = Volatile.Read(ref referenceCount_);
+
+      if (count <= 0) {
+        return null;
+      }
+    } while (Interlocked.CompareExchange(ref referenceCount_, count + 1, count) != count);
+
+    return this;
+  }
+
+  public void Dispose() {
+    if (Interlocked.Decrement(ref referenceCount_) == 0) {
+      Dispose(true);
+      GC.SuppressFinalize(this);
+    }
+  }
+
+  private int FindFunctionIndex(long rva) {
+    var rvas = RVAs;
+    var sizes = Sizes;
+    int index = AddressRangeTable.FindLastAtOrBefore(rvas, rva);
+
+    if (index < 0) {
+      return -1;
+    }
+
+    bool found = rva <= rvas[index] + sizes[index] - 1;
+
+    if (HasOverlappingFunctions) {
+      // With code written in assembly, it's possible to have overlapping functions,
+      // pick the outer function that contains the RVA, same as FunctionDebugInfo.BinarySearch.
+      int count = 0;
+      int other = index;
+
+      while (--other >= 0 && count++ < 10) {
+        if (rva <= rvas[other] + sizes[other] - 1 &&
+            (!found || rvas[other] != rvas[index] || sizes[other] > sizes[index])) {
+          return other;
+        }
+      }
+    }
+
+    return found ? index : -1;
+  }
+
+  private string ReadFunctionName(int index) {
+    var nameOffsets = NameOffsets;
+    int length = nameOffsets[index + 1] - nameOffsets[index];
+
+    if (length == 0) {
+      return null;
+    }
+
+    return Encoding.UTF8.GetString(basePtr_ + namePoolOffset_ + nameOffsets[index], length);
+  }
+
+  private bool ReadHeader(long fileLength) {
+    uint magic = *(uint*)basePtr_;
+    int version = *(int*)(basePtr_ + 4);
+
+    if (magic != FileMagic || version < MinSupportedFileVersion) {
+      Trace.WriteLine($"File version mismatch in symbol file cache");
+      Trace.WriteLine($"  actual: {version} vs min supported {MinSupportedFileVersion}");
+      return false;
+    }
+
+    int count = *(int*)(basePtr_ + 8);
+    int flags = *(int*)(basePtr_ + 12);
+    var id = new Guid(new ReadOnlySpan<byte>(basePtr_ + 16, 16));
+    int age = *(int*)(basePtr_ + 32);
+    int fileNameLength = *(int*)(basePtr_ + 36);
+    long namePoolSize = *(long*)(basePtr_ + 40);
+
+    if (count < 0 || fileNameLength < 0 || namePoolSize < 0) {
+      return false;
+    }
+
+    rvasOffset_ = Align(HeaderSize + fileNameLength);
+    sizesOffset_ = rvasOffset_ + (long)count * sizeof(long);
+    nameOffsetsOffset_ = Align(sizesOffset_ + (long)count * sizeof(uint));
+    namePoolOffset_ = Align(nameOffsetsOffset_ + ((long)count + 1) * sizeof(int));
+
+    if (namePoolOffset_ + namePoolSize > fileLength) {
+      Trace.WriteLine($"Truncated symbol file cache for {SymbolFile.FileName}");
+      return false;
+    }
+
+    // Ensure it's a cache for the same symbol file.
+    string fileName = Encoding.UTF8.GetString(basePtr_ + HeaderSize, fileNameLength);
+    var cacheSymbolFile = new SymbolFileDescriptor(fileName, id, age);
+
+    if (!cacheSymbolFile.Equals(SymbolFile)) {
+      Trace.WriteLine($"Symbol file mismatch in symbol file cache");
+      Trace.WriteLine($"  actual: {cacheSymbolFile} vs expected {SymbolFile}");
+      return false;
+    }
+
+    // A corrupted cache is rejected and rebuilt from the symbol file.
+    if (!ValidateFunctionIndex(count, namePoolSize)) {
+      Trace.WriteLine($"Invalid function index in symbol file cache for {SymbolFile.FileName}");
+      return false;
+    }
+
+    FunctionCount = count;
+    HasOverlappingFunctions = (flags & OverlappingFunctionsFlag) != 0;
+    functions_ = new FunctionDebugInfo[count];
+    return true;
+  }
+
+  private bool ValidateFunctionIndex(int count, long namePoolSize) {
+    // The lookups index the mapped arrays directly, the RVAs must be sorted
+    // and each name must be inside the name pool.
+    var rvas = new ReadOnlySpan<long>(basePtr_ + rvasOffset_, count);
+    var nameOffsets = new ReadOnlySpan<int>(basePtr_ + nameOffsetsOffset_, count + 1);
+
+    if (nameOffsets[0] != 0 || nameOffsets[count] != namePoolSize) {
+      return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (nameOffsets[i + 1] < nameOffsets[i] ||
+          i > 0 && rvas[i] < rvas[i - 1]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  private void Dispose(bool disposing) {
+    if (basePtr_ != null) {
+      view_.SafeMemoryMappedViewHandle.ReleasePointer();
+      basePtr_ = null;
+    }
+
+    if (disposing) {
+      view_?.Dispose();
+      mappedFile_?.Dispose();
+      view_ = null;
+      mappedFile_ = null;
+      functions_ = null;
+    }
+  }
+
+  private static long Align(long offset) {
+    return (offset + 7) & ~7L;
+  }
+
+  private static void WritePadding(BinaryWriter writer) {
+    long position = writer.BaseStream.Position;
+
+    for (long i = position; i < Align(position); i++) {
+      writer.Write((byte)0);
+    }
+  }
+
   private static string MakeCacheFilePath(SymbolFileDescriptor symbolFile) {
-    return $"{Utils.TryGetFileName(symbolFile.FileName)}-{symbolFile.Id}-{symbolFile.Age}.cache";
+    return $"{Utils.TryGetFileName(symbolFile.FileName)}-{symbolFile.Id}-{symbolFile.Age}.symcache";
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,129 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.Numerics;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+using System.Runtime.Intrinsics;
+
+namespace ProfileExplorer.Core.Collections;
+
+// Address ranges sorted by start address, stored as contiguous arrays
+// to resolve many addresses (for ex. all frames of a stack) in one call.
+// The search for the last range starting at or before an address is branchless:
+// small tables are scanned with vector compares, larger ones use
+// a binary search that compiles to conditional moves.
+public sealed class AddressRangeTable {
+  // Below this many ranges a vectorized linear scan beats the binary search.
+  private const int LinearSearchThreshold = 64;
+  private long[] starts_;
+  private long[] ends_; // Inclusive.
+  private long[] maxEnds_; // Max. end of the ranges 0..i, handles overlapping ranges.
+
+  // The starts must be sorted, the ends are inclusive.
+  public AddressRangeTable(long[] starts, long[] ends) {
+    Debug.Assert(starts.Length == ends.Length);
+    starts_ = starts;
+    ends_ = ends;
+    maxEnds_ = new long[ends.Length];
+    long maxEnd = long.MinValue;
+
+    for (int i = 0; i < ends.Length; i++) {
+      Debug.Assert(i == 0 || starts[i - 1] <= starts[i]);
+      maxEnd = Math.Max(maxEnd, ends[i]);
+      maxEnds_[i] = maxEnd;
+    }
+  }
+
+  public int Count => starts_.Length;
+  public long LowestAddress => starts_.Length > 0 ? starts_[0] : long.MaxValue;
+
+  // Returns the index of the range containing the address, or -1.
+  // With overlapping ranges, the one with the highest start address is picked.
+  public int Find(long address) {
+    int index = FindLastAtOrBefore(starts_, address);
+
+    if (index < 0 || address <= ends_[index]) {
+      return index;
+    }
+
+    // Rare case of a range nested in a bigger one that also contains the address.
+    while (--index >= 0 && maxEnds_[index] >= address) {
+      if (address <= ends_[index]) {
+        return index;
+      }
+    }
+
+    return -1;
+  }
+
+  // Resolves each address to a range index, or -1.
+  // Neighboring addresses often fall in the same range (frames of a stack
+  // in the same module), check the previous result before searching.
+  public void Find(ReadOnlySpan<long> addresses, Span<int> indices) {
+    Debug.Assert(indices.Length >= addresses.Length);
+    int lastIndex = -1;
+
+    for (int i = 0; i < addresses.Length; i++) {
+      long address = addresses[i];
+
+      if (lastIndex >= 0 && address >= starts_[lastIndex] && address <= ends_[lastIndex]) {
+        indices[i] = lastIndex;
+        continue;
+      }
+
+      int index = Find(address);
+      indices[i] = index;
+
+      if (index >= 0) {
+        lastIndex = index;
+      }
+    }
+  }
+
+  // Returns the index of the last value less than or equal to the given value,
+  // -1 if all values are greater. The values must be sorted.
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  public static int FindLastAtOrBefore(ReadOnlySpan<long> sortedValues, long value) {
+    if (sortedValues.Length <= LinearSearchThreshold) {
+      return CountAtOrBefore(sortedValues, value) - 1;
+    }
+
+    // Branchless lower bound: the loop runs log2(n) times regardless of the value,
+    // with the comparison result selecting the next base.
+    ref long start = ref MemoryMarshal.GetReference(sortedValues);
+    int baseIndex = 0;
+    int length = sortedValues.Length;
+
+    while (length > 1) {
+      int half = length >> 1;
+      baseIndex = Unsafe.Add(ref start, baseIndex + half) <= value ? baseIndex + half : baseIndex;
+      length -= half;
+    }
+
+    return Unsafe.Add(ref start, baseIndex) <= value ? baseIndex : -1;
+  }
+
+  private static int CountAtOrBefore(ReadOnlySpan<long> sortedValues, long value) {
+    ref long start = ref MemoryMarshal.GetReference(sortedValues);
+    int count = 0;
+    int i = 0;
+
+    if (Vector256.IsHardwareAccelerated) {
+      var valueVector = Vector256.Create(value);
+
+      for (; i <= sortedValues.Length - Vector256<long>.Count; i += Vector256<long>.Count) {
+        var values = Vector256.LoadUnsafe(ref start, (nuint)i);
+        uint mask = Vector256.LessThanOrEqual(values, valueVector).ExtractMostSignificantBits();
+        count += BitOperations.PopCount(mask);
+      }
+    }
+
+    for (; i < sortedValues.Length; i++) {
+      count += Unsafe.Add(ref start, i) <= value ? 1 : 0;
+    }
+
+    return count;
+  }
+}
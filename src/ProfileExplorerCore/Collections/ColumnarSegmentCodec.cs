@@ -0,0 +1,251 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Buffers.Binary;
+using System.Diagnostics;
+using System.Numerics;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+namespace ProfileExplorer.Core.Collections;
+
+// Encodes struct values by splitting them into columns of 32-bit words
+// (the fields of the struct, 64-bit fields being split into a low and high column),
+// each column being bit-packed with the fewest bits needed for either
+//   - frame of reference: the offset from the minimum value of the column, or
+//   - delta: the zigzag-encoded difference from the previous value.
+// This fits the profile events, where times are increasing, IPs in the same module
+// share the high bits and context/stack IDs repeat, while decoding is a single
+// branch-free pass per column, without the cost of a general-purpose decompressor.
+//
+// Layout: [int count] then per column [byte mode][byte bit width][uint reference][packed bits],
+// followed by padding that allows reading the packed bits as unaligned 64-bit words.
+public sealed class ColumnarSegmentCodec<T> : ISegmentCodec<T> where T : struct {
+  public static readonly ColumnarSegmentCodec<T> Instance = new();
+  private const byte FrameOfReferenceMode = 0;
+  private const byte DeltaMode = 1;
+  private const int CountSize = 4;
+  private const int ColumnHeaderSize = 6;
+  private const int PaddingSize = 8;
+  private static readonly int ValueSize = Unsafe.SizeOf<T>();
+  private static readonly int ColumnCount = (ValueSize + 3) / 4;
+
+  public byte[] Compress(ReadOnlySpan<T> values) {
+    var rows = MemoryMarshal.AsBytes(values);
+    int count = values.Length;
+    var columns = new ColumnEncoding[ColumnCount];
+    int dataSize = CountSize + PaddingSize;
+
+    for (int column = 0; column < ColumnCount; column++) {
+      columns[column] = AnalyzeColumn(rows, count, column);
+      dataSize += ColumnHeaderSize + PackedSize(count, columns[column].BitWidth);
+    }
+
+    byte[] data = new byte[dataSize];
+    BinaryPrimitives.WriteInt32LittleEndian(data, count);
+    int position = CountSize;
+
+    for (int column = 0; column < ColumnCount; column++) {
+      var encoding = columns[column];
+      data[position] = encoding.Mode;
+      data[position + 1] = (byte)encoding.BitWidth;
+      BinaryPrimitives.WriteUInt32LittleEndian(data.AsSpan(position + 2), encoding.Reference);
+      position += ColumnHeaderSize;
+      position += PackColumn(rows, count, column, encoding, data.AsSpan(position));
+    }
+
+    Debug.Assert(position + PaddingSize == dataSize);
+    return data;
+  }
+
+  public void Decompress(byte[] data, Span<T> values) {
+    int count = BinaryPrimitives.ReadInt32LittleEndian(data);
+    Debug.Assert(count == values.Length);
+    ref byte rows = ref MemoryMarshal.GetReference(MemoryMarshal.AsBytes(values));
+    int position = CountSize;
+
+    for (int column = 0; column < ColumnCount; column++) {
+      byte mode = data[position];
+      int bitWidth = data[position + 1];
+      uint reference = BinaryPrimitives.ReadUInt32LittleEndian(data.AsSpan(position + 2));
+      position += ColumnHeaderSize;
+
+      int offset = column * 4;
+      int columnSize = Math.Min(4, ValueSize - offset);
+      ref byte packed = ref data[position];
+      ref byte firstRow = ref Unsafe.Add(ref rows, offset);
+
+      if (columnSize == 4) {
+        DecodeColumn(ref firstRow, ref packed, count, mode, bitWidth, reference, 4);
+      }
+      else {
+        DecodeColumn(ref firstRow, ref packed, count, mode, bitWidth, reference, columnSize);
+      }
+
+      position += PackedSize(count, bitWidth);
+    }
+  }
+
+  private static ColumnEncoding AnalyzeColumn(ReadOnlySpan<byte> rows, int count, int column) {
+    if (count == 0) {
+      return new ColumnEncoding(FrameOfReferenceMode, 0, 0);
+    }
+
+    int offset = column * 4;
+    int columnSize = Math.Min(4, ValueSize - offset);
+    ref byte row = ref Unsafe.Add(ref MemoryMarshal.GetReference(rows), offset);
+    uint first = ReadColumn(ref row, columnSize);
+    uint min = first;
+    uint max = first;
+    uint prev = first;
+    uint deltaBits = 0; // The width of the OR of all deltas is the width of the largest one.
+
+    for (int i = 0; i < count; i++) {
+      uint value = ReadColumn(ref row, columnSize);
+      min = Math.Min(min, value);
+      max = Math.Max(max, value);
+      deltaBits |= ZigZagEncode(value - prev);
+      prev = value;
+      row = ref Unsafe.Add(ref row, ValueSize);
+    }
+
+    int forWidth = BitWidth(max - min);
+    int deltaWidth = BitWidth(deltaBits);
+
+    // On a tie prefer frame of reference, it doesn't depend on the previous value.
+    return deltaWidth < forWidth ? new ColumnEncoding(DeltaMode, deltaWidth, first) :
+      new ColumnEncoding(FrameOfReferenceMode, forWidth, min);
+  }
+
+  private static int PackColumn(ReadOnlySpan<byte> rows, int count, int column,
+                                ColumnEncoding encoding, Span<byte> output) {
+    if (encoding.BitWidth == 0) {
+      return 0;
+    }
+
+    int offset = column * 4;
+    int columnSize = Math.Min(4, ValueSize - offset);
+    ref byte row = ref Unsafe.Add(ref MemoryMarshal.GetReference(rows), offset);
+    ref byte outputStart = ref MemoryMarshal.GetReference(output);
+    int bitWidth = encoding.BitWidth;
+    uint prev = encoding.Reference;
+    ulong buffer = 0;
+    int bufferBits = 0;
+    int position = 0;
+
+    for (int i = 0; i < count; i++) {
+      uint value = ReadColumn(ref row, columnSize);
+      uint packedValue = encoding.Mode == DeltaMode ? ZigZagEncode(value - prev) : value - encoding.Reference;
+      prev = value;
+      row = ref Unsafe.Add(ref row, ValueSize);
+
+      // Accumulate the bits and write them out 32 at a time.
+      buffer |= (ulong)packedValue << bufferBits;
+      bufferBits += bitWidth;
+
+      if (bufferBits >= 32) {
+        Unsafe.WriteUnaligned(ref Unsafe.Add(ref outputStart, position), (uint)buffer);
+        position += 4;
+        buffer >>= 32;
+        bufferBits -= 32;
+      }
+    }
+
+    while (bufferBits > 0) {
+      output[position++] = (byte)buffer;
+      buffer >>= 8;
+      bufferBits -= 8;
+    }
+
+    Debug.Assert(position == PackedSize(count, bitWidth));
+    return position;
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private static void DecodeColumn(ref byte row, ref byte packed, int count, byte mode,
+                                   int bitWidth, uint reference, int columnSize) {
+    if (bitWidth == 0) {
+      // All values are the same.
+      for (int i = 0; i < count; i++) {
+        WriteColumn(ref row, reference, columnSize);
+        row = ref Unsafe.Add(ref row, ValueSize);
+      }
+
+      return;
+    }
+
+    // Each value is extracted from the 64-bit word starting at the byte
+    // that contains its first bit, values are at most 32 bits so they
+    // always fit in the word after shifting out the bit offset (< 8).
+    ulong mask = (1UL << bitWidth) - 1;
+    long bitPosition = 0;
+
+    if (mode == DeltaMode) {
+      uint value = reference;
+
+      for (int i = 0; i < count; i++) {
+        ulong word = Unsafe.ReadUnaligned<ulong>(ref Unsafe.Add(ref packed, (nint)(bitPosition >> 3)));
+        value += ZigZagDecode((uint)((word >> (int)(bitPosition & 7)) & mask));
+        WriteColumn(ref row, value, columnSize);
+        row = ref Unsafe.Add(ref row, ValueSize);
+        bitPosition += bitWidth;
+      }
+    }
+    else {
+      for (int i = 0; i < count; i++) {
+        ulong word = Unsafe.ReadUnaligned<ulong>(ref Unsafe.Add(ref packed, (nint)(bitPosition >> 3)));
+        WriteColumn(ref row, reference + (uint)((word >> (int)(bitPosition & 7)) & mask), columnSize);
+        row = ref Unsafe.Add(ref row, ValueSize);
+        bitPosition += bitWidth;
+      }
+    }
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private static uint ReadColumn(ref byte row, int columnSize) {
+    if (columnSize == 4) {
+      return Unsafe.ReadUnaligned<uint>(ref row);
+    }
+
+    // Last column of a struct whose size is not a multiple of 4 bytes.
+    uint value = 0;
+
+    for (int i = 0; i < columnSize; i++) {
+      value |= (uint)Unsafe.Add(ref row, i) << i * 8;
+    }
+
+    return value;
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private static void WriteColumn(ref byte row, uint value, int columnSize) {
+    if (columnSize == 4) {
+      Unsafe.WriteUnaligned(ref row, value);
+      return;
+    }
+
+    for (int i = 0; i < columnSize; i++) {
+      Unsafe.Add(ref row, i) = (byte)(value >> i * 8);
+    }
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private static uint ZigZagEncode(uint delta) {
+    return (delta << 1) ^ (uint)((int)delta >> 31);
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private static uint ZigZagDecode(uint value) {
+    return (value >> 1) ^ (uint)-(int)(value & 1);
+  }
+
+  private static int BitWidth(uint value) {
+    return 32 - BitOperations.LeadingZeroCount(value);
+  }
+
+  private static int PackedSize(int count, int bitWidth) {
+    return (int)(((long)count * bitWidth + 7) / 8);
+  }
+
+  private readonly record struct ColumnEncoding(byte Mode, int BitWidth, uint Reference);
+}
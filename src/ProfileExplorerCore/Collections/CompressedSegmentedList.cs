@@ -9,9 +9,9 @@ using System.Collections;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Diagnostics;
-using System.IO.Compression;
 using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Threading;
 using System.Threading.Tasks;
 
 namespace ProfileExplorer.Core.Collections;
@@ -23,27 +23,37 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
   private static readonly int SegmentLength = Math.Max(1, LOHObjectSize / Unsafe.SizeOf<T>());
   private List<Segment> segments_;
   private Segment activeSegment_;
+  private Segment recentSegment_; // Last decompressed segment accessed by index.
   private int count_; // Total number of items in all segments.
   private int segmentLength_; // Number of items per segment.
   private int prefetchLimit_; // Segments to prefetch ahead.
+  private ISegmentCodec<T> codec_; // Encoding of the compressed segments.
   private BlockingCollection<Task> taskQueue_; // Pending compression tasks.
   private List<Task> taskQueueThreadTasks_; // Tasks representing the compression threads.
+  private bool useThreads_;
+  private object taskQueueLock_;
 #if DEBUG
   private int version_;
 #endif
 
-  public CompressedSegmentedList(bool useThreads = true, bool prefetch = true, int prefetchLimit = 2) :
-    this(SegmentLength, useThreads, prefetch, prefetchLimit) {
+  public CompressedSegmentedList(bool useThreads = true, bool prefetch = true, int prefetchLimit = 2,
+                                 ISegmentCodec<T> codec = null) :
+    this(SegmentLength, useThreads, prefetch, prefetchLimit, codec) {
   }
 
   public CompressedSegmentedList(int segmentLength, bool useThreads = true,
-                                 bool prefetch = true, int prefetchLimit = 2) {
+                                 bool prefetch = true, int prefetchLimit = 2,
+                                 ISegmentCodec<T> codec = null) {
     segmentLength_ = segmentLength;
     segments_ = new List<Segment>();
+    codec_ = codec ?? ColumnarSegmentCodec<T>.Instance;
 
     if (useThreads) {
+      // The compression threads are started when the first segment is compressed,
+      // a list that stays in a single segment doesn't keep any thread.
       prefetchLimit_ = prefetch ? prefetchLimit : 0;
-      SetupCompressionThreads();
+      useThreads_ = true;
+      taskQueueLock_ = new object();
     }
   }
 
@@ -63,12 +73,24 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 
   public void Wait(bool reset = true) {
 #if !DISABLE_COMPRESSION
-    taskQueue_.CompleteAdding();
-    Task.WhenAll(taskQueueThreadTasks_);
-    Task.WhenAll(taskQueueThreadTasks_).Wait();
+    if (!useThreads_) {
+      return;
+    }
 
-    if (reset) {
-      SetupCompressionThreads();
+    lock (taskQueueLock_) {
+      if (taskQueue_ == null) {
+        useThreads_ = reset;
+        return;
+      }
+
+      // The queue is not disposed, another thread may still try to add to it,
+      // the task then runs synchronously. With reset, the threads are started
+      // again for the next compression task.
+      taskQueue_.CompleteAdding();
+      Task.WhenAll(taskQueueThreadTasks_).Wait();
+      taskQueue_ = null;
+      taskQueueThreadTasks_ = null;
+      useThreads_ = reset;
     }
 #endif
   }
@@ -98,7 +120,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       return activeSegment_.GetValue(activeIndex);
     }
 
-    var segment = segments_[index / segmentLength_];
+    var segment = GetSegment(index);
     return segment.GetValue(index % segmentLength_);
   }
 
@@ -111,7 +133,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       return ref activeSegment_.GetValueRef(activeIndex);
     }
 
-    var segment = segments_[index / segmentLength_];
+    var segment = GetSegment(index);
     return ref segment.GetValueRef(index % segmentLength_);
   }
 
@@ -124,7 +146,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       activeSegment_.SetValue(activeIndex, value);
     }
     else {
-      var segment = segments_[index / segmentLength_];
+      var segment = GetSegment(index);
       segment.SetValue(index % segmentLength_, value);
     }
 #if DEBUG
@@ -160,6 +182,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
   public void Clear() {
     segments_.Clear();
     activeSegment_ = null;
+    recentSegment_ = null;
     count_ = 0;
 #if DEBUG
     version_++;
@@ -195,14 +218,6 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 #if !DISABLE_COMPRESSION
     // End compression tasks and free memory.
     Wait(false);
-    taskQueue_?.Dispose();
-    taskQueue_ = null;
-
-    foreach (var task in taskQueueThreadTasks_) {
-      task.Dispose();
-    }
-
-    taskQueueThreadTasks_ = null;
 #endif
   }
 
@@ -250,25 +265,46 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 
   private Task ScheduleCompressionTask(Action action) {
     var task = new Task(action);
+    var taskQueue = GetTaskQueue();
 
-    if (!taskQueue_.TryAdd(task)) {
+    if (taskQueue == null || !taskQueue.TryAdd(task)) {
       task.RunSynchronously();
     }
 
     return task;
   }
 
+  private BlockingCollection<Task> GetTaskQueue() {
+    if (!useThreads_) {
+      return null;
+    }
+
+    var taskQueue = Volatile.Read(ref taskQueue_);
+
+    if (taskQueue != null) {
+      return taskQueue;
+    }
+
+    lock (taskQueueLock_) {
+      if (taskQueue_ == null && useThreads_) {
+        SetupCompressionThreads();
+      }
+
+      return taskQueue_;
+    }
+  }
+
   private void SetupCompressionThreads() {
 #if !(DISABLE_COMPRESSION)
-    taskQueue_ = new BlockingCollection<Task>();
+    var taskQueue = new BlockingCollection<Task>();
     taskQueueThreadTasks_ = new List<Task>();
     int threads = 1 + prefetchLimit_; // 1 used for compression.
 
     for (int i = 0; i < threads; i++) {
       taskQueueThreadTasks_.Add(Task.Run(() => {
         try {
-          while (!taskQueue_.IsCompleted) {
-            if (taskQueue_.TryTake(out var task, 1000)) {
+          while (!taskQueue.IsCompleted) {
+            if (taskQueue.TryTake(out var task, 1000)) {
               // Execute the actual (de)compression task.
               task.Start();
               task.Wait();
@@ -280,9 +316,27 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
         }
       }));
     }
+
+    Volatile.Write(ref taskQueue_, taskQueue);
 #endif
   }
 
+  private Segment GetSegment(int index) {
+    var segment = segments_[index / segmentLength_];
+
+    // Accessing values by index in a compressed segment, like updating recent samples
+    // while parsing a trace, decompresses it. Keep the last such segment decompressed
+    // so that repeated accesses to it don't decompress it again, and compress
+    // the previous one so that only a single segment stays decompressed.
+    // Like adding values, this is not meant to be done from multiple threads.
+    if (segment != recentSegment_ && segment.IsCompressed) {
+      recentSegment_?.CompressValues();
+      recentSegment_ = segment;
+    }
+
+    return segment;
+  }
+
   private int GetActiveSegmentIndex(int index) {
     // Check if index is in the active segment to avoid the expensive DIV below.
     if (activeSegment_ != null) {
@@ -317,7 +371,8 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       rangeStart_ = rangeStart;
       rangeEnd_ = rangeEnd;
       segmentStart_ = rangeStart / target.segmentLength_;
-      segmentEnd_ = rangeEnd / target.segmentLength_;
+      // The end is exclusive, don't include the next segment when it's at a segment boundary.
+      segmentEnd_ = rangeEnd > rangeStart ? (rangeEnd - 1) / target.segmentLength_ : segmentStart_ - 1;
       recompress_ = recompress;
     }
 
@@ -328,48 +383,67 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 
       int lastPrefetchIndex = segmentStart_;
       Segment prevSegment = null;
+      Segment segment = null;
 
 #if DEBUG
       int initialVersion = target_.version_;
 #endif
 
-      for (int segmentIndex = segmentStart_; segmentIndex <= segmentEnd_; segmentIndex++) {
-        var segment = target_.segments_[segmentIndex];
-        segment.DecompressValues();
+      try {
+        for (int segmentIndex = segmentStart_; segmentIndex <= segmentEnd_; segmentIndex++) {
+          segment = target_.segments_[segmentIndex];
+          segment.DecompressValues();
 
-        // // Ignore values in the segment before rangeStart and after rangeEnd.
-        int segmentValueIndex = segmentIndex * target_.segmentLength_;
-        int segmentValueStart = segmentValueIndex < rangeStart_ ? rangeStart_ - segmentValueIndex : 0;
-        int segmentValueEnd = segmentValueIndex + segment.Count > rangeEnd_ ? rangeEnd_ - segmentValueIndex
-          : segment.Count;
+          // // Ignore values in the segment before rangeStart and after rangeEnd.
+          int segmentValueIndex = segmentIndex * target_.segmentLength_;
+          int segmentValueStart = segmentValueIndex < rangeStart_ ? rangeStart_ - segmentValueIndex : 0;
+          int segmentValueEnd = segmentValueIndex + segment.Count > rangeEnd_ ? rangeEnd_ - segmentValueIndex
+            : segment.Count;
 
-        for (int i = segmentValueStart; i < segmentValueEnd; i++) {
+          for (int i = segmentValueStart; i < segmentValueEnd; i++) {
 #if DEBUG
-          if (initialVersion != target_.version_) {
-            throw new InvalidOperationException("List modified, potential thread racing bug");
-          }
+            if (initialVersion != target_.version_) {
+              throw new InvalidOperationException("List modified, potential thread racing bug");
+            }
 #endif
-          yield return segment.GetValueDirect(i);
-        }
+            yield return segment.GetValueDirect(i);
+          }
 
-        // Prefetch segments in advance on another thread
-        // to hide the delay of decompressing the data.
-        int prefetchEnd = segmentIndex + target_.prefetchLimit_;
+          // Prefetch segments in advance on another thread
+          // to hide the delay of decompressing the data.
+          int prefetchEnd = segmentIndex + target_.prefetchLimit_;
 
-        if (target_.prefetchLimit_ > 0 && prefetchEnd < segmentEnd_) {
-          for (; lastPrefetchIndex < prefetchEnd; lastPrefetchIndex++) {
-            target_.segments_[lastPrefetchIndex].DecompressValues(true);
-            lastPrefetchIndex = prefetchEnd;
+          if (target_.prefetchLimit_ > 0 && prefetchEnd < segmentEnd_) {
+            for (; lastPrefetchIndex < prefetchEnd; lastPrefetchIndex++) {
+              target_.segments_[lastPrefetchIndex].DecompressValues(true);
+              lastPrefetchIndex = prefetchEnd;
+            }
+          }
+
+          // Re-compress the values, done on another thread.
+          if (recompress_) {
+            prevSegment?.CompressValues();
           }
-        }
 
-        // Re-compress the values, done on another thread.
-        // Don't compress the last segment, it's likely that more values are added to it.
+          prevSegment = segment;
+        }
+      }
+      finally {
+        // Re-compress the segments left decompressed when the enumeration ends
+        // or is stopped early, except the active one, values are still added to it.
         if (recompress_) {
-          prevSegment?.CompressValues();
+          RecompressSegment(prevSegment);
+
+          if (segment != prevSegment) {
+            RecompressSegment(segment);
+          }
         }
+      }
+    }
 
-        prevSegment = segment;
+    private void RecompressSegment(Segment segment) {
+      if (segment != null && segment != target_.activeSegment_) {
+        segment.CompressValues();
       }
     }
 
@@ -404,30 +478,13 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       set => SetValue(index, value);
     }
 
-    private static byte[] CompressImpl(T[] values, int segmentSize) {
+    private byte[] CompressImpl(T[] values, int count) {
       // Since the pooled array can be larger than needed, slice it to the right length.
-      var arraySpan = values.AsSpan();
-      var byteSpan = MemoryMarshal.AsBytes(arraySpan).Slice(0, segmentSize);
-
-      int bufferSize = BrotliEncoder.GetMaxCompressedLength(segmentSize);
-      byte[] tempBuffer = ArrayPool<byte>.Shared.Rent(bufferSize);
-      var bufferSpan = tempBuffer.AsSpan();
-
-      var encoder = new BrotliEncoder(5, 10);
-      var result = encoder.Compress(byteSpan, bufferSpan, out int bytesConsumed, out int bytesWritten, true);
-      Debug.Assert(result == OperationStatus.Done);
-      encoder.Flush(bufferSpan, out int extraBytesWritten);
-      bytesWritten += extraBytesWritten; // Seems to be always 0.
-
-      // Copy to another array, the initial estimate is as large as the input.
-      byte[] outBuffer = new byte[bytesWritten];
-      Array.Copy(tempBuffer, 0, outBuffer, 0, bytesWritten);
+      byte[] result = parent_.codec_.Compress(values.AsSpan(0, count));
 
       // Return array to the pool.
-      ArrayPool<byte>.Shared.Return(tempBuffer);
       ArrayPool<T>.Shared.Return(values);
-      encoder.Dispose();
-      return outBuffer;
+      return result;
     }
 
     [MethodImpl(MethodImplOptions.AggressiveInlining)]
@@ -445,6 +502,14 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
     public void AddValue(T value) {
       Debug.Assert(count_ < values_.Length);
       values_[count_++] = value;
+
+      // If the values were compressed before, discard the data
+      // since it doesn't include the new value.
+      if (WasCompressed) {
+        lock (lockObject_) {
+          data_ = null;
+        }
+      }
     }
 
     [MethodImpl(MethodImplOptions.AggressiveInlining)]
@@ -470,7 +535,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       // If the values were compressed before, discard the data
       // since it doesn't match the current values anymore.
       if (WasCompressed) {
-        lock (this) {
+        lock (lockObject_) {
           data_ = null;
         }
       }
@@ -503,7 +568,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
       }
 
       // Decompress the data. In prefetch mode run it on another thread.
-      lock (this) {
+      lock (lockObject_) {
         if (!IsCompressed) {
           Debug.Assert(values_ != null);
           return;
@@ -511,7 +576,7 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 
         if (prefetch) {
           activeTask_ = parent_.ScheduleCompressionTask(() => {
-            var result = DecompressImpl(data_, size_);
+            var result = DecompressImpl(data_);
 
             lock (lockObject_) {
               values_ = result;
@@ -520,28 +585,34 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
           });
         }
         else {
-          values_ = DecompressImpl(data_, size_);
+          values_ = DecompressImpl(data_);
         }
       }
     }
 
     public void CompressValues() {
 #if !DISABLE_COMPRESSION
-      lock (this) {
+      lock (lockObject_) {
         if (WasCompressed || IsBeingCompressed) {
-          values_ = null; // Free array.
+          // Return the decompressed values to the pool, the compressed data is still valid.
+          if (values_ != null) {
+            ArrayPool<T>.Shared.Return(values_);
+            values_ = null;
+          }
+
           return;
         }
 
         Debug.Assert(data_ == null);
         var valuesCopy = values_;
+        int count = count_;
         values_ = null; // Put into the compressed state.
 
         // Compress on another thread.
         activeTask_ = parent_.ScheduleCompressionTask(() => {
-          byte[] result = CompressImpl(valuesCopy, size_);
+          byte[] result = CompressImpl(valuesCopy, count);
 
-          lock (this) {
+          lock (lockObject_) {
             data_ = result;
             activeTask_ = null;
           }
@@ -562,20 +633,16 @@ public sealed class CompressedSegmentedList<T> : IDisposable, IList<T> where T :
 
     internal void CopyTo(T[] array, int arrayIndex) {
       DecompressValues();
-      values_.CopyTo(array, arrayIndex);
+      values_.AsSpan(0, count_).CopyTo(array.AsSpan(arrayIndex));
     }
 
-    private T[] DecompressImpl(byte[] data, int segmentSize) {
-      var dataSpan = data.AsSpan();
-      int length = segmentSize / Unsafe.SizeOf<T>();
+    private T[] DecompressImpl(byte[] data) {
+      int length = size_ / Unsafe.SizeOf<T>();
 
       // Use an ArrayPool to reduce GC pressure, values are usually used temporarely.
       // Since the pooled array can be larger than needed, slice it to the right length.
       var values = ArrayPool<T>.Shared.Rent(length);
-      var decompressedSpan = MemoryMarshal.AsBytes(values.AsSpan()).Slice(0, segmentSize);
-      bool result = BrotliDecoder.TryDecompress(dataSpan, decompressedSpan, out int readBytes);
-      Debug.Assert(result);
-      Debug.Assert(readBytes == segmentSize);
+      parent_.codec_.Decompress(data, values.AsSpan(0, count_));
       return values;
     }
   }
@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Buffers;
+using System.Diagnostics;
+using System.IO.Compression;
+using System.Runtime.InteropServices;
+
+namespace ProfileExplorer.Core.Collections;
+
+// Encodes the values of a CompressedSegmentedList segment.
+// The values are plain structs without references, the decoded values
+// must be bit-identical to the encoded ones.
+public interface ISegmentCodec<T> where T : struct {
+  byte[] Compress(ReadOnlySpan<T> values);
+  void Decompress(byte[] data, Span<T> values);
+}
+
+// General-purpose compression of the raw struct bytes. Compresses better than
+// ColumnarSegmentCodec when the values don't have a per-field structure,
+// but it's an order of magnitude slower to compress and decompress.
+public sealed class BrotliSegmentCodec<T> : ISegmentCodec<T> where T : struct {
+  public static readonly BrotliSegmentCodec<T> Instance = new();
+  private const int Quality = 5;
+  private const int WindowBits = 10;
+
+  public byte[] Compress(ReadOnlySpan<T> values) {
+    var byteSpan = MemoryMarshal.AsBytes(values);
+    int bufferSize = BrotliEncoder.GetMaxCompressedLength(byteSpan.Length);
+    byte[] tempBuffer = ArrayPool<byte>.Shared.Rent(bufferSize);
+    var bufferSpan = tempBuffer.AsSpan();
+
+    using var encoder = new BrotliEncoder(Quality, WindowBits);
+    var result = encoder.Compress(byteSpan, bufferSpan, out int bytesConsumed, out int bytesWritten, true);
+    Debug.Assert(result == OperationStatus.Done);
+    encoder.Flush(bufferSpan, out int extraBytesWritten);
+    bytesWritten += extraBytesWritten; // Seems to be always 0.
+
+    // Copy to another array, the initial estimate is as large as the input.
+    byte[] outBuffer = bufferSpan.Slice(0, bytesWritten).ToArray();
+    ArrayPool<byte>.Shared.Return(tempBuffer);
+    return outBuffer;
+  }
+
+  public void Decompress(byte[] data, Span<T> values) {
+    var decompressedSpan = MemoryMarshal.AsBytes(values);
+    bool result = BrotliDecoder.TryDecompress(data, decompressedSpan, out int readBytes);
+    Debug.Assert(result);
+    Debug.Assert(readBytes == decompressedSpan.Length);
+  }
+}
@@ -0,0 +1,206 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections;
+using System.Collections.Generic;
+using System.Runtime.CompilerServices;
+
+namespace ProfileExplorer.Core.Collections;
+
+// A lightweight dictionary for the few entries per call tree node, like the
+// per-thread weights and call sites. A single entry is stored inline, a few
+// entries in an array searched linearly, and only for many entries
+// a hash index is built over the array. With most nodes having a single
+// thread and call site, this uses several times less memory than a Dictionary.
+public sealed class TinyDictionary<TKey, TValue> : IReadOnlyDictionary<TKey, TValue> {
+  private const int LinearSearchLimit = 8;
+  private Entry[] entries_; // Null while there is at most one entry.
+  private Entry singleEntry_;
+  private Dictionary<TKey, int> index_; // Key to entry index, for many entries.
+  private int count_;
+
+  public TinyDictionary() { }
+
+  public TinyDictionary(int capacity) {
+    if (capacity > 1) {
+      entries_ = new Entry[capacity];
+    }
+  }
+
+  public int Count => count_;
+
+  public IEnumerable<TKey> Keys {
+    get {
+      foreach (var pair in this) {
+        yield return pair.Key;
+      }
+    }
+  }
+
+  public IEnumerable<TValue> Values {
+    get {
+      foreach (var pair in this) {
+        yield return pair.Value;
+      }
+    }
+  }
+
+  public TValue this[TKey key] {
+    get {
+      int index = IndexOf(key);
+
+      if (index < 0) {
+        throw new KeyNotFoundException($"Key {key} not found");
+      }
+
+      return EntryAt(index).Value;
+    }
+    set => GetValueRefOrAddDefault(key, out _) = value;
+  }
+
+  public bool ContainsKey(TKey key) {
+    return IndexOf(key) >= 0;
+  }
+
+  public bool TryGetValue(TKey key, out TValue value) {
+    int index = IndexOf(key);
+
+    if (index < 0) {
+      value = default(TValue);
+      return false;
+    }
+
+    value = EntryAt(index).Value;
+    return true;
+  }
+
+  // Same as CollectionsMarshal.GetValueRefOrAddDefault for a Dictionary,
+  // the reference is valid until another entry is added.
+  public ref TValue GetValueRefOrAddDefault(TKey key, out bool exists) {
+    int index = IndexOf(key);
+
+    if (index >= 0) {
+      exists = true;
+      return ref EntryAt(index).Value;
+    }
+
+    exists = false;
+
+    if (count_ == 0 && entries_ == null) {
+      singleEntry_.Key = key;
+      count_ = 1;
+      return ref singleEntry_.Value;
+    }
+
+    if (entries_ == null) {
+      entries_ = new Entry[2];
+      entries_[0] = singleEntry_;
+      singleEntry_ = default(Entry);
+    }
+    else if (entries_.Length == count_) {
+      Array.Resize(ref entries_, count_ * 2);
+    }
+
+    entries_[count_].Key = key;
+
+    if (index_ != null) {
+      index_[key] = count_;
+    }
+    else if (count_ == LinearSearchLimit) {
+      index_ = new Dictionary<TKey, int>(count_ * 2);
+
+      for (int i = 0; i <= count_; i++) {
+        index_[entries_[i].Key] = i;
+      }
+    }
+
+    return ref entries_[count_++].Value;
+  }
+
+  public List<(TKey, TValue)> ToList() {
+    var list = new List<(TKey, TValue)>(count_);
+
+    foreach (var pair in this) {
+      list.Add((pair.Key, pair.Value));
+    }
+
+    return list;
+  }
+
+  public Enumerator GetEnumerator() {
+    return new Enumerator(this);
+  }
+
+  IEnumerator<KeyValuePair<TKey, TValue>> IEnumerable<KeyValuePair<TKey, TValue>>.GetEnumerator() {
+    return GetEnumerator();
+  }
+
+  IEnumerator IEnumerable.GetEnumerator() {
+    return GetEnumerator();
+  }
+
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  private ref Entry EntryAt(int index) {
+    if (entries_ == null) {
+      return ref singleEntry_;
+    }
+
+    return ref entries_[index];
+  }
+
+  private int IndexOf(TKey key) {
+    if (count_ == 0) {
+      return -1;
+    }
+
+    if (entries_ == null) {
+      return EqualityComparer<TKey>.Default.Equals(singleEntry_.Key, key) ? 0 : -1;
+    }
+
+    if (index_ != null) {
+      return index_.TryGetValue(key, out int index) ? index : -1;
+    }
+
+    for (int i = 0; i < count_; i++) {
+      if (EqualityComparer<TKey>.Default.Equals(entries_[i].Key, key)) {
+        return i;
+      }
+    }
+
+    return -1;
+  }
+
+  private struct Entry {
+    public TKey Key;
+    public TValue Value;
+  }
+
+  public struct Enumerator : IEnumerator<KeyValuePair<TKey, TValue>> {
+    private readonly TinyDictionary<TKey, TValue> dict_;
+    private int index_;
+
+    internal Enumerator(TinyDictionary<TKey, TValue> dict) {
+      dict_ = dict;
+      index_ = -1;
+    }
+
+    public KeyValuePair<TKey, TValue> Current {
+      get {
+        ref var entry = ref dict_.EntryAt(index_);
+        return new KeyValuePair<TKey, TValue>(entry.Key, entry.Value);
+      }
+    }
+
+    object IEnumerator.Current => Current;
+
+    public bool MoveNext() {
+      return ++index_ < dict_.count_;
+    }
+
+    public void Reset() {
+      index_ = -1;
+    }
+
+    public void Dispose() { }
+  }
+}
@@ -1,6 +1,8 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Collections.Generic;
+using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.Compilers.Architecture;
 using ProfileExplorer.Core.IR;
 using ProfileExplorer.Core.Parser;
@@ -30,6 +32,15 @@ public sealed class ASMIRSectionParser : IRSectionParser {
                          sectionText, section, functionSize_).Parse();
   }
 
+  // Builds the function from the instructions decoded by the disassembler
+  // instead of parsing the section text they were printed to.
+  public FunctionIR BuildSection(IRTextSection section, string sectionText,
+                                 List<DisassembledInstruction> instructions) {
+    return new ASMParser(irInfo_, errorHandler_,
+                         RegisterTables.SelectRegisterTable(irInfo_.Mode),
+                         sectionText, section, functionSize_).Build(instructions);
+  }
+
   public void SkipCurrentToken() {
     throw new NotImplementedException();
   }
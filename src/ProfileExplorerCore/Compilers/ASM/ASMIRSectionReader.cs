@@ -1,5 +1,7 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+using System;
+
 namespace ProfileExplorer.Core.Compilers.ASM;
 
 public sealed class ASMIRSectionReader : SectionReaderBase {
@@ -11,6 +13,13 @@ public sealed class ASMIRSectionReader : SectionReaderBase {
     base(textData, expectSectionHeaders) {
   }
 
+  protected override bool SupportsParallelSummary => true;
+
+  protected override bool IsCandidateLine(ReadOnlySpan<byte> line) {
+    // Function starts contain a colon, empty lines end functions.
+    return line.IsEmpty || line.IndexOf((byte)':') >= 0;
+  }
+
   protected override string ExtractFunctionName(string line) {
     return line.Substring(0, line.Length - 1);
   }
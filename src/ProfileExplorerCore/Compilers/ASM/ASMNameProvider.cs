@@ -1,6 +1,5 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
-using System.Collections.Concurrent;
 using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.Providers;
 using ProfileExplorer.Core.Utilities;
@@ -8,14 +7,6 @@ using ProfileExplorer.Core.Utilities;
 namespace ProfileExplorer.Core.Compilers.ASM;
 
 public sealed class ASMNameProvider : INameProvider {
-  private static ConcurrentDictionary<string, string> demangledNameMap_;
-  private static ConcurrentDictionary<string, string> functionNameMap_;
-
-  static ASMNameProvider() {
-    demangledNameMap_ = new ConcurrentDictionary<string, string>();
-    functionNameMap_ = new ConcurrentDictionary<string, string>();
-  }
-
   public bool IsDemanglingSupported => true;
   public bool IsDemanglingEnabled => IsDemanglingSupported && CoreSettingsProvider.SectionSettings.ShowDemangledNames;
   public FunctionNameDemanglingOptions GlobalDemanglingOptions => CoreSettingsProvider.SectionSettings.DemanglingOptions;
@@ -44,12 +35,8 @@ public sealed class ASMNameProvider : INameProvider {
   }
 
   public string DemangleFunctionName(string name, FunctionNameDemanglingOptions options) {
-    if (!demangledNameMap_.TryGetValue(name, out string demangledName)) {
-      demangledName = PDBDebugInfoProvider.DemangleFunctionName(name, options);
-      demangledNameMap_.TryAdd(name, demangledName);
-    }
-
-    return demangledName;
+    // Demangled names are cached by PDBDebugInfoProvider per name and options.
+    return PDBDebugInfoProvider.DemangleFunctionName(name, options);
   }
 
   public string DemangleFunctionName(IRTextFunction function, FunctionNameDemanglingOptions options) {
@@ -61,22 +48,11 @@ public sealed class ASMNameProvider : INameProvider {
       return name;
     }
 
-    // Mangled MSVC C++ names always start with a ? char.
-    if (!name.StartsWith('?')) {
-      return name;
-    }
-
-    if (!functionNameMap_.TryGetValue(name, out string demangledName)) {
-      demangledName = PDBDebugInfoProvider.DemangleFunctionName(name, GlobalDemanglingOptions);
-      functionNameMap_.TryAdd(name, demangledName);
-    }
-
-    return demangledName;
+    return PDBDebugInfoProvider.DemangleFunctionName(name, GlobalDemanglingOptions);
   }
 
   public void SettingsChanged() {
-    demangledNameMap_.Clear();
-    functionNameMap_.Clear();
+    // The demangled name cache is keyed by the options, nothing to reset.
   }
 
   public string FormatFunctionName(IRTextFunction function) {
@@ -3,8 +3,10 @@
 using System;
 using System.Collections.Generic;
 using System.Diagnostics;
+using System.Globalization;
 using System.Text;
 using ProfileExplorer.Core.Analysis;
+using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.Collections;
 using ProfileExplorer.Core.Compilers.Architecture;
 using ProfileExplorer.Core.IR;
@@ -131,6 +133,72 @@ public sealed class ASMParser : ParserBase {
     return function;
   }
 
+  // Builds the function from the instructions decoded by the disassembler,
+  // which already provide the address, opcode and operands location of each
+  // instruction in the section text, so only the operands are scanned.
+  // The result has the same blocks and metadata as parsing the text.
+  public FunctionIR Build(List<DisassembledInstruction> instructions) {
+    var function = new FunctionIR(section_.ParentFunction.Name);
+    var startLocation = default(TextLocation);
+    BlockIR block = null;
+    MetadataTag.EnsureCapacity(instructions.Count + 1);
+
+    foreach (var instrInfo in instructions) {
+      potentialLabelMap_[instrInfo.Address] =
+        new Tuple<TextLocation, int>(instrInfo.Location, instrInfo.AddressLength);
+
+      if (makeNewBlock_) {
+        var newBlock = GetOrCreateBlock(instrInfo.Address, function);
+        var blockLabel = GetOrCreateBlockLabel(newBlock);
+        blockLabel.SetTextRange(instrInfo.Location, instrInfo.AddressLength);
+
+        if (block != null && connectNewBlock_) {
+          ConnectBlocks(block, newBlock);
+        }
+
+        function.Blocks.Add(newBlock);
+        committedBlocks_.Add(newBlock);
+        block = newBlock;
+        startLocation = instrInfo.Location;
+        makeNewBlock_ = false;
+        connectNewBlock_ = false;
+      }
+
+      var instr = new InstructionIR(NextElementId, InstructionKind.Other, block);
+      block.AddTuple(instr);
+      instrCount_++;
+
+      instr.OpcodeText = lexer_.GetText(instrInfo.OpcodeOffset, instrInfo.OpcodeLength);
+      instr.OpcodeLocation = MakeLocation(instrInfo, instrInfo.OpcodeOffset);
+
+      if (irInfo_.Mode == IRMode.ARM64 && instr.OpcodeText.Span.IndexOf('.') > 0) {
+        // Use beq for b.eq, same as when parsing the text.
+        instr.OpcodeText = instr.OpcodeText.ToString().Replace(".", "").AsMemory();
+      }
+
+      SetInstructionOpcodeInfo(instr);
+      bool isJump = UpdateBlockEnd(instr);
+      BuildOperandList(instr, instrInfo);
+      ConnectInstruction(instr, block, isJump);
+      AddInstructionAddress(instr, instrInfo.Address);
+      instr.SetTextRange(instrInfo.Location, instrInfo.EndOffset - instrInfo.Location.Offset);
+
+      if (isJump) {
+        block.SetTextRange(startLocation, instrInfo.EndOffset - startLocation.Offset);
+      }
+    }
+
+    if (block != null) {
+      block.SetTextRange(startLocation, instructions[^1].EndOffset - startLocation.Offset);
+    }
+
+    SetLastInstructionSize();
+    FixBlockReferences(function);
+    AssignBlockNumbers(function);
+    AddMetadata(function);
+    return function;
+  }
+
   private void Reset() {
     base.Reset();
     makeNewBlock_ = true;
@@ -321,7 +389,14 @@ public sealed class ASMParser : ParserBase {
     // Skip over the list of instruction bytecodes.
     SkipInstructionBytes();
     (var instr, bool isJump) = ParseInstruction(block);
+    AddInstructionAddress(instr, address);
 
+    SetTextRange(instr, startToken, current_, 1);
+    SkipToLineEnd();
+    return isJump; // A jump ends the current block.
+  }
+
+  private void AddInstructionAddress(InstructionIR instr, long address) {
     // Update metadata.
     initialAddress_ ??= address;
     long offset = address - initialAddress_.Value;
@@ -333,10 +408,6 @@ public sealed class ASMParser : ParserBase {
 
     previousInstr_ = instr;
     previousInstrAddress_ = address;
-
-    SetTextRange(instr, startToken, current_, 1);
-    SkipToLineEnd();
-    return isJump; // A jump ends the current block.
   }
 
   private void SetPreviousInstructionSize(long address) {
@@ -364,51 +435,59 @@ public sealed class ASMParser : ParserBase {
     // Extract the opcode.
     if (IsIdentifier()) {
       SetInstructionOpcode(instr);
-
-      if (instr.Kind == InstructionKind.Branch) {
-        isJump = true;
-        makeNewBlock_ = true;
-        connectNewBlock_ = true; // Fall-through.
-      }
-      else if (instr.Kind == InstructionKind.Goto) {
-        isJump = true;
-        makeNewBlock_ = true;
-        connectNewBlock_ = false;
-      }
-      else if (instr.Kind == InstructionKind.Return) {
-        isJump = true;
-        makeNewBlock_ = true;
-        connectNewBlock_ = false;
-      }
+      isJump = UpdateBlockEnd(instr);
 
       SkipToken(); // Skip opcode.
       ParseOperandList(instr, instr.Sources);
+      ConnectInstruction(instr, block, isJump);
+    }
 
-      if (isJump) {
-        // Connect the block with the jump target.
-        var targetOp = irInfo_.GetBranchTarget(instr);
-
-        if (targetOp != null && targetOp.IsIntConstant) {
-          long targetAddress = targetOp.IntValue;
-          var targetBlock = GetOrCreateBlock(targetAddress, block.ParentFunction);
-          ConnectBlocks(block, targetBlock);
-          referencedBlocks_[targetBlock] = targetAddress;
-
-          int opIndex = instr.Sources.IndexOf(targetOp);
-          instr.Sources[opIndex].Kind = OperandKind.LabelAddress;
-          instr.Sources[opIndex].Value = GetOrCreateBlockLabel(targetBlock);
-        }
-      }
-      else {
-        if (instr.Sources.Count > 0) {
-          instr.Destinations.Add(instr.Sources[0]);
-        }
+    return (instr, isJump);
+  }
 
-        //? TODO: OPEQ add first source as dest
+  private bool UpdateBlockEnd(InstructionIR instr) {
+    if (instr.Kind == InstructionKind.Branch) {
+      makeNewBlock_ = true;
+      connectNewBlock_ = true; // Fall-through.
+      return true;
+    }
+    else if (instr.Kind == InstructionKind.Goto) {
+      makeNewBlock_ = true;
+      connectNewBlock_ = false;
+      return true;
+    }
+    else if (instr.Kind == InstructionKind.Return) {
+      makeNewBlock_ = true;
+      connectNewBlock_ = false;
+      return true;
+    }
+
+    return false;
+  }
+
+  private void ConnectInstruction(InstructionIR instr, BlockIR block, bool isJump) {
+    if (isJump) {
+      // Connect the block with the jump target.
+      var targetOp = irInfo_.GetBranchTarget(instr);
+
+      if (targetOp != null && targetOp.IsIntConstant) {
+        long targetAddress = targetOp.IntValue;
+        var targetBlock = GetOrCreateBlock(targetAddress, block.ParentFunction);
+        ConnectBlocks(block, targetBlock);
+        referencedBlocks_[targetBlock] = targetAddress;
+
+        int opIndex = instr.Sources.IndexOf(targetOp);
+        instr.Sources[opIndex].Kind = OperandKind.LabelAddress;
+        instr.Sources[opIndex].Value = GetOrCreateBlockLabel(targetBlock);
       }
     }
+    else {
+      if (instr.Sources.Count > 0) {
+        instr.Destinations.Add(instr.Sources[0]);
+      }
 
-    return (instr, isJump);
+      //? TODO: OPEQ add first source as dest
+    }
   }
 
   private bool ParseOperandList(InstructionIR instr, List<OperandIR> list) {
@@ -462,6 +541,193 @@ public sealed class ASMParser : ParserBase {
     return true;
   }
 
+  private void BuildOperandList(InstructionIR instr, DisassembledInstruction instrInfo) {
+    var text = lexer_.GetText(0, instrInfo.EndOffset).Span;
+    int offset = instrInfo.OperandsOffset;
+
+    while (offset < text.Length) {
+      var operand = BuildOperand(instr, instrInfo, text, ref offset);
+
+      if (operand != null) {
+        operand.Role = OperandRole.Source;
+        instr.Sources.Add(operand);
+      }
+
+      // Skip over the rest of the operand, such as ARM64 annotations like v22.4s,
+      // and the comma separating it from the next one.
+      int depth = 0;
+
+      for (; offset < text.Length; offset++) {
+        char letter = text[offset];
+
+        if (letter == '[' || letter == '(' || letter == '{') {
+          depth++;
+        }
+        else if (letter == ']' || letter == ')' || letter == '}') {
+          depth--;
+        }
+        else if (letter == ',' && depth <= 0) {
+          offset++;
+          break;
+        }
+      }
+    }
+  }
+
+  private OperandIR BuildOperand(InstructionIR instr, DisassembledInstruction instrInfo,
+                                 ReadOnlySpan<char> text, ref int offset, bool isIndirBaseOp = false) {
+    SkipOperandKeywords(text, ref offset); // Skip DWORD PTR, etc.
+
+    if (offset >= text.Length) {
+      return null;
+    }
+
+    if (instrInfo.HasTargetName && offset == instrInfo.TargetNameOffset) {
+      // The function name that replaced the target address,
+      // with demangled names it can contain any character.
+      var nameOperand = CreateOperand(NextElementId, OperandKind.Variable, TypeIR.GetUnknown(), instr);
+      nameOperand.Value = lexer_.GetText(offset, instrInfo.TargetNameLength);
+      nameOperand.SetTextRange(MakeLocation(instrInfo, offset), instrInfo.TargetNameLength);
+      offset += instrInfo.TargetNameLength;
+      return nameOperand;
+    }
+
+    int startOffset = offset;
+    char letter = text[offset];
+
+    if (letter == '[') {
+      if (isIndirBaseOp) {
+        return null; // Nested [indir] not allowed.
+      }
+
+      // [base+index*scale+offset], only the base operand is kept.
+      offset++;
+      var baseOp = BuildOperand(instr, instrInfo, text, ref offset, true);
+      int endOffset = text.Slice(offset).IndexOf(']');
+
+      if (endOffset < 0) {
+        return null;
+      }
+
+      offset += endOffset + 1;
+      var operand = CreateOperand(NextElementId, OperandKind.Indirection, TypeIR.GetUnknown(), instr);
+      operand.Value = baseOp;
+      operand.SetTextRange(MakeLocation(instrInfo, startOffset), offset - startOffset);
+      return operand;
+    }
+
+    if (letter == '#' || letter == '-' || CharTable.IsDigit(letter)) {
+      // ARM64 assembly can have a # in front of a number like in #0x30.
+      bool isNegated = false;
+
+      if (letter == '#') {
+        offset++;
+      }
+
+      if (offset < text.Length && text[offset] == '-') {
+        offset++;
+        isNegated = true;
+      }
+
+      int numberOffset = offset;
+
+      while (offset < text.Length && IsHexNumberLetter(text[offset])) {
+        offset++;
+      }
+
+      // The disassembler prints hex values with the 0x prefix, others are decimal.
+      var number = text.Slice(numberOffset, offset - numberOffset);
+
+      if (!TryParseIntConstant(number, false, out long value)) {
+        return null;
+      }
+
+      var operand = CreateOperand(NextElementId, OperandKind.IntConstant, TypeIR.GetUnknown(), instr);
+
+      unchecked {
+        operand.Value = isNegated ? -value : value;
+      }
+
+      operand.SetTextRange(MakeLocation(instrInfo, startOffset), offset - startOffset);
+      return operand;
+    }
+
+    if (CharTable.IsIdentifierChar(letter)) {
+      while (offset < text.Length && CharTable.IsIdentifierChar(text[offset])) {
+        offset++;
+      }
+
+      var operand = CreateOperand(NextElementId, OperandKind.Variable, TypeIR.GetUnknown(), instr);
+      var name = lexer_.GetText(startOffset, offset - startOffset);
+      operand.Value = name;
+
+      // Try to associate with a register.
+      var register = RegisterTable.GetRegister(name.ToString());
+
+      if (register != null) {
+        operand.AddTag(new RegisterTag(register, operand));
+      }
+
+      operand.SetTextRange(MakeLocation(instrInfo, startOffset), offset - startOffset);
+      return operand;
+    }
+
+    return null;
+  }
+
+  private void SkipOperandKeywords(ReadOnlySpan<char> text, ref int offset) {
+    while (offset < text.Length) {
+      if (text[offset] == ' ') {
+        offset++;
+        continue;
+      }
+
+      int endOffset = offset;
+
+      while (endOffset < text.Length && CharTable.IsIdentifierChar(text[endOffset])) {
+        endOffset++;
+      }
+
+      if (endOffset == offset ||
+          !keywordTrie_.TryGetValue(text.Slice(offset, endOffset - offset), out _)) {
+        return;
+      }
+
+      offset = endOffset;
+    }
+  }
+
+  // Parses an integer constant with an optional 0x prefix. Numbers without
+  // the prefix are hex in text listings (MASM style) and decimal in the disassembler output.
+  private static bool TryParseIntConstant(ReadOnlySpan<char> text, bool defaultHex, out long value) {
+    bool isHex = defaultHex;
+
+    if (text.StartsWith("0x", StringComparison.OrdinalIgnoreCase)) {
+      text = text.Slice(2);
+      isHex = true;
+    }
+
+    if (isHex) {
+      bool result = ulong.TryParse(text, NumberStyles.AllowHexSpecifier,
+                                   NumberFormatInfo.InvariantInfo, out ulong hexValue);
+      value = unchecked((long)hexValue);
+      return result;
+    }
+
+    return long.TryParse(text, NumberStyles.None, NumberFormatInfo.InvariantInfo, out value);
+  }
+
+  private static bool IsHexNumberLetter(char c) {
+    return c >= '0' && c <= '9' ||
+           c >= 'a' && c <= 'f' ||
+           c >= 'A' && c <= 'F' ||
+           c == 'x' || c == 'X';
+  }
+
+  private static TextLocation MakeLocation(DisassembledInstruction instrInfo, int offset) {
+    return new TextLocation(offset, instrInfo.Location.Line, offset - instrInfo.Location.Offset);
+  }
+
   private OperandIR ParseOperand(TupleIR parent, bool isIndirBaseOp = false,
                                  bool isBlockLabelRef = false,
                                  bool disableSkipToNext = false) {
@@ -506,7 +772,8 @@ public sealed class ASMParser : ParserBase {
       isNegated = true;
     }
 
-    if (TokenLongHexNumber(out long intValue)) {
+    if ((IsNumber() || IsIdentifier()) &&
+        TryParseIntConstant(TokenData().Span, true, out long intValue)) {
       // intConst = DECIMAL [(0xHEX)] [.type]
       SkipToken();
       opKind = OperandKind.IntConstant;
@@ -640,6 +907,10 @@ public sealed class ASMParser : ParserBase {
       }
     }
 
+    SetInstructionOpcodeInfo(instr);
+  }
+
+  private void SetInstructionOpcodeInfo(InstructionIR instr) {
     switch (irInfo_.Mode) {
       case IRMode.x86_64: {
         if (x86Opcodes.GetOpcodeInfo(instr.OpcodeText, out var info)) {
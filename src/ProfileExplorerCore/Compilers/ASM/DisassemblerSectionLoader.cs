@@ -143,7 +143,8 @@ public sealed class DisassemblerSectionLoader : IRTextSectionLoader {
   }
 
   public override ParsedIRTextSection LoadSection(IRTextSection section) {
-    string text = GetSectionText(section);
+    var instructions = new List<DisassembledInstruction>();
+    string text = GetSectionText(section, instructions);
 
     if (string.IsNullOrEmpty(text)) {
       return null;
@@ -162,6 +163,10 @@ public sealed class DisassemblerSectionLoader : IRTextSectionLoader {
     if (sectionParser == null) {
       function = new FunctionIR();
     }
+    else if (sectionParser is ASMIRSectionParser asmParser && instructions.Count > 0) {
+      // Build the IR from the decoded instructions, the text is used only for display.
+      function = asmParser.BuildSection(section, text, instructions);
+    }
     else {
       function = sectionParser.ParseSection(section, text);
     }
@@ -170,6 +175,10 @@ public sealed class DisassemblerSectionLoader : IRTextSectionLoader {
   }
 
   public override string GetSectionText(IRTextSection section) {
+    return GetSectionText(section, null);
+  }
+
+  private string GetSectionText(IRTextSection section, List<DisassembledInstruction> instructions) {
     if (disassembler_ == null) {
       return null; // Failed to initialize.
     }
@@ -187,14 +196,14 @@ public sealed class DisassemblerSectionLoader : IRTextSectionLoader {
 
         if (code != null) {
           disassembler_.UseSymbolNameResolver(address => methodCode.FindCallTarget(address));
-          return disassembler_.DisassembleToText(code, funcInfo.StartRVA);
+          return disassembler_.DisassembleToText(code, funcInfo.StartRVA, instructions);
         }
       }
 
       return "";
     }
 
-    return disassembler_.DisassembleToText(funcInfo);
+    return disassembler_.DisassembleToText(funcInfo, instructions);
   }
 
   public override ReadOnlyMemory<char> GetSectionTextSpan(IRTextSection section) {
@@ -1,7 +1,6 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
-using System.Collections.Concurrent;
 using System.Collections.Generic;
 using ProfileExplorer.Core;
 using ProfileExplorer.Core.Binary;
@@ -31,12 +30,8 @@ public class FilteredSectionName {
 
 public sealed class DefaultNameProvider : INameProvider {
   private static List<FilteredSectionName> sectionNameFilters_;
-  private static ConcurrentDictionary<string, string> demangledNameMap_;
-  private static ConcurrentDictionary<string, string> functionNameMap_;
 
   static DefaultNameProvider() {
-    demangledNameMap_ = new ConcurrentDictionary<string, string>();
-    functionNameMap_ = new ConcurrentDictionary<string, string>();
     sectionNameFilters_ = new List<FilteredSectionName>();
     sectionNameFilters_.Add(new FilteredSectionName("* ", FilteredSectionNameKind.TrimPrefix));
     sectionNameFilters_.Add(new FilteredSectionName(" *", FilteredSectionNameKind.TrimSuffix));
@@ -120,12 +115,8 @@ public sealed class DefaultNameProvider : INameProvider {
   }
 
   public string DemangleFunctionName(string name, FunctionNameDemanglingOptions options) {
-    if (!demangledNameMap_.TryGetValue(name, out string demangledName)) {
-      demangledName = PDBDebugInfoProvider.DemangleFunctionName(name, options);
-      demangledNameMap_.TryAdd(name, demangledName);
-    }
-
-    return demangledName;
+    // Demangled names are cached by PDBDebugInfoProvider per name and options.
+    return PDBDebugInfoProvider.DemangleFunctionName(name, options);
   }
 
   public string DemangleFunctionName(IRTextFunction function, FunctionNameDemanglingOptions options) {
@@ -137,12 +128,7 @@ public sealed class DefaultNameProvider : INameProvider {
       return name;
     }
 
-    if (!functionNameMap_.TryGetValue(name, out string demangledName)) {
-      demangledName = PDBDebugInfoProvider.DemangleFunctionName(name, FunctionNameDemanglingOptions.OnlyName);
-      functionNameMap_.TryAdd(name, demangledName);
-    }
-
-    return demangledName;
+    return PDBDebugInfoProvider.DemangleFunctionName(name, FunctionNameDemanglingOptions.OnlyName);
   }
 
   public string FormatFunctionName(IRTextFunction function) {
@@ -150,7 +136,6 @@ public sealed class DefaultNameProvider : INameProvider {
   }
 
   public void SettingsChanged() {
-    demangledNameMap_.Clear();
-    functionNameMap_.Clear();
+    // The demangled name cache is keyed by the options, nothing to reset.
   }
 }
\ No newline at end of file
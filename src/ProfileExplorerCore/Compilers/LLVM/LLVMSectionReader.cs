@@ -17,6 +17,14 @@ public sealed class LLVMSectionReader : SectionReaderBase, IDisposable {
     base(textData, expectSectionHeaders) {
   }
 
+  protected override bool SupportsParallelSummary => true;
+
+  protected override bool IsCandidateLine(ReadOnlySpan<byte> line) {
+    return line.StartsWith("*** IR Dump "u8) ||
+           line.StartsWith("define"u8) ||
+           line.StartsWith("}"u8);
+  }
+
   protected override bool IsSectionStart(string line) {
     return line.StartsWith(SectionStartLine, StringComparison.Ordinal);
   }
@@ -0,0 +1,207 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.IO;
+
+namespace ProfileExplorer.Core.Graph;
+
+// Node positions and edge points computed by LayeredGraphLayout, indexed
+// like the nodes and edges recorded in it. Edge points are stored as
+// pairs of X, Y values. The layout depends only on the graph structure,
+// it is saved in a file cache named by the structure hash so that
+// the graphs of the same functions don't have to be laid out again
+// when a trace or document is reopened. The cache directory is trimmed
+// to a max. size by deleting the least recently used layouts.
+public sealed class GraphLayoutData {
+  public const long MaxCacheDirectorySize = 64 * 1024 * 1024;
+  private const uint FileMagic = 0x4C474550; // "PEGL"
+  private const int CurrentFileVersion = 1; // Increment when the layout algorithm changes.
+
+  public GraphLayoutData(double width, double height, double[] nodeX, double[] nodeY,
+                         double[][] edgePoints) {
+    Width = width;
+    Height = height;
+    NodeX = nodeX;
+    NodeY = nodeY;
+    EdgePoints = edgePoints;
+  }
+
+  public static string DefaultCacheDirectoryPath => Path.Combine(Path.GetTempPath(), "ProfileExplorer", "graphcache");
+  public double Width { get; }
+  public double Height { get; }
+  public double[] NodeX { get; }
+  public double[] NodeY { get; }
+  public double[][] EdgePoints { get; }
+
+  public static string MakeCacheFilePath(byte[] structureHash, string directoryPath) {
+    return Path.Combine(directoryPath, $"{Convert.ToHexString(structureHash)}.layout");
+  }
+
+  public void Serialize(BinaryWriter writer) {
+    writer.Write(FileMagic);
+    writer.Write(CurrentFileVersion);
+    writer.Write(Width);
+    writer.Write(Height);
+    writer.Write(NodeX.Length);
+
+    for (int i = 0; i < NodeX.Length; i++) {
+      writer.Write(NodeX[i]);
+      writer.Write(NodeY[i]);
+    }
+
+    writer.Write(EdgePoints.Length);
+
+    foreach (double[] points in EdgePoints) {
+      writer.Write(points.Length);
+
+      foreach (double value in points) {
+        writer.Write(value);
+      }
+    }
+  }
+
+  public static GraphLayoutData Deserialize(BinaryReader reader) {
+    if (reader.ReadUInt32() != FileMagic || reader.ReadInt32() != CurrentFileVersion) {
+      return null;
+    }
+
+    double width = reader.ReadDouble();
+    double height = reader.ReadDouble();
+    int nodeCount = reader.ReadInt32();
+    double[] nodeX = new double[nodeCount];
+    double[] nodeY = new double[nodeCount];
+
+    for (int i = 0; i < nodeCount; i++) {
+      nodeX[i] = reader.ReadDouble();
+      nodeY[i] = reader.ReadDouble();
+    }
+
+    int edgeCount = reader.ReadInt32();
+    double[][] edgePoints = new double[edgeCount][];
+
+    for (int i = 0; i < edgeCount; i++) {
+      double[] points = new double[reader.ReadInt32()];
+
+      for (int k = 0; k < points.Length; k++) {
+        points[k] = reader.ReadDouble();
+      }
+
+      edgePoints[i] = points;
+    }
+
+    return new GraphLayoutData(width, height, nodeX, nodeY, edgePoints);
+  }
+
+  public bool Save(byte[] structureHash, string directoryPath) {
+    string cachePath = MakeCacheFilePath(structureHash, directoryPath);
+    string tempPath = $"{cachePath}.{Environment.ProcessId}.tmp";
+
+    try {
+      if (!Directory.Exists(directoryPath)) {
+        Directory.CreateDirectory(directoryPath);
+      }
+
+      // Write to a temporary file first so that another instance
+      // never reads a partially written layout.
+      using (var stream = new FileStream(tempPath, FileMode.Create, FileAccess.Write, FileShare.None))
+      using (var writer = new BinaryWriter(stream)) {
+        Serialize(writer);
+      }
+
+      File.Move(tempPath, cachePath, true);
+      return true;
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to save graph layout cache: {ex.Message}");
+
+      try {
+        File.Delete(tempPath);
+      }
+      catch {
+        // Ignore cleanup failures.
+      }
+
+      return false;
+    }
+  }
+
+  public static GraphLayoutData Load(byte[] structureHash, string directoryPath) {
+    string cachePath = MakeCacheFilePath(structureHash, directoryPath);
+    GraphLayoutData layoutData;
+
+    try {
+      if (!File.Exists(cachePath)) {
+        return null;
+      }
+
+      using var stream = new FileStream(cachePath, FileMode.Open, FileAccess.Read,
+                                        FileShare.Read | FileShare.Delete);
+      using var reader = new BinaryReader(stream);
+      layoutData = Deserialize(reader);
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to load graph layout cache: {ex.Message}");
+      return null;
+    }
+
+    try {
+      // Mark the layout as recently used, the last access time
+      // is usually not updated by the file system.
+      File.SetLastWriteTimeUtc(cachePath, DateTime.UtcNow);
+    }
+    catch {
+      // Ignore failures, the file may be in use by another instance.
+    }
+
+    return layoutData;
+  }
+
+  // Deletes the least recently used layout files until the total size
+  // of the directory is below maxSize. Returns the number of deleted files.
+  public static int TrimCacheDirectory(string directoryPath, long maxSize = MaxCacheDirectorySize) {
+    int deletedCount = 0;
+
+    try {
+      var directory = new DirectoryInfo(directoryPath);
+
+      if (!directory.Exists) {
+        return 0;
+      }
+
+      var files = directory.GetFiles("*.layout");
+      long totalSize = 0;
+
+      foreach (var file in files) {
+        totalSize += file.Length;
+      }
+
+      if (totalSize <= maxSize) {
+        return 0;
+      }
+
+      Array.Sort(files, (a, b) => a.LastWriteTimeUtc.CompareTo(b.LastWriteTimeUtc));
+
+      foreach (var file in files) {
+        if (totalSize <= maxSize) {
+          break;
+        }
+
+        try {
+          long length = file.Length;
+          file.Delete();
+          totalSize -= length;
+          deletedCount++;
+        }
+        catch {
+          // Ignore files in use by another instance.
+        }
+      }
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to trim graph layout cache: {ex.Message}");
+    }
+
+    return deletedCount;
+  }
+}
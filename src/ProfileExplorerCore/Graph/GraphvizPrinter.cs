@@ -14,6 +14,7 @@ namespace ProfileExplorer.Core.Graph;
 public class GraphVizPrinter {
   private int subgraphIndex_;
   private int nextInvisibleId_;
+  private LayeredGraphLayout layout_; // Set only while recording the graph for the layout.
 
   public virtual Dictionary<string, TaggedObject> CreateNodeDataMap() {
     throw new NotImplementedException();
@@ -40,6 +41,35 @@ public class GraphVizPrinter {
     }
   }
 
+  // Records the nodes and edges of the graph for the built-in layout engine,
+  // the same ones that would be printed for Graphviz.
+  public LayeredGraphLayout CreateLayout(GraphKind kind) {
+    try {
+      layout_ = new LayeredGraphLayout(kind);
+      PrintGraph(new StringBuilder());
+      return layout_;
+    }
+    catch (Exception ex) {
+      Trace.TraceError($"Failed to record graph for layout: {ex.Message}");
+      return null;
+    }
+    finally {
+      layout_ = null;
+    }
+  }
+
+  // Lays out the graph in-process, without running Graphviz.
+  public Graph CreateLayoutGraph(GraphKind kind, CancelableTask task) {
+    var layout = CreateLayout(kind);
+    var layoutData = layout?.Compute(task);
+
+    if (layoutData == null) {
+      return null;
+    }
+
+    return layout.CreateGraph(layoutData, CreateNodeDataMap());
+  }
+
   public string CreateGraph(CancelableTask task) {
     return CreateGraph(PrintGraph(), task);
   }
@@ -128,6 +158,11 @@ public class GraphVizPrinter {
                               string labelPrefix = null) {
     string nodeName = $"n{id}";
 
+    if (layout_ != null) {
+      RecordNode(nodeName, labelPrefix + label, 0.11, 0.055);
+      return nodeName;
+    }
+
     if (!string.IsNullOrEmpty(labelPrefix)) {
       builder.AppendFormat(CultureInfo.InvariantCulture,
                            "{0}[shape=rectangle, label=\"{1}{2}\"];\n", nodeName,
@@ -152,6 +187,11 @@ public class GraphVizPrinter {
                                          string labelPrefix = null) {
     string nodeName = $"n{id}";
 
+    if (layout_ != null) {
+      RecordNode(nodeName, labelPrefix + label, horizontalMargin, verticalMargin);
+      return nodeName;
+    }
+
     if (!string.IsNullOrEmpty(labelPrefix)) {
       builder.AppendFormat(CultureInfo.InvariantCulture,
                            "{0}[shape=rectangle, margin=\"{1},{2}\", label=\"{3}{4}\"];\n", nodeName,
@@ -168,6 +208,12 @@ public class GraphVizPrinter {
 
   protected string CreateInvisibleNode(StringBuilder builder) {
     string nodeName = $"inv{nextInvisibleId_++}";
+
+    if (layout_ != null) {
+      layout_.AddNode(nodeName, null, 0, 0);
+      return nodeName;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, $"{nodeName}[shape=point,width=0,height=0];\n");
     return nodeName;
   }
@@ -181,10 +227,20 @@ public class GraphVizPrinter {
   }
 
   protected void CreateEdge(string id1, string id2, StringBuilder builder) {
+    if (layout_ != null) {
+      layout_.AddEdge(id1, id2);
+      return;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, "{0} -> {1};\n", id1, id2);
   }
 
   protected void CreateEdge(ulong id1, string id2, StringBuilder builder) {
+    if (layout_ != null) {
+      layout_.AddEdge(GetNodeName(id1), id2);
+      return;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, "n{0} -> {1};\n", id1, id2);
   }
 
@@ -193,11 +249,21 @@ public class GraphVizPrinter {
   }
 
   protected void CreateEdge(ulong id1, ulong id2, StringBuilder builder) {
+    if (layout_ != null) {
+      layout_.AddEdge(GetNodeName(id1), GetNodeName(id2));
+      return;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, "n{0} -> n{1};\n", id1, id2);
   }
 
   protected void CreateEdge(ulong id1, ulong id2, string attribute,
                             StringBuilder builder) {
+    if (layout_ != null) {
+      layout_.AddEdge(GetNodeName(id1), GetNodeName(id2));
+      return;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, "n{0} -> n{1} {2};\n", id1, id2, attribute);
   }
 
@@ -208,6 +274,11 @@ public class GraphVizPrinter {
 
   protected void CreateEdgeWithStyle(ulong id1, ulong id2, string style,
                                      StringBuilder builder) {
+    if (layout_ != null) {
+      layout_.AddEdge(GetNodeName(id1), GetNodeName(id2), Edge.GetEdgeStyle(style.AsMemory()));
+      return;
+    }
+
     builder.AppendFormat(CultureInfo.InvariantCulture, "n{0} -> n{1}[style={2}];\n", id1, id2, style);
   }
 
@@ -220,4 +291,9 @@ public class GraphVizPrinter {
   protected void EndSubgraph(StringBuilder builder) {
     builder.AppendLine("}");
   }
+
+  private void RecordNode(string nodeName, string label, double horizontalMargin, double verticalMargin) {
+    var (width, height) = LayeredGraphLayout.EstimateNodeSize(label, horizontalMargin, verticalMargin);
+    layout_.AddNode(nodeName, label, width, height);
+  }
 }
\ No newline at end of file
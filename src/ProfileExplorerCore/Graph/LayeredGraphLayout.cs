@@ -0,0 +1,951 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+using ProfileExplorer.Core.IR;
+using ProfileExplorer.Core.Utilities;
+
+namespace ProfileExplorer.Core.Graph;
+
+// In-process layered (Sugiyama-style) graph layout, used instead of running
+// Graphviz dot for each graph. The nodes and edges are recorded by the
+// GraphVizPrinter while printing the graph and the result uses the same
+// units as the dot -Tplain output read by GraphvizReader: inches, with Y
+// growing downward and each edge drawn as a cubic B-spline (3n + 1 points).
+//
+// The layout steps are:
+//   - cycle removal, by reversing the back edges found by a DFS,
+//   - layer assignment, longest path from the sources,
+//   - dummy nodes for edges spanning multiple layers,
+//   - crossing reduction, barycenter sweeps keeping the best ordering,
+//   - X coordinates, pulling nodes toward their neighbors while keeping
+//     the order and separation within each layer,
+//   - edge routing through the dummy nodes.
+public sealed class LayeredGraphLayout {
+  // Distances in inches, same as the dot defaults.
+  private const double RankSeparation = 0.5;
+  private const double NodeSeparation = 0.25;
+  private const double DummyNodeWidth = 0.1;
+  private const double PortSeparation = 0.15;
+  private const double SelfLoopWidth = 0.3;
+  private const int MaxOrderingIterations = 24;
+  private const int LargeGraphOrderingIterations = 8;
+  private const int SeededOrderingIterations = 4;
+  private const int LargeGraphThreshold = 2000;
+  private const int CoordinateIterations = 8;
+  private GraphKind kind_;
+  private List<LayoutNode> nodes_;
+  private List<LayoutEdge> edges_;
+  private Dictionary<string, int> nodeIndices_;
+
+  // Per-layout state, vertices are the nodes followed by the dummy nodes.
+  private int vertexCount_;
+  private List<int> ranks_;
+  private List<double> widths_;
+  private List<List<int>> upNeighbors_;
+  private List<List<int>> downNeighbors_;
+  private List<int>[] layers_;
+  private int[] positions_;
+  private double[] x_;
+  private double[] layerCenters_;
+  private double[] layerHeights_;
+  private int[][] edgeChains_;
+  private bool[] reversedEdges_;
+
+  public LayeredGraphLayout(GraphKind kind) {
+    kind_ = kind;
+    nodes_ = new List<LayoutNode>();
+    edges_ = new List<LayoutEdge>();
+    nodeIndices_ = new Dictionary<string, int>();
+  }
+
+  public GraphKind Kind => kind_;
+  public int NodeCount => nodes_.Count;
+  public int EdgeCount => edges_.Count;
+
+  public int AddNode(string name, string label, double width, double height) {
+    if (nodeIndices_.TryGetValue(name, out int index)) {
+      return index; // Node declared again, keep the first one like dot does.
+    }
+
+    index = nodes_.Count;
+    nodes_.Add(new LayoutNode(name, label, width, height));
+    nodeIndices_[name] = index;
+    return index;
+  }
+
+  public void AddEdge(string fromName, string toName, Edge.EdgeKind style = Edge.EdgeKind.Default) {
+    // Like with dot, an edge to an undeclared node creates it.
+    int from = GetOrAddNode(fromName);
+    int to = GetOrAddNode(toName);
+    edges_.Add(new LayoutEdge(from, to, style));
+  }
+
+  // Estimated size of a rectangle node with a label, matching the size
+  // dot computes for the default font closely enough to fit the text.
+  public static (double Width, double Height) EstimateNodeSize(string label, double horizontalMargin = 0.11,
+                                                               double verticalMargin = 0.055) {
+    const double CharWidth = 0.1;
+    const double LineHeight = 0.2;
+    const double MinWidth = 0.75;
+    const double MinHeight = 0.5;
+    int lines = 1;
+    int lineLength = 0;
+    int maxLineLength = 0;
+
+    if (label != null) {
+      for (int i = 0; i < label.Length; i++) {
+        // Both an actual new line and the \n escape in a DOT label.
+        if (label[i] == '\n' || label[i] == '\\' && i + 1 < label.Length && label[i + 1] == 'n') {
+          maxLineLength = Math.Max(maxLineLength, lineLength);
+          lineLength = 0;
+          lines++;
+          i += label[i] == '\\' ? 1 : 0;
+        }
+        else {
+          lineLength++;
+        }
+      }
+    }
+
+    maxLineLength = Math.Max(maxLineLength, lineLength);
+    return (Math.Max(MinWidth, maxLineLength * CharWidth + 2 * horizontalMargin),
+            Math.Max(MinHeight, lines * LineHeight + 2 * verticalMargin));
+  }
+
+  // Hash of the graph structure (nodes with their labels and sizes, edges with their style),
+  // graphs with the same hash get the same layout, even for different functions.
+  public byte[] ComputeStructureHash() {
+    using var stream = new MemoryStream(nodes_.Count * 32 + edges_.Count * 12);
+    using var writer = new BinaryWriter(stream, Encoding.UTF8);
+    writer.Write((int)kind_);
+    writer.Write(nodes_.Count);
+
+    foreach (var node in nodes_) {
+      writer.Write(node.Label ?? "");
+      writer.Write(node.Width);
+      writer.Write(node.Height);
+    }
+
+    writer.Write(edges_.Count);
+
+    foreach (var edge in edges_) {
+      writer.Write(edge.From);
+      writer.Write(edge.To);
+      writer.Write((byte)edge.Style);
+    }
+
+    writer.Flush();
+    return CompressionUtils.CreateSHA256(stream.ToArray());
+  }
+
+  // Returns the center X of each node in a layout, by node label. When passed
+  // to Compute for a similar graph, like the flow graph of the same function
+  // after another compiler pass, the nodes found in it keep their relative
+  // order and only the new or changed parts of the graph are reordered.
+  public Dictionary<string, double> GetNodePositions(GraphLayoutData layout) {
+    var positions = new Dictionary<string, double>(nodes_.Count);
+
+    for (int i = 0; i < nodes_.Count; i++) {
+      positions.TryAdd(nodes_[i].Label ?? nodes_[i].Name, layout.NodeX[i]);
+    }
+
+    return positions;
+  }
+
+  public GraphLayoutData Compute(CancelableTask task = null,
+                                 IReadOnlyDictionary<string, double> previousPositions = null) {
+    if (nodes_.Count == 0) {
+      return new GraphLayoutData(0, 0, Array.Empty<double>(), Array.Empty<double>(),
+                                 new double[edges_.Count][]);
+    }
+
+    try {
+      bool[] reversed = RemoveCycles();
+      AssignLayers(reversed);
+      CreateDummyNodes(reversed);
+
+      if (task is {IsCanceled: true}) {
+        return null;
+      }
+
+      InitializeOrder(previousPositions);
+
+      if (!ReduceCrossings(previousPositions != null, task)) {
+        return null;
+      }
+
+      AssignCoordinates();
+
+      if (task is {IsCanceled: true}) {
+        return null;
+      }
+
+      return RouteEdges();
+    }
+    finally {
+      ResetLayoutState();
+    }
+  }
+
+  public Graph CreateGraph(GraphLayoutData layout, Dictionary<string, TaggedObject> dataNameMap) {
+    if (layout.NodeX.Length != nodes_.Count || layout.EdgePoints.Length != edges_.Count) {
+      return null; // Layout of another graph.
+    }
+
+    var graph = new Graph(kind_) {
+      Width = layout.Width,
+      Height = layout.Height
+    };
+
+    var nodes = new Node[nodes_.Count];
+
+    for (int i = 0; i < nodes_.Count; i++) {
+      var layoutNode = nodes_[i];
+      var node = new Node {
+        Name = layoutNode.Name.AsMemory(),
+        Label = layoutNode.Label,
+        CenterX = layout.NodeX[i],
+        CenterY = layout.NodeY[i],
+        Width = layoutNode.Width,
+        Height = layoutNode.Height
+      };
+
+      // Associate with IR objects.
+      if (dataNameMap != null && dataNameMap.TryGetValue(layoutNode.Name, out var data)) {
+        node.Data = data;
+        graph.DataNodeMap.Add(data, node);
+      }
+
+      nodes[i] = node;
+      graph.Nodes.Add(node);
+    }
+
+    for (int i = 0; i < edges_.Count; i++) {
+      var layoutEdge = edges_[i];
+      double[] points = layout.EdgePoints[i];
+      var edge = new Edge {
+        NodeFrom = nodes[layoutEdge.From],
+        NodeTo = nodes[layoutEdge.To],
+        Style = layoutEdge.Style,
+        Color = "black".AsMemory(),
+        LinePoints = new Tuple<double, double>[points.Length / 2]
+      };
+
+      for (int k = 0; k < edge.LinePoints.Length; k++) {
+        edge.LinePoints[k] = new Tuple<double, double>(points[2 * k], points[2 * k + 1]);
+      }
+
+      edge.NodeFrom.OutEdges ??= new List<Edge>();
+      edge.NodeFrom.OutEdges.Add(edge);
+      edge.NodeTo.InEdges ??= new List<Edge>();
+      edge.NodeTo.InEdges.Add(edge);
+      graph.Edges.Add(edge);
+    }
+
+    return graph;
+  }
+
+  private int GetOrAddNode(string name) {
+    if (nodeIndices_.TryGetValue(name, out int index)) {
+      return index;
+    }
+
+    var (width, height) = EstimateNodeSize(name);
+    return AddNode(name, name, width, height);
+  }
+
+  private bool IsSelfLoop(LayoutEdge edge) {
+    return edge.From == edge.To;
+  }
+
+  private bool[] RemoveCycles() {
+    // Iterative DFS starting from the nodes without incoming edges, an edge
+    // to a node still on the DFS stack closes a cycle and is reversed.
+    int nodeCount = nodes_.Count;
+    var outEdges = new List<int>[nodeCount];
+    bool[] hasInEdges = new bool[nodeCount];
+    bool[] reversed = new bool[edges_.Count];
+
+    for (int i = 0; i < edges_.Count; i++) {
+      var edge = edges_[i];
+
+      if (IsSelfLoop(edge)) {
+        continue;
+      }
+
+      outEdges[edge.From] ??= new List<int>();
+      outEdges[edge.From].Add(i);
+      hasInEdges[edge.To] = true;
+    }
+
+    byte[] state = new byte[nodeCount]; // 0 - not visited, 1 - on stack, 2 - done.
+    var stack = new Stack<(int Node, int NextEdge)>();
+
+    for (int pass = 0; pass < 2; pass++) {
+      for (int root = 0; root < nodeCount; root++) {
+        if (state[root] != 0 || pass == 0 && hasInEdges[root]) {
+          continue;
+        }
+
+        state[root] = 1;
+        stack.Push((root, 0));
+
+        while (stack.TryPop(out var item)) {
+          var nodeEdges = outEdges[item.Node];
+
+          if (nodeEdges == null || item.NextEdge == nodeEdges.Count) {
+            state[item.Node] = 2;
+            continue;
+          }
+
+          stack.Push((item.Node, item.NextEdge + 1));
+          int edgeIndex = nodeEdges[item.NextEdge];
+          int target = edges_[edgeIndex].To;
+
+          if (state[target] == 1) {
+            reversed[edgeIndex] = true;
+          }
+          else if (state[target] == 0) {
+            state[target] = 1;
+            stack.Push((target, 0));
+          }
+        }
+      }
+    }
+
+    return reversed;
+  }
+
+  private void AssignLayers(bool[] reversed) {
+    // Longest path layering over the acyclic graph, in topological order.
+    int nodeCount = nodes_.Count;
+    var successors = new List<int>[nodeCount];
+    int[] inDegree = new int[nodeCount];
+
+    for (int i = 0; i < edges_.Count; i++) {
+      var edge = edges_[i];
+
+      if (IsSelfLoop(edge)) {
+        continue;
+      }
+
+      var (upper, lower) = reversed[i] ? (edge.To, edge.From) : (edge.From, edge.To);
+      successors[upper] ??= new List<int>();
+      successors[upper].Add(lower);
+      inDegree[lower]++;
+    }
+
+    ranks_ = new List<int>(new int[nodeCount]);
+    int[] order = new int[nodeCount];
+    int head = 0;
+    int tail = 0;
+
+    for (int i = 0; i < nodeCount; i++) {
+      if (inDegree[i] == 0) {
+        order[tail++] = i;
+      }
+    }
+
+    while (head < tail) {
+      int node = order[head++];
+
+      if (successors[node] == null) {
+        continue;
+      }
+
+      foreach (int successor in successors[node]) {
+        ranks_[successor] = Math.Max(ranks_[successor], ranks_[node] + 1);
+
+        if (--inDegree[successor] == 0) {
+          order[tail++] = successor;
+        }
+      }
+    }
+
+    // Sources are placed right above their closest successor instead of
+    // the first layer, otherwise their edges become needlessly long.
+    for (int i = nodeCount - 1; i >= 0; i--) {
+      int node = order[i];
+
+      if (successors[node] == null || ranks_[node] != 0) {
+        continue;
+      }
+
+      int minRank = int.MaxValue;
+
+      foreach (int successor in successors[node]) {
+        minRank = Math.Min(minRank, ranks_[successor]);
+      }
+
+      ranks_[node] = minRank - 1;
+    }
+  }
+
+  private void CreateDummyNodes(bool[] reversed) {
+    int nodeCount = nodes_.Count;
+    vertexCount_ = nodeCount;
+    widths_ = new List<double>(nodeCount);
+    upNeighbors_ = new List<List<int>>(nodeCount);
+    downNeighbors_ = new List<List<int>>(nodeCount);
+    edgeChains_ = new int[edges_.Count][];
+    reversedEdges_ = reversed;
+
+    for (int i = 0; i < nodeCount; i++) {
+      widths_.Add(nodes_[i].Width);
+      upNeighbors_.Add(null);
+      downNeighbors_.Add(null);
+    }
+
+    for (int i = 0; i < edges_.Count; i++) {
+      var edge = edges_[i];
+
+      if (IsSelfLoop(edge)) {
+        // Make room for the loop on the right side, nodes are kept centered.
+        widths_[edge.From] = nodes_[edge.From].Width + 2 * SelfLoopWidth;
+        continue;
+      }
+
+      var (upper, lower) = reversed[i] ? (edge.To, edge.From) : (edge.From, edge.To);
+      int span = ranks_[lower] - ranks_[upper];
+      int[] chain = new int[span + 1];
+      chain[0] = upper;
+      chain[span] = lower;
+
+      for (int k = 1; k < span; k++) {
+        chain[k] = vertexCount_++;
+        ranks_.Add(ranks_[upper] + k);
+        widths_.Add(DummyNodeWidth);
+        upNeighbors_.Add(null);
+        downNeighbors_.Add(null);
+      }
+
+      for (int k = 0; k < span; k++) {
+        (downNeighbors_[chain[k]] ??= new List<int>()).Add(chain[k + 1]);
+        (upNeighbors_[chain[k + 1]] ??= new List<int>()).Add(chain[k]);
+      }
+
+      edgeChains_[i] = chain;
+    }
+  }
+
+  private void InitializeOrder(IReadOnlyDictionary<string, double> previousPositions) {
+    // Initial order of each layer from a DFS over the layered graph,
+    // which keeps the nodes of the same path close to each other.
+    int layerCount = 0;
+
+    for (int i = 0; i < vertexCount_; i++) {
+      layerCount = Math.Max(layerCount, ranks_[i] + 1);
+    }
+
+    layers_ = new List<int>[layerCount];
+
+    for (int i = 0; i < layerCount; i++) {
+      layers_[i] = new List<int>();
+    }
+
+    bool[] visited = new bool[vertexCount_];
+    var stack = new Stack<int>();
+
+    for (int root = 0; root < vertexCount_; root++) {
+      if (visited[root] || upNeighbors_[root] != null) {
+        continue;
+      }
+
+      stack.Push(root);
+
+      while (stack.TryPop(out int vertex)) {
+        if (visited[vertex]) {
+          continue;
+        }
+
+        visited[vertex] = true;
+        layers_[ranks_[vertex]].Add(vertex);
+        var neighbors = downNeighbors_[vertex];
+
+        if (neighbors != null) {
+          for (int k = neighbors.Count - 1; k >= 0; k--) {
+            if (!visited[neighbors[k]]) {
+              stack.Push(neighbors[k]);
+            }
+          }
+        }
+      }
+    }
+
+    if (previousPositions != null) {
+      ApplyPreviousOrder(previousPositions);
+    }
+
+    positions_ = new int[vertexCount_];
+    UpdatePositions();
+  }
+
+  private void ApplyPreviousOrder(IReadOnlyDictionary<string, double> previousPositions) {
+    // Order the nodes found in the previous layout by their X coordinate,
+    // the other nodes follow the node before them in the initial order
+    // and dummy nodes follow the edge they belong to.
+    double[] keys = new double[vertexCount_];
+
+    foreach (var layer in layers_) {
+      double lastKey = 0;
+
+      foreach (int vertex in layer) {
+        double key = double.NaN;
+
+        if (vertex < nodes_.Count) {
+          var node = nodes_[vertex];
+
+          if (previousPositions.TryGetValue(node.Label ?? node.Name, out double x)) {
+            key = x;
+          }
+        }
+        else {
+          key = keys[upNeighbors_[vertex][0]];
+        }
+
+        keys[vertex] = double.IsNaN(key) ? lastKey : key;
+        lastKey = keys[vertex];
+      }
+
+      SortLayer(layer, keys);
+    }
+  }
+
+  private static void SortLayer(List<int> layer, double[] keys) {
+    // Stable sort, vertices with the same key keep their current order.
+    var items = new (double Key, int Index, int Vertex)[layer.Count];
+
+    for (int i = 0; i < layer.Count; i++) {
+      items[i] = (keys[layer[i]], i, layer[i]);
+    }
+
+    Array.Sort(items, (a, b) => {
+      int result = a.Key.CompareTo(b.Key);
+      return result != 0 ? result : a.Index.CompareTo(b.Index);
+    });
+
+    for (int i = 0; i < items.Length; i++) {
+      layer[i] = items[i].Vertex;
+    }
+  }
+
+  private void UpdatePositions() {
+    foreach (var layer in layers_) {
+      for (int i = 0; i < layer.Count; i++) {
+        positions_[layer[i]] = i;
+      }
+    }
+  }
+
+  private bool ReduceCrossings(bool isSeeded, CancelableTask task) {
+    int maxIterations = isSeeded ? SeededOrderingIterations :
+      vertexCount_ > LargeGraphThreshold ? LargeGraphOrderingIterations : MaxOrderingIterations;
+    long bestCrossings = CountCrossings();
+    var bestLayers = CopyLayers();
+    double[] keys = new double[vertexCount_];
+    int iterationsWithoutImprovement = 0;
+
+    for (int iteration = 0; iteration < maxIterations && bestCrossings > 0; iteration++) {
+      if (task is {IsCanceled: true}) {
+        return false;
+      }
+
+      // Alternate sweeping down, ordering each layer by the layer above,
+      // and sweeping up, ordering by the layer below.
+      bool sweepDown = iteration % 2 == 0;
+
+      for (int i = 1; i < layers_.Length; i++) {
+        int layerIndex = sweepDown ? i : layers_.Length - 1 - i;
+        var layer = layers_[layerIndex];
+
+        foreach (int vertex in layer) {
+          var neighbors = sweepDown ? upNeighbors_[vertex] : downNeighbors_[vertex];
+          keys[vertex] = neighbors != null ? Barycenter(neighbors) : positions_[vertex];
+        }
+
+        SortLayer(layer, keys);
+
+        for (int k = 0; k < layer.Count; k++) {
+          positions_[layer[k]] = k;
+        }
+      }
+
+      long crossings = CountCrossings();
+
+      if (crossings < bestCrossings) {
+        bestCrossings = crossings;
+        bestLayers = CopyLayers();
+        iterationsWithoutImprovement = 0;
+      }
+      else if (++iterationsWithoutImprovement > 2) {
+        break;
+      }
+    }
+
+    layers_ = bestLayers;
+    UpdatePositions();
+    return true;
+  }
+
+  private double Barycenter(List<int> neighbors) {
+    double sum = 0;
+
+    foreach (int neighbor in neighbors) {
+      sum += positions_[neighbor];
+    }
+
+    return sum / neighbors.Count;
+  }
+
+  private List<int>[] CopyLayers() {
+    var copy = new List<int>[layers_.Length];
+
+    for (int i = 0; i < layers_.Length; i++) {
+      copy[i] = new List<int>(layers_[i]);
+    }
+
+    return copy;
+  }
+
+  private long CountCrossings() {
+    // For each pair of adjacent layers, the edges are taken in the order of
+    // their upper end and each one crosses the edges already seen that have
+    // the lower end further to the right, counted with a Fenwick tree.
+    long crossings = 0;
+    var lowerPositions = new List<int>();
+
+    for (int layerIndex = 0; layerIndex + 1 < layers_.Length; layerIndex++) {
+      int lowerCount = layers_[layerIndex + 1].Count;
+      int[] tree = new int[lowerCount + 1];
+      int inserted = 0;
+
+      foreach (int vertex in layers_[layerIndex]) {
+        var neighbors = downNeighbors_[vertex];
+
+        if (neighbors == null) {
+          continue;
+        }
+
+        lowerPositions.Clear();
+
+        foreach (int neighbor in neighbors) {
+          lowerPositions.Add(positions_[neighbor]);
+        }
+
+        lowerPositions.Sort();
+
+        foreach (int position in lowerPositions) {
+          int notGreater = 0;
+
+          for (int k = position + 1; k > 0; k -= k & -k) {
+            notGreater += tree[k];
+          }
+
+          crossings += inserted - notGreater;
+
+          for (int k = position + 1; k <= lowerCount; k += k & -k) {
+            tree[k]++;
+          }
+
+          inserted++;
+        }
+      }
+    }
+
+    return crossings;
+  }
+
+  private void AssignCoordinates() {
+    // Start with the layers packed to the left, then move each node toward
+    // the mean X of its neighbors, alternating between the neighbors above
+    // and below, with a last pass considering both.
+    x_ = new double[vertexCount_];
+    double[] desired = new double[vertexCount_];
+
+    foreach (var layer in layers_) {
+      double position = 0;
+
+      for (int i = 0; i < layer.Count; i++) {
+        int vertex = layer[i];
+
+        if (i > 0) {
+          position += Separation(layer[i - 1], vertex);
+        }
+
+        x_[vertex] = position;
+      }
+    }
+
+    for (int iteration = 0; iteration <= CoordinateIterations; iteration++) {
+      bool useUp = iteration == CoordinateIterations || iteration % 2 == 0;
+      bool useDown = iteration == CoordinateIterations || iteration % 2 == 1;
+
+      for (int i = 0; i < layers_.Length; i++) {
+        int layerIndex = useDown && !useUp ? layers_.Length - 1 - i : i;
+        var layer = layers_[layerIndex];
+
+        foreach (int vertex in layer) {
+          double sum = 0;
+          int count = 0;
+          AddNeighborPositions(useUp ? upNeighbors_[vertex] : null, ref sum, ref count);
+          AddNeighborPositions(useDown ? downNeighbors_[vertex] : null, ref sum, ref count);
+          desired[vertex] = count > 0 ? sum / count : x_[vertex];
+        }
+
+        PlaceLayer(layer, desired);
+      }
+    }
+
+    // Y coordinates, each layer is as tall as its tallest node.
+    layerCenters_ = new double[layers_.Length];
+    layerHeights_ = new double[layers_.Length];
+    double top = 0;
+
+    for (int i = 0; i < layers_.Length; i++) {
+      foreach (int vertex in layers_[i]) {
+        if (vertex < nodes_.Count) {
+          layerHeights_[i] = Math.Max(layerHeights_[i], nodes_[vertex].Height);
+        }
+      }
+
+      layerCenters_[i] = top + layerHeights_[i] / 2;
+      top += layerHeights_[i] + RankSeparation;
+    }
+  }
+
+  private void AddNeighborPositions(List<int> neighbors, ref double sum, ref int count) {
+    if (neighbors == null) {
+      return;
+    }
+
+    foreach (int neighbor in neighbors) {
+      sum += x_[neighbor];
+    }
+
+    count += neighbors.Count;
+  }
+
+  private double Separation(int left, int right) {
+    return (widths_[left] + widths_[right]) / 2 + NodeSeparation;
+  }
+
+  private void PlaceLayer(List<int> layer, double[] desired) {
+    // Closest placement to the desired positions (least squares) that keeps
+    // the order and minimum separation. With the offset of each vertex from
+    // the first one when packed, the problem becomes an isotonic regression,
+    // solved by merging adjacent blocks while their means are out of order.
+    int count = layer.Count;
+    double[] offsets = new double[count];
+    var blocks = new List<(double Sum, int Count)>(count);
+
+    for (int i = 0; i < count; i++) {
+      if (i > 0) {
+        offsets[i] = offsets[i - 1] + Separation(layer[i - 1], layer[i]);
+      }
+
+      var block = (Sum: desired[layer[i]] - offsets[i], Count: 1);
+
+      while (blocks.Count > 0 &&
+             blocks[^1].Sum / blocks[^1].Count >= block.Sum / block.Count) {
+        block = (blocks[^1].Sum + block.Sum, blocks[^1].Count + block.Count);
+        blocks.RemoveAt(blocks.Count - 1);
+      }
+
+      blocks.Add(block);
+    }
+
+    int index = 0;
+
+    foreach (var block in blocks) {
+      double mean = block.Sum / block.Count;
+
+      for (int k = 0; k < block.Count; k++, index++) {
+        x_[layer[index]] = mean + offsets[index];
+      }
+    }
+  }
+
+  private GraphLayoutData RouteEdges() {
+    int nodeCount = nodes_.Count;
+    double[] nodeX = new double[nodeCount];
+    double[] nodeY = new double[nodeCount];
+
+    for (int i = 0; i < nodeCount; i++) {
+      nodeX[i] = x_[i];
+      nodeY[i] = layerCenters_[ranks_[i]];
+    }
+
+    // Polyline of each edge from the upper to the lower end,
+    // passing through the dummy nodes as vertical segments.
+    var polylines = new List<(double X, double Y)>[edges_.Count];
+    var bottomPorts = new List<(int Edge, double OtherX)>[nodeCount];
+    var topPorts = new List<(int Edge, double OtherX)>[nodeCount];
+
+    for (int i = 0; i < edges_.Count; i++) {
+      int[] chain = edgeChains_[i];
+
+      if (chain == null) {
+        continue; // Self loop.
+      }
+
+      var polyline = new List<(double X, double Y)>(2 * chain.Length);
+      polyline.Add((nodeX[chain[0]], nodeY[chain[0]] + nodes_[chain[0]].Height / 2));
+
+      for (int k = 1; k < chain.Length - 1; k++) {
+        int rank = ranks_[chain[k]];
+        double halfHeight = layerHeights_[rank] / 2;
+        polyline.Add((x_[chain[k]], layerCenters_[rank] - halfHeight));
+
+        if (halfHeight > 0) {
+          polyline.Add((x_[chain[k]], layerCenters_[rank] + halfHeight));
+        }
+      }
+
+      int lower = chain[^1];
+      polyline.Add((nodeX[lower], nodeY[lower] - nodes_[lower].Height / 2));
+      polylines[i] = polyline;
+      (bottomPorts[chain[0]] ??= new List<(int, double)>()).Add((i, polyline[1].X));
+      (topPorts[lower] ??= new List<(int, double)>()).Add((i, polyline[^2].X));
+    }
+
+    // Spread the ends of the edges sharing a node side over its width,
+    // ordered by where the edge is going so that they don't cross.
+    // Otherwise the edges of a two-block loop would be drawn over each other.
+    for (int i = 0; i < nodeCount; i++) {
+      SpreadPorts(bottomPorts[i], nodes_[i].Width, polylines, true);
+      SpreadPorts(topPorts[i], nodes_[i].Width, polylines, false);
+    }
+
+    double[][] edgePoints = new double[edges_.Count][];
+
+    for (int i = 0; i < edges_.Count; i++) {
+      if (polylines[i] == null) {
+        int node = edges_[i].From;
+        edgePoints[i] = CreateSelfLoop(nodeX[node], nodeY[node], nodes_[node]);
+        continue;
+      }
+
+      edgePoints[i] = CreateSpline(polylines[i], reversedEdges_[i]);
+    }
+
+    return NormalizeLayout(nodeX, nodeY, edgePoints);
+  }
+
+  private static void SpreadPorts(List<(int Edge, double OtherX)> ports, double width,
+                                  List<(double X, double Y)>[] polylines, bool isUpperEnd) {
+    if (ports == null || ports.Count < 2) {
+      return;
+    }
+
+    ports.Sort((a, b) => {
+      int result = a.OtherX.CompareTo(b.OtherX);
+      return result != 0 ? result : a.Edge.CompareTo(b.Edge);
+    });
+
+    double span = Math.Min(width * 0.6, (ports.Count - 1) * PortSeparation);
+    double step = span / (ports.Count - 1);
+
+    for (int i = 0; i < ports.Count; i++) {
+      var polyline = polylines[ports[i].Edge];
+      int pointIndex = isUpperEnd ? 0 : polyline.Count - 1;
+      var point = polyline[pointIndex];
+      polyline[pointIndex] = (point.X - span / 2 + i * step, point.Y);
+    }
+  }
+
+  private static double[] CreateSpline(List<(double X, double Y)> polyline, bool reverse) {
+    // Each segment becomes a cubic curve with vertical tangents at both ends,
+    // which also makes the arrowhead at the last point point straight down (or up).
+    double[] points = new double[2 * (1 + 3 * (polyline.Count - 1))];
+    int index = 0;
+    AddPoint(points, ref index, polyline[0].X, polyline[0].Y);
+
+    for (int i = 1; i < polyline.Count; i++) {
+      var (startX, startY) = polyline[i - 1];
+      var (endX, endY) = polyline[i];
+      double middleY = (startY + endY) / 2;
+      AddPoint(points, ref index, startX, middleY);
+      AddPoint(points, ref index, endX, middleY);
+      AddPoint(points, ref index, endX, endY);
+    }
+
+    if (reverse) {
+      // Reversed back edge, the points must go from the edge source to its target.
+      for (int i = 0, k = points.Length - 2; i < k; i += 2, k -= 2) {
+        (points[i], points[k]) = (points[k], points[i]);
+        (points[i + 1], points[k + 1]) = (points[k + 1], points[i + 1]);
+      }
+    }
+
+    return points;
+  }
+
+  private static double[] CreateSelfLoop(double x, double y, LayoutNode node) {
+    // Loop on the right side of the node.
+    double right = x + node.Width / 2;
+    double[] points = new double[8];
+    int index = 0;
+    AddPoint(points, ref index, right, y - node.Height / 4);
+    AddPoint(points, ref index, right + SelfLoopWidth, y - node.Height / 2);
+    AddPoint(points, ref index, right + SelfLoopWidth, y + node.Height / 2);
+    AddPoint(points, ref index, right, y + node.Height / 4);
+    return points;
+  }
+
+  private static void AddPoint(double[] points, ref int index, double x, double y) {
+    points[index++] = x;
+    points[index++] = y;
+  }
+
+  private GraphLayoutData NormalizeLayout(double[] nodeX, double[] nodeY, double[][] edgePoints) {
+    // Move the layout so that its bounding box starts at (0, 0).
+    double minX = double.MaxValue;
+    double maxX = double.MinValue;
+    double maxY = 0;
+
+    for (int i = 0; i < nodeX.Length; i++) {
+      minX = Math.Min(minX, nodeX[i] - nodes_[i].Width / 2);
+      maxX = Math.Max(maxX, nodeX[i] + nodes_[i].Width / 2);
+      maxY = Math.Max(maxY, nodeY[i] + nodes_[i].Height / 2);
+    }
+
+    foreach (double[] points in edgePoints) {
+      for (int k = 0; k < points.Length; k += 2) {
+        minX = Math.Min(minX, points[k]);
+        maxX = Math.Max(maxX, points[k]);
+      }
+    }
+
+    for (int i = 0; i < nodeX.Length; i++) {
+      nodeX[i] -= minX;
+    }
+
+    foreach (double[] points in edgePoints) {
+      for (int k = 0; k < points.Length; k += 2) {
+        points[k] -= minX;
+      }
+    }
+
+    return new GraphLayoutData(maxX - minX, maxY, nodeX, nodeY, edgePoints);
+  }
+
+  private void ResetLayoutState() {
+    ranks_ = null;
+    widths_ = null;
+    upNeighbors_ = null;
+    downNeighbors_ = null;
+    layers_ = null;
+    positions_ = null;
+    x_ = null;
+    layerCenters_ = null;
+    layerHeights_ = null;
+    edgeChains_ = null;
+    reversedEdges_ = null;
+  }
+
+  private readonly record struct LayoutNode(string Name, string Label, double Width, double Height);
+  private readonly record struct LayoutEdge(int From, int To, Edge.EdgeKind Style);
+}
@@ -13,6 +13,8 @@ public class IRTextSummary : IEquatable<IRTextSummary> {
   private Dictionary<int, IRTextFunction> functionMap_;
   private Dictionary<int, IRTextSection> sectionMap_;
   private int hashCode_;
+  private int nextFunctionNumber_;
+  private int nextSectionId_;
 
   public IRTextSummary(string moduleName = null) {
     SetModuleName(moduleName);
@@ -41,7 +43,7 @@ public class IRTextSummary : IEquatable<IRTextSummary> {
       return; //? remove
     }
 
-    function.Number = Functions.Count;
+    function.Number = nextFunctionNumber_++;
     Functions.Add(function);
     functionNameMap_.Add(function.Name, function);
     functionMap_.Add(function.Number, function);
@@ -49,8 +51,31 @@ public class IRTextSummary : IEquatable<IRTextSummary> {
   }
 
   public void AddSection(IRTextSection section) {
-    section.Id = sectionMap_.Count;
-    sectionMap_.Add(sectionMap_.Count, section);
+    section.Id = nextSectionId_++;
+    sectionMap_.Add(section.Id, section);
+  }
+
+  // Removes placeholder functions and their sections. The numbers and IDs
+  // of the remaining functions and sections don't change.
+  public void RemoveFunctions(HashSet<IRTextFunction> functions) {
+    if (functions.Count == 0) {
+      return;
+    }
+
+    Functions.RemoveAll(function => functions.Contains(function));
+
+    foreach (var function in functions) {
+      functionNameMap_.Remove(function.Name);
+      functionMap_.Remove(function.Number);
+
+      foreach (var section in function.Sections) {
+        sectionMap_.Remove(section.Id);
+      }
+    }
+
+    lock (this) {
+      unmangledFunctionNameMap_ = null;
+    }
   }
 
   public IRTextSection GetSectionWithId(int id) {
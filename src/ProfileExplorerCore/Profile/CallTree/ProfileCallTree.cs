@@ -1,13 +1,16 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.Runtime.InteropServices;
 using System.Text;
 using System.Threading;
+using System.Threading.Tasks;
 using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Collections;
 using ProfileExplorer.Core.Profile.Data;
 using ProfileExplorer.Core.Utilities;
 
@@ -21,9 +24,11 @@ public enum ProfileCallTreeNodeKind {
 }
 
 public sealed class ProfileCallTree {
+  private const int MaxStackAllocPathLength = 256;
+  private const int MaxParallelMergeDepth = 4;
   private ConcurrentDictionary<IRTextFunction, ProfileCallTreeNode> rootNodes_;
   private Dictionary<IRTextFunction, List<ProfileCallTreeNode>> funcToNodesMap_;
-  private Dictionary<long, ProfileCallTreeNode> nodeIdMap_;
+  private ProfileCallTreeNode[] nodesById_; // Sorted by ID, built on demand.
   private int nextNodeId_;
 
   public ProfileCallTree(int startId = 0) {
@@ -46,55 +51,113 @@ public sealed class ProfileCallTree {
   }
 
   public void UpdateCallTree(ref ProfileSample sample, ResolvedProfileStack resolvedStack) {
+    UpdateCallTree(sample.Weight, resolvedStack);
+  }
+
+  public void UpdateCallTree(TimeSpan sampleWeight, ResolvedProfileStack resolvedStack) {
+    if (resolvedStack.StackTable != null) {
+      UpdateCallTree(sampleWeight, resolvedStack.StackTable, resolvedStack.Id);
+      return;
+    }
+
     // Build call tree. Note that the call tree methods themselves are thread-safe.
-    bool isRootFrame = true;
     ProfileCallTreeNode prevNode = null;
     ResolvedProfileStackFrame prevFrame = null;
-    var sampleWeight = sample.Weight;
+    int threadId = resolvedStack.Context.ThreadId;
 
-    for (int k = resolvedStack.FrameCount - 1; k >= 0; k--) {
-      var resolvedFrame = resolvedStack.StackFrames[k];
+    // The frames are added starting with the root, copy them once
+    // instead of indexing the frame list from the top frame each time.
+    var frames = ArrayPool<ResolvedProfileStackFrame>.Shared.Rent(resolvedStack.FrameCount);
+    int frameCount = resolvedStack.StackFrames.CopyTo(frames);
 
-      if (resolvedFrame.FrameRVA == 0 && resolvedFrame.FrameDetails.DebugInfo == null) {
-        continue;
-      }
+    for (int k = frameCount - 1; k >= 0; k--) {
+      var resolvedFrame = frames[k];
 
-      ProfileCallTreeNode node = null;
+      var node = AddFrameNode(resolvedFrame, prevNode, prevFrame, sampleWeight, threadId);
 
-      if (isRootFrame) {
-        node = AddRootNode(resolvedFrame.FrameDetails.DebugInfo, resolvedFrame.FrameDetails.Function);
-        isRootFrame = false;
-      }
-      else {
-        node = AddChildNode(prevNode, resolvedFrame.FrameDetails.DebugInfo, resolvedFrame.FrameDetails.Function);
-        prevNode.AddCallSite(node, prevFrame.FrameRVA, sampleWeight);
+      if (node != null) {
+        prevNode = node;
+        prevFrame = resolvedFrame;
       }
+    }
 
-      node.AccumulateWeight(sampleWeight);
-      node.AccumulateWeight(sampleWeight, TimeSpan.Zero, resolvedStack.Context.ThreadId);
+    ArrayPool<ResolvedProfileStackFrame>.Shared.Return(frames, true);
+    AccumulateTopFrameWeight(prevNode, sampleWeight, threadId);
+  }
 
-      // Set the user/kernel-mode context of the function.
-      if (node.Kind == ProfileCallTreeNodeKind.Unset) {
-        if (resolvedFrame.FrameDetails.IsKernelCode) {
-          node.Kind = ProfileCallTreeNodeKind.NativeKernel;
-        }
-        else if (resolvedFrame.FrameDetails.IsManagedCode) {
-          node.Kind = ProfileCallTreeNodeKind.Managed;
-        }
-        else {
-          node.Kind = ProfileCallTreeNodeKind.NativeUser;
-        }
+  public void UpdateCallTree(TimeSpan sampleWeight, ResolvedProfileStackTable stackTable, int stackId) {
+    // Same as above, but walks the stack's path in the interned prefix tree
+    // using integer node indices instead of the frame list.
+    int nodeId = stackTable.GetStackNode(stackId);
+    int depth = stackTable.GetNodeDepth(nodeId);
+    int threadId = stackTable[stackId].Context.ThreadId;
+    int[] pathBuffer = null;
+    Span<int> path = depth <= MaxStackAllocPathLength ?
+      stackalloc int[depth] : (pathBuffer = ArrayPool<int>.Shared.Rent(depth));
+    stackTable.GetStackPath(stackId, path);
+
+    ProfileCallTreeNode prevNode = null;
+    ResolvedProfileStackFrame prevFrame = null;
+
+    for (int k = 0; k < depth; k++) {
+      var resolvedFrame = stackTable.GetNodeFrame(path[k]);
+
+      var node = AddFrameNode(resolvedFrame, prevNode, prevFrame, sampleWeight, threadId);
+
+      if (node != null) {
+        prevNode = node;
+        prevFrame = resolvedFrame;
       }
+    }
+
+    AccumulateTopFrameWeight(prevNode, sampleWeight, threadId);
+
+    if (pathBuffer != null) {
+      ArrayPool<int>.Shared.Return(pathBuffer);
+    }
+  }
+
+  private ProfileCallTreeNode AddFrameNode(ResolvedProfileStackFrame resolvedFrame,
+                                           ProfileCallTreeNode prevNode, ResolvedProfileStackFrame prevFrame,
+                                           TimeSpan sampleWeight, int threadId) {
+    if (resolvedFrame.FrameRVA == 0 && resolvedFrame.FrameDetails.DebugInfo == null) {
+      return null;
+    }
+
+    ProfileCallTreeNode node = null;
+
+    if (prevNode == null) {
+      node = AddRootNode(resolvedFrame.FrameDetails.DebugInfo, resolvedFrame.FrameDetails.Function);
+    }
+    else {
+      node = AddChildNode(prevNode, resolvedFrame.FrameDetails.DebugInfo, resolvedFrame.FrameDetails.Function);
+      prevNode.AddCallSite(node, prevFrame.FrameRVA, sampleWeight);
+    }
 
-      //node.RecordSample(sample, resolvedFrame); //? Remove
-      prevNode = node;
-      prevFrame = resolvedFrame;
+    node.AccumulateWeight(sampleWeight);
+    node.AccumulateWeight(sampleWeight, TimeSpan.Zero, threadId);
+
+    // Set the user/kernel-mode context of the function.
+    if (node.Kind == ProfileCallTreeNodeKind.Unset) {
+      if (resolvedFrame.FrameDetails.IsKernelCode) {
+        node.Kind = ProfileCallTreeNodeKind.NativeKernel;
+      }
+      else if (resolvedFrame.FrameDetails.IsManagedCode) {
+        node.Kind = ProfileCallTreeNodeKind.Managed;
+      }
+      else {
+        node.Kind = ProfileCallTreeNodeKind.NativeUser;
+      }
     }
 
+    return node;
+  }
+
+  private static void AccumulateTopFrameWeight(ProfileCallTreeNode topNode, TimeSpan sampleWeight, int threadId) {
     // Last function on the stack gets the exclusive weight.
-    if (prevNode != null) {
-      prevNode.AccumulateExclusiveWeight(sampleWeight);
-      prevNode.AccumulateWeight(TimeSpan.Zero, sampleWeight, resolvedStack.Context.ThreadId);
+    if (topNode != null) {
+      topNode.AccumulateExclusiveWeight(sampleWeight);
+      topNode.AccumulateWeight(TimeSpan.Zero, sampleWeight, threadId);
     }
   }
 
@@ -122,6 +185,11 @@ public sealed class ProfileCallTree {
   private void RegisterFunctionTreeNode(ProfileCallTreeNode node) {
     // Add an unique instance of the node for a function.
     node.Id = Interlocked.Increment(ref nextNodeId_);
+    nodesById_ = null;
+    AddFunctionTreeNode(node);
+  }
+
+  private void AddFunctionTreeNode(ProfileCallTreeNode node) {
     ref var nodeList = ref CollectionsMarshal.GetValueRefOrAddDefault(funcToNodesMap_, node.Function, out bool exists);
 
     if (!exists) {
@@ -132,20 +200,42 @@ public sealed class ProfileCallTree {
   }
 
   public ProfileCallTreeNode FindNode(long nodeId) {
-    // Build mapping on-demand.
-    if (nodeIdMap_ == null) {
-      if (nodeIdMap_ == null) {
-        nodeIdMap_ = new Dictionary<long, ProfileCallTreeNode>(funcToNodesMap_.Count);
-
-        foreach (var list in funcToNodesMap_.Values) {
-          foreach (var node in list) {
-            nodeIdMap_[node.Id] = node;
-          }
-        }
+    // Build the array of nodes sorted by ID on-demand and binary search it.
+    // Without locking, threads racing to build it publish only the first array.
+    var nodes = Volatile.Read(ref nodesById_);
+
+    if (nodes == null) {
+      var nodeList = new List<ProfileCallTreeNode>();
+
+      foreach (var list in funcToNodesMap_.Values) {
+        nodeList.AddRange(list);
+      }
+
+      nodeList.Sort((a, b) => a.Id.CompareTo(b.Id));
+      nodes = nodeList.ToArray();
+      nodes = Interlocked.CompareExchange(ref nodesById_, nodes, null) ?? nodes;
+    }
+
+    int low = 0;
+    int high = nodes.Length - 1;
+
+    while (low <= high) {
+      int mid = low + (high - low) / 2;
+      int id = nodes[mid].Id;
+
+      if (id == nodeId) {
+        return nodes[mid];
+      }
+
+      if (id < nodeId) {
+        low = mid + 1;
+      }
+      else {
+        high = mid - 1;
       }
     }
 
-    return nodeIdMap_.GetValueOrNull(nodeId);
+    return null;
   }
 
   public ProfileCallTreeNode FindMatchingNode(ProfileCallTreeNode queryNode) {
@@ -248,8 +338,8 @@ public sealed class ProfileCallTree {
     var comparer = new ProfileCallTreeNodeComparer();
     var childrenSet = new HashSet<ProfileCallTreeNode>(comparer);
     var callersSet = new HashSet<ProfileCallTreeNode>(comparer);
-    var callSiteMap = new Dictionary<long, ProfileCallSite>();
-    var threadsMap = new Dictionary<int, (TimeSpan, TimeSpan)>();
+    var callSiteMap = new TinyDictionary<long, ProfileCallSite>();
+    var threadsMap = new TinyDictionary<int, (TimeSpan, TimeSpan)>();
     var weight = TimeSpan.Zero;
     var excWeight = TimeSpan.Zero;
     var kind = ProfileCallTreeNodeKind.Unset;
@@ -327,7 +417,7 @@ public sealed class ProfileCallTree {
 
       if (node.HasCallSites) {
         foreach (var pair in node.CallSites) {
-          ref var callsite = ref CollectionsMarshal.GetValueRefOrAddDefault(callSiteMap, pair.Key, out bool exists);
+          ref var callsite = ref callSiteMap.GetValueRefOrAddDefault(pair.Key, out bool exists);
 
           if (!exists) {
             callsite = new ProfileCallSite(pair.Key);
@@ -535,11 +625,111 @@ public sealed class ProfileCallTree {
       }
     }
 
-    if (otherTree.nodeIdMap_ != null) {
-      nodeIdMap_ ??= new Dictionary<long, ProfileCallTreeNode>();
+    nodesById_ = null;
+  }
+
+  // Merges the call trees built in parallel from different parts of the samples
+  // into the first one. Instead of merging pairs of trees in multiple rounds,
+  // the nodes with the same call path in all trees are merged at once,
+  // and since the subtrees below different nodes are disjoint,
+  // they are merged in parallel down to a few levels below the roots.
+  public static ProfileCallTree Merge(List<ProfileCallTree> trees) {
+    var mergedTree = trees[0];
+
+    if (trees.Count == 1) {
+      return mergedTree;
+    }
+
+    var rootGroups = new Dictionary<IRTextFunction, List<ProfileCallTreeNode>>();
+
+    foreach (var tree in trees) {
+      foreach (var pair in tree.rootNodes_) {
+        ref var group = ref CollectionsMarshal.GetValueRefOrAddDefault(rootGroups, pair.Key, out bool exists);
+
+        if (!exists) {
+          group = new List<ProfileCallTreeNode>(trees.Count);
+        }
+
+        group.Add(pair.Value);
+      }
+    }
+
+    Parallel.ForEach(rootGroups.Values, group => MergeNodes(group, 0));
+
+    foreach (var pair in rootGroups) {
+      mergedTree.rootNodes_[pair.Key] = pair.Value[0];
+    }
+
+    mergedTree.RebuildFunctionNodeMap();
+    return mergedTree;
+  }
+
+  private static void MergeNodes(List<ProfileCallTreeNode> nodes, int depth) {
+    // The first node is kept and receives the data of the others,
+    // then the children with the same function are merged the same way.
+    if (nodes.Count == 1) {
+      return; // Subtree found in a single tree.
+    }
+
+    var targetNode = nodes[0];
+    var childGroups = new List<List<ProfileCallTreeNode>>();
+    var childGroupMap = new Dictionary<IRTextFunction, List<ProfileCallTreeNode>>();
+
+    for (int i = 0; i < nodes.Count; i++) {
+      var node = nodes[i];
+
+      if (i > 0) {
+        targetNode.MergeNodeData(node);
+      }
+
+      if (!node.HasChildren) {
+        continue;
+      }
+
+      foreach (var childNode in node.Children) {
+        ref var group = ref CollectionsMarshal.GetValueRefOrAddDefault(childGroupMap, childNode.Function,
+                                                                       out bool exists);
+
+        if (!exists) {
+          group = new List<ProfileCallTreeNode>();
+          childGroups.Add(group);
+
+          if (i > 0) {
+            targetNode.AdoptChild(childNode);
+          }
+        }
+
+        group.Add(childNode);
+      }
+    }
+
+    if (depth < MaxParallelMergeDepth && childGroups.Count > 1) {
+      Parallel.ForEach(childGroups, group => MergeNodes(group, depth + 1));
+    }
+    else {
+      foreach (var group in childGroups) {
+        MergeNodes(group, depth + 1);
+      }
+    }
+  }
 
-      foreach (var pair in otherTree.nodeIdMap_) {
-        nodeIdMap_[pair.Key] = pair.Value;
+  private void RebuildFunctionNodeMap() {
+    // Register the nodes remaining after merging, with their existing IDs.
+    funcToNodesMap_ = new Dictionary<IRTextFunction, List<ProfileCallTreeNode>>();
+    nodesById_ = null;
+    var worklist = new Stack<ProfileCallTreeNode>();
+
+    foreach (var rootNode in rootNodes_.Values) {
+      worklist.Push(rootNode);
+    }
+
+    while (worklist.TryPop(out var node)) {
+      AddFunctionTreeNode(node);
+
+      if (node.HasChildren) {
+        for (int i = node.Children.Count - 1; i >= 0; i--) {
+          worklist.Push(node.Children[i]);
+        }
       }
     }
   }
@@ -2,7 +2,6 @@
 // Licensed under the MIT license.
 using System;
 using System.Collections.Generic;
-using System.Runtime.InteropServices;
 using System.Text;
 using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.Collections;
@@ -19,11 +18,10 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
   private ProfileCallTreeNode caller_; // Can't be serialized, reconstructed.
   public FunctionDebugInfo FunctionDebugInfo { get; set; }
 
-  //? TODO: Replace Threads dict and CallSites with a TinyDictionary-like data struct
-  //? like TinyList, also consider DictionarySlim instead of Dictionary from
-  //? https://github.com/dotnet/corefxlab/blob/archive/src/Microsoft.Experimental.Collections/Microsoft/Collections/Extensions/DictionarySlim
-  public Dictionary<long, ProfileCallSite> CallSites { get; set; }
-  public Dictionary<int, (TimeSpan Weight, TimeSpan ExclusiveWeight)> ThreadWeights { get; set; }
+  // Most nodes have a single thread and call site, a TinyDictionary
+  // stores them inline instead of allocating a Dictionary per node.
+  public TinyDictionary<long, ProfileCallSite> CallSites { get; set; }
+  public TinyDictionary<int, (TimeSpan Weight, TimeSpan ExclusiveWeight)> ThreadWeights { get; set; }
   public TimeSpan Weight { get; set; }
   public TimeSpan ExclusiveWeight { get; set; }
   public object Tag { get; set; }
@@ -72,11 +70,11 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
   public ProfileCallTreeNode(FunctionDebugInfo funcInfo, IRTextFunction function,
                              List<ProfileCallTreeNode> children = null,
                              ProfileCallTreeNode caller = null,
-                             Dictionary<long, ProfileCallSite> callSites = null,
-                             Dictionary<int, (TimeSpan, TimeSpan)> threadWeights = null) {
+                             TinyDictionary<long, ProfileCallSite> callSites = null,
+                             TinyDictionary<int, (TimeSpan, TimeSpan)> threadWeights = null) {
     FunctionDebugInfo = funcInfo;
     Function = function;
-    ThreadWeights = threadWeights ?? new Dictionary<int, (TimeSpan, TimeSpan)>();
+    ThreadWeights = threadWeights;
     children_ = new TinyList<ProfileCallTreeNode>(children);
     caller_ = caller;
     CallSites = callSites;
@@ -87,13 +85,14 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
   }
 
   public void AccumulateWeight(TimeSpan weight, TimeSpan exclusiveWeight, int threadId) {
+    ThreadWeights ??= new TinyDictionary<int, (TimeSpan Weight, TimeSpan ExclusiveWeight)>();
     ThreadWeights.AccumulateValue(threadId, weight, exclusiveWeight);
   }
 
   public List<(int ThreadId, (TimeSpan Weight, TimeSpan ExclusiveWeight) Values)>
     SortedByWeightPerThreadWeights {
     get {
-      var list = ThreadWeights.ToList();
+      var list = ThreadWeights?.ToList() ?? new List<(int, (TimeSpan, TimeSpan))>();
       list.Sort((a, b) => b.Item2.Weight.CompareTo(a.Item2.Weight));
       return list;
     }
@@ -102,7 +101,7 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
   public List<(int ThreadId, (TimeSpan Weight, TimeSpan ExclusiveWeight) Values)>
     SortedByIdPerThreadWeights {
     get {
-      var list = ThreadWeights.ToList();
+      var list = ThreadWeights?.ToList() ?? new List<(int, (TimeSpan, TimeSpan))>();
       list.Sort((a, b) => a.Item1.CompareTo(b.Item1));
       return list;
     }
@@ -134,6 +133,12 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
     caller_ = parentNode;
   }
 
+  internal void AdoptChild(ProfileCallTreeNode childNode) {
+    // Used by ProfileCallTree.Merge to move a child from another call tree.
+    children_.Add(childNode);
+    childNode.caller_ = this;
+  }
+
   public bool HasParent(ProfileCallTreeNode parentNode, ProfileCallTreeNodeComparer comparer) {
     return caller_ != null && comparer.Equals(caller_, parentNode);
   }
@@ -152,8 +157,8 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
   }
 
   public void AddCallSite(ProfileCallTreeNode childNode, long rva, TimeSpan weight) {
-    CallSites ??= new Dictionary<long, ProfileCallSite>();
-    ref var callsite = ref CollectionsMarshal.GetValueRefOrAddDefault(CallSites, rva, out bool exists);
+    CallSites ??= new TinyDictionary<long, ProfileCallSite>();
+    ref var callsite = ref CallSites.GetValueRefOrAddDefault(rva, out bool exists);
 
     if (!exists) {
       callsite = new ProfileCallSite(rva);
@@ -179,15 +184,35 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
     // then recursively merge the common child nodes
     // and copy over any new child nodes.
     otherNode.Tag = MergedNodeTag; // Mark node as merged to be discarded later.
+    MergeNodeData(otherNode);
+
+    if (otherNode.HasChildren) {
+      foreach (var child in otherNode.children_) {
+        var existingChild = FindChildNode(child.Function);
+
+        if (existingChild != null) {
+          // Recursively merge child nodes.
+          existingChild.MergeWith(child);
+        }
+        else {
+          // Copy over the child from the other node.
+          AdoptChild(child);
+        }
+      }
+    }
+  }
+
+  internal void MergeNodeData(ProfileCallTreeNode otherNode) {
+    // Accumulate the weights and merge the call sites and per-thread weights,
+    // without the child nodes.
     Weight += otherNode.Weight;
     ExclusiveWeight += otherNode.ExclusiveWeight;
 
     if (otherNode.HasCallSites) {
-      CallSites ??= new Dictionary<long, ProfileCallSite>();
+      CallSites ??= new TinyDictionary<long, ProfileCallSite>();
 
       foreach (var callSite in otherNode.CallSites) {
-        ref var existingCallSite =
-          ref CollectionsMarshal.GetValueRefOrAddDefault(CallSites, callSite.Key, out bool exists);
+        ref var existingCallSite = ref CallSites.GetValueRefOrAddDefault(callSite.Key, out bool exists);
 
         if (!exists) {
           existingCallSite = callSite.Value;
@@ -199,27 +224,10 @@ public class ProfileCallTreeNode : IEquatable<ProfileCallTreeNode> {
     }
 
     if (otherNode.HasThreadWeights) {
-      ThreadWeights ??= new Dictionary<int, (TimeSpan Weight, TimeSpan ExclusiveWeight)>();
-
       foreach (var threadWeight in otherNode.ThreadWeights) {
         AccumulateWeight(threadWeight.Value.Weight, threadWeight.Value.ExclusiveWeight, threadWeight.Key);
       }
     }
-
-    if (otherNode.HasChildren) {
-      foreach (var child in otherNode.children_) {
-        var existingChild = FindChildNode(child.Function);
-
-        if (existingChild != null) {
-          // Recursively merge child nodes.
-          existingChild.MergeWith(child);
-        }
-        else {
-          // Copy over the child from the other node.
-          children_.Add(child);
-        }
-      }
-    }
   }
 
   public bool IsMergeNode() {
@@ -324,8 +332,8 @@ public sealed class ProfileCallTreeGroupNode : ProfileCallTreeNode {
                                   List<ProfileCallTreeNode> nodes = null,
                                   List<ProfileCallTreeNode> children = null,
                                   List<ProfileCallTreeNode> callers = null,
-                                  Dictionary<long, ProfileCallSite> callSites = null,
-                                  Dictionary<int, (TimeSpan, TimeSpan)> threadWeights = null) :
+                                  TinyDictionary<long, ProfileCallSite> callSites = null,
+                                  TinyDictionary<int, (TimeSpan, TimeSpan)> threadWeights = null) :
     base(funcInfo, function, children, null, callSites, threadWeights) {
     nodes_ = nodes ?? new List<ProfileCallTreeNode>();
     callers_ = callers ?? new List<ProfileCallTreeNode>();
@@ -0,0 +1,281 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Numerics;
+using ProfileExplorer.Core.Profile.CallTree;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Inverted index from call tree nodes to the samples that make up their total weight,
+// used to find the samples of a function instance without scanning all samples
+// and matching each stack against the instance's call path.
+// The nodes are numbered in preorder, which makes the subtree of a node the range
+// [number, subtree end) of node numbers. Each sample is assigned to the node of its
+// stack's top frame and the sample indices are grouped by node number, so the samples
+// of a node are the groups in its subtree range, read from two offsets.
+// The call tree may be computed from part of the samples (filtered profile),
+// a stack whose path leaves the call tree is assigned to the deepest node
+// still on its path, like the stack matching of FunctionSamplesProcessor.
+public sealed class CallTreeSampleIndex {
+  private const int RootNode = -1; // Stack path not started yet, no call tree node.
+  private ProfileSampleStore samples_;
+  private ProfileCallTree callTree_;
+  private int sampleCount_;
+  private Dictionary<ProfileCallTreeNode, int> nodeNumbers_;
+  private ProfileCallTreeNode[] nodes_;
+  private int[] subtreeEnds_;
+  private int[] nodeSampleOffsets_;
+  private int[] nodeSamples_;
+
+  private CallTreeSampleIndex(ProfileSampleStore samples, ProfileCallTree callTree) {
+    samples_ = samples;
+    callTree_ = callTree;
+    sampleCount_ = samples.Count;
+  }
+
+  public ProfileSampleStore Samples => samples_;
+  public ProfileCallTree CallTree => callTree_;
+  public int SampleCount => sampleCount_;
+  public int NodeCount => nodes_.Length;
+
+  public static CallTreeSampleIndex Build(ProfileSampleStore samples, ProfileCallTree callTree) {
+    var index = new CallTreeSampleIndex(samples, callTree);
+    index.NumberNodes();
+    index.GroupSamples(index.MapStacks());
+    return index;
+  }
+
+  public bool Contains(ProfileCallTreeNode node) {
+    foreach (var instance in node.Nodes) {
+      if (!nodeNumbers_.ContainsKey(instance)) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  public int GetSampleCount(ProfileCallTreeNode node) {
+    var ranges = GetNodeRanges(node);
+    return ranges != null ? GetSampleCount(ranges) : 0;
+  }
+
+  // Returns the sorted indices of the samples included in the node's total weight,
+  // for a group node the samples of all its nodes, or null if the node
+  // is not part of the indexed call tree.
+  public int[] GetSampleIndices(ProfileCallTreeNode node) {
+    var ranges = GetNodeRanges(node);
+
+    if (ranges == null) {
+      return null;
+    }
+
+    int[] result = new int[GetSampleCount(ranges)];
+    int position = 0;
+
+    foreach (var range in ranges) {
+      int start = nodeSampleOffsets_[range.Start];
+      int end = nodeSampleOffsets_[range.End];
+      Array.Copy(nodeSamples_, start, result, position, end - start);
+      position += end - start;
+    }
+
+    // The samples of a single node are already sorted,
+    // the groups of a subtree must be merged back into sample order.
+    if (ranges.Count > 1 || ranges[0].End - ranges[0].Start > 1) {
+      SortSampleIndices(result);
+    }
+
+    return result;
+  }
+
+  private int GetSampleCount(List<(int Start, int End)> ranges) {
+    int count = 0;
+
+    foreach (var range in ranges) {
+      count += nodeSampleOffsets_[range.End] - nodeSampleOffsets_[range.Start];
+    }
+
+    return count;
+  }
+
+  private List<(int Start, int End)> GetNodeRanges(ProfileCallTreeNode node) {
+    var ranges = new List<(int Start, int End)>();
+
+    foreach (var instance in node.Nodes) {
+      if (!nodeNumbers_.TryGetValue(instance, out int number)) {
+        return null;
+      }
+
+      ranges.Add((number, subtreeEnds_[number]));
+    }
+
+    if (ranges.Count == 1) {
+      return ranges;
+    }
+
+    // With recursion, a node of a group can be in the subtree of another one,
+    // preorder ranges either nest or are disjoint, keep only the outer ones.
+    ranges.Sort((a, b) => a.Start.CompareTo(b.Start));
+    var mergedRanges = new List<(int Start, int End)>(ranges.Count);
+
+    foreach (var range in ranges) {
+      if (mergedRanges.Count > 0 && range.Start < mergedRanges[^1].End) {
+        continue;
+      }
+
+      mergedRanges.Add(range);
+    }
+
+    return mergedRanges;
+  }
+
+  private void SortSampleIndices(int[] sampleIndices) {
+    if ((long)sampleIndices.Length * 64 < sampleCount_) {
+      Array.Sort(sampleIndices);
+      return;
+    }
+
+    // For a large part of the samples, marking them in a bitmap
+    // over all samples and reading it back in order is faster.
+    ulong[] bitmap = new ulong[(sampleCount_ + 63) / 64];
+
+    foreach (int sampleIndex in sampleIndices) {
+      bitmap[sampleIndex >> 6] |= 1UL << (sampleIndex & 63);
+    }
+
+    int position = 0;
+
+    for (int i = 0; i < bitmap.Length; i++) {
+      ulong bits = bitmap[i];
+
+      while (bits != 0) {
+        sampleIndices[position++] = (i << 6) + BitOperations.TrailingZeroCount(bits);
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  private void NumberNodes() {
+    // Depth-first walk with an explicit stack, the whole subtree of a node
+    // is visited before moving to its next sibling.
+    var nodeList = new List<ProfileCallTreeNode>();
+    var worklist = new Stack<ProfileCallTreeNode>();
+    nodeNumbers_ = new Dictionary<ProfileCallTreeNode, int>(ReferenceEqualityComparer.Instance);
+
+    foreach (var rootNode in callTree_.RootNodes) {
+      worklist.Push(rootNode);
+    }
+
+    while (worklist.TryPop(out var node)) {
+      nodeNumbers_[node] = nodeList.Count;
+      nodeList.Add(node);
+
+      if (node.HasChildren) {
+        for (int i = node.Children.Count - 1; i >= 0; i--) {
+          worklist.Push(node.Children[i]);
+        }
+      }
+    }
+
+    // Children are numbered after their parent, compute the subtree
+    // sizes bottom-up by walking the nodes in reverse order.
+    nodes_ = nodeList.ToArray();
+    subtreeEnds_ = new int[nodes_.Length];
+
+    for (int i = nodes_.Length - 1; i >= 0; i--) {
+      int end = i + 1;
+
+      if (nodes_[i].HasChildren) {
+        foreach (var child in nodes_[i].Children) {
+          end = Math.Max(end, subtreeEnds_[nodeNumbers_[child]]);
+        }
+      }
+
+      subtreeEnds_[i] = end;
+    }
+  }
+
+  private int[] MapStacks() {
+    // Find the call tree node of each prefix tree node in the stack table,
+    // following the same frames as ProfileCallTree.UpdateCallTree.
+    // A parent node is always added to the table before its children.
+    // Once the path leaves the call tree, the table node and its descendants
+    // keep the number of the deepest call tree node found on the path.
+    var stacks = samples_.Stacks;
+    int[] tableNodeNumbers = new int[stacks.NodeCount];
+    bool[] pathLeftTree = new bool[stacks.NodeCount];
+
+    for (int tableNodeId = 0; tableNodeId < tableNodeNumbers.Length; tableNodeId++) {
+      int parentId = stacks.GetParentNode(tableNodeId);
+      int parentNumber = RootNode;
+
+      if (parentId != ResolvedProfileStackTable.RootNodeId) {
+        parentNumber = tableNodeNumbers[parentId];
+        pathLeftTree[tableNodeId] = pathLeftTree[parentId];
+      }
+
+      var frame = stacks.GetNodeFrame(tableNodeId);
+
+      if (pathLeftTree[tableNodeId] ||
+          frame.FrameRVA == 0 && frame.FrameDetails.DebugInfo == null) {
+        tableNodeNumbers[tableNodeId] = parentNumber; // Frame not in the call tree.
+        continue;
+      }
+
+      var function = frame.FrameDetails.Function;
+      var node = parentNumber == RootNode ?
+        callTree_.FindRootNode(function) :
+        nodes_[parentNumber].FindChildNode(function);
+
+      if (node != null && nodeNumbers_.TryGetValue(node, out int number)) {
+        tableNodeNumbers[tableNodeId] = number;
+      }
+      else {
+        tableNodeNumbers[tableNodeId] = parentNumber;
+        pathLeftTree[tableNodeId] = true;
+      }
+    }
+
+    int[] stackNumbers = new int[stacks.Count];
+
+    for (int stackId = 0; stackId < stackNumbers.Length; stackId++) {
+      int tableNodeId = stacks.GetStackNode(stackId);
+      stackNumbers[stackId] = tableNodeId == ResolvedProfileStackTable.RootNodeId ?
+        RootNode : tableNodeNumbers[tableNodeId];
+    }
+
+    return stackNumbers;
+  }
+
+  private void GroupSamples(int[] stackNumbers) {
+    // Counting sort of the sample indices by node number,
+    // which keeps the samples of each node in sample order.
+    var stackIds = samples_.StackIds;
+    nodeSampleOffsets_ = new int[nodes_.Length + 1];
+
+    for (int i = 0; i < sampleCount_; i++) {
+      int number = stackNumbers[stackIds[i]];
+
+      if (number >= 0) {
+        nodeSampleOffsets_[number + 1]++;
+      }
+    }
+
+    for (int i = 1; i < nodeSampleOffsets_.Length; i++) {
+      nodeSampleOffsets_[i] += nodeSampleOffsets_[i - 1];
+    }
+
+    int[] positions = nodeSampleOffsets_[..^1];
+    nodeSamples_ = new int[nodeSampleOffsets_[^1]];
+
+    for (int i = 0; i < sampleCount_; i++) {
+      int number = stackNumbers[stackIds[i]];
+
+      if (number >= 0) {
+        nodeSamples_[positions[number]++] = i;
+      }
+    }
+  }
+}
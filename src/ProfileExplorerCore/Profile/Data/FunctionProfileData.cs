@@ -2,7 +2,6 @@
 // Licensed under the MIT license.
 using System;
 using System.Collections.Generic;
-using System.Runtime.InteropServices;
 using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.IR;
 using ProfileExplorer.Core.IR.Tags;
@@ -12,7 +11,7 @@ namespace ProfileExplorer.Core.Profile.Data;
 
 public class FunctionProfileData {
   public FunctionProfileData() {
-    InstructionWeight = new Dictionary<long, TimeSpan>();
+    Instructions = new InstructionProfileTable();
     SampleStartIndex = int.MaxValue;
     SampleEndIndex = int.MinValue;
   }
@@ -23,40 +22,39 @@ public class FunctionProfileData {
 
   public TimeSpan Weight { get; set; }
   public TimeSpan ExclusiveWeight { get; set; }
-  public Dictionary<long, TimeSpan> InstructionWeight { get; set; } // Instr. offset mapping
-  public Dictionary<long, PerformanceCounterValueSet> InstructionCounters { get; set; }
+  public InstructionProfileTable Instructions { get; } // Instr. offset mapping
   public FunctionDebugInfo FunctionDebugInfo { get; set; }
   public int SampleStartIndex { get; set; }
   public int SampleEndIndex { get; set; }
-  public bool HasPerformanceCounters => InstructionCounters is {Count: > 0};
+  public bool HasPerformanceCounters => Instructions.HasCounters;
 
   public void MergeWith(FunctionProfileData otherData) {
     Weight += otherData.Weight;
     ExclusiveWeight += otherData.ExclusiveWeight;
     SampleStartIndex = Math.Min(SampleStartIndex, otherData.SampleStartIndex);
     SampleEndIndex = Math.Max(SampleEndIndex, otherData.SampleEndIndex);
+    Instructions.MergeWith(otherData.Instructions);
+  }
 
-    foreach (var pair in otherData.InstructionWeight) {
-      ref var existingValue =
-        ref CollectionsMarshal.GetValueRefOrAddDefault(InstructionWeight, pair.Key, out bool exists);
-      existingValue += pair.Value;
-    }
-
-    if (otherData.HasPerformanceCounters) {
-      InstructionCounters ??= new Dictionary<long, PerformanceCounterValueSet>();
-
-      foreach (var pair in otherData.InstructionCounters) {
-        ref var existingValue =
-          ref CollectionsMarshal.GetValueRefOrAddDefault(InstructionCounters, pair.Key, out bool exists);
-
-        if (exists) {
-          existingValue.Add(pair.Value);
-        }
-        else {
-          existingValue = pair.Value;
-        }
+  // Merges the profiles of the same function from all sample chunks into the first one,
+  // with the per-instruction tables combined in a single pass.
+  public static FunctionProfileData Merge(List<FunctionProfileData> profiles) {
+    var result = profiles[0];
+    var tables = new List<InstructionProfileTable>(profiles.Count);
+
+    foreach (var profile in profiles) {
+      if (profile != result) {
+        result.Weight += profile.Weight;
+        result.ExclusiveWeight += profile.ExclusiveWeight;
+        result.SampleStartIndex = Math.Min(result.SampleStartIndex, profile.SampleStartIndex);
+        result.SampleEndIndex = Math.Max(result.SampleEndIndex, profile.SampleEndIndex);
       }
+
+      tables.Add(profile.Instructions);
     }
+
+    InstructionProfileTable.Merge(tables);
+    return result;
   }
 
   public static bool TryFindElementForOffset(AssemblyMetadataTag metadataTag, long offset,
@@ -79,18 +77,11 @@ public class FunctionProfileData {
   }
 
   public void AddCounterSample(long instrOffset, int perfCounterId, long value) {
-    InstructionCounters ??= new Dictionary<long, PerformanceCounterValueSet>();
-    var counterSet = InstructionCounters.GetOrAddValue(instrOffset);
-    counterSet.AddCounterSample(perfCounterId, value);
+    Instructions.AddCounter(instrOffset, perfCounterId, value);
   }
 
   public void AddInstructionSample(long instrOffset, TimeSpan weight) {
-    if (InstructionWeight.TryGetValue(instrOffset, out var currentWeight)) {
-      InstructionWeight[instrOffset] = currentWeight + weight;
-    }
-    else {
-      InstructionWeight[instrOffset] = weight;
-    }
+    Instructions.AddWeight(instrOffset, weight);
   }
 
   public double ScaleWeight(TimeSpan weight) {
@@ -106,24 +97,48 @@ public class FunctionProfileData {
     }
 
     var result = new FunctionProcessingResult(metadataTag.OffsetToElementMap.Count);
-
-    foreach (var pair in InstructionWeight) {
-      if (TryFindElementForOffset(metadataTag, pair.Key, ir, out var element)) {
-        result.SampledElements.Add((element, pair.Value));
-        result.BlockSampledElementsMap.AccumulateValue(element.ParentBlock, pair.Value);
+    bool hasCounters = Instructions.HasCounters;
+    BlockIR currentBlock = null;
+    var currentBlockWeight = TimeSpan.Zero;
+
+    // Instructions are sorted by offset, so the ones of a block
+    // are usually consecutive and their weight is summed up before
+    // being added to the block map.
+    for (int i = 0; i < Instructions.Count; i++) {
+      if (!TryFindElementForOffset(metadataTag, Instructions.GetOffset(i), ir, out var element)) {
+        continue;
       }
-    }
 
-    if (HasPerformanceCounters) {
-      foreach (var pair in InstructionCounters) {
-        if (TryFindElementForOffset(metadataTag, pair.Key, ir, out var element)) {
-          result.CounterElements.Add((element, pair.Value));
+      var weight = Instructions.GetWeight(i);
+
+      if (weight != TimeSpan.Zero) {
+        result.SampledElements.Add((element, weight));
+
+        if (element.ParentBlock != currentBlock) {
+          if (currentBlock != null) {
+            result.BlockSampledElementsMap.AccumulateValue(currentBlock, currentBlockWeight);
+          }
+
+          currentBlock = element.ParentBlock;
+          currentBlockWeight = TimeSpan.Zero;
         }
 
-        result.FunctionCountersValue.Add(pair.Value);
+        currentBlockWeight += weight;
+      }
+
+      if (hasCounters && Instructions.GetCounters(i) is {} counters) {
+        result.CounterElements.Add((element, counters));
       }
     }
 
+    if (currentBlock != null) {
+      result.BlockSampledElementsMap.AccumulateValue(currentBlock, currentBlockWeight);
+    }
+
+    if (hasCounters) {
+      result.FunctionCountersValue = Instructions.ComputeTotalCounters();
+    }
+
     result.BlockSampledElements = result.BlockSampledElementsMap.ToList();
     result.SortSampledElements();
     return result;
@@ -149,8 +164,8 @@ public class FunctionProfileData {
       lastLine = lastLineInfo.Line;
     }
 
-    foreach (var pair in InstructionWeight) {
-      long rva = pair.Key + FunctionDebugInfo.RVA - offsetData.InitialMultiplier;
+    foreach (var pair in Instructions.Weights) {
+      long rva = pair.Offset + FunctionDebugInfo.RVA - offsetData.InitialMultiplier;
       var lineInfo = debugInfo.FindSourceLineByRVA(rva, inlinee != null);
 
       if (!lineInfo.IsUnknown) {
@@ -169,15 +184,15 @@ public class FunctionProfileData {
           }
         }
 
-        result.SourceLineWeight.AccumulateValue(line, pair.Value);
+        result.SourceLineWeight.AccumulateValue(line, pair.Weight);
         firstLine = Math.Min(line, firstLine);
         lastLine = Math.Max(line, lastLine);
       }
     }
 
     if (HasPerformanceCounters) {
-      foreach (var pair in InstructionCounters) {
-        long rva = pair.Key + FunctionDebugInfo.RVA;
+      foreach (var pair in Instructions.Counters) {
+        long rva = pair.Offset + FunctionDebugInfo.RVA;
         var lineInfo = debugInfo.FindSourceLineByRVA(rva, inlinee != null);
 
         if (!lineInfo.IsUnknown) {
@@ -196,12 +211,12 @@ public class FunctionProfileData {
             }
           }
 
-          result.SourceLineCounters.AccumulateValue(line, pair.Value);
+          result.SourceLineCounters.AccumulateValue(line, pair.Counters);
           firstLine = Math.Min(line, firstLine);
           lastLine = Math.Max(line, lastLine);
         }
 
-        result.FunctionCountersValue.Add(pair.Value);
+        result.FunctionCountersValue.Add(pair.Counters);
       }
     }
 
@@ -211,15 +226,7 @@ public class FunctionProfileData {
   }
 
   public PerformanceCounterValueSet ComputeFunctionTotalCounters() {
-    var result = new PerformanceCounterValueSet();
-
-    if (HasPerformanceCounters) {
-      foreach (var pair in InstructionCounters) {
-        result.Add(pair.Value);
-      }
-    }
-
-    return result;
+    return Instructions.ComputeTotalCounters();
   }
 
   public void Reset() {
@@ -227,8 +234,7 @@ public class FunctionProfileData {
     ExclusiveWeight = TimeSpan.Zero;
     SampleStartIndex = int.MaxValue;
     SampleEndIndex = int.MinValue;
-    InstructionWeight?.Clear();
-    InstructionCounters?.Clear();
+    Instructions.Clear();
   }
 }
 
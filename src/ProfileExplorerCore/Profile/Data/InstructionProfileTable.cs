@@ -0,0 +1,388 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Runtime.InteropServices;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Per-instruction sample weights and performance counters of a function,
+// stored as columns with the rows sorted by instruction offset: an offset column,
+// a weight column and one column for each collected counter.
+// Compared to a dictionary per function, there is no per-entry overhead,
+// the tables of the sample chunks are combined with a k-way merge of
+// the sorted rows and instructions can be walked in address order.
+// Samples are first appended to a pending list that gets sorted and merged
+// into the columns once it's large enough, or when the table is read.
+public sealed class InstructionProfileTable {
+  private const int MinPendingSamples = 64;
+  private static readonly long[][] EmptyColumns = Array.Empty<long[]>();
+  private long[] offsets_;
+  private long[] weights_; // Weight ticks, zero for instrs. with only counters.
+  private int[] counterIds_; // Sorted counter IDs, one column for each.
+  private long[][] counterColumns_;
+  private int count_;
+  private int weightCount_;
+  private List<PendingSample> pending_;
+  private volatile bool hasPending_;
+  private readonly object lockObject_ = new();
+
+  public InstructionProfileTable() {
+    ResetColumns();
+  }
+
+  // Number of instructions with a weight or counters.
+  public int Count {
+    get {
+      EnsureCompacted();
+      return count_;
+    }
+  }
+
+  // Number of instructions with a non-zero sample weight.
+  public int WeightCount {
+    get {
+      EnsureCompacted();
+      return weightCount_;
+    }
+  }
+
+  public bool HasCounters {
+    get {
+      EnsureCompacted();
+      return counterIds_.Length > 0;
+    }
+  }
+
+  public IEnumerable<(long Offset, TimeSpan Weight)> Weights {
+    get {
+      EnsureCompacted();
+
+      for (int i = 0; i < count_; i++) {
+        if (weights_[i] != 0) {
+          yield return (offsets_[i], TimeSpan.FromTicks(weights_[i]));
+        }
+      }
+    }
+  }
+
+  // The same counter set is reused for all the instructions,
+  // it must be copied to keep the values after moving to the next one.
+  public IEnumerable<(long Offset, PerformanceCounterValueSet Counters)> Counters {
+    get {
+      EnsureCompacted();
+      var counters = new PerformanceCounterValueSet();
+
+      for (int i = 0; i < count_; i++) {
+        if (GetCounters(i, counters) != null) {
+          yield return (offsets_[i], counters);
+        }
+      }
+    }
+  }
+
+  public void AddWeight(long offset, TimeSpan weight) {
+    AddPendingSample(new PendingSample(offset, -1, weight.Ticks));
+  }
+
+  public void AddCounter(long offset, int perfCounterId, long value) {
+    AddPendingSample(new PendingSample(offset, perfCounterId, value));
+  }
+
+  public long GetOffset(int row) {
+    EnsureCompacted();
+    return offsets_[row];
+  }
+
+  public TimeSpan GetWeight(int row) {
+    EnsureCompacted();
+    return TimeSpan.FromTicks(weights_[row]);
+  }
+
+  public int FindRow(long offset) {
+    EnsureCompacted();
+    int row = Array.BinarySearch(offsets_, 0, count_, offset);
+    return row >= 0 ? row : -1;
+  }
+
+  public bool TryGetWeight(long offset, out TimeSpan weight) {
+    int row = FindRow(offset);
+
+    if (row < 0 || weights_[row] == 0) {
+      weight = TimeSpan.Zero;
+      return false;
+    }
+
+    weight = TimeSpan.FromTicks(weights_[row]);
+    return true;
+  }
+
+  // Returns the counters of the instruction, or null if it has none.
+  // If a counter set is passed in, it is cleared and filled instead of allocating a new one.
+  public PerformanceCounterValueSet GetCounters(int row, PerformanceCounterValueSet counters = null) {
+    EnsureCompacted();
+    counters?.Counters.Clear();
+    bool found = false;
+
+    for (int k = 0; k < counterIds_.Length; k++) {
+      long value = counterColumns_[k][row];
+
+      if (value != 0) {
+        counters ??= new PerformanceCounterValueSet();
+        counters.Counters.Add(new PerformanceCounterValue(counterIds_[k], value));
+        found = true;
+      }
+    }
+
+    return found ? counters : null;
+  }
+
+  public PerformanceCounterValueSet ComputeTotalCounters() {
+    EnsureCompacted();
+    var result = new PerformanceCounterValueSet();
+
+    for (int k = 0; k < counterIds_.Length; k++) {
+      long total = 0;
+
+      foreach (long value in counterColumns_[k].AsSpan(0, count_)) {
+        total += value;
+      }
+
+      if (total != 0) {
+        result.Counters.Add(new PerformanceCounterValue(counterIds_[k], total));
+      }
+    }
+
+    return result;
+  }
+
+  public void MergeWith(InstructionProfileTable other) {
+    EnsureCompacted();
+    other.EnsureCompacted();
+    MergeRows(this, new List<InstructionProfileTable> {this, other});
+  }
+
+  // Combines the tables into the first one in a single pass
+  // over the rows of all tables.
+  public static InstructionProfileTable Merge(List<InstructionProfileTable> tables) {
+    foreach (var table in tables) {
+      table.EnsureCompacted();
+    }
+
+    if (tables.Count > 1) {
+      MergeRows(tables[0], tables);
+    }
+
+    return tables[0];
+  }
+
+  public void Clear() {
+    lock (lockObject_) {
+      pending_ = null;
+      hasPending_ = false;
+      ResetColumns();
+    }
+  }
+
+  private void AddPendingSample(PendingSample sample) {
+    pending_ ??= new List<PendingSample>(MinPendingSamples);
+    pending_.Add(sample);
+    hasPending_ = true;
+
+    // Merge pending samples once there are as many as rows,
+    // which keeps the merging cost amortized per sample.
+    if (pending_.Count >= Math.Max(MinPendingSamples, count_)) {
+      Compact();
+    }
+  }
+
+  private void EnsureCompacted() {
+    if (hasPending_) {
+      Compact();
+    }
+  }
+
+  private void Compact() {
+    // Tables are filled by a single thread, but can be read
+    // by multiple threads once complete, the first one compacting it.
+    lock (lockObject_) {
+      if (!hasPending_) {
+        return;
+      }
+
+      var samples = CollectionsMarshal.AsSpan(pending_);
+      samples.Sort((a, b) => a.Offset.CompareTo(b.Offset));
+      var pendingTable = FromSortedSamples(samples);
+
+      if (count_ == 0) {
+        SetColumns(pendingTable.offsets_, pendingTable.weights_, pendingTable.counterIds_,
+                   pendingTable.counterColumns_, pendingTable.count_);
+      }
+      else {
+        MergeRows(this, new List<InstructionProfileTable> {this, pendingTable});
+      }
+
+      pending_ = null;
+      hasPending_ = false;
+    }
+  }
+
+  private static InstructionProfileTable FromSortedSamples(ReadOnlySpan<PendingSample> samples) {
+    var counterIds = new List<int>();
+    int rows = 0;
+
+    for (int i = 0; i < samples.Length; i++) {
+      if (i == 0 || samples[i].Offset != samples[i - 1].Offset) {
+        rows++;
+      }
+
+      if (samples[i].CounterId >= 0 && !counterIds.Contains(samples[i].CounterId)) {
+        counterIds.Add(samples[i].CounterId);
+      }
+    }
+
+    counterIds.Sort();
+    var table = new InstructionProfileTable();
+    long[] offsets = new long[rows];
+    long[] weights = new long[rows];
+    long[][] counterColumns = CreateColumns(counterIds.Count, rows);
+    int row = -1;
+
+    foreach (var sample in samples) {
+      if (row < 0 || offsets[row] != sample.Offset) {
+        offsets[++row] = sample.Offset;
+      }
+
+      if (sample.CounterId < 0) {
+        weights[row] += sample.Value;
+      }
+      else {
+        counterColumns[counterIds.BinarySearch(sample.CounterId)][row] += sample.Value;
+      }
+    }
+
+    table.SetColumns(offsets, weights, counterIds.ToArray(), counterColumns, rows);
+    return table;
+  }
+
+  private static void MergeRows(InstructionProfileTable target, List<InstructionProfileTable> tables) {
+    // Map the counter columns of each table to the columns of the merged table.
+    var counterIdList = new List<int>();
+    int capacity = 0;
+
+    foreach (var table in tables) {
+      capacity += table.count_;
+
+      foreach (int counterId in table.counterIds_) {
+        if (!counterIdList.Contains(counterId)) {
+          counterIdList.Add(counterId);
+        }
+      }
+    }
+
+    counterIdList.Sort();
+    int[][] counterMaps = new int[tables.Count][];
+
+    for (int i = 0; i < tables.Count; i++) {
+      int[] tableCounterIds = tables[i].counterIds_;
+      counterMaps[i] = new int[tableCounterIds.Length];
+
+      for (int k = 0; k < tableCounterIds.Length; k++) {
+        counterMaps[i][k] = counterIdList.BinarySearch(tableCounterIds[k]);
+      }
+    }
+
+    // K-way merge of the sorted rows, with the number of tables
+    // being the number of sample chunks, a linear scan for the next offset is enough.
+    long[] offsets = new long[capacity];
+    long[] weights = new long[capacity];
+    long[][] counterColumns = CreateColumns(counterIdList.Count, capacity);
+    int[] cursors = new int[tables.Count];
+    int rows = 0;
+
+    while (true) {
+      long offset = long.MaxValue;
+      bool found = false;
+
+      for (int i = 0; i < tables.Count; i++) {
+        if (cursors[i] < tables[i].count_ && tables[i].offsets_[cursors[i]] <= offset) {
+          offset = tables[i].offsets_[cursors[i]];
+          found = true;
+        }
+      }
+
+      if (!found) {
+        break;
+      }
+
+      offsets[rows] = offset;
+
+      for (int i = 0; i < tables.Count; i++) {
+        var table = tables[i];
+        int cursor = cursors[i];
+
+        if (cursor < table.count_ && table.offsets_[cursor] == offset) {
+          weights[rows] += table.weights_[cursor];
+
+          for (int k = 0; k < table.counterColumns_.Length; k++) {
+            counterColumns[counterMaps[i][k]][rows] += table.counterColumns_[k][cursor];
+          }
+
+          cursors[i] = cursor + 1;
+        }
+      }
+
+      rows++;
+    }
+
+    if (rows < capacity) {
+      // Trim the columns when offsets were found in multiple tables.
+      Array.Resize(ref offsets, rows);
+      Array.Resize(ref weights, rows);
+
+      for (int k = 0; k < counterColumns.Length; k++) {
+        Array.Resize(ref counterColumns[k], rows);
+      }
+    }
+
+    target.SetColumns(offsets, weights, counterIdList.ToArray(), counterColumns, rows);
+  }
+
+  private static long[][] CreateColumns(int columnCount, int rows) {
+    if (columnCount == 0) {
+      return EmptyColumns;
+    }
+
+    long[][] columns = new long[columnCount][];
+
+    for (int k = 0; k < columnCount; k++) {
+      columns[k] = new long[rows];
+    }
+
+    return columns;
+  }
+
+  private void SetColumns(long[] offsets, long[] weights, int[] counterIds,
+                          long[][] counterColumns, int count) {
+    int weightCount = 0;
+
+    for (int i = 0; i < count; i++) {
+      if (weights[i] != 0) {
+        weightCount++;
+      }
+    }
+
+    offsets_ = offsets;
+    weights_ = weights;
+    counterIds_ = counterIds;
+    counterColumns_ = counterColumns;
+    weightCount_ = weightCount;
+    count_ = count;
+  }
+
+  private void ResetColumns() {
+    SetColumns(Array.Empty<long>(), Array.Empty<long>(), Array.Empty<int>(), EmptyColumns, 0);
+  }
+
+  private readonly record struct PendingSample(long Offset, int CounterId, long Value);
+}
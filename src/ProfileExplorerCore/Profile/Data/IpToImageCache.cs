@@ -3,17 +3,32 @@
 using System;
 using System.Collections.Generic;
 using System.Diagnostics;
+using System.Linq;
+using ProfileExplorer.Core.Collections;
 
 namespace ProfileExplorer.Core.Profile.Data;
 
 public class IpToImageCache {
-  private List<ProfileImage> images_;
+  private ProfileImage[] images_;
+  private AddressRangeTable ranges_;
   private long lowestBaseAddress_;
 
   public IpToImageCache(IEnumerable<ProfileImage> images, long lowestBaseAddress) {
     lowestBaseAddress_ = lowestBaseAddress;
-    images_ = new List<ProfileImage>(images);
-    images_.Sort();
+    images_ = images.ToArray();
+    Array.Sort(images_, (a, b) => a.BaseAddress.CompareTo(b.BaseAddress));
+
+    // The image address ranges are kept in contiguous arrays for the lookups.
+    // Note that the end address is inclusive, same as ProfileImage.CompareTo.
+    long[] starts = new long[images_.Length];
+    long[] ends = new long[images_.Length];
+
+    for (int i = 0; i < images_.Length; i++) {
+      starts[i] = images_[i].BaseAddress;
+      ends[i] = images_[i].BaseAddressEnd;
+    }
+
+    ranges_ = new AddressRangeTable(starts, ends);
   }
 
   public static IpToImageCache Create(IEnumerable<ProfileImage> images) {
@@ -32,30 +47,17 @@ public class IpToImageCache {
 
   public ProfileImage Find(long ip) {
     Debug.Assert(IsValidAddres(ip));
-    return BinarySearch(images_, ip);
+    int index = ranges_.Find(ip);
+    return index >= 0 ? images_[index] : null;
   }
 
-  private ProfileImage BinarySearch(List<ProfileImage> ranges, long value) {
-    int min = 0;
-    int max = ranges.Count - 1;
-
-    while (min <= max) {
-      int mid = (min + max) / 2;
-      var range = ranges[mid];
-      int comparison = range.CompareTo(value);
-
-      if (comparison == 0) {
-        return range;
-      }
-
-      if (comparison < 0) {
-        min = mid + 1;
-      }
-      else {
-        max = mid - 1;
-      }
-    }
+  // Resolves the image of each IP, null if not found.
+  public void Find(ReadOnlySpan<long> ips, Span<ProfileImage> images) {
+    Span<int> indices = ips.Length <= 256 ? stackalloc int[ips.Length] : new int[ips.Length];
+    ranges_.Find(ips, indices);
 
-    return null;
+    for (int i = 0; i < ips.Length; i++) {
+      images[i] = indices[i] >= 0 ? images_[indices[i]] : null;
+    }
   }
-}
\ No newline at end of file
+}
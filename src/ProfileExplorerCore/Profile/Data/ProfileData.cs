@@ -2,6 +2,7 @@
 // Licensed under the MIT license.
 using System;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.Runtime.InteropServices;
 using System.Threading.Tasks;
 using ProfileExplorer.Core.Binary;
@@ -12,6 +13,14 @@ using ProfileExplorer.Core.Utilities;
 namespace ProfileExplorer.Core.Profile.Data;
 
 public class ProfileData {
+  private SampleBlockIndex sampleBlocks_;
+  private object sampleBlocksLock_ = new();
+  private CallTreeSampleIndex callTreeSamples_;
+  private object callTreeSamplesLock_ = new();
+  private Dictionary<int, SampleTimeIndex> sampleTimeIndex_;
+  private object sampleTimeIndexLock_ = new();
+  private object profileLock_ = new();
+
   public ProfileData(TimeSpan profileWeight, TimeSpan totalWeight) : this() {
     ProfileWeight = profileWeight;
     TotalWeight = totalWeight;
@@ -25,7 +34,7 @@ public class ProfileData {
     ModuleCounters = new Dictionary<string, PerformanceCounterValueSet>();
     Threads = new Dictionary<int, ProfileThread>();
     Modules = new Dictionary<int, ProfileImage>();
-    Samples = new List<(ProfileSample, ResolvedProfileStack)>();
+    Samples = new ProfileSampleStore();
     Events = new List<(PerformanceCounterEvent Sample, ResolvedProfileStack Stack)>();
     ModuleDebugInfo = new Dictionary<string, IDebugInfoProvider>();
     Filter = new ProfileSampleFilter();
@@ -40,13 +49,21 @@ public class ProfileData {
   public ProfileCallTree CallTree { get; set; }
   public ThreadSampleRanges ThreadSampleRanges { get; set; }
   public ProfileDataReport Report { get; set; }
-  public List<(ProfileSample Sample, ResolvedProfileStack Stack)> Samples { get; set; }
+  public ProfileSampleStore Samples { get; set; }
   public List<(PerformanceCounterEvent Sample, ResolvedProfileStack Stack)> Events { get; set; }
   public ProfileProcess Process { get; set; }
   public Dictionary<int, ProfileThread> Threads { get; set; }
   public Dictionary<int, ProfileImage> Modules { get; set; }
   public Dictionary<string, IDebugInfoProvider> ModuleDebugInfo { get; set; }
   public ProfileSampleFilter Filter { get; set; }
+  // With lazy symbolization, completes once the stack frames were remapped
+  // from address buckets to the functions found in the debug info,
+  // with false if it was canceled.
+  public Task<bool> SymbolizationTask { get; set; }
+  public CancelableTask SymbolizationCancelableTask { get; set; }
+  // Raised from a background thread after the function profiles and call tree
+  // were recomputed with newly loaded symbols.
+  public event EventHandler FunctionsRemapped;
 
   public List<PerformanceCounter> SortedPerformanceCounters {
     get {
@@ -60,11 +77,13 @@ public class ProfileData {
     get {
       var list = new List<(int ThreadId, TimeSpan Weight)>();
       var threadWeights = new Dictionary<int, TimeSpan>();
-      var sampleSpan = CollectionsMarshal.AsSpan(Samples);
+      int[] contextThreadIds = Samples.ComputeContextThreadIds();
+      var contextIds = Samples.ContextIds;
+      var weights = Samples.Weights;
 
-      for (int i = 0; i < sampleSpan.Length; i++) {
-        threadWeights.AccumulateValue(sampleSpan[i].Stack.Context.ThreadId,
-                                      sampleSpan[i].Sample.Weight);
+      for (int i = 0; i < contextIds.Length; i++) {
+        threadWeights.AccumulateValue(contextThreadIds[contextIds[i]],
+                                      TimeSpan.FromTicks(weights[i]));
       }
 
       foreach ((int threadId, var weight) in threadWeights) {
@@ -209,6 +228,61 @@ public class ProfileData {
   public ProcessingResult FilterFunctionProfile(ProfileSampleFilter filter) {
     //? TODO: Split ProfileData into a part that has the samples and other info that doesn't change,
     //? while the rest is more like a processing result similar to FuncProfileData
+    // The profile may be recomputed by a background symbolization
+    // while the UI applies a filter, one at a time.
+    lock (profileLock_) {
+      return FilterFunctionProfileImpl(filter);
+    }
+  }
+
+  // Recomputes the function profiles and call tree with the current filter
+  // after the stack frames were remapped to other functions.
+  public void RefreshFunctionProfile() {
+    lock (profileLock_) {
+      FilterFunctionProfileImpl(Filter);
+    }
+
+    NotifyFunctionsRemapped();
+  }
+
+  // Remaps the stack frames resolved before the debug info was loaded.
+  // Frames are shared by the call tree and the samples, the UI doesn't see
+  // them change while it filters the profile or builds call trees.
+  public void RemapStackFrames(List<(ResolvedProfileStackFrame Frame, IRTextFunction Function,
+                                     ResolvedProfileStackFrameKey FrameDetails)> frames) {
+    lock (profileLock_) {
+      foreach (var (frame, function, frameDetails) in frames) {
+        ResolvedProfileStack.RemapFrame(frame, function, frameDetails);
+      }
+    }
+  }
+
+  // Stops the background symbolization and waits for it to end,
+  // must be done before the profile is unloaded or replaced.
+  public async Task CancelSymbolizationAsync() {
+    var symbolizationTask = SymbolizationTask;
+
+    if (symbolizationTask == null) {
+      return;
+    }
+
+    SymbolizationCancelableTask?.Cancel();
+
+    try {
+      await symbolizationTask.ConfigureAwait(false);
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"CancelSymbolizationAsync: Symbolization failed: {ex.Message}");
+    }
+
+    SymbolizationTask = null;
+  }
+
+  public void NotifyFunctionsRemapped() {
+    FunctionsRemapped?.Invoke(this, EventArgs.Empty);
+  }
+
+  private ProcessingResult FilterFunctionProfileImpl(ProfileSampleFilter filter) {
     var currentProfile = new ProcessingResult {
       FunctionProfiles = FunctionProfiles,
       CallTree = CallTree,
@@ -235,6 +309,12 @@ public class ProfileData {
   }
 
   public ProcessingResult RestorePreviousProfile(ProcessingResult previousProfile) {
+    lock (profileLock_) {
+      return RestorePreviousProfileImpl(previousProfile);
+    }
+  }
+
+  private ProcessingResult RestorePreviousProfileImpl(ProcessingResult previousProfile) {
     var currentProfile = new ProcessingResult {
       FunctionProfiles = FunctionProfiles,
       CallTree = CallTree,
@@ -264,16 +344,20 @@ public class ProfileData {
       maxChunks = Math.Max(1, CoreSettingsProvider.GeneralSettings.CurrentCpuCoreLimit / 2);
     }
 
+    // Combine the precomputed per-block stack weights covered by the filter,
+    // both the call tree and the function profiles are then built per unique stack.
+    var histogram = baseProfile.GetSampleBlockIndex().ComputeHistogram(filter);
+
     var callTreeTask = Task.Run(() => {
       if (computeCallTree) {
-        return CallTreeProcessor.Compute(baseProfile, filter, maxChunks);
+        return CallTreeProcessor.Compute(baseProfile, histogram, maxChunks);
       }
 
       return null;
     });
 
     var funcProfileTask = Task.Run(() => {
-      return FunctionProfileProcessor.Compute(baseProfile, filter, maxChunks);
+      return FunctionProfileProcessor.Compute(baseProfile, histogram, filter, maxChunks);
     });
 
     tasks.Add(callTreeTask);
@@ -284,6 +368,57 @@ public class ProfileData {
     return profile;
   }
 
+  // Returns the index of per-block sample aggregates, built on first use
+  // and rebuilt if samples were added since then.
+  public SampleBlockIndex GetSampleBlockIndex() {
+    lock (sampleBlocksLock_) {
+      if (sampleBlocks_ == null || sampleBlocks_.Samples != Samples ||
+          sampleBlocks_.SampleCount != Samples.Count) {
+        sampleBlocks_ = SampleBlockIndex.Build(Samples);
+      }
+
+      return sampleBlocks_;
+    }
+  }
+
+  // Returns the index from the nodes of the current call tree to their samples,
+  // built on first use and rebuilt if the call tree or the samples changed since then.
+  public CallTreeSampleIndex GetCallTreeSampleIndex() {
+    lock (callTreeSamplesLock_) {
+      if (CallTree == null) {
+        return null;
+      }
+
+      if (callTreeSamples_ == null || callTreeSamples_.CallTree != CallTree ||
+          callTreeSamples_.Samples != Samples || callTreeSamples_.SampleCount != Samples.Count) {
+        callTreeSamples_ = CallTreeSampleIndex.Build(Samples, CallTree);
+      }
+
+      return callTreeSamples_;
+    }
+  }
+
+  // Returns the time index of the samples of a thread, or of all threads for -1,
+  // built on first use and rebuilt if the samples changed since then.
+  public SampleTimeIndex GetSampleTimeIndex(int threadId = -1) {
+    lock (sampleTimeIndexLock_) {
+      if (ThreadSampleRanges == null ||
+          !ThreadSampleRanges.Ranges.TryGetValue(threadId, out var ranges)) {
+        return null;
+      }
+
+      sampleTimeIndex_ ??= new Dictionary<int, SampleTimeIndex>();
+
+      if (!sampleTimeIndex_.TryGetValue(threadId, out var index) ||
+          index.Samples != Samples || index.SampleCount != Samples.Count || index.Ranges != ranges) {
+        index = SampleTimeIndex.Build(Samples, ranges, threadId);
+        sampleTimeIndex_[threadId] = index;
+      }
+
+      return index;
+    }
+  }
+
   //? TODO: Port to ProfileSampleProcessor
   public ThreadSampleRanges ComputeThreadSampleRanges() {
     // Compute lists of contiguous range of samples running on the same thread,
@@ -293,10 +428,11 @@ public class ProfileData {
     int sampleIndex = 0;
     int prevThreadId = -1;
     int prevSampleIndex = -1;
-    var sampleSpan = CollectionsMarshal.AsSpan(Samples);
+    int[] contextThreadIds = Samples.ComputeContextThreadIds();
+    var contextIds = Samples.ContextIds;
 
-    for (int i = 0; i < sampleSpan.Length; i++) {
-      int threadId = sampleSpan[i].Stack.Context.ThreadId;
+    for (int i = 0; i < contextIds.Length; i++) {
+      int threadId = contextThreadIds[contextIds[i]];
 
       if (threadId != prevThreadId) {
         if (prevThreadId != -1) {
@@ -360,4 +496,24 @@ public class ThreadSampleRanges {
   }
 
   public Dictionary<int, List<ThreadSampleRange>> Ranges { get; set; }
+
+  // Returns the index of the first range ending after the sample index,
+  // or the number of ranges if there is none.
+  public static int FindRangeIndex(List<ThreadSampleRange> ranges, int sampleIndex) {
+    int low = 0;
+    int high = ranges.Count;
+
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+
+      if (ranges[mid].EndIndex <= sampleIndex) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+
+    return low;
+  }
 }
\ No newline at end of file
@@ -80,6 +80,13 @@ public class ProfileDataReport : IEquatable<ProfileDataReport> {
     }
   }
 
+  // Used to restore the module info saved with a ResolvedProfileCache.
+  public void AddModuleStatus(ModuleStatus status) {
+    lock (this) {
+      moduleStatusMap_[status.ImageFileInfo] = status;
+    }
+  }
+
   public ModuleStatus GetModuleStatus(string moduleName) {
     lock (this) {
       return Modules.Find(
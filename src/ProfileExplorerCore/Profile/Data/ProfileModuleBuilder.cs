@@ -28,7 +28,12 @@ public sealed class ProfileModuleBuilder : IDisposable {
   private ICompilerIRInfo compilerIrInfo_;
   private INameProvider nameProvider_;
   private BinaryFileDescriptor binaryInfo_;
+  // With lazy symbolization, frames are grouped by address bucket
+  // until the debug info is loaded, see GetOrCreateAddressBucketFunction.
+  private const long AddressBucketSize = 0x100;
+  private const int AddressBucketFunctionId = -2;
   private ConcurrentDictionary<long, (IRTextFunction, FunctionDebugInfo)> functionMap_;
+  private ConcurrentDictionary<long, (IRTextFunction, FunctionDebugInfo)> bucketFunctionMap_;
   private ConcurrentDictionary<long, bool> loggedFuncAddresses_ = new();
   private ProfileDataReport report_;
   private ReaderWriterLockSlim lock_;
@@ -45,6 +50,7 @@ public sealed class ProfileModuleBuilder : IDisposable {
     compilerIrInfo_ = compilerInfoProvider.IR;
     nameProvider_ = compilerInfoProvider.NameProvider;
     functionMap_ = new ConcurrentDictionary<long, (IRTextFunction, FunctionDebugInfo)>();
+    bucketFunctionMap_ = new ConcurrentDictionary<long, (IRTextFunction, FunctionDebugInfo)>();
     lock_ = new ReaderWriterLockSlim();
     binaryLoadLock_ = new SemaphoreSlim(1, 1);
   }
@@ -55,6 +61,13 @@ public sealed class ProfileModuleBuilder : IDisposable {
   public bool HasDebugInfo { get; set; }
   public bool Initialized { get; set; }
   public bool IsManaged { get; set; }
+  // Set with lazy symbolization while the debug info is not loaded yet,
+  // functions are then created with GetOrCreateAddressBucketFunction.
+  public bool DebugInfoPending { get; set; }
+
+  public static bool IsAddressBucketFunction(FunctionDebugInfo debugInfo) {
+    return debugInfo.Id == AddressBucketFunctionId;
+  }
 
   public async Task<bool> Initialize(BinaryFileDescriptor binaryInfo,
                                      SymbolFileSourceSettings symbolSettings,
@@ -160,6 +173,33 @@ public sealed class ProfileModuleBuilder : IDisposable {
     return true;
   }
 
+  // Initializes the module when the profile is loaded from a ResolvedProfileCache,
+  // the functions are added with AddCachedFunction and no debug info is loaded.
+  // The binary can still be loaded on-demand like with lazy binary loading.
+  public void InitializeFromCache(BinaryFileDescriptor binaryInfo, SymbolFileSourceSettings symbolSettings) {
+    binaryInfo_ = binaryInfo;
+    symbolSettings_ = symbolSettings;
+    CreateDummyDocument(binaryInfo);
+    Initialized = true;
+  }
+
+  public IRTextFunction AddCachedFunction(FunctionDebugInfo debugInfo) {
+    lock_.EnterWriteLock();
+
+    try {
+      if (functionMap_.TryGetValue(debugInfo.RVA, out var pair)) {
+        return pair.Item1;
+      }
+
+      var func = ModuleDocument.AddDummyFunction(debugInfo.Name);
+      functionMap_.TryAdd(debugInfo.RVA, (func, debugInfo));
+      return func;
+    }
+    finally {
+      lock_.ExitWriteLock();
+    }
+  }
+
   /// <summary>
   /// Loads the binary file on-demand for disassembly view.
   /// Call this when the user wants to view assembly for a function.
@@ -426,6 +466,59 @@ public sealed class ProfileModuleBuilder : IDisposable {
     return pair;
   }
 
+  // Returns a placeholder function for the address range the RVA is part of,
+  // used before the debug info is loaded so that samples can be grouped
+  // without knowing the function boundaries. The frames using it are later
+  // remapped to the functions found in the debug info.
+  public (IRTextFunction Function, FunctionDebugInfo DebugInfo)
+    GetOrCreateAddressBucketFunction(long rva) {
+    long bucketRva = rva & ~(AddressBucketSize - 1);
+
+    if (bucketFunctionMap_.TryGetValue(bucketRva, out var pair)) {
+      return pair;
+    }
+
+    lock_.EnterWriteLock();
+
+    try {
+      if (bucketFunctionMap_.TryGetValue(bucketRva, out pair)) {
+        return pair;
+      }
+
+      // The ID makes it different from a function starting at the same RVA.
+      string name = $"[{bucketRva:X}-{bucketRva + AddressBucketSize - 1:X}]";
+      var debugInfo = new FunctionDebugInfo(name, bucketRva, (uint)AddressBucketSize,
+                                            id: AddressBucketFunctionId);
+      var func = ModuleDocument.AddDummyFunction(name);
+      pair = (func, debugInfo);
+      bucketFunctionMap_.TryAdd(bucketRva, pair);
+      return pair;
+    }
+    finally {
+      lock_.ExitWriteLock();
+    }
+  }
+
+  // Removes the placeholder functions from the module after
+  // all frames using them were remapped to the debug info functions.
+  public void RemoveAddressBucketFunctions() {
+    lock_.EnterWriteLock();
+
+    try {
+      var functions = new HashSet<IRTextFunction>();
+
+      foreach (var pair in bucketFunctionMap_.Values) {
+        functions.Add(pair.Item1);
+      }
+
+      ModuleDocument.RemoveDummyFunctions(functions);
+      bucketFunctionMap_.Clear();
+    }
+    finally {
+      lock_.ExitWriteLock();
+    }
+  }
+
 #if DEBUG
   public static void PrintStatistics() {
     Trace.WriteLine($"FuncQueries: {FuncQueries}");
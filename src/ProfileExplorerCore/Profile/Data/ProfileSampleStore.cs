@@ -0,0 +1,263 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Columnar (struct-of-arrays) storage for the resolved samples of a profile.
+// Each sample field is kept in a separate array so that the per-sample loops
+// of the ProfileSampleProcessor subclasses touch only the columns they need,
+// sequentially, instead of pointer-chasing a (ProfileSample, ResolvedProfileStack) tuple.
+// The stack and context columns are indices into dense tables shared by all samples.
+public sealed class ProfileSampleStore : IEnumerable<(ProfileSample Sample, ResolvedProfileStack Stack)> {
+  private const int DefaultCapacity = 1024;
+  private long[] ips_;
+  private long[] times_; // TimeSpan ticks.
+  private long[] weights_; // TimeSpan ticks.
+  private int[] stackIds_;
+  private int[] contextIds_;
+  private int count_;
+  private List<ProfileContext> contexts_;
+  private Dictionary<ProfileContext, int> contextMap_;
+
+  public ProfileSampleStore(int capacity = 0) :
+    this(new ResolvedProfileStackTable(), capacity) {
+  }
+
+  // Creates a store that shares the stack table with another store,
+  // used to build per-chunk stores that are later appended together.
+  public ProfileSampleStore(ResolvedProfileStackTable stacks, int capacity = 0) {
+    Stacks = stacks;
+    contexts_ = new List<ProfileContext>();
+    contextMap_ = new Dictionary<ProfileContext, int>();
+    AllocateColumns(capacity);
+  }
+
+  public int Count => count_;
+  public ResolvedProfileStackTable Stacks { get; }
+  public IReadOnlyList<ProfileContext> Contexts => contexts_;
+  public ReadOnlySpan<long> IPs => ips_.AsSpan(0, count_);
+  public ReadOnlySpan<long> Times => times_.AsSpan(0, count_);
+  public ReadOnlySpan<long> Weights => weights_.AsSpan(0, count_);
+  public ReadOnlySpan<int> StackIds => stackIds_.AsSpan(0, count_);
+  public ReadOnlySpan<int> ContextIds => contextIds_.AsSpan(0, count_);
+
+  public (ProfileSample Sample, ResolvedProfileStack Stack) this[int index] {
+    get {
+      Debug.Assert(index >= 0 && index < count_);
+      var sample = new ProfileSample(ips_[index], TimeSpan.FromTicks(times_[index]),
+                                     TimeSpan.FromTicks(weights_[index]), false, contextIds_[index]) {
+        StackId = stackIds_[index]
+      };
+
+      return (sample, Stacks[stackIds_[index]]);
+    }
+  }
+
+  public TimeSpan TimeAt(int index) {
+    return TimeSpan.FromTicks(times_[index]);
+  }
+
+  public TimeSpan WeightAt(int index) {
+    return TimeSpan.FromTicks(weights_[index]);
+  }
+
+  public ResolvedProfileStack StackAt(int index) {
+    return Stacks[stackIds_[index]];
+  }
+
+  public ProfileContext ContextAt(int index) {
+    return contexts_[contextIds_[index]];
+  }
+
+  public int[] ComputeContextThreadIds() {
+    // Mapping from context index to thread ID, small enough to stay in cache
+    // while scanning the context column to filter by thread.
+    int[] threadIds = new int[contexts_.Count];
+
+    for (int i = 0; i < contexts_.Count; i++) {
+      threadIds[i] = contexts_[i].ThreadId;
+    }
+
+    return threadIds;
+  }
+
+  public void Add((ProfileSample Sample, ResolvedProfileStack Stack) item) {
+    Add(item.Sample, item.Stack);
+  }
+
+  public void Add(ProfileSample sample, ResolvedProfileStack stack) {
+    Add(sample, Stacks.Register(stack), stack.Context);
+  }
+
+  public void Add(ProfileSample sample, int stackId, ProfileContext context) {
+    if (count_ == times_.Length) {
+      EnsureCapacity(count_ + 1);
+    }
+
+    ips_[count_] = sample.IP;
+    times_[count_] = sample.Time.Ticks;
+    weights_[count_] = sample.Weight.Ticks;
+    stackIds_[count_] = stackId;
+    contextIds_[count_] = GetOrAddContext(context);
+    count_++;
+  }
+
+  public void AddRange(ProfileSampleStore other) {
+    AddRange(other, 0, other.count_);
+  }
+
+  // Appends the samples in the [start, start + count) range of the other store.
+  public void AddRange(ProfileSampleStore other, int start, int count) {
+    Debug.Assert(ReferenceEquals(Stacks, other.Stacks));
+    Debug.Assert(start >= 0 && start + count <= other.count_);
+    EnsureCapacity(count_ + count);
+    other.IPs.Slice(start, count).CopyTo(ips_.AsSpan(count_));
+    other.Times.Slice(start, count).CopyTo(times_.AsSpan(count_));
+    other.Weights.Slice(start, count).CopyTo(weights_.AsSpan(count_));
+    other.StackIds.Slice(start, count).CopyTo(stackIds_.AsSpan(count_));
+
+    // The context tables are per-store, remap the indices.
+    int[] contextMap = new int[other.contexts_.Count];
+
+    for (int i = 0; i < contextMap.Length; i++) {
+      contextMap[i] = GetOrAddContext(other.contexts_[i]);
+    }
+
+    var otherContextIds = other.ContextIds.Slice(start, count);
+
+    for (int i = 0; i < otherContextIds.Length; i++) {
+      contextIds_[count_ + i] = contextMap[otherContextIds[i]];
+    }
+
+    count_ += count;
+  }
+
+  // Appends samples given as columns, the context IDs are indices
+  // into the contexts list and the stacks must already be registered.
+  public void AddColumns(ReadOnlySpan<long> ips, ReadOnlySpan<long> times, ReadOnlySpan<long> weights,
+                         ReadOnlySpan<int> stackIds, ReadOnlySpan<int> contextIds,
+                         IReadOnlyList<ProfileContext> contexts) {
+    EnsureCapacity(count_ + times.Length);
+    ips.CopyTo(ips_.AsSpan(count_));
+    times.CopyTo(times_.AsSpan(count_));
+    weights.CopyTo(weights_.AsSpan(count_));
+    stackIds.CopyTo(stackIds_.AsSpan(count_));
+    int[] contextMap = new int[contexts.Count];
+
+    for (int i = 0; i < contextMap.Length; i++) {
+      contextMap[i] = GetOrAddContext(contexts[i]);
+    }
+
+    for (int i = 0; i < contextIds.Length; i++) {
+      contextIds_[count_ + i] = contextMap[contextIds[i]];
+    }
+
+    count_ += times.Length;
+  }
+
+  public void EnsureCapacity(int capacity) {
+    if (capacity <= times_.Length) {
+      return;
+    }
+
+    int newCapacity = Math.Max(capacity, Math.Max(DefaultCapacity, times_.Length * 2));
+    Array.Resize(ref ips_, newCapacity);
+    Array.Resize(ref times_, newCapacity);
+    Array.Resize(ref weights_, newCapacity);
+    Array.Resize(ref stackIds_, newCapacity);
+    Array.Resize(ref contextIds_, newCapacity);
+  }
+
+  public void TrimExcess() {
+    if (count_ < times_.Length) {
+      Array.Resize(ref ips_, count_);
+      Array.Resize(ref times_, count_);
+      Array.Resize(ref weights_, count_);
+      Array.Resize(ref stackIds_, count_);
+      Array.Resize(ref contextIds_, count_);
+    }
+  }
+
+  public void SortByTime() {
+    if (IsSortedByTime()) {
+      return;
+    }
+
+    // Sort a permutation using the time column as the key,
+    // then gather all the columns in the new order.
+    long[] keys = Times.ToArray();
+    int[] order = new int[count_];
+
+    for (int i = 0; i < count_; i++) {
+      order[i] = i;
+    }
+
+    Array.Sort(keys, order);
+    times_ = keys;
+    ips_ = Gather(ips_, order);
+    weights_ = Gather(weights_, order);
+    stackIds_ = Gather(stackIds_, order);
+    contextIds_ = Gather(contextIds_, order);
+  }
+
+  public void Clear() {
+    count_ = 0;
+    contexts_.Clear();
+    contextMap_.Clear();
+    AllocateColumns(0);
+  }
+
+  public IEnumerator<(ProfileSample Sample, ResolvedProfileStack Stack)> GetEnumerator() {
+    for (int i = 0; i < count_; i++) {
+      yield return this[i];
+    }
+  }
+
+  IEnumerator IEnumerable.GetEnumerator() {
+    return GetEnumerator();
+  }
+
+  private bool IsSortedByTime() {
+    var times = Times;
+
+    for (int i = 1; i < times.Length; i++) {
+      if (times[i] < times[i - 1]) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  private static T[] Gather<T>(T[] column, int[] order) {
+    var result = new T[order.Length];
+
+    for (int i = 0; i < order.Length; i++) {
+      result[i] = column[order[i]];
+    }
+
+    return result;
+  }
+
+  private int GetOrAddContext(ProfileContext context) {
+    if (!contextMap_.TryGetValue(context, out int contextId)) {
+      contextId = contexts_.Count;
+      contexts_.Add(context);
+      contextMap_[context] = contextId;
+    }
+
+    return contextId;
+  }
+
+  private void AllocateColumns(int capacity) {
+    ips_ = new long[capacity];
+    times_ = new long[capacity];
+    weights_ = new long[capacity];
+    stackIds_ = new int[capacity];
+    contextIds_ = new int[capacity];
+  }
+}
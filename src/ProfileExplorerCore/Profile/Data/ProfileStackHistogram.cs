@@ -0,0 +1,39 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Total weight and sample index range of each unique stack for a set of samples,
+// indexed by the stack ID. Since the call tree and function profile updates are linear
+// in the sample weight, both can be computed from the histogram instead of the samples.
+public sealed class ProfileStackHistogram {
+  public ProfileStackHistogram(int stackCount) {
+    Weights = new long[stackCount];
+    FirstSampleIndex = new int[stackCount];
+    LastSampleIndex = new int[stackCount];
+    Array.Fill(FirstSampleIndex, int.MaxValue);
+    Array.Fill(LastSampleIndex, -1);
+  }
+
+  public int Count => Weights.Length;
+  public long[] Weights { get; }
+  public int[] FirstSampleIndex { get; }
+  public int[] LastSampleIndex { get; }
+
+  // A stack can be referenced only by samples with a zero weight,
+  // presence is tracked through the sample index range.
+  public bool HasStack(int stackId) {
+    return LastSampleIndex[stackId] >= 0;
+  }
+
+  public void Add(int stackId, long weight, int sampleIndex) {
+    Add(stackId, weight, sampleIndex, sampleIndex);
+  }
+
+  public void Add(int stackId, long weight, int firstSampleIndex, int lastSampleIndex) {
+    Weights[stackId] += weight;
+    FirstSampleIndex[stackId] = Math.Min(FirstSampleIndex[stackId], firstSampleIndex);
+    LastSampleIndex[stackId] = Math.Max(LastSampleIndex[stackId], lastSampleIndex);
+  }
+}
@@ -17,7 +17,8 @@ namespace ProfileExplorer.Core.Profile.Data;
 [ProtoContract(SkipConstructor = true)]
 public class RawProfileData : IDisposable {
   private static ProfileContext tempContext_ = new();
-  private static ProfileStack tempStack_ = new();
+  private const int MinSampleMorselLength = 8 * 1024;
+  private const int MaxSampleMorselLength = 64 * 1024;
 
   // Per-thread caches to speed up lookups.
   [ThreadStatic]
@@ -36,7 +37,7 @@ public class RawProfileData : IDisposable {
     globalIpImageCache_ = null;
   }
   [ProtoMember(1)]
-  private List<ProfileSample> samples_;
+  private CompressedSegmentedList<ProfileSample> samples_;
   [ProtoMember(2)]
   private Dictionary<int, ProfileProcess> processes_;
   [ProtoMember(3)]
@@ -53,17 +54,15 @@ public class RawProfileData : IDisposable {
   private CompressedSegmentedList<PerformanceCounterEvent> perfCountersEvents_;
   [ProtoMember(9)]
   private ProfileTraceInfo traceInfo_;
+  private StackFrameArena stackFrames_;
 
   // Objects used only while building the profile.
   private Dictionary<ProfileThread, int> threadsMap_;
   private Dictionary<ProfileContext, int> contextsMap_;
   private Dictionary<ProfileImage, int> imagesMap_;
-  private Dictionary<int, Dictionary<ProfileStack, int>> stacksMap_;
+  private Dictionary<(int ContextId, int KernelStackId, int UserStackId), int> stacksMap_;
   private Dictionary<int, Dictionary<long, SymbolFileDescriptor>> imageSymbols_;
-  private HashSet<long[]> stackData_;
   private Dictionary<int, ManagedRawProfileData> procManagedDataMap_;
-  private Dictionary<ProfileStack, int> lastProcStacks_;
-  private int lastProcId_;
 
   public RawProfileData(string tracePath, bool handlesDotNetEvents = false) {
     traceInfo_ = new ProfileTraceInfo(tracePath);
@@ -75,9 +74,9 @@ public class RawProfileData : IDisposable {
     threads_ = new List<ProfileThread>();
     threadsMap_ = new Dictionary<ProfileThread, int>();
     stacks_ = new List<ProfileStack>();
-    stacksMap_ = new Dictionary<int, Dictionary<ProfileStack, int>>();
-    stackData_ = new HashSet<long[]>(new StackComparer());
-    samples_ = new List<ProfileSample>();
+    stacksMap_ = new Dictionary<(int ContextId, int KernelStackId, int UserStackId), int>();
+    stackFrames_ = new StackFrameArena();
+    samples_ = new CompressedSegmentedList<ProfileSample>();
     perfCounters_ = new List<PerformanceCounter>();
     imageSymbols_ = new Dictionary<int, Dictionary<long, SymbolFileDescriptor>>();
 
@@ -87,15 +86,20 @@ public class RawProfileData : IDisposable {
   }
 
   public ProfileTraceInfo TraceInfo => traceInfo_;
-  public List<ProfileSample> Samples => samples_;
+  public CompressedSegmentedList<ProfileSample> Samples => samples_;
   public List<ProfileProcess> Processes => processes_.ToValueList();
   public List<ProfileThread> Threads => threads_;
   public List<ProfileImage> Images => images_;
   public CompressedSegmentedList<PerformanceCounterEvent> PerformanceCountersEvents => perfCountersEvents_;
   public List<PerformanceCounter> PerformanceCounters => perfCounters_;
   public bool HasPerformanceCountersEvents => PerformanceCountersEvents is {Count: > 0};
+  // If the PMU counters were used as sampling sources instead of separate counting events,
+  // the trace has no counter events and each sample is an event of every counter.
+  public bool UsesSamplesAsPerformanceCounterEvents => !HasPerformanceCountersEvents && perfCounters_.Count > 0;
+  public bool HasPerformanceCounterData => HasPerformanceCountersEvents || UsesSamplesAsPerformanceCounterEvents;
 
   public void Dispose() {
+    samples_.Dispose();
     perfCountersEvents_?.Dispose();
   }
 
@@ -109,6 +113,15 @@ public class RawProfileData : IDisposable {
     return Math.Min(chunkSize, samples_.Count);
   }
 
+  // Length of the sample ranges taken on demand by the sample processing workers,
+  // see MorselScheduler. It's a multiple of the segment length of the compressed samples,
+  // so that each segment is decompressed by a single worker.
+  public int ComputeSampleMorselLength(int workers) {
+    int morselSize = MorselScheduler.ComputeMorselSize(samples_.Count, workers,
+                                                       MinSampleMorselLength, MaxSampleMorselLength);
+    return CompressedSegmentedList<ProfileSample>.RoundUpToSegmentLength(morselSize);
+  }
+
   public int ComputePerfCounterChunkLength(int chunks) {
     if (perfCountersEvents_ == null) {
       return 0;
@@ -285,10 +298,10 @@ public class RawProfileData : IDisposable {
     contextsMap_ = null;
     imagesMap_ = null;
     threadsMap_ = null;
-    stackData_ = null;
-    lastProcStacks_ = null;
+    stackFrames_.LoadingCompleted();
 
     // Wait for any compression tasks.
+    samples_.Wait();
     perfCountersEvents_?.Wait();
   }
 
@@ -404,7 +417,7 @@ public class RawProfileData : IDisposable {
   public void SetSampleStack(int sampleId, int stackId, int contextId) {
     // Change the stack ID in-place in the array.
     Debug.Assert(samples_[sampleId - 1].ContextId == contextId);
-    CollectionsMarshal.AsSpan(samples_)[sampleId - 1].StackId = stackId;
+    samples_.GetValueRef(sampleId - 1).StackId = stackId;
   }
 
   public int AddPerformanceCounter(PerformanceCounter counter) {
@@ -424,54 +437,24 @@ public class RawProfileData : IDisposable {
     return contexts_[id - 1];
   }
 
-  public int AddStack(ProfileStack stack, ProfileContext context) {
-    Debug.Assert(stack.ContextId != 0);
-    Dictionary<ProfileStack, int> procStacks = null;
-
-    if (lastProcId_ == context.ProcessId && lastProcStacks_ != null) {
-      procStacks = lastProcStacks_;
-    }
-    else {
-      if (!stacksMap_.TryGetValue(context.ProcessId, out procStacks)) {
-        procStacks = new Dictionary<ProfileStack, int>();
-        stacksMap_[context.ProcessId] = procStacks;
-      }
-
-      lastProcId_ = context.ProcessId;
-      lastProcStacks_ = procStacks;
-    }
+  // Adds the frames of a kernel or user mode stack part, identical parts are stored once.
+  public int AddStackFrames(ReadOnlySpan<long> frames) {
+    return stackFrames_.Add(frames);
+  }
 
-    if (!procStacks.TryGetValue(stack, out int existingStackId)) {
-      // De-duplicate the stack frame pointer array,
-      // since lots of samples have identical stacks.
-      if (!stackData_.TryGetValue(stack.FramePointers, out long[] framePtrData)) {
-        // Make a clone since the temporary stack uses a static array.
-        framePtrData = stack.CloneFramePointers();
-        stackData_.Add(framePtrData);
-      }
+  public int AddStack(int contextId, int kernelStackId, int userStackId) {
+    Debug.Assert(contextId != 0);
+    ref int existingStackId = ref CollectionsMarshal.GetValueRefOrAddDefault(stacksMap_,
+      (contextId, kernelStackId, userStackId), out bool exists);
 
-      var newStack = new ProfileStack(stack.ContextId, framePtrData);
-      stacks_.Add(newStack);
-      procStacks[newStack] = stacks_.Count;
+    if (!exists) {
+      stacks_.Add(new ProfileStack(contextId, kernelStackId, userStackId, stackFrames_));
       existingStackId = stacks_.Count;
     }
-    else {
-      Debug.Assert(stack == FindStack(existingStackId));
-    }
 
-    stack.Discard();
     return existingStackId;
   }
 
-  public void ReplaceStackFramePointers(ProfileStack stack, long[] newFramePtrs, ProfileContext context) {
-    if (stacksMap_.TryGetValue(context.ProcessId, out var procStacks)) {
-      procStacks.Remove(stack);
-    }
-
-    stack.FramePointers = newFramePtrs;
-    AddStack(stack, context);
-  }
-
   public ProfileStack FindStack(int id) {
     Debug.Assert(id > 0 && id <= stacks_.Count);
     return stacks_[id - 1];
@@ -522,21 +505,7 @@ public class RawProfileData : IDisposable {
       return lastIpImage_;
     }
 
-    ipImageCache_ ??= new List<(int ProcessId, IpToImageCache Cache)>();
-    IpToImageCache cache = null;
-
-    foreach (var entry in ipImageCache_) {
-      if (entry.ProcessId == processId) {
-        cache = entry.Cache;
-        break;
-      }
-    }
-
-    if (cache == null) {
-      var process = GetOrCreateProcess(processId);
-      cache = IpToImageCache.Create(process.Images(this));
-      ipImageCache_.Add((processId, cache));
-    }
+    var cache = GetIpImageCache(processId);
 
     if (!cache.IsValidAddres(ip)) {
       return null;
@@ -553,6 +522,30 @@ public class RawProfileData : IDisposable {
     return null;
   }
 
+  // Resolves the images of a span of IPs, such as the frames of a stack, in one call.
+  // Kernel addresses are looked up in the images of the kernel process.
+  public void FindImagesForIPs(ReadOnlySpan<long> ips, int processId, Span<ProfileImage> images) {
+    Debug.Assert(images.Length >= ips.Length);
+    int pointerSize = traceInfo_.PointerSize;
+    int start = 0;
+
+    // Kernel frames are usually a contiguous run at the top of the stack,
+    // resolve each run of same-kind addresses as a batch.
+    while (start < ips.Length) {
+      bool isKernel = ETWEventProcessor.IsKernelAddress((ulong)ips[start], pointerSize);
+      int end = start + 1;
+
+      while (end < ips.Length &&
+             ETWEventProcessor.IsKernelAddress((ulong)ips[end], pointerSize) == isKernel) {
+        end++;
+      }
+
+      var cache = GetIpImageCache(isKernel ? ETWEventProcessor.KernelProcessId : processId);
+      cache.Find(ips[start..end], images[start..end]);
+      start = end;
+    }
+  }
+
   public ProfileImage FindImageForIP(long ip) {
     if (globalIpImageCache_ == null) {
       // Per-thread, no locks needed.
@@ -648,18 +641,19 @@ public class RawProfileData : IDisposable {
     return existingContextId;
   }
 
-  internal ProfileStack RentTemporaryStack(int frameCount, int contextId) {
-    tempStack_.SetTempFramePointers(frameCount);
-    tempStack_.ContextId = contextId;
-    return tempStack_;
-  }
-
-  internal void ReturnStack(int stackId) {
-    var stack = FindStack(stackId);
+  private IpToImageCache GetIpImageCache(int processId) {
+    ipImageCache_ ??= new List<(int ProcessId, IpToImageCache Cache)>();
 
-    if (ReferenceEquals(stack, tempStack_)) {
-      tempStack_ = new ProfileStack();
+    foreach (var entry in ipImageCache_) {
+      if (entry.ProcessId == processId) {
+        return entry.Cache;
+      }
     }
+
+    var process = GetOrCreateProcess(processId);
+    var cache = IpToImageCache.Create(process.Images(this));
+    ipImageCache_.Add((processId, cache));
+    return cache;
   }
 
   private ManagedRawProfileData GetOrCreateManagedData(int processId) {
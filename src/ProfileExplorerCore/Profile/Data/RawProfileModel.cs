@@ -120,43 +120,63 @@ public struct PerformanceCounterEvent : IEquatable<PerformanceCounterEvent> {
 
 [ProtoContract(SkipConstructor = true)]
 public class ProfileStack : IEquatable<ProfileStack> {
-  private const int MaxFrameNumber = 512;
-  private static long[][] TempFrameArrays = new long[MaxFrameNumber + 1][];
   public static readonly ProfileStack Unknown = new();
   private object optionalData_;
-
-  static ProfileStack() {
-    // The frame ptr. array is being interned (unique instance)
-    // later, use a pre-allocated array initially to reduce GC pressure.
-    // Note: this also means creating ProfileStack must be single-threaded.
-    for (int i = 0; i <= MaxFrameNumber; i++) {
-      TempFrameArrays[i] = new long[i];
-    }
-  }
+  private StackFrameArena frameArena_;
 
   public ProfileStack() {
     FramePointers = null;
     ContextId = 0;
   }
 
-  public ProfileStack(int contextId, int frameCount) {
+  public ProfileStack(int contextId, long[] framePtrs) {
     ContextId = contextId;
-    FramePointers = RentArray(frameCount);
+    FramePointers = framePtrs;
   }
 
-  public ProfileStack(int contextId, long[] framePtrs) {
+  // Stack of a trace, made of a kernel mode and a user mode part stored in the
+  // frame arena of the trace. Either part can be missing (EmptyStackId), the parts
+  // are shared by all stacks using them and are never concatenated.
+  public ProfileStack(int contextId, int kernelStackId, int userStackId, StackFrameArena frameArena) {
     ContextId = contextId;
-    FramePointers = framePtrs;
+    KernelStackId = kernelStackId;
+    UserStackId = userStackId;
+    frameArena_ = frameArena;
+    UserModeTransitionIndex = frameArena.GetFrameCount(kernelStackId); // Frames after index are user mode.
   }
 
+  // Frames of a stack not stored in a frame arena.
   [ProtoMember(1)]
   public long[] FramePointers { get; set; }
   [ProtoMember(2)]
   public int ContextId { get; set; }
   [ProtoMember(3)]
   public int UserModeTransitionIndex { get; set; }
-  public bool IsUnknown => FramePointers == null;
-  public int FrameCount => FramePointers.Length;
+  public int KernelStackId { get; }
+  public int UserStackId { get; }
+  public bool IsUnknown => FramePointers == null && frameArena_ == null;
+  public int FrameCount => frameArena_ != null ?
+    UserModeTransitionIndex + frameArena_.GetFrameCount(UserStackId) : FramePointers.Length;
+
+  // Frames are ordered from the leaf, the kernel mode frames being first.
+  public long GetFrame(int index) {
+    if (frameArena_ == null) {
+      return FramePointers[index];
+    }
+
+    return index < UserModeTransitionIndex ? frameArena_.GetFrames(KernelStackId)[index] :
+      frameArena_.GetFrames(UserStackId)[index - UserModeTransitionIndex];
+  }
+
+  public void CopyFrames(Span<long> frames) {
+    if (frameArena_ == null) {
+      FramePointers.CopyTo(frames);
+      return;
+    }
+
+    frameArena_.GetFrames(KernelStackId).CopyTo(frames);
+    frameArena_.GetFrames(UserStackId).CopyTo(frames.Slice(UserModeTransitionIndex));
+  }
 
   public bool Equals(ProfileStack other) {
     Debug.Assert(other != null);
@@ -165,10 +185,13 @@ public class ProfileStack : IEquatable<ProfileStack> {
       return true;
     }
 
-    // FramePointers is allocated using interning, ref. equality is sufficient.
+    // FramePointers and the arena stacks are unique, ref./ID equality is sufficient.
     return ContextId == other.ContextId &&
            UserModeTransitionIndex == other.UserModeTransitionIndex &&
-           FramePointers == other.FramePointers;
+           FramePointers == other.FramePointers &&
+           KernelStackId == other.KernelStackId &&
+           UserStackId == other.UserStackId &&
+           frameArena_ == other.frameArena_;
   }
 
   public static bool operator ==(ProfileStack left, ProfileStack right) {
@@ -189,22 +212,8 @@ public class ProfileStack : IEquatable<ProfileStack> {
     Interlocked.MemoryBarrier();
   }
 
-  public long[] CloneFramePointers() {
-    long[] clone = new long[FramePointers.Length];
-    FramePointers.CopyTo(clone, 0);
-    return clone;
-  }
-
-  public void SetTempFramePointers(int frameCount) {
-    FramePointers = RentArray(frameCount);
-  }
-
   public ProfileImage FindImageForFrame(int frameIndex, RawProfileData profileData) {
-    return profileData.FindImageForIP(FramePointers[frameIndex], profileData.FindContext(ContextId));
-  }
-
-  public void Discard() {
-    ReturnArray(FramePointers);
+    return profileData.FindImageForIP(GetFrame(frameIndex), profileData.FindContext(ContextId));
   }
 
   public override bool Equals(object obj) {
@@ -212,6 +221,10 @@ public class ProfileStack : IEquatable<ProfileStack> {
   }
 
   public override int GetHashCode() {
+    if (frameArena_ != null) {
+      return HashCode.Combine(KernelStackId, UserStackId, ContextId);
+    }
+
     int framePtrHash = StackComparer.ComputeHashCode(FramePointers);
     return HashCode.Combine(framePtrHash, ContextId);
   }
@@ -219,32 +232,6 @@ public class ProfileStack : IEquatable<ProfileStack> {
   public override string ToString() {
     return $"#{FrameCount}, ContextId: {ContextId}";
   }
-
-  private long[] RentArray(int frameCount) {
-    // In most cases one of the pre-allocated temporary arrays can be used.
-    long[] array;
-
-    if (frameCount <= MaxFrameNumber) {
-      array = TempFrameArrays[frameCount];
-#if DEBUG
-      Debug.Assert(array != null);
-      TempFrameArrays[frameCount] = null;
-#endif
-    }
-    else {
-      array = new long[frameCount];
-    }
-
-    return array;
-  }
-
-  private void ReturnArray(long[] array) {
-#if DEBUG
-    if (array.Length <= MaxFrameNumber) {
-      TempFrameArrays[array.Length] = array;
-    }
-#endif
-  }
 }
 
 [ProtoContract(SkipConstructor = true)]
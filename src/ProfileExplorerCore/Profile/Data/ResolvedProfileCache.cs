@@ -0,0 +1,404 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Linq;
+using System.Text;
+using System.Threading.Tasks;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.FileFormat;
+using ProfileExplorer.Core.Settings;
+using ProfileExplorer.Core.Utilities;
+using ProtoBuf;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Identifies the trace and the loading options a resolved profile cache was created for,
+// the cache is used only if all of them match the current trace load.
+[ProtoContract(SkipConstructor = true)]
+public class ResolvedProfileCacheKey : IEquatable<ResolvedProfileCacheKey> {
+  [ProtoMember(1)]
+  public string TracePath { get; set; }
+  [ProtoMember(2)]
+  public long TraceSize { get; set; }
+  [ProtoMember(3)]
+  public long TraceLastWriteTime { get; set; }
+  [ProtoMember(4)]
+  public List<int> ProcessIds { get; set; }
+  [ProtoMember(5)]
+  public byte[] SettingsHash { get; set; }
+
+  public static ResolvedProfileCacheKey Create(string tracePath, List<int> processIds,
+                                               ProfileDataProviderOptions options,
+                                               SymbolFileSourceSettings symbolSettings) {
+    var fileInfo = new FileInfo(tracePath);
+    var sortedProcessIds = new List<int>(processIds);
+    sortedProcessIds.Sort();
+
+    return new ResolvedProfileCacheKey {
+      TracePath = fileInfo.FullName,
+      TraceSize = fileInfo.Length,
+      TraceLastWriteTime = fileInfo.LastWriteTimeUtc.Ticks,
+      ProcessIds = sortedProcessIds,
+      SettingsHash = ComputeSettingsHash(options, symbolSettings)
+    };
+  }
+
+  private static byte[] ComputeSettingsHash(ProfileDataProviderOptions options,
+                                            SymbolFileSourceSettings symbolSettings) {
+    // Include only the options that can change the resolved functions,
+    // the settings objects also hold state updated after each load (previous sessions, rejected files).
+    var sb = new StringBuilder();
+    sb.AppendLine($"{options.IncludeKernelEvents} {options.IncludePerformanceCounters} {options.MarkInlinedFunctions}");
+    sb.AppendLine(options.HasBinarySearchPaths ? string.Join(";", options.BinarySearchPaths) : "");
+    sb.AppendLine(options.HasBinaryNameAllowedList ? string.Join(";", options.BinaryNameAllowedList) : "");
+    sb.AppendLine(string.Join(";", symbolSettings.SymbolPaths));
+    sb.AppendLine($"{symbolSettings.SourceServerEnabled} {symbolSettings.UseEnvironmentVarSymbolPaths} " +
+                  $"{symbolSettings.IncludeSymbolSubdirectories} {symbolSettings.SkipLowSampleModules} " +
+                  $"{symbolSettings.LowSampleModuleCutoff} {symbolSettings.WindowsPathFilterEnabled} " +
+                  $"{symbolSettings.AllowApproximateBinaryMatch}");
+    sb.AppendLine(symbolSettings.HasCompanyFilter ? string.Join(";", symbolSettings.CompanyFilterStrings) : "");
+    return CompressionUtils.CreateSHA256(sb.ToString());
+  }
+
+  public bool Equals(ResolvedProfileCacheKey other) {
+    if (ReferenceEquals(null, other)) {
+      return false;
+    }
+
+    if (ReferenceEquals(this, other)) {
+      return true;
+    }
+
+    return string.Equals(TracePath, other.TracePath, StringComparison.OrdinalIgnoreCase) &&
+           TraceSize == other.TraceSize &&
+           TraceLastWriteTime == other.TraceLastWriteTime &&
+           ProcessIds.SequenceEqual(other.ProcessIds) &&
+           SettingsHash.AsSpan().SequenceEqual(other.SettingsHash);
+  }
+
+  public override bool Equals(object obj) {
+    return obj is ResolvedProfileCacheKey other && Equals(other);
+  }
+
+  public override int GetHashCode() {
+    return HashCode.Combine(TracePath, TraceSize, TraceLastWriteTime);
+  }
+
+  public override string ToString() {
+    return $"{TracePath}, size: {TraceSize}, processes: {string.Join(", ", ProcessIds)}";
+  }
+}
+
+// On-disk cache of a profile after ETW parsing and stack symbolization,
+// stored in a FileArchive in the app's cache directory. Reloading the profile from it
+// skips reading the trace and the debug files entirely.
+// The stacks are saved as the prefix tree of the ResolvedProfileStackTable
+// and the samples as the ProfileSampleStore columns, both flat arrays.
+// The function profiles and call tree are recomputed from the samples after loading.
+[ProtoContract(SkipConstructor = true)]
+public class ResolvedProfileCache {
+  private static int CurrentFileVersion = 1;
+  private static int MinSupportedFileVersion = 1;
+  private const string CacheFileExtension = ".pecache";
+  private const string CacheFileEntry = "profile";
+  [ProtoMember(1)]
+  public int Version { get; set; }
+  [ProtoMember(2)]
+  public ResolvedProfileCacheKey Key { get; set; }
+  [ProtoMember(3)]
+  public ProfileTraceInfo TraceInfo { get; set; }
+  [ProtoMember(4)]
+  public ProfileProcess Process { get; set; }
+  [ProtoMember(5)]
+  public List<ProfileThread> Threads { get; set; }
+  [ProtoMember(6)]
+  public List<ProfileImage> Images { get; set; }
+  [ProtoMember(7)]
+  public List<int> ProfileModuleIds { get; set; } // Images in ProfileData.Modules.
+  [ProtoMember(8)]
+  public List<ProfileDataReport.ModuleStatus> ModuleStatus { get; set; }
+  [ProtoMember(9)]
+  public List<CachedFunction> Functions { get; set; }
+  [ProtoMember(10)]
+  public List<CachedFrameDetails> FrameDetails { get; set; }
+  [ProtoMember(11, IsPacked = true)]
+  public int[] FrameDetailsIds { get; set; }
+  [ProtoMember(12, IsPacked = true)]
+  public long[] FrameIPs { get; set; }
+  [ProtoMember(13, IsPacked = true)]
+  public long[] FrameRVAs { get; set; }
+  [ProtoMember(14, IsPacked = true)]
+  public int[] NodeParents { get; set; }
+  [ProtoMember(15, IsPacked = true)]
+  public int[] NodeFrames { get; set; }
+  [ProtoMember(16)]
+  public List<ProfileContext> Contexts { get; set; }
+  [ProtoMember(17, IsPacked = true)]
+  public int[] StackNodes { get; set; }
+  [ProtoMember(18, IsPacked = true)]
+  public int[] StackContextIds { get; set; }
+  [ProtoMember(19, IsPacked = true)]
+  public long[] SampleIPs { get; set; }
+  [ProtoMember(20, IsPacked = true)]
+  public long[] SampleTimes { get; set; }
+  [ProtoMember(21, IsPacked = true)]
+  public long[] SampleWeights { get; set; }
+  [ProtoMember(22, IsPacked = true)]
+  public int[] SampleStackIds { get; set; }
+  [ProtoMember(23, IsPacked = true)]
+  public int[] SampleContextIds { get; set; }
+
+  public static string DefaultCacheDirectoryPath => Path.Combine(Path.GetTempPath(), "ProfileExplorer", "profilecache");
+
+  // The cache is saved in the app's cache directory instead of next to the trace,
+  // which may be read-only or shared. The file name includes a hash of the full trace path
+  // to separate traces with the same name, the key is still checked when loading.
+  public static string MakeCacheFilePath(string tracePath, string directoryPath) {
+    string fullPath = Path.GetFullPath(tracePath).ToLowerInvariant();
+    byte[] pathHash = CompressionUtils.CreateSHA256(fullPath);
+    string fileName = $"{Path.GetFileName(tracePath)}-{Convert.ToHexString(pathHash, 0, 8)}{CacheFileExtension}";
+    return Path.Combine(directoryPath, fileName);
+  }
+
+  public static ResolvedProfileCache Create(ResolvedProfileCacheKey key, ProfileData profile,
+                                            ProfileDataReport report) {
+    var cache = new ResolvedProfileCache {
+      Key = key,
+      TraceInfo = report.TraceInfo,
+      Process = profile.Process,
+      Threads = profile.Threads.Values.ToList(),
+      ProfileModuleIds = profile.Modules.Keys.ToList(),
+      ModuleStatus = report.Modules,
+      Functions = new List<CachedFunction>(),
+      FrameDetails = new List<CachedFrameDetails>(),
+      Contexts = new List<ProfileContext>()
+    };
+
+    var images = new Dictionary<int, ProfileImage>(profile.Modules);
+    var contextMap = new Dictionary<ProfileContext, int>();
+    var functionMap = new Dictionary<IRTextFunction, int>(ReferenceEqualityComparer.Instance);
+    var detailsMap = new Dictionary<ResolvedProfileStackFrameDetails, int>(ReferenceEqualityComparer.Instance);
+    var stacks = profile.Samples.Stacks;
+
+    // Unique frames referenced by the prefix tree nodes.
+    cache.FrameDetailsIds = new int[stacks.UniqueFrameCount];
+    cache.FrameIPs = new long[stacks.UniqueFrameCount];
+    cache.FrameRVAs = new long[stacks.UniqueFrameCount];
+
+    for (int i = 0; i < stacks.UniqueFrameCount; i++) {
+      var frame = stacks.GetFrame(i);
+      cache.FrameIPs[i] = frame.FrameIP;
+      cache.FrameRVAs[i] = frame.FrameRVA;
+      cache.FrameDetailsIds[i] = cache.GetOrAddFrameDetails(frame.FrameDetails, detailsMap,
+                                                           functionMap, images);
+    }
+
+    cache.NodeParents = new int[stacks.NodeCount];
+    cache.NodeFrames = new int[stacks.NodeCount];
+
+    for (int i = 0; i < stacks.NodeCount; i++) {
+      cache.NodeParents[i] = stacks.GetParentNode(i);
+      cache.NodeFrames[i] = stacks.GetNodeFrameId(i);
+    }
+
+    cache.StackNodes = new int[stacks.Count];
+    cache.StackContextIds = new int[stacks.Count];
+
+    for (int i = 0; i < stacks.Count; i++) {
+      cache.StackNodes[i] = stacks.GetStackNode(i);
+      cache.StackContextIds[i] = cache.GetOrAddContext(stacks[i].Context, contextMap);
+    }
+
+    var samples = profile.Samples;
+    var sampleContexts = samples.Contexts;
+    var sampleContextIds = samples.ContextIds;
+    cache.SampleIPs = samples.IPs.ToArray();
+    cache.SampleTimes = samples.Times.ToArray();
+    cache.SampleWeights = samples.Weights.ToArray();
+    cache.SampleStackIds = samples.StackIds.ToArray();
+    cache.SampleContextIds = new int[samples.Count];
+
+    for (int i = 0; i < samples.Count; i++) {
+      cache.SampleContextIds[i] = cache.GetOrAddContext(sampleContexts[sampleContextIds[i]], contextMap);
+    }
+
+    cache.Images = images.Values.ToList();
+    return cache;
+  }
+
+  // Recreates the stacks and samples into the profile, with the functions
+  // created by the client for each entry in the Functions list.
+  public void RestoreSamples(ProfileData profile, IReadOnlyList<IRTextFunction> functions) {
+    var images = new Dictionary<int, ProfileImage>();
+
+    foreach (var image in Images ?? new List<ProfileImage>()) {
+      images[image.Id] = image;
+    }
+
+    var frameDetails = new ResolvedProfileStackFrameDetails[FrameDetails?.Count ?? 0];
+
+    for (int i = 0; i < frameDetails.Length; i++) {
+      var details = FrameDetails[i];
+      var image = details.ImageId >= 0 ? images[details.ImageId] : null;
+      var debugInfo = details.FunctionId >= 0 ? Functions[details.FunctionId].DebugInfo : null;
+      var function = details.FunctionId >= 0 ? functions[details.FunctionId] : null;
+      frameDetails[i] = new ResolvedProfileStackFrameDetails(debugInfo, function, image, details.IsManagedCode) {
+        IsKernelCode = details.IsKernelCode
+      };
+    }
+
+    var frameDetailsIds = FrameDetailsIds ?? Array.Empty<int>();
+    var frames = new ResolvedProfileStackFrame[frameDetailsIds.Length];
+
+    for (int i = 0; i < frames.Length; i++) {
+      frames[i] = ResolvedProfileStackFrame.CreateStackFrame(FrameRVAs[i], frameDetails[frameDetailsIds[i]]);
+      frames[i].FrameIP = FrameIPs[i];
+    }
+
+    // Registering the stacks in the same order assigns the same stack IDs.
+    var nodeParents = NodeParents ?? Array.Empty<int>();
+    var nodeFrames = NodeFrames ?? Array.Empty<int>();
+    var stackNodes = StackNodes ?? Array.Empty<int>();
+    var contexts = Contexts ?? new List<ProfileContext>();
+
+    for (int i = 0; i < stackNodes.Length; i++) {
+      var stack = new ResolvedProfileStack(0, contexts[StackContextIds[i]]);
+
+      // Walk from the top frame node towards the root,
+      // the stack frames are ordered from the top of the stack.
+      for (int nodeId = stackNodes[i]; nodeId != ResolvedProfileStackTable.RootNodeId;
+           nodeId = nodeParents[nodeId]) {
+        stack.AddFrame(frames[nodeFrames[nodeId]]);
+      }
+
+      int stackId = profile.Samples.Stacks.Register(stack);
+      Debug.Assert(stackId == i);
+    }
+
+    profile.Samples.AddColumns(SampleIPs ?? Array.Empty<long>(), SampleTimes ?? Array.Empty<long>(),
+                               SampleWeights ?? Array.Empty<long>(), SampleStackIds ?? Array.Empty<int>(),
+                               SampleContextIds ?? Array.Empty<int>(), contexts);
+  }
+
+  public static async Task<bool> SerializeAsync(ResolvedProfileCache cache, string cachePath) {
+    try {
+      cache.Version = CurrentFileVersion;
+      Directory.CreateDirectory(Path.GetDirectoryName(cachePath));
+      await using var outStream = new MemoryStream();
+      Serializer.Serialize(outStream, cache);
+      outStream.Position = 0;
+      return await FileArchive.CreateFromStreamAsync(outStream, CacheFileEntry, cachePath).ConfigureAwait(false);
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to save resolved profile cache {cachePath}: {ex.Message}");
+      return false;
+    }
+  }
+
+  public static async Task<ResolvedProfileCache> DeserializeAsync(ResolvedProfileCacheKey key, string cachePath) {
+    try {
+      if (!File.Exists(cachePath)) {
+        return null;
+      }
+
+      using var archive = await FileArchive.LoadAsync(cachePath).ConfigureAwait(false);
+
+      if (archive != null) {
+        using var stream = await archive.ExtractFileToMemoryAsync(CacheFileEntry).ConfigureAwait(false);
+
+        if (stream != null) {
+          var cache = Serializer.Deserialize<ResolvedProfileCache>(stream);
+
+          if (cache.Version < MinSupportedFileVersion) {
+            Trace.WriteLine($"File version mismatch in deserialized resolved profile cache");
+            Trace.WriteLine($"  actual: {cache.Version} vs min supported {MinSupportedFileVersion}");
+            return null;
+          }
+
+          // Ensure it's a cache for the same trace and options.
+          if (key.Equals(cache.Key)) {
+            return cache;
+          }
+
+          Trace.WriteLine($"Trace mismatch in deserialized resolved profile cache");
+          Trace.WriteLine($"  actual: {cache.Key} vs expected {key}");
+        }
+      }
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to load resolved profile cache {cachePath}: {ex.Message}");
+    }
+
+    return null;
+  }
+
+  private int GetOrAddFrameDetails(ResolvedProfileStackFrameDetails details,
+                                   Dictionary<ResolvedProfileStackFrameDetails, int> detailsMap,
+                                   Dictionary<IRTextFunction, int> functionMap,
+                                   Dictionary<int, ProfileImage> images) {
+    if (detailsMap.TryGetValue(details, out int detailsId)) {
+      return detailsId;
+    }
+
+    int functionId = -1;
+
+    if (details.Function != null) {
+      if (!functionMap.TryGetValue(details.Function, out functionId)) {
+        functionId = Functions.Count;
+        functionMap[details.Function] = functionId;
+        Functions.Add(new CachedFunction {
+          ImageId = details.Image?.Id ?? -1,
+          DebugInfo = details.DebugInfo
+        });
+      }
+    }
+
+    // Synthetic images (unknown module) are not part of the profile modules.
+    if (details.Image != null) {
+      images.TryAdd(details.Image.Id, details.Image);
+    }
+
+    detailsId = FrameDetails.Count;
+    detailsMap[details] = detailsId;
+    FrameDetails.Add(new CachedFrameDetails {
+      FunctionId = functionId,
+      ImageId = details.Image?.Id ?? -1,
+      IsKernelCode = details.IsKernelCode,
+      IsManagedCode = details.IsManagedCode
+    });
+    return detailsId;
+  }
+
+  private int GetOrAddContext(ProfileContext context, Dictionary<ProfileContext, int> contextMap) {
+    if (!contextMap.TryGetValue(context, out int contextId)) {
+      contextId = Contexts.Count;
+      Contexts.Add(context);
+      contextMap[context] = contextId;
+    }
+
+    return contextId;
+  }
+
+  [ProtoContract(SkipConstructor = true)]
+  public class CachedFunction {
+    [ProtoMember(1)]
+    public int ImageId { get; set; }
+    [ProtoMember(2)]
+    public FunctionDebugInfo DebugInfo { get; set; }
+  }
+
+  [ProtoContract(SkipConstructor = true)]
+  public class CachedFrameDetails {
+    [ProtoMember(1)]
+    public int FunctionId { get; set; }
+    [ProtoMember(2)]
+    public int ImageId { get; set; }
+    [ProtoMember(3)]
+    public bool IsKernelCode { get; set; }
+    [ProtoMember(4)]
+    public bool IsManagedCode { get; set; }
+  }
+}
@@ -4,6 +4,7 @@ using System;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Runtime.InteropServices;
+using System.Threading;
 using ProfileExplorer.Core.Binary;
 using ProfileExplorer.Core.Profile.ETW;
 
@@ -96,15 +97,53 @@ public sealed class ResolvedProfileStack {
     kernelFrameInstances_.Clear();
   }
 
+  // Frames added while the stack is resolved, dropped once the stack is registered
+  // in a ResolvedProfileStackTable, which has the frames in its prefix tree.
+  private List<ResolvedProfileStackFrame> frames_;
+  private int stackNode_;
+
   public ResolvedProfileStack(int frameCount, ProfileContext context) {
-    StackFrames = new List<ResolvedProfileStackFrame>(frameCount);
+    frames_ = new List<ResolvedProfileStackFrame>(frameCount);
     Context = context;
   }
 
-  public List<ResolvedProfileStackFrame> StackFrames { get; set; }
+  public ResolvedProfileStackFrameList StackFrames {
+    get {
+      // Pairs with the write in SetStackNode, once the frame list is dropped
+      // the table and node are already visible to other threads.
+      var frames = Volatile.Read(ref frames_);
+      return frames != null ? new ResolvedProfileStackFrameList(frames) :
+        new ResolvedProfileStackFrameList(StackTable, stackNode_);
+    }
+  }
+
   public ProfileContext Context { get; set; }
+  // Index in the ResolvedProfileStackTable, -1 if not registered yet.
+  public int Id { get; set; } = -1;
+  public ResolvedProfileStackTable StackTable { get; private set; }
   public int FrameCount => StackFrames.Count;
 
+  // Called by the table registering the stack, the frames are read
+  // from the prefix tree node of the top frame from now on.
+  public void SetStackNode(ResolvedProfileStackTable stackTable, int nodeId) {
+    stackNode_ = nodeId;
+    StackTable = stackTable;
+    Volatile.Write(ref frames_, null);
+  }
+
+  public void AddFrame(ResolvedProfileStackFrame frame) {
+    frames_.Add(frame);
+  }
+
+  public void AddFrames(ResolvedProfileStackFrame[] frames) {
+    frames_.AddRange(frames);
+  }
+
+  // Returns the frames added so far, starting with the frame at startIndex.
+  public ResolvedProfileStackFrame[] CopyFrames(int startIndex) {
+    return CollectionsMarshal.AsSpan(frames_).Slice(startIndex).ToArray();
+  }
+
   public void AddFrame(IRTextFunction function, long frameIP, long frameRVA, int frameIndex,
                        ResolvedProfileStackFrameKey frameDetails, ProfileStack stack, int pointerSize) {
     // Deduplicate the frame.
@@ -122,7 +161,16 @@ public sealed class ResolvedProfileStack {
     var existingFrame = uniqueFrame.IsKernelCode ?
       kernelFrameInstances_.GetOrAdd(frameIP, rvaFrame) :
       frameInstances_.GetOrAdd(frameIP, rvaFrame);
-    StackFrames.Add(existingFrame);
+    frames_.Add(existingFrame);
+  }
+
+  // Replaces the function of a frame resolved before the debug info was loaded.
+  // Frame instances are shared by all stacks with the same IP, which all see the new function.
+  public static void RemapFrame(ResolvedProfileStackFrame frame, IRTextFunction function,
+                                ResolvedProfileStackFrameKey frameDetails) {
+    var uniqueFrame = uniqueFrames_.GetOrAdd(frameDetails, CreateResolvedProfileStackFrameDetails, function);
+    uniqueFrame.IsKernelCode |= frame.FrameDetails.IsKernelCode;
+    frame.FrameDetails = uniqueFrame;
   }
 
   private static ResolvedProfileStackFrameDetails CreateResolvedProfileStackFrameDetails(
@@ -132,6 +180,102 @@ public sealed class ResolvedProfileStack {
   }
 }
 
+// The frames of a stack, ordered from the top of the stack. They are read from the frame list
+// of a stack being resolved, or from the prefix tree of the table the stack is registered in.
+// With the prefix tree, indexing walks the parent nodes from the top frame:
+// enumerate the frames or copy them to a buffer when most of the stack is needed.
+public readonly struct ResolvedProfileStackFrameList {
+  private readonly List<ResolvedProfileStackFrame> frames_;
+  private readonly ResolvedProfileStackTable stackTable_;
+  private readonly int nodeId_;
+
+  public ResolvedProfileStackFrameList(List<ResolvedProfileStackFrame> frames) {
+    frames_ = frames;
+    nodeId_ = ResolvedProfileStackTable.RootNodeId;
+  }
+
+  public ResolvedProfileStackFrameList(ResolvedProfileStackTable stackTable, int nodeId) {
+    stackTable_ = stackTable;
+    nodeId_ = nodeId;
+  }
+
+  public int Count => frames_ != null ? frames_.Count :
+    stackTable_ != null ? stackTable_.GetNodeDepth(nodeId_) : 0;
+
+  // With the prefix tree this walks index parent nodes,
+  // don't use it to iterate over all frames.
+  public ResolvedProfileStackFrame this[int index] {
+    get {
+      if (frames_ != null) {
+        return frames_[index];
+      }
+
+      if ((uint)index >= (uint)Count) {
+        throw new ArgumentOutOfRangeException(nameof(index));
+      }
+
+      int nodeId = nodeId_;
+
+      for (int i = 0; i < index; i++) {
+        nodeId = stackTable_.GetParentNode(nodeId);
+      }
+
+      return stackTable_.GetNodeFrame(nodeId);
+    }
+  }
+
+  // Copies the frames to the buffer in the same order and returns their number.
+  public int CopyTo(Span<ResolvedProfileStackFrame> buffer) {
+    int count = 0;
+
+    foreach (var frame in this) {
+      buffer[count++] = frame;
+    }
+
+    return count;
+  }
+
+  public Enumerator GetEnumerator() {
+    return new Enumerator(frames_, stackTable_, nodeId_);
+  }
+
+  public struct Enumerator {
+    private readonly List<ResolvedProfileStackFrame> frames_;
+    private readonly ResolvedProfileStackTable stackTable_;
+    private int index_;
+    private int nextNodeId_;
+
+    public Enumerator(List<ResolvedProfileStackFrame> frames, ResolvedProfileStackTable stackTable, int nodeId) {
+      frames_ = frames;
+      stackTable_ = stackTable;
+      index_ = -1;
+      nextNodeId_ = stackTable != null ? nodeId : ResolvedProfileStackTable.RootNodeId;
+      Current = null;
+    }
+
+    public ResolvedProfileStackFrame Current { get; private set; }
+
+    public bool MoveNext() {
+      if (frames_ != null) {
+        if (++index_ >= frames_.Count) {
+          return false;
+        }
+
+        Current = frames_[index_];
+        return true;
+      }
+
+      if (nextNodeId_ == ResolvedProfileStackTable.RootNodeId) {
+        return false;
+      }
+
+      Current = stackTable_.GetNodeFrame(nextNodeId_);
+      nextNodeId_ = stackTable_.GetParentNode(nextNodeId_);
+      return true;
+    }
+  }
+}
+
 [StructLayout(LayoutKind.Sequential, Pack = 1)]
 public sealed class ResolvedProfileStackFrameDetails : IEquatable<ResolvedProfileStackFrameDetails> {
   public static readonly ResolvedProfileStackFrameDetails Unknown = new();
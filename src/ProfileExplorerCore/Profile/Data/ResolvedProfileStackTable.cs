@@ -0,0 +1,165 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Buffers;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Dense table of the unique resolved stacks referenced by the samples,
+// a sample stores the index into this table instead of an object reference.
+// Registration is thread-safe since stacks get resolved on multiple threads
+// during trace loading, lookup by index is lock-free once loading completed.
+//
+// The stacks are also interned into a prefix tree stored in flat arrays,
+// similar to the stack table of the Gecko profiler format: each node is
+// a (parent node, frame) pair, a stack being represented by the node of its top frame.
+// Call paths shared by multiple stacks are stored only once and can be
+// walked using integer indices, from the top frame towards the root.
+// A registered stack drops its own frame list and reads its frames from the prefix tree,
+// the table is the only copy of the frames (see ResolvedProfileStackFrameList).
+public sealed class ResolvedProfileStackTable {
+  public const int RootNodeId = -1;
+  private const int DefaultNodeCapacity = 1024;
+  private List<ResolvedProfileStack> stacks_;
+  private List<int> stackNodes_;
+  private List<ResolvedProfileStackFrame> frames_;
+  private Dictionary<ResolvedProfileStackFrame, int> frameMap_;
+  private int[] nodeParents_;
+  private int[] nodeFrames_;
+  private int[] nodeDepths_;
+  private int nodeCount_;
+  private Dictionary<long, int> nodeMap_;
+  private object lockObject_;
+
+  public ResolvedProfileStackTable(int capacity = 0) {
+    stacks_ = new List<ResolvedProfileStack>(capacity);
+    stackNodes_ = new List<int>(capacity);
+    frames_ = new List<ResolvedProfileStackFrame>();
+    frameMap_ = new Dictionary<ResolvedProfileStackFrame, int>();
+    nodeParents_ = new int[DefaultNodeCapacity];
+    nodeFrames_ = new int[DefaultNodeCapacity];
+    nodeDepths_ = new int[DefaultNodeCapacity];
+    nodeMap_ = new Dictionary<long, int>();
+    lockObject_ = new object();
+  }
+
+  public int Count => stacks_.Count;
+  public int NodeCount => nodeCount_;
+  public int UniqueFrameCount => frames_.Count;
+  public ResolvedProfileStack this[int stackId] => stacks_[stackId];
+
+  public int Register(ResolvedProfileStack stack) {
+    lock (lockObject_) {
+      // A stack can be shared by multiple tables (for ex. in tests),
+      // reuse the ID only if it was assigned by this table.
+      if (stack.Id >= 0 && stack.Id < stacks_.Count &&
+          ReferenceEquals(stacks_[stack.Id], stack)) {
+        return stack.Id;
+      }
+
+      int nodeId = InternStackFrames(stack.StackFrames);
+
+      // Stacks with the same frames but a different context (thread)
+      // share the node of the top frame.
+      stack.Id = stacks_.Count;
+      stacks_.Add(stack);
+      stackNodes_.Add(nodeId);
+      stack.SetStackNode(this, nodeId);
+      return stack.Id;
+    }
+  }
+
+  // Returns the prefix tree node of the stack's top frame,
+  // RootNodeId for a stack without frames.
+  public int GetStackNode(int stackId) {
+    return stackNodes_[stackId];
+  }
+
+  public int GetParentNode(int nodeId) {
+    return nodeParents_[nodeId];
+  }
+
+  public int GetNodeFrameId(int nodeId) {
+    return nodeFrames_[nodeId];
+  }
+
+  public ResolvedProfileStackFrame GetNodeFrame(int nodeId) {
+    return frames_[nodeFrames_[nodeId]];
+  }
+
+  // Number of frames on the path from the root to the node, inclusive.
+  public int GetNodeDepth(int nodeId) {
+    return nodeId == RootNodeId ? 0 : nodeDepths_[nodeId];
+  }
+
+  public ResolvedProfileStackFrame GetFrame(int frameId) {
+    return frames_[frameId];
+  }
+
+  // Fills the buffer with the nodes on the path from the root
+  // to the stack's top frame and returns the number of nodes.
+  public int GetStackPath(int stackId, Span<int> buffer) {
+    int nodeId = stackNodes_[stackId];
+    int depth = GetNodeDepth(nodeId);
+    Debug.Assert(buffer.Length >= depth);
+
+    for (int i = depth - 1; i >= 0; i--) {
+      buffer[i] = nodeId;
+      nodeId = nodeParents_[nodeId];
+    }
+
+    return depth;
+  }
+
+  private int InternStackFrames(ResolvedProfileStackFrameList stackFrames) {
+    // Frames are ordered from the top of the stack,
+    // insert them into the prefix tree starting with the root.
+    var frames = ArrayPool<ResolvedProfileStackFrame>.Shared.Rent(stackFrames.Count);
+    int frameCount = stackFrames.CopyTo(frames);
+    int parentId = RootNodeId;
+
+    for (int k = frameCount - 1; k >= 0; k--) {
+      int frameId = GetOrAddFrame(frames[k]);
+      long key = (long)(parentId + 1) << 32 | (uint)frameId;
+
+      if (!nodeMap_.TryGetValue(key, out int nodeId)) {
+        nodeId = AddNode(parentId, frameId);
+        nodeMap_[key] = nodeId;
+      }
+
+      parentId = nodeId;
+    }
+
+    ArrayPool<ResolvedProfileStackFrame>.Shared.Return(frames, true);
+    return parentId;
+  }
+
+  private int GetOrAddFrame(ResolvedProfileStackFrame frame) {
+    // Frame instances are already unique per IP (see ResolvedProfileStack.AddFrame),
+    // reference equality is sufficient.
+    if (!frameMap_.TryGetValue(frame, out int frameId)) {
+      frameId = frames_.Count;
+      frames_.Add(frame);
+      frameMap_[frame] = frameId;
+    }
+
+    return frameId;
+  }
+
+  private int AddNode(int parentId, int frameId) {
+    if (nodeCount_ == nodeParents_.Length) {
+      int newCapacity = nodeParents_.Length * 2;
+      Array.Resize(ref nodeParents_, newCapacity);
+      Array.Resize(ref nodeFrames_, newCapacity);
+      Array.Resize(ref nodeDepths_, newCapacity);
+    }
+
+    int nodeId = nodeCount_++;
+    nodeParents_[nodeId] = parentId;
+    nodeFrames_[nodeId] = frameId;
+    nodeDepths_[nodeId] = GetNodeDepth(parentId) + 1;
+    return nodeId;
+  }
+}
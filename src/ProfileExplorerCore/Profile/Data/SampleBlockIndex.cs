@@ -0,0 +1,147 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Threading.Tasks;
+using ProfileExplorer.Core.Profile.Processing;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Partial aggregates of the samples over fixed-size blocks of consecutive samples,
+// used to speed up recomputing the profile when the sample filter changes.
+// Each block stores the weight and sample index range per unique (stack, context) pair,
+// a filtered stack histogram is obtained by combining the blocks fully covered
+// by the filter time range and scanning only the samples of the two edge blocks.
+// The context is kept per entry so that the thread filter can still be applied.
+public sealed class SampleBlockIndex {
+  public const int DefaultBlockSize = 64 * 1024;
+  private ProfileSampleStore samples_;
+  private SampleBlock[] blocks_;
+  private int blockSize_;
+  private int sampleCount_;
+
+  private SampleBlockIndex(ProfileSampleStore samples, int blockSize) {
+    samples_ = samples;
+    blockSize_ = blockSize;
+    sampleCount_ = samples.Count;
+    blocks_ = new SampleBlock[(sampleCount_ + blockSize - 1) / blockSize];
+  }
+
+  public ProfileSampleStore Samples => samples_;
+  public int BlockSize => blockSize_;
+  public int BlockCount => blocks_.Length;
+  public int SampleCount => sampleCount_;
+
+  public static SampleBlockIndex Build(ProfileSampleStore samples, int blockSize = DefaultBlockSize) {
+    var index = new SampleBlockIndex(samples, blockSize);
+    Parallel.For(0, index.blocks_.Length, i => {
+      index.blocks_[i] = index.BuildBlock(i);
+    });
+    return index;
+  }
+
+  public ProfileStackHistogram ComputeHistogram(ProfileSampleFilter filter) {
+    int startIndex = Math.Clamp(filter.TimeRange?.StartSampleIndex ?? 0, 0, sampleCount_);
+    int endIndex = Math.Clamp(filter.TimeRange?.EndSampleIndex ?? sampleCount_, startIndex, sampleCount_);
+    var histogram = new ProfileStackHistogram(samples_.Stacks.Count);
+    int[] contextThreadIds = filter.HasThreadFilter ? samples_.ComputeContextThreadIds() : null;
+
+    int firstFullBlock = (startIndex + blockSize_ - 1) / blockSize_;
+    int endFullBlock = endIndex / blockSize_;
+
+    if (firstFullBlock >= endFullBlock) {
+      // The time range is within a single block, or spans two partial blocks.
+      AddSamples(histogram, startIndex, endIndex, filter, contextThreadIds);
+      return histogram;
+    }
+
+    AddSamples(histogram, startIndex, firstFullBlock * blockSize_, filter, contextThreadIds);
+
+    for (int i = firstFullBlock; i < endFullBlock; i++) {
+      AddBlock(histogram, blocks_[i], filter, contextThreadIds);
+    }
+
+    AddSamples(histogram, endFullBlock * blockSize_, endIndex, filter, contextThreadIds);
+    return histogram;
+  }
+
+  private void AddSamples(ProfileStackHistogram histogram, int startIndex, int endIndex,
+                          ProfileSampleFilter filter, int[] contextThreadIds) {
+    var stackIds = samples_.StackIds;
+    var weights = samples_.Weights;
+    var contextIds = samples_.ContextIds;
+
+    for (int i = startIndex; i < endIndex; i++) {
+      if (contextThreadIds != null &&
+          !filter.ThreadIds.Contains(contextThreadIds[contextIds[i]])) {
+        continue;
+      }
+
+      histogram.Add(stackIds[i], weights[i], i);
+    }
+  }
+
+  private static void AddBlock(ProfileStackHistogram histogram, SampleBlock block,
+                               ProfileSampleFilter filter, int[] contextThreadIds) {
+    for (int i = 0; i < block.StackIds.Length; i++) {
+      if (contextThreadIds != null &&
+          !filter.ThreadIds.Contains(contextThreadIds[block.ContextIds[i]])) {
+        continue;
+      }
+
+      histogram.Add(block.StackIds[i], block.Weights[i],
+                    block.FirstSampleIndex[i], block.LastSampleIndex[i]);
+    }
+  }
+
+  private SampleBlock BuildBlock(int blockIndex) {
+    int startIndex = blockIndex * blockSize_;
+    int endIndex = Math.Min(startIndex + blockSize_, sampleCount_);
+    var stackIds = samples_.StackIds;
+    var weights = samples_.Weights;
+    var contextIds = samples_.ContextIds;
+    var entryMap = new Dictionary<long, int>();
+    var block = new SampleBlockBuilder();
+
+    for (int i = startIndex; i < endIndex; i++) {
+      long key = (long)contextIds[i] << 32 | (uint)stackIds[i];
+
+      if (entryMap.TryGetValue(key, out int entry)) {
+        block.Weights[entry] += weights[i];
+        block.LastSampleIndex[entry] = i;
+      }
+      else {
+        entryMap[key] = block.StackIds.Count;
+        block.StackIds.Add(stackIds[i]);
+        block.ContextIds.Add(contextIds[i]);
+        block.Weights.Add(weights[i]);
+        block.FirstSampleIndex.Add(i);
+        block.LastSampleIndex.Add(i);
+      }
+    }
+
+    return new SampleBlock {
+      StackIds = block.StackIds.ToArray(),
+      ContextIds = block.ContextIds.ToArray(),
+      Weights = block.Weights.ToArray(),
+      FirstSampleIndex = block.FirstSampleIndex.ToArray(),
+      LastSampleIndex = block.LastSampleIndex.ToArray()
+    };
+  }
+
+  private sealed class SampleBlock {
+    public int[] StackIds;
+    public int[] ContextIds;
+    public long[] Weights;
+    public int[] FirstSampleIndex;
+    public int[] LastSampleIndex;
+  }
+
+  private sealed class SampleBlockBuilder {
+    public List<int> StackIds = new();
+    public List<int> ContextIds = new();
+    public List<long> Weights = new();
+    public List<int> FirstSampleIndex = new();
+    public List<int> LastSampleIndex = new();
+  }
+}
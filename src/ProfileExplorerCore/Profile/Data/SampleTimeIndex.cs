@@ -0,0 +1,379 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Multi-resolution index of the sample counts and weights over time of a thread,
+// or of all threads, used by the timeline to compute the activity at any zoom level
+// and to map times to sample indices without scanning the samples.
+// Level 0 splits the time into buckets of a power-of-two number of ticks,
+// each level above has buckets twice as large, up to a single bucket.
+// Since samples are sorted by time, a time is mapped to a sample index
+// with a binary search over the thread sample ranges, then over the range samples.
+public sealed class SampleTimeIndex {
+  private const int TargetSamplesPerBucket = 32;
+  private const int MaxThreadBaseBuckets = 1 << 16;
+  private const int MaxBaseBuckets = 1 << 18;
+  private const int MinBucketsPerSlice = 4;
+  private ProfileSampleStore samples_;
+  private List<ThreadSampleRange> ranges_;
+  private int sampleCount_;
+  private long startTicks_;
+  private int baseShift_; // Level 0 buckets have 2^baseShift_ ticks.
+  private TimeBucket[][] levels_;
+
+  private SampleTimeIndex(ProfileSampleStore samples, List<ThreadSampleRange> ranges, int threadId) {
+    samples_ = samples;
+    ranges_ = ranges;
+    ThreadId = threadId;
+    sampleCount_ = samples.Count;
+  }
+
+  public int ThreadId { get; }
+  public ProfileSampleStore Samples => samples_;
+  public List<ThreadSampleRange> Ranges => ranges_;
+  public int SampleCount => sampleCount_;
+  public int LevelCount => levels_.Length;
+
+  // Builds the index of the samples in the thread ranges, with the buckets
+  // starting at the first sample of the trace so that they line up across threads.
+  public static SampleTimeIndex Build(ProfileSampleStore samples, List<ThreadSampleRange> ranges,
+                                      int threadId = -1) {
+    var index = new SampleTimeIndex(samples, ranges, threadId);
+    index.BuildLevels();
+    return index;
+  }
+
+  public TimeSpan BucketDuration(int level) {
+    return TimeSpan.FromTicks(1L << (baseShift_ + level));
+  }
+
+  // Returns the weight and number of samples in each time slice,
+  // slices being assigned the buckets of the coarsest level with at least
+  // a few buckets per slice, so that the cost depends on the number of slices
+  // instead of the number of samples. A bucket crossing a slice boundary
+  // is split into its halves from the level below, down to level 0 where
+  // its samples are checked, so the slices are exact, same as when scanning all samples.
+  public SampleTimeSlice[] ComputeSlices(TimeSpan startTime, double sliceTicks, int sliceCount) {
+    var slices = new SampleTimeSlice[Math.Max(0, sliceCount)];
+    Array.Fill(slices, new SampleTimeSlice(TimeSpan.Zero, -1, 0));
+
+    if (sliceCount <= 0 || sliceTicks <= 0 || levels_.Length == 0) {
+      return slices;
+    }
+
+    int level = -1;
+
+    while (level + 1 < levels_.Length &&
+           (1L << (baseShift_ + level + 1)) * MinBucketsPerSlice <= sliceTicks) {
+      level++;
+    }
+
+    if (level < 0) {
+      // Slices are smaller than a few level 0 buckets, which happens only when zoomed in
+      // far enough that there are just a few samples per slice, walk the samples instead.
+      int startIndex = FindFirstSampleAtOrAfter(startTime);
+
+      if (startIndex >= 0) {
+        AddSamplesToSlices(slices, startTime.Ticks, sliceTicks, startIndex, int.MaxValue);
+      }
+
+      return slices;
+    }
+
+    int shift = baseShift_ + level;
+    double endTicks = startTime.Ticks + sliceTicks * sliceCount;
+    long firstBucket = Math.Max(0, (startTime.Ticks - startTicks_) >> shift);
+    long lastBucket = Math.Min(levels_[level].Length - 1, (long)(endTicks - startTicks_) >> shift);
+
+    for (long i = firstBucket; i <= lastBucket; i++) {
+      AddBucketToSlices(slices, startTime.Ticks, sliceTicks, level, i);
+    }
+
+    return slices;
+  }
+
+  // Returns the index of the first sample of the thread at or after the time, or -1.
+  public int FindFirstSampleAtOrAfter(TimeSpan time) {
+    if (levels_.Length == 0) {
+      return -1;
+    }
+
+    var times = samples_.Times;
+    int low = 0;
+    int high = ranges_.Count - 1;
+    int rangeIndex = -1;
+
+    // Find the first range ending at or after the time.
+    while (low <= high) {
+      int mid = low + (high - low) / 2;
+
+      if (times[ranges_[mid].EndIndex - 1] >= time.Ticks) {
+        rangeIndex = mid;
+        high = mid - 1;
+      }
+      else {
+        low = mid + 1;
+      }
+    }
+
+    if (rangeIndex < 0) {
+      return -1;
+    }
+
+    var range = ranges_[rangeIndex];
+    return range.StartIndex + LowerBound(times.Slice(range.StartIndex, range.EndIndex - range.StartIndex),
+                                         time.Ticks);
+  }
+
+  // Returns the index of the last sample of the thread at or before the time, or -1.
+  public int FindLastSampleAtOrBefore(TimeSpan time) {
+    if (levels_.Length == 0) {
+      return -1;
+    }
+
+    var times = samples_.Times;
+    int low = 0;
+    int high = ranges_.Count - 1;
+    int rangeIndex = -1;
+
+    // Find the last range starting at or before the time.
+    while (low <= high) {
+      int mid = low + (high - low) / 2;
+
+      if (times[ranges_[mid].StartIndex] <= time.Ticks) {
+        rangeIndex = mid;
+        low = mid + 1;
+      }
+      else {
+        high = mid - 1;
+      }
+    }
+
+    if (rangeIndex < 0) {
+      return -1;
+    }
+
+    var range = ranges_[rangeIndex];
+    return range.StartIndex + LowerBound(times.Slice(range.StartIndex, range.EndIndex - range.StartIndex),
+                                         time.Ticks + 1) - 1;
+  }
+
+  // Returns the [start, end) sample index range of the thread samples in the time range.
+  public (int StartIndex, int EndIndex) FindSampleRange(TimeSpan startTime, TimeSpan endTime) {
+    int startIndex = FindFirstSampleAtOrAfter(startTime);
+    int endIndex = FindLastSampleAtOrBefore(endTime) + 1;
+
+    if (startIndex < 0 || endIndex <= startIndex) {
+      return (0, 0);
+    }
+
+    return (startIndex, endIndex);
+  }
+
+  // Returns the index of the first thread range ending after the sample index.
+  private int FindRangeEndingAfter(int sampleIndex) {
+    int low = 0;
+    int high = ranges_.Count;
+
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+
+      if (ranges_[mid].EndIndex <= sampleIndex) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+
+    return low;
+  }
+
+  private static int LowerBound(ReadOnlySpan<long> times, long value) {
+    int low = 0;
+    int high = times.Length;
+
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+
+      if (times[mid] < value) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+
+    return low;
+  }
+
+  private void AddBucketToSlices(SampleTimeSlice[] slices, long startTicks, double sliceTicks,
+                                 int level, long bucketIndex) {
+    ref var bucket = ref levels_[level][bucketIndex];
+
+    if (bucket.Count == 0) {
+      return;
+    }
+
+    int shift = baseShift_ + level;
+    long bucketStart = startTicks_ + (bucketIndex << shift);
+    long firstSlice = GetSliceIndex(bucketStart, startTicks, sliceTicks);
+    long lastSlice = GetSliceIndex(bucketStart + (1L << shift) - 1, startTicks, sliceTicks);
+
+    if (lastSlice < 0 || firstSlice >= slices.Length) {
+      return;
+    }
+
+    if (firstSlice == lastSlice) {
+      ref var slice = ref slices[firstSlice];
+
+      if (slice.FirstSampleIndex < 0) {
+        slice.FirstSampleIndex = bucket.FirstSampleIndex;
+      }
+
+      slice.Weight += TimeSpan.FromTicks(bucket.Weight);
+      slice.SampleCount += bucket.Count;
+    }
+    else if (level > 0) {
+      // Split the bucket at the level below, only the halves crossing
+      // a slice boundary are split further.
+      int childCount = levels_[level - 1].Length;
+
+      for (long i = 2 * bucketIndex; i < Math.Min(2 * bucketIndex + 2, childCount); i++) {
+        AddBucketToSlices(slices, startTicks, sliceTicks, level - 1, i);
+      }
+    }
+    else {
+      AddSamplesToSlices(slices, startTicks, sliceTicks, bucket.FirstSampleIndex, bucket.Count);
+    }
+  }
+
+  private static long GetSliceIndex(long ticks, long startTicks, double sliceTicks) {
+    return (long)Math.Floor((ticks - startTicks) / sliceTicks);
+  }
+
+  // Adds up to sampleCount samples of the thread, starting with the one at startIndex.
+  private void AddSamplesToSlices(SampleTimeSlice[] slices, long startTicks, double sliceTicks,
+                                  int startIndex, int sampleCount) {
+    var times = samples_.Times;
+    var weights = samples_.Weights;
+
+    for (int r = FindRangeEndingAfter(startIndex); r < ranges_.Count; r++) {
+      var range = ranges_[r];
+
+      for (int i = Math.Max(startIndex, range.StartIndex); i < range.EndIndex; i++) {
+        if (sampleCount-- == 0) {
+          return;
+        }
+
+        long sliceIndex = GetSliceIndex(times[i], startTicks, sliceTicks);
+
+        if (sliceIndex >= slices.Length) {
+          return;
+        }
+
+        if (sliceIndex < 0) {
+          continue;
+        }
+
+        ref var slice = ref slices[sliceIndex];
+
+        if (slice.FirstSampleIndex < 0) {
+          slice.FirstSampleIndex = i;
+        }
+
+        slice.Weight += TimeSpan.FromTicks(weights[i]);
+        slice.SampleCount++;
+      }
+    }
+  }
+
+  private void BuildLevels() {
+    var times = samples_.Times;
+    var weights = samples_.Weights;
+    int threadSamples = 0;
+
+    foreach (var range in ranges_) {
+      threadSamples += range.EndIndex - range.StartIndex;
+    }
+
+    if (threadSamples == 0) {
+      levels_ = Array.Empty<TimeBucket[]>();
+      return;
+    }
+
+    // Pick the bucket size so that there are a few dozen samples per bucket
+    // on average, with a limit on the number of buckets.
+    startTicks_ = times[0];
+    long duration = times[^1] - startTicks_ + 1;
+    int maxBuckets = ThreadId == -1 ? MaxBaseBuckets : MaxThreadBaseBuckets;
+    long targetBuckets = Math.Clamp(threadSamples / TargetSamplesPerBucket, 1, maxBuckets);
+    baseShift_ = 0;
+
+    while ((duration >> baseShift_) > targetBuckets) {
+      baseShift_++;
+    }
+
+    var baseLevel = new TimeBucket[(int)((duration - 1) >> baseShift_) + 1];
+    Array.Fill(baseLevel, new TimeBucket(0, 0, -1));
+
+    foreach (var range in ranges_) {
+      for (int i = range.StartIndex; i < range.EndIndex; i++) {
+        ref var bucket = ref baseLevel[(times[i] - startTicks_) >> baseShift_];
+
+        if (bucket.Count == 0) {
+          bucket.FirstSampleIndex = i;
+        }
+
+        bucket.Weight += weights[i];
+        bucket.Count++;
+      }
+    }
+
+    var levels = new List<TimeBucket[]> {baseLevel};
+
+    while (levels[^1].Length > 1) {
+      var prevLevel = levels[^1];
+      var level = new TimeBucket[(prevLevel.Length + 1) / 2];
+
+      for (int i = 0; i < level.Length; i++) {
+        var left = prevLevel[2 * i];
+        var right = 2 * i + 1 < prevLevel.Length ? prevLevel[2 * i + 1] : new TimeBucket(0, 0, -1);
+        level[i] = new TimeBucket(left.Weight + right.Weight, left.Count + right.Count,
+                                  left.Count > 0 ? left.FirstSampleIndex : right.FirstSampleIndex);
+      }
+
+      levels.Add(level);
+    }
+
+    levels_ = levels.ToArray();
+  }
+
+  private struct TimeBucket {
+    public long Weight;
+    public int Count;
+    public int FirstSampleIndex;
+
+    public TimeBucket(long weight, int count, int firstSampleIndex) {
+      Weight = weight;
+      Count = count;
+      FirstSampleIndex = firstSampleIndex;
+    }
+  }
+}
+
+// Activity of a thread over a time slice, with the index of its first sample.
+public struct SampleTimeSlice {
+  public TimeSpan Weight;
+  public int FirstSampleIndex;
+  public int SampleCount;
+
+  public SampleTimeSlice(TimeSpan weight, int firstSampleIndex, int sampleCount) {
+    Weight = weight;
+    FirstSampleIndex = firstSampleIndex;
+    SampleCount = sampleCount;
+  }
+}
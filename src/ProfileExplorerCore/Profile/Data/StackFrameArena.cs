@@ -0,0 +1,144 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Numerics;
+
+namespace ProfileExplorer.Core.Profile.Data;
+
+// Stores the frame pointers of the unique stacks (or stack parts, like the
+// kernel and user mode halves of a sample stack) of a trace in large shared blocks
+// instead of an array per stack. A stack is identified by an ID referencing
+// the location of its frames, identical stacks are stored only once.
+// Stacks are found using a 64-bit hash of their frames, computed once when added.
+// Adding stacks must be done from a single thread, once loading is completed
+// the frames can be read from multiple threads.
+public sealed class StackFrameArena {
+  public const int EmptyStackId = 0;
+  private const int InitialBlockSize = 4 * 1024;
+  private const int MaxBlockSize = 1024 * 1024;
+  private const int InitialTableSize = 1024; // Must be a power of two.
+  private List<long[]> blocks_;
+  private long[] currentBlock_;
+  private int currentBlockUsed_;
+  private StackEntry[] stacks_;
+  private int stackCount_;
+  private int[] table_; // Open addressing hash table of stack IDs, 0 is an empty slot.
+  private int tableMask_;
+
+  public StackFrameArena() {
+    blocks_ = new List<long[]>();
+    stacks_ = new StackEntry[InitialTableSize / 2];
+    stackCount_ = 1; // ID 0 is the empty stack.
+    table_ = new int[InitialTableSize];
+    tableMask_ = InitialTableSize - 1;
+  }
+
+  public int Count => stackCount_ - 1;
+
+  public int Add(ReadOnlySpan<long> frames) {
+    if (frames.IsEmpty) {
+      return EmptyStackId;
+    }
+
+    Debug.Assert(table_ != null, "Adding stacks after loading completed");
+    ulong hash = ComputeHash(frames);
+    int slot = (int)hash & tableMask_;
+
+    while (true) {
+      int id = table_[slot];
+
+      if (id == EmptyStackId) {
+        break;
+      }
+
+      ref var entry = ref stacks_[id];
+
+      if (entry.Hash == hash && entry.Length == frames.Length &&
+          frames.SequenceEqual(blocks_[entry.Block].AsSpan(entry.Offset, entry.Length))) {
+        return id;
+      }
+
+      slot = (slot + 1) & tableMask_;
+    }
+
+    // New stack, append its frames to the current block.
+    if (currentBlock_ == null || currentBlock_.Length - currentBlockUsed_ < frames.Length) {
+      AllocateBlock(frames.Length);
+    }
+
+    frames.CopyTo(currentBlock_.AsSpan(currentBlockUsed_));
+
+    if (stackCount_ == stacks_.Length) {
+      Array.Resize(ref stacks_, stacks_.Length * 2);
+    }
+
+    int newId = stackCount_++;
+    stacks_[newId] = new StackEntry(hash, blocks_.Count - 1, currentBlockUsed_, frames.Length);
+    currentBlockUsed_ += frames.Length;
+    table_[slot] = newId;
+
+    if (stackCount_ * 2 > table_.Length) {
+      GrowTable(); // Keep the load factor under 0.5.
+    }
+
+    return newId;
+  }
+
+  public ReadOnlySpan<long> GetFrames(int id) {
+    ref var entry = ref stacks_[id];
+    return entry.Length > 0 ? blocks_[entry.Block].AsSpan(entry.Offset, entry.Length) :
+      ReadOnlySpan<long>.Empty;
+  }
+
+  public int GetFrameCount(int id) {
+    return stacks_[id].Length;
+  }
+
+  public void LoadingCompleted() {
+    // Free the lookup table, no more stacks are added after this point.
+    table_ = null;
+    Array.Resize(ref stacks_, stackCount_);
+  }
+
+  private void AllocateBlock(int minSize) {
+    // Start with small blocks, most traces are small.
+    int size = currentBlock_ == null ? InitialBlockSize : Math.Min(currentBlock_.Length * 2, MaxBlockSize);
+    currentBlock_ = new long[Math.Max(size, minSize)];
+    currentBlockUsed_ = 0;
+    blocks_.Add(currentBlock_);
+  }
+
+  private void GrowTable() {
+    // Reinsert the stacks using their saved hash, the frames are not hashed again.
+    int[] table = new int[table_.Length * 2];
+    int mask = table.Length - 1;
+
+    for (int id = 1; id < stackCount_; id++) {
+      int slot = (int)stacks_[id].Hash & mask;
+
+      while (table[slot] != EmptyStackId) {
+        slot = (slot + 1) & mask;
+      }
+
+      table[slot] = id;
+    }
+
+    table_ = table;
+    tableMask_ = mask;
+  }
+
+  private static ulong ComputeHash(ReadOnlySpan<long> frames) {
+    ulong hash = (ulong)frames.Length;
+
+    foreach (long frame in frames) {
+      hash = BitOperations.RotateLeft(hash ^ (ulong)frame, 27) * 0x9E3779B97F4A7C15;
+    }
+
+    // Mix the high bits into the low ones used as table index.
+    return hash ^ (hash >> 32);
+  }
+
+  private readonly record struct StackEntry(ulong Hash, int Block, int Offset, int Length);
+}
@@ -96,6 +96,29 @@ public sealed partial class ETWEventProcessor : IDisposable {
     }
   }
 
+  // Returns the frames of a stack event, read in place from the event data
+  // for 64-bit traces, otherwise widened into the buffer.
+  private unsafe static ReadOnlySpan<long> ReadStackFrames(IntPtr eventData, int framesOffset, int frameCount,
+                                                           int pointerSize, ref long[] buffer) {
+    var ptr = (void*)(eventData + framesOffset);
+
+    if (pointerSize == 8) {
+      return new ReadOnlySpan<long>(ptr, frameCount);
+    }
+
+    var frames = new ReadOnlySpan<uint>(ptr, frameCount);
+
+    if (buffer.Length < frameCount) {
+      buffer = new long[frameCount];
+    }
+
+    for (int i = 0; i < frameCount; i++) {
+      buffer[i] = frames[i];
+    }
+
+    return buffer.AsSpan(0, frameCount);
+  }
+
   public List<ProcessSummary> BuildProcessSummary(ProcessListProgressHandler progressCallback,
                                                   CancelableTask cancelableTask) {
     // Default 1ms sampling interval.
@@ -227,13 +250,14 @@ public sealed partial class ETWEventProcessor : IDisposable {
     // Info used to associate a sample with the last call stack running on a thread.
     var perThreadLastTimeMap = new Dictionary<int, double>();
     var perThreadLastSampleMap = new Dictionary<int, int>();
-    var perThreadLastKernelStackMap = new Dictionary<int, (int StackId, long Timestamp)>();
+    var perThreadLastKernelStackMap = new Dictionary<int, (int StackId, int SampleId, long Timestamp)>();
     var perContextLastSampleMap = new Dictionary<int, int>();
     int lastReportedSample = 0;
 
     // Info used to handle compressed stack event
     var kernelStackKeyToPendingSamples = new Dictionary<ulong, List<int>>();
     var userStackKeyToPendingSamples = new Dictionary<ulong, List<int>>();
+    long[] stackFrameBuffer = new long[256];
     var profile = new RawProfileData(tracePath_, handleDotNetEvents_);
 
     // Enable building of a thead ID -> process ID table
@@ -454,8 +478,9 @@ public sealed partial class ETWEventProcessor : IDisposable {
 #endif
       var context = profile.RentTempContext(data.ProcessID, data.ThreadID, data.ProcessorNumber);
       int contextId = profile.AddContext(context);
-      int frameCount = data.FrameCount;
-      ProfileStack kstack = null;
+      var frames = ReadStackFrames(data.DataStart, 16, data.FrameCount, data.PointerSize, ref stackFrameBuffer);
+      int framesId = profile.AddStackFrames(frames);
+      bool isMergedStack = false;
 
       if (!isKernelStack && !isKernelStackStart) {
         // This is a user mode stack, check if before it an associated
@@ -468,44 +493,25 @@ public sealed partial class ETWEventProcessor : IDisposable {
 #if DEBUG
           //Trace.WriteLine($"  Found matching KernelStack {lastKernelStack.StackId} at {lastKernelStack.Timestamp} on CPU {data.ProcessorNumber}");
 #endif
-          // Append at the end of the kernel stack, marking a user -> kernel mode transition.
-          kstack = profile.FindStack(lastKernelStack.StackId);
-          int kstackFrameCount = kstack.FrameCount;
-          long[] frames = new long[kstack.FrameCount + data.FrameCount];
-          kstack.FramePointers.CopyTo(frames, 0);
-
-#if DEBUG
-          //Trace.WriteLine($"    kernel mode end IP: {frames[kstackFrameCount - 1]:X}");
-          //Trace.WriteLine($"    user mode start IP: {data.InstructionPointer(0):X}");
-#endif
-          for (int i = 0; i < frameCount; i++) {
-            frames[kstackFrameCount + i] = (long)data.InstructionPointer(i);
+          // Pair the user mode part with the kernel mode one, the user -> kernel mode
+          // transition being after the kernel frames. The frames are not concatenated,
+          // the kernel part stays shared with the other stacks using it.
+          var kstack = profile.FindStack(lastKernelStack.StackId);
+          int stackId = profile.AddStack(kstack.ContextId, kstack.KernelStackId, framesId);
+
+          if (lastKernelStack.SampleId != 0) {
+            profile.SetSampleStack(lastKernelStack.SampleId, stackId, kstack.ContextId);
           }
 
-          profile.ReplaceStackFramePointers(kstack, frames, context);
-          kstack.UserModeTransitionIndex = kstackFrameCount; // Frames after index are user mode.
-          lastKernelStack = (0, 0); // Clear the last kernel stack.
+          lastKernelStack = default; // Clear the last kernel stack.
+          isMergedStack = true;
         }
       }
 
-      if (kstack == null) {
+      if (!isMergedStack) {
         // This is either a kernel mode stack, or a user mode stack with no associated kernel mode stack.
-        var stack = profile.RentTemporaryStack(frameCount, contextId);
-
-        // Copy data from event to the temp. stack pointer array.
-        // Slightly faster to copy the entire array as a whole.
-        unsafe {
-          var ptr = (void*)((IntPtr)(void*)data.DataStart + 16);
-          int bytes = data.PointerSize * frameCount;
-          var span = new Span<byte>(ptr, bytes);
-
-          fixed (long* destPtr = stack.FramePointers) {
-            var destSpan = new Span<byte>(destPtr, bytes);
-            span.CopyTo(destSpan);
-          }
-        }
-
-        int stackId = profile.AddStack(stack, context);
+        int stackId = isKernelStack ? profile.AddStack(contextId, framesId, StackFrameArena.EmptyStackId) :
+          profile.AddStack(contextId, StackFrameArena.EmptyStackId, framesId);
 
         // Try to associate with a previous sample from the same context.
         int sampleId = perThreadLastSampleMap.GetValueOrDefault(data.ThreadID);
@@ -516,13 +522,14 @@ public sealed partial class ETWEventProcessor : IDisposable {
 #if DEBUG
           //Trace.WriteLine($"Couldn't set stack {stackId} for sample {sampleId}");
 #endif
+          sampleId = 0;
         }
 
         if (isKernelStack) {
 #if DEBUG
           //Trace.WriteLine($"    register KernelStack {stackId} on CPU {data.ProcessorNumber}");
 #endif
-          perThreadLastKernelStackMap[data.ThreadID] = (stackId, data.EventTimeStampQPC);
+          perThreadLastKernelStackMap[data.ThreadID] = (stackId, sampleId, data.EventTimeStampQPC);
         }
       }
 
@@ -600,77 +607,37 @@ public sealed partial class ETWEventProcessor : IDisposable {
       }
 
       bool isKernelAddress = IsKernelAddress(data.InstructionPointer(0), data.PointerSize);
-      List<int> pendingSamples;
+      var stackKeyToPendingSamples = isKernelAddress ? kernelStackKeyToPendingSamples : userStackKeyToPendingSamples;
 
-      if (isKernelAddress && !kernelStackKeyToPendingSamples.TryGetValue(data.StackKey, out pendingSamples)) {
+      if (!stackKeyToPendingSamples.TryGetValue(data.StackKey, out var pendingSamples)) {
         return;
       }
 
-      if (!userStackKeyToPendingSamples.TryGetValue(data.StackKey, out pendingSamples)) {
-        return;
-      }
+      var frames = ReadStackFrames(data.DataStart, 8, data.FrameCount, data.PointerSize, ref stackFrameBuffer);
+      int framesId = profile.AddStackFrames(frames);
 
       foreach (int sampleId in pendingSamples) {
         var sample = profile.Samples[sampleId - 1];
+        int kernelStackId = isKernelAddress ? framesId : StackFrameArena.EmptyStackId;
+        int userStackId = isKernelAddress ? StackFrameArena.EmptyStackId : framesId;
 
-        // Check if we already have part of the stack for this sample
-        if (sample.StackId == 0) {
-          var profileStack = profile.RentTemporaryStack(data.FrameCount, sample.ContextId);
-
-          // Copy data from event to the temp. stack pointer array.
-          // Slightly faster to copy the entire array as a whole.
-          unsafe {
-            var ptr = (void*)((IntPtr)(void*)data.DataStart + 8);
-            int bytes = data.PointerSize * data.FrameCount;
-            var span = new Span<byte>(ptr, bytes);
-
-            fixed (long* destPtr = profileStack.FramePointers) {
-              var destSpan = new Span<byte>(destPtr, bytes);
-              span.CopyTo(destSpan);
-            }
-          }
+        // Check if we already have the other part of the stack for this sample.
+        if (sample.StackId != 0) {
+          var stack = profile.FindStack(sample.StackId);
 
-          int stackId = profile.AddStack(profileStack, profile.FindContext(sample.ContextId));
-          profile.SetSampleStack(sampleId, stackId, sample.ContextId);
-        }
-        else if (isKernelAddress) {
-          var profileStack = profile.FindStack(sample.StackId);
-          int ustackFrameCount = profileStack.FrameCount;
-          int kstackFrameCount = data.FrameCount;
-          long[] frames = new long[kstackFrameCount + ustackFrameCount];
-          profileStack.FramePointers.CopyTo(frames, kstackFrameCount);
-
-          for (int i = 0; i < kstackFrameCount; i++) {
-            frames[i] = (long)data.InstructionPointer(i);
+          if (isKernelAddress) {
+            userStackId = stack.UserStackId;
           }
-
-          var context = profile.FindContext(sample.ContextId);
-          profile.ReplaceStackFramePointers(profileStack, frames, context);
-          profileStack.UserModeTransitionIndex = kstackFrameCount; // Frames after kernel stack are user mode.
-        }
-        else {
-          var profileStack = profile.FindStack(sample.StackId);
-          int ustackFrameCount = data.FrameCount;
-          int kstackFrameCount = profileStack.FrameCount;
-          long[] frames = new long[kstackFrameCount + ustackFrameCount];
-          profileStack.FramePointers.CopyTo(frames, 0);
-
-          for (int i = 0; i < ustackFrameCount; i++) {
-            frames[i + kstackFrameCount] = (long)data.InstructionPointer(i);
+          else {
+            kernelStackId = stack.KernelStackId;
           }
-
-          var context = profile.FindContext(sample.ContextId);
-          profile.ReplaceStackFramePointers(profileStack, frames, context);
-          profileStack.UserModeTransitionIndex = kstackFrameCount; // Frames after kernel stack are user mode.
         }
-      }
 
-      if (isKernelAddress) {
-        kernelStackKeyToPendingSamples.Remove(data.StackKey);
-      }
-      else {
-        userStackKeyToPendingSamples.Remove(data.StackKey);
+        int stackId = profile.AddStack(sample.ContextId, kernelStackId, userStackId);
+        profile.SetSampleStack(sampleId, stackId, sample.ContextId);
       }
+
+      stackKeyToPendingSamples.Remove(data.StackKey);
     });
 
     void HandlePerfInfoCollection(SampledProfileIntervalTraceData data, RawProfileData profile) {
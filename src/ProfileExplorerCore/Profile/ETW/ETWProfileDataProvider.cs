@@ -1,6 +1,7 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Concurrent;
 using System.Collections.Generic;
 using System.Diagnostics;
@@ -28,6 +29,8 @@ public delegate Task StartNewSessionHandler(string sessionName, SessionKind sess
 public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
   private const int IMAGE_LOCK_COUNT = 64;
   private const int PROGRESS_UPDATE_INTERVAL = 2048; // Progress UI update after pow2 N samples.
+  private const int PendingDebugFilesChunkFactor = 4; // Sample chunks per thread while debug files are searched.
+  private const int SymbolizationRefreshInterval = 1000; // Min. ms between profile updates with lazy symbolization.
 #if DEBUG
   // For collecting statistics on stack frame resolution.
   private volatile static int UnresolvedStackCount;
@@ -51,7 +54,15 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
   private object[] imageLocks_;
   private ConcurrentDictionary<int, ProfileModuleBuilder> imageModuleMap_;
   private HashSet<ProfileImage> rejectedDebugModules_;
-  private int currentSampleIndex_;
+  private ConcurrentDictionary<int, Task<DebugFileSearchResult>> pendingDebugFiles_; // By image ID.
+  private int pendingDebugFileCount_;
+  private int processedSampleCount_; // Progress of the sample processing workers.
+  private volatile bool deferDebugInfo_; // Lazy symbolization, see SymbolizeAddressBucketsAsync.
+  private volatile bool missingDebugInfo_; // A module's symbol file wasn't found or failed to load.
+  // Resolved frames of the user mode part of stacks, reused by the stacks
+  // that have the same user mode part with a different kernel mode part.
+  private ConcurrentDictionary<(int UserStackId, int ProcessId, int ThreadId),
+    ResolvedProfileStackFrame[]> userStackFrames_;
 
   // Synthetic module for samples whose instruction pointers don't map to any
   // known module loaded in the process. This can be dynamically generated code
@@ -160,6 +171,8 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     lockObject_ = new object();
     imageModuleMap_ = new ConcurrentDictionary<int, ProfileModuleBuilder>();
     rejectedDebugModules_ = new HashSet<ProfileImage>();
+    pendingDebugFiles_ = new ConcurrentDictionary<int, Task<DebugFileSearchResult>>();
+    userStackFrames_ = new ConcurrentDictionary<(int, int, int), ResolvedProfileStackFrame[]>();
     imageLocks_ = new object[IMAGE_LOCK_COUNT];
 
     for (int i = 0; i < imageLocks_.Length; i++) {
@@ -253,6 +266,20 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     try {
       UpdateProgress(progressCallback, ProfileLoadStage.TraceReading, 0, 0);
 
+      // The cache key is computed before the symbol settings are
+      // updated below with the trace directory.
+      ResolvedProfileCacheKey cacheKey = null;
+
+      if (options.CacheResolvedProfile) {
+        cacheKey = ResolvedProfileCacheKey.Create(tracePath, processIds, options, symbolSettings);
+        var cachedProfile = await LoadCachedProfileAsync(tracePath, cacheKey, options, symbolSettings,
+                                                         report, progressCallback, cancelableTask);
+
+        if (cachedProfile != null) {
+          return cachedProfile;
+        }
+      }
+
       Trace.WriteLine($"LoadTraceAsync(file): Creating ETW event processor");
       var rawProfile = await Task.Run(() => {
         int acceptedProcessId = processIds.Count == 1 ? processIds[0] : 0;
@@ -286,7 +313,25 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
       
       var result = await LoadTraceAsync(rawProfile, processIds, options, symbolSettings,
                                         report, progressCallback, cancelableTask);
-      
+
+      // The performance counters are attributed to the functions directly
+      // and not saved in the cache, don't cache such profiles.
+      bool saveCache = result != null && cacheKey != null && !rawProfile.HasPerformanceCounterData;
+
+      if (result?.SymbolizationTask != null) {
+        // The raw profile is still used by the background symbolization,
+        // the profile is also cached only once all symbols are loaded.
+        result.SymbolizationTask = CompleteSymbolizationAsync(result.SymbolizationTask, rawProfile,
+                                                              tracePath, saveCache ? cacheKey : null);
+        Trace.WriteLine($"LoadTraceAsync(file): LoadTraceAsync completed, symbolization continues in background");
+        return result;
+      }
+
+      if (saveCache) {
+        // Save in the background, the profile isn't changed anymore once loaded.
+        _ = Task.Run(() => SaveCachedProfileAsync(tracePath, cacheKey));
+      }
+
       Trace.WriteLine($"LoadTraceAsync(file): LoadTraceAsync completed, disposing raw profile");
       rawProfile.Dispose();
       
@@ -329,6 +374,8 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
       // Save process and thread info.
       profileData_.Process = mainProcess;
       options_ = options;
+      deferDebugInfo_ = options.LazySymbolization;
+      missingDebugInfo_ = false;
 
       foreach (int procId in processIds) {
         var proc = rawProfile.FindProcess(procId);
@@ -365,6 +412,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
       // The entire ETW processing must be done on the same thread.
       Trace.WriteLine($"LoadTraceAsync: Starting main processing task");
+      Task debugFilesTask = null;
       bool result = await Task.Run(async () => {
         try {
           // Start getting the function address data while the trace is loading.
@@ -383,11 +431,14 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
           //profile.PrintSamples(mainProcessId);
 #endif
 
-          // Preload binaries and debug files, downloading them concurrently if needed.
+          // Start locating the debug files, downloading them concurrently if needed.
+          // Sample processing doesn't wait for all downloads to complete, a stack frame
+          // waits only for the debug file of its own module, so that downloads and
+          // stack resolution overlap instead of running one after another.
           Trace.WriteLine($"LoadTraceAsync: Starting LoadBinaryAndDebugFiles");
-          await LoadBinaryAndDebugFiles(rawProfile, mainProcess, imageName,
-                                        symbolSettings, progressCallback, cancelableTask);
-          Trace.WriteLine($"LoadTraceAsync: Completed LoadBinaryAndDebugFiles");
+          debugFilesTask = await LoadBinaryAndDebugFiles(rawProfile, mainProcess, imageName,
+                                                         symbolSettings, progressCallback, cancelableTask);
+          Trace.WriteLine($"LoadTraceAsync: Started debug file search for {pendingDebugFiles_.Count} modules");
 
           if (cancelableTask is {IsCanceled: true}) {
             Trace.WriteLine($"LoadTraceAsync: Cancellation requested after binary loading");
@@ -400,37 +451,66 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
           var processingSw = Stopwatch.StartNew();
           Trace.WriteLine($"LoadTraceAsync: Starting sample processing for {rawProfile.Samples.Count} samples");
 
-          // Split sample processing in multiple chunks, each done by another thread.
+          // Split sample processing in small ranges of samples (morsels) taken on demand
+          // by the workers, each running on another thread. A part of the trace with many
+          // stacks to resolve is spread over all the workers instead of a single one.
           int chunks = CoreSettingsProvider.GeneralSettings.CurrentCpuCoreLimit;
 #if DEBUG
           chunks = 1;
 #endif
-          int chunkSize = rawProfile.ComputeSampleChunkLength(chunks);
-          int sampleCount = rawProfile.Samples.Count;
-
-          Trace.WriteLine($"LoadTraceAsync: Using {chunks} threads, chunk size: {chunkSize}");
-          var tasks = new List<Task<List<(ProfileSample Sample, ResolvedProfileStack Stack)>>>();
+          // While debug files are still being downloaded, use more workers than threads:
+          // a worker waiting for a debug file doesn't occupy a thread,
+          // which is used meanwhile by the workers that can make progress.
+          // With lazy symbolization workers never wait for the debug files.
+          int workers = debugFilesTask.IsCompleted || deferDebugInfo_ ?
+            chunks : chunks * PendingDebugFilesChunkFactor;
+          var scheduler = new MorselScheduler(0, rawProfile.Samples.Count,
+                                              rawProfile.ComputeSampleMorselLength(workers));
+          workers = Math.Min(workers, scheduler.MorselCount);
+
+          Trace.WriteLine($"LoadTraceAsync: Using {chunks} threads, {workers} workers, " +
+                          $"{scheduler.MorselCount} morsels of {scheduler.MorselSize} samples");
+          var tasks = new List<Task<ProfileSampleStore>>();
           var taskScheduler = new ConcurrentExclusiveSchedulerPair(TaskScheduler.Default, chunks);
           var taskFactory = new TaskFactory(taskScheduler.ConcurrentScheduler);
 
           // Process the raw samples and stacks by resolving stack frame symbols
-          // and creating the function profiles.
-          for (int k = 0; k < chunks; k++) {
-            int start = Math.Min(k * chunkSize, sampleCount);
-            int end = k == chunks - 1 ? sampleCount : Math.Min((k + 1) * chunkSize, sampleCount);
+          // and creating the function profiles. Each worker collects the samples
+          // of the morsels it processed in its own store, the range of each morsel
+          // in the store is recorded to merge the samples in the raw sample order.
+          var morselSamples = new SampleMorselRange[scheduler.MorselCount];
+          processedSampleCount_ = 0;
 
-            Trace.WriteLine($"LoadTraceAsync: Creating task {k} for samples {start}-{end}");
+          for (int k = 0; k < workers; k++) {
             tasks.Add(taskFactory.StartNew(async () => {
-              var chunkSamples = await ProcessSamplesChunk(rawProfile, start, end,
-                                                     processIds, options.IncludeKernelEvents,
-                                                     symbolSettings, progressCallback, cancelableTask, chunks).ConfigureAwait(false);
-              return chunkSamples;
+              var worker = new SampleWorkerState(new ProfileSampleStore(profileData_.Samples.Stacks,
+                                                                        scheduler.MorselSize));
+
+              while (cancelableTask is not {IsCanceled: true} &&
+                     scheduler.TryTake(out int start, out int end, out int morselIndex)) {
+                int storeStart = worker.Samples.Count;
+                await ProcessSamplesChunk(rawProfile, start, end, worker,
+                                          processIds, options.IncludeKernelEvents,
+                                          symbolSettings, progressCallback, cancelableTask).ConfigureAwait(false);
+                morselSamples[morselIndex] = new SampleMorselRange(worker.Samples, storeStart, worker.Samples.Count);
+              }
+
+              CompleteSamplesWorker(worker);
+              return worker.Samples;
             }).Unwrap());
           }
 
           Trace.WriteLine($"LoadTraceAsync: Waiting for {tasks.Count} sample processing tasks");
           await Task.WhenAll(tasks.ToArray());
           Trace.WriteLine($"LoadTraceAsync: Done processing samples in {processingSw.Elapsed}");
+          userStackFrames_.Clear(); // All stacks are resolved.
+
+          // Debug files for modules without samples in the profiled processes
+          // may still be searched, wait for them to release the symbol server connections.
+          // With lazy symbolization, the debug files are awaited in the background instead.
+          if (!deferDebugInfo_) {
+            await debugFilesTask.ConfigureAwait(false);
+          }
 
           if (cancelableTask is {IsCanceled: true}) {
             Trace.WriteLine($"LoadTraceAsync: Cancellation requested after sample processing");
@@ -439,7 +519,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
           // Collect samples from tasks.
           Trace.WriteLine($"LoadTraceAsync: Collecting chunk samples");
-          CollectChunkSamples(tasks);
+          CollectChunkSamples(morselSamples);
 
           // Create the per-function profile and call tree.
           UpdateProgress(progressCallback, ProfileLoadStage.ComputeCallTree, 0, rawProfile.Samples.Count);
@@ -454,27 +534,14 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
           Trace.WriteLine(
             $"LoadTraceAsync: Done processing trace in {processingSw.Elapsed}, {processingSw.ElapsedMilliseconds} ms");
 
-          // If the trace has registered PMU counters (from PerfInfoCollectionEnd events)
-          // but no PerfInfoPMCSample events, the PMU counters were used as sampling sources
-          // rather than as separate counting events. Create synthetic counter events from
-          // the regular samples, similar to how samples without stacks get a synthetic
-          // single-frame stack (see ProcessSamplesChunk).
-          if (!rawProfile.HasPerformanceCountersEvents && rawProfile.PerformanceCounters.Count > 0) {
-            Trace.WriteLine($"LoadTraceAsync: Generating synthetic PMC events from {rawProfile.Samples.Count} samples " +
-                           $"for {rawProfile.PerformanceCounters.Count} PMU sampling source counter(s)");
-
-            foreach (var sample in rawProfile.Samples) {
-              foreach (var counter in rawProfile.PerformanceCounters) {
-                var counterEvent = new PerformanceCounterEvent(
-                  sample.IP, sample.Time, sample.ContextId, (short)counter.Id);
-                rawProfile.AddPerformanceCounterEvent(counterEvent);
-              }
-            }
+          // Process performance counters. If the PMU counters were used as sampling sources,
+          // the samples are used as the counter events (see ProcessPerformanceCounterEvents).
+          // With lazy symbolization, the events are attributed to the functions
+          // once the symbols are loaded.
+          if (rawProfile.HasPerformanceCounterData && deferDebugInfo_) {
+            RegisterPerformanceCounters(rawProfile);
           }
-
-          // Process performance counters.
-          if (rawProfile.HasPerformanceCountersEvents) {
-            Trace.WriteLine($"LoadTraceAsync: Processing {rawProfile.PerformanceCountersEvents.Count} performance counter events");
+          else if (rawProfile.HasPerformanceCounterData) {
             ProcessPerformanceCounters(rawProfile, processIds, symbolSettings, progressCallback, cancelableTask);
           }
           else {
@@ -502,20 +569,19 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
       // Setup session documents.
       if (result) {
         Trace.WriteLine($"LoadTraceAsync: Main processing succeeded, setting up session documents");
-        var exeDocument = FindSessionDocuments(imageName, out var otherDocuments);
-
-        if (exeDocument == null) {
-          Trace.WriteLine($"LoadTraceAsync: WARNING - Failed to find main EXE document for {imageName}");
-          exeDocument = new LoadedDocument(string.Empty, string.Empty, Guid.Empty);
-          exeDocument.Summary = new IRTextSummary(string.Empty);
-        }
-        else {
-          Trace.WriteLine($"LoadTraceAsync: Using exe document {exeDocument.ModuleName} with {otherDocuments.Count} other documents");
+        await SetupSessionDocumentsAsync(imageName);
+
+        if (deferDebugInfo_) {
+          // Show the profile with the address buckets right away,
+          // the symbols are loaded and the frames remapped in the background.
+          // The load task completes here, the symbolization has its own task
+          // canceled when the profile is unloaded (see ProfileData.CancelSymbolizationAsync).
+          var symbolizationTask = new CancelableTask();
+          profileData_.SymbolizationCancelableTask = symbolizationTask;
+          profileData_.SymbolizationTask =
+            Task.Run(() => SymbolizeAddressBucketsAsync(rawProfile, processIds, debugFilesTask,
+                                                        symbolSettings, symbolizationTask));
         }
-
-        Trace.WriteLine($"LoadTraceAsync: Calling SetupNewSessionRequested event");
-        await (SetupNewSessionRequested?.Invoke(exeDocument, otherDocuments, profileData_) ?? Task.CompletedTask);
-        Trace.WriteLine($"LoadTraceAsync: Completed SetupNewSessionRequested event");
       }
       else {
         Trace.WriteLine($"LoadTraceAsync: ERROR - Main processing task returned false (failed)");
@@ -545,74 +611,201 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     }
   }
 
-  private void CollectChunkSamples(List<Task<List<(ProfileSample Sample, ResolvedProfileStack Stack)>>> tasks) {
-    var samples = new List<(ProfileSample, ResolvedProfileStack)>[tasks.Count];
+  private async Task<ProfileData> LoadCachedProfileAsync(string tracePath, ResolvedProfileCacheKey cacheKey,
+                                                         ProfileDataProviderOptions options,
+                                                         SymbolFileSourceSettings symbolSettings,
+                                                         ProfileDataReport report,
+                                                         ProfileLoadProgressHandler progressCallback,
+                                                         CancelableTask cancelableTask) {
+    var sw = Stopwatch.StartNew();
+    string cachePath = ResolvedProfileCache.MakeCacheFilePath(tracePath, ResolvedProfileCache.DefaultCacheDirectoryPath);
+    var cache = await ResolvedProfileCache.DeserializeAsync(cacheKey, cachePath).ConfigureAwait(false);
+
+    if (cache == null || cancelableTask is {IsCanceled: true}) {
+      return null;
+    }
+
+    Trace.WriteLine($"LoadTraceAsync(file): Loading profile from cache {cachePath}");
+    report_ = report;
+    report_.Process = cache.Process;
+    report_.TraceInfo = cache.TraceInfo;
+    options_ = options;
+
+    profileData_.Process = cache.Process;
+    profileData_.AddThreads(cache.Threads ?? new List<ProfileThread>());
+    var images = new Dictionary<int, ProfileImage>();
 
-    for (int k = 0; k < tasks.Count; k++) {
-      samples[k] = tasks[k].Result;
+    foreach (var image in cache.Images ?? new List<ProfileImage>()) {
+      images[image.Id] = image;
     }
 
-    // Preallocate merged samples list.
+    foreach (int imageId in cache.ProfileModuleIds ?? new List<int>()) {
+      profileData_.Modules[imageId] = images[imageId];
+    }
+
+    foreach (var status in cache.ModuleStatus ?? new List<ProfileDataReport.ModuleStatus>()) {
+      report_.AddModuleStatus(status);
+    }
+
+    string imageName = Utilities.Utils.TryGetFileNameWithoutExtension(cache.Process.ImageFileName);
+    await StartFileSessionAsync(cache.TraceInfo, imageName);
+
+    bool result = await Task.Run(() => {
+      // Recreate the module documents with the functions referenced by the stacks,
+      // then the stacks and samples. The function profiles and call tree are recomputed.
+      UpdateProgress(progressCallback, ProfileLoadStage.TraceProcessing, 0, 0);
+      var cachedFunctions = cache.Functions ?? new List<ResolvedProfileCache.CachedFunction>();
+      var functions = new IRTextFunction[cachedFunctions.Count];
+
+      for (int i = 0; i < functions.Length; i++) {
+        var cachedFunction = cachedFunctions[i];
+        var moduleBuilder = imageModuleMap_.GetOrAdd(cachedFunction.ImageId, imageId => {
+          var builder = new ProfileModuleBuilder(report_, compilerInfoProvider_);
+          builder.InitializeFromCache(FromProfileImage(images[imageId], cache.Process,
+                                                       cache.TraceInfo.PointerSize), symbolSettings);
+          return builder;
+        });
+
+        functions[i] = moduleBuilder.AddCachedFunction(cachedFunction.DebugInfo);
+      }
+
+      if (cancelableTask is {IsCanceled: true}) {
+        return false;
+      }
+
+      cache.RestoreSamples(profileData_, functions);
+      UpdateProgress(progressCallback, ProfileLoadStage.ComputeCallTree, 0, profileData_.Samples.Count);
+      profileData_.ComputeThreadSampleRanges();
+      profileData_.FilterFunctionProfile(new ProfileSampleFilter());
+      return true;
+    });
+
+    if (!result || cancelableTask is {IsCanceled: true}) {
+      return null;
+    }
+
+    await SetupSessionDocumentsAsync(imageName);
+    Trace.WriteLine($"LoadTraceAsync(file): Done loading profile from cache in {sw.Elapsed}");
+    return profileData_;
+  }
+
+  private async Task<bool> CompleteSymbolizationAsync(Task<bool> symbolizationTask, RawProfileData rawProfile,
+                                                      string tracePath, ResolvedProfileCacheKey cacheKey) {
+    try {
+      bool completed = await symbolizationTask.ConfigureAwait(false);
+
+      if (completed && cacheKey != null) {
+        await SaveCachedProfileAsync(tracePath, cacheKey).ConfigureAwait(false);
+      }
+
+      return completed;
+    }
+    finally {
+      rawProfile.Dispose();
+    }
+  }
+
+  private async Task SaveCachedProfileAsync(string tracePath, ResolvedProfileCacheKey cacheKey) {
+    // The cache key depends only on the trace and settings. If the symbol file of a module
+    // couldn't be loaded, like during a symbol server outage, don't save a profile
+    // with unresolved functions that would be used by all the next loads of the trace.
+    if (missingDebugInfo_ || imageModuleMap_.Values.Any(module => module.DebugInfoPending)) {
+      Trace.WriteLine($"LoadTraceAsync(file): Profile cache not saved, missing debug info for some modules");
+      return;
+    }
+
+    var sw = Stopwatch.StartNew();
+    string cachePath = ResolvedProfileCache.MakeCacheFilePath(tracePath, ResolvedProfileCache.DefaultCacheDirectoryPath);
+
+    try {
+      var cache = ResolvedProfileCache.Create(cacheKey, profileData_, report_);
+
+      if (await ResolvedProfileCache.SerializeAsync(cache, cachePath).ConfigureAwait(false)) {
+        Trace.WriteLine($"LoadTraceAsync(file): Saved profile cache {cachePath} in {sw.Elapsed}");
+      }
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"LoadTraceAsync(file): Failed to save profile cache {cachePath}: {ex.Message}");
+    }
+  }
+
+  private void CollectChunkSamples(SampleMorselRange[] morselSamples) {
+    // Preallocate the merged sample columns.
     int totalSamples = 0;
 
-    foreach (var chunkSamples in samples) {
-      totalSamples += chunkSamples.Count;
+    foreach (var morsel in morselSamples) {
+      totalSamples += morsel.End - morsel.Start;
     }
 
     profileData_.Samples.EnsureCapacity(totalSamples);
 
-    // Merge the samples from all chunks and sort them by time.
-    foreach (var chunkSamples in samples) {
-      profileData_.Samples.AddRange(chunkSamples);
+    // Merge the samples of the morsels in morsel order, which keeps them
+    // in the time order of the raw samples, the sort then only checks the order.
+    // The workers share the stack table of the profile, only the columns are copied.
+    foreach (var morsel in morselSamples) {
+      if (morsel.Samples != null) {
+        profileData_.Samples.AddRange(morsel.Samples, morsel.Start, morsel.End - morsel.Start);
+      }
     }
 
-    if (profileData_.Samples != null) {
-      profileData_.Samples.Sort((a, b) => a.Sample.Time.CompareTo(b.Sample.Time));
-    }
-    else {
-      // Make an empty list to keep other parts happy.
-      profileData_.Samples = [];
+    profileData_.Samples.SortByTime();
+    profileData_.Samples.TrimExcess();
+  }
+
+  private void CompleteSamplesWorker(SampleWorkerState worker) {
+    Trace.WriteLine($"ProcessSamplesChunk: Worker completed {worker.MorselCount} morsels " +
+                    $"in {worker.Stopwatch.Elapsed.TotalSeconds:F2}s, " +
+                    $"collected {worker.Samples.Count} samples, resolved {worker.ResolvedStacks} stacks, " +
+                    $"skipped {worker.KernelSamplesSkipped} kernel + " +
+                    $"{worker.OtherProcessSamplesSkipped} other process samples");
+
+    lock (lockObject_) {
+      profileData_.TotalWeight += worker.TotalWeight;
+      profileData_.ProfileWeight += worker.ProfileWeight;
     }
   }
 
-  private async Task<List<(ProfileSample Sample, ResolvedProfileStack Stack)>>
-    ProcessSamplesChunk(RawProfileData rawProfile, int start, int end, List<int> processIds,
-                        bool includeKernelEvents,
+  private async Task
+    ProcessSamplesChunk(RawProfileData rawProfile, int start, int end, SampleWorkerState worker,
+                        List<int> processIds, bool includeKernelEvents,
                         SymbolFileSourceSettings symbolSettings,
                         ProfileLoadProgressHandler progressCallback,
-                        CancelableTask cancelableTask, int chunks) {
+                        CancelableTask cancelableTask) {
 
     // Clear thread-local caches to prevent stale data from previous trace loads
     prevImage_ = null;
     prevProfileModuleBuilder_ = null;
     RawProfileData.ClearThreadLocalCaches();
 
+    var samples = worker.Samples;
     var totalWeight = TimeSpan.Zero;
     var profileWeight = TimeSpan.Zero;
-    var samples = new List<(ProfileSample Sample, ResolvedProfileStack Stack)>(end - start + 1);
     int sampleIndex = 0;
-    var chunkSw = Stopwatch.StartNew();
     int stackResolutionCount = 0;
     int kernelSamplesSkipped = 0;
     int otherProcessSamplesSkipped = 0;
+    worker.MorselCount++;
 
-    Trace.WriteLine($"ProcessSamplesChunk: Processing chunk {start}-{end} ({end - start} samples) on thread {Thread.CurrentThread.ManagedThreadId}");
-
-    for (int i = start; i < end; i++) {
-      var sample = rawProfile.Samples[i];
-      
+    // The morsels start at a segment boundary of the compressed samples,
+    // each segment being decompressed by a single worker.
+    foreach (var sample in rawProfile.Samples.Enumerate(start, end)) {
       // Update progress every pow2 N samples.
       if ((++sampleIndex & PROGRESS_UPDATE_INTERVAL - 1) == 0) {
         if (cancelableTask is {IsCanceled: true}) {
           Trace.WriteLine($"ProcessSamplesChunk: Cancellation requested at sample {sampleIndex}");
-          return samples;
+          return;
         }
 
-        // Calculate global progress more accurately - each chunk processes start+sampleIndex samples
-        int globalProgress = start + sampleIndex;
-        var elapsed = chunkSw.Elapsed;
-        var samplesPerSecond = sampleIndex / Math.Max(elapsed.TotalSeconds, 0.001);
-        var progressInfo = $"Thread {Thread.CurrentThread.ManagedThreadId}: {samplesPerSecond:F0} samples/sec, {stackResolutionCount} stacks resolved";
+        // The morsels are not processed in order, report the number of samples
+        // processed by all workers so far to keep the progress increasing.
+        int globalProgress = Interlocked.Add(ref processedSampleCount_, PROGRESS_UPDATE_INTERVAL);
+        var samplesPerSecond = globalProgress / Math.Max(worker.Stopwatch.Elapsed.TotalSeconds, 0.001);
+        var progressInfo = $"{samplesPerSecond:F0} samples/sec, {worker.ResolvedStacks + stackResolutionCount} stacks resolved";
+        int pendingDebugFiles = Volatile.Read(ref pendingDebugFileCount_);
+
+        if (pendingDebugFiles > 0) {
+          progressInfo += $", {pendingDebugFiles} PDB downloads pending";
+        }
         
         UpdateProgress(progressCallback, ProfileLoadStage.TraceProcessing,
                        rawProfile.Samples.Count, globalProgress, progressInfo);
@@ -661,6 +854,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 #endif
         stackResolutionCount++;
         resolvedStack = await ProcessUnresolvedStackAsync(stack, context, rawProfile, symbolSettings).ConfigureAwait(false);
+        profileData_.Samples.Stacks.Register(resolvedStack); // Assign the dense stack ID.
         stack.SetOptionalData(resolvedStack); // Cache resolved stack.
       }
       else {
@@ -673,28 +867,25 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
       RecordSampleStatistics(resolvedStack);
 #endif
 
-      samples.Add((sample, resolvedStack));
-    }
-
-    var finalElapsed = chunkSw.Elapsed;
-    Trace.WriteLine($"ProcessSamplesChunk: Completed chunk {start}-{end} in {finalElapsed.TotalSeconds:F2}s, " +
-                   $"processed {samples.Count} samples, resolved {stackResolutionCount} stacks, " +
-                   $"skipped {kernelSamplesSkipped} kernel + {otherProcessSamplesSkipped} other process samples");
-
-    lock (lockObject_) {
-      profileData_.TotalWeight += totalWeight;
-      profileData_.ProfileWeight += profileWeight;
+      samples.Add(sample, resolvedStack.Id, context);
     }
 
-    return samples;
+    // The totals are added to the profile once the worker completed all its morsels.
+    worker.TotalWeight += totalWeight;
+    worker.ProfileWeight += profileWeight;
+    worker.ResolvedStacks += stackResolutionCount;
+    worker.KernelSamplesSkipped += kernelSamplesSkipped;
+    worker.OtherProcessSamplesSkipped += otherProcessSamplesSkipped;
   }
 
   private async Task<ResolvedProfileStack> ProcessUnresolvedStackAsync(ProfileStack stack,
                                                       ProfileContext context, RawProfileData rawProfile,
                                                       SymbolFileSourceSettings symbolSettings) {
     var sw = Stopwatch.StartNew();
-    var resolvedStack = new ResolvedProfileStack(stack.FrameCount, context);
-    long[] stackFrames = stack.FramePointers;
+    int frameCount = stack.FrameCount;
+    var resolvedStack = new ResolvedProfileStack(frameCount, context);
+    long[] stackFrames = ArrayPool<long>.Shared.Rent(frameCount);
+    stack.CopyFrames(stackFrames);
     bool isManagedCode = false;
     int frameIndex = 0;
     int pointerSize = rawProfile.TraceInfo.PointerSize;
@@ -703,20 +894,35 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     int unknownFrames = 0;
     int resolvedFrames = 0;
     bool prevFrameWasUnknownJit = false;
+    int userFramesStart = -1;
+
+    // Resolve the images of all frames in one batch before resolving the functions.
+    var frameImages = new ProfileImage[frameCount];
+    rawProfile.FindImagesForIPs(stackFrames.AsSpan(0, frameCount), context.ProcessId, frameImages);
 
     //? TODO: Stacks with >256 frames are truncated, inclusive time computation is not right then
     //? for ex it never gets to main. Easy example is a quicksort impl
-    for (; frameIndex < stackFrames.Length; frameIndex++) {
+    for (; frameIndex < frameCount; frameIndex++) {
+      if (frameIndex == stack.UserModeTransitionIndex && frameIndex > 0 &&
+          stack.UserStackId != StackFrameArena.EmptyStackId && !prevFrameWasUnknownJit) {
+        // The user mode part may have been resolved already for a stack
+        // from the same thread that has a different kernel mode part.
+        var userFramesKey = (stack.UserStackId, context.ProcessId, context.ThreadId);
+
+        if (userStackFrames_.TryGetValue(userFramesKey, out var userFrames)) {
+          resolvedStack.AddFrames(userFrames);
+          break;
+        }
+
+        userFramesStart = resolvedStack.FrameCount;
+      }
+
       long frameIp = stackFrames[frameIndex];
-      ProfileImage frameImage = null;
+      ProfileImage frameImage = frameImages[frameIndex];
       isManagedCode = false;
 
       if (ETWEventProcessor.IsKernelAddress((ulong)frameIp, pointerSize)) {
         kernelFrames++;
-        frameImage = rawProfile.FindImageForIP(frameIp, ETWEventProcessor.KernelProcessId);
-      }
-      else {
-        frameImage = rawProfile.FindImageForIP(frameIp, context.ProcessId);
       }
 
       if (frameImage == null) {
@@ -802,9 +1008,12 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
         frameRva = frameIp - frameImage.BaseAddress;
       }
 
-      // Find the function the sample belongs to.
+      // Find the function the sample belongs to. With lazy symbolization,
+      // use the address bucket until the debug info is loaded.
       var funcStartTime = sw.Elapsed;
-      var funcPair = profileModuleBuilder.GetOrCreateFunction(frameRva);
+      var funcPair = profileModuleBuilder.DebugInfoPending ?
+        profileModuleBuilder.GetOrCreateAddressBucketFunction(frameRva) :
+        profileModuleBuilder.GetOrCreateFunction(frameRva);
       var funcEndTime = sw.Elapsed;
 
       // Track significant function lookup delays
@@ -823,11 +1032,17 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
       prevFrameWasUnknownJit = false; // Known frame breaks unknown frame run.
     }
 
+    if (userFramesStart >= 0) {
+      var userFrames = resolvedStack.CopyFrames(userFramesStart);
+      userStackFrames_.TryAdd((stack.UserStackId, context.ProcessId, context.ThreadId), userFrames);
+    }
+
+    ArrayPool<long>.Shared.Return(stackFrames);
     var totalTime = sw.Elapsed;
     
     // Log slow stack resolutions for debugging
     if (totalTime.TotalMilliseconds > 50) { // Log stacks taking > 50ms
-      Trace.WriteLine($"Slow stack resolution: {totalTime.TotalMilliseconds:F1}ms for {stackFrames.Length} frames " +
+      Trace.WriteLine($"Slow stack resolution: {totalTime.TotalMilliseconds:F1}ms for {frameCount} frames " +
                      $"(resolved: {resolvedFrames}, unknown: {unknownFrames}, managed: {managedFrames}, kernel: {kernelFrames})");
     }
 
@@ -883,6 +1098,23 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     return unchecked((long)(SyntheticIpBase | (pid << 32) | tid));
   }
 
+  private async Task SetupSessionDocumentsAsync(string imageName) {
+    var exeDocument = FindSessionDocuments(imageName, out var otherDocuments);
+
+    if (exeDocument == null) {
+      Trace.WriteLine($"LoadTraceAsync: WARNING - Failed to find main EXE document for {imageName}");
+      exeDocument = new LoadedDocument(string.Empty, string.Empty, Guid.Empty);
+      exeDocument.Summary = new IRTextSummary(string.Empty);
+    }
+    else {
+      Trace.WriteLine($"LoadTraceAsync: Using exe document {exeDocument.ModuleName} with {otherDocuments.Count} other documents");
+    }
+
+    Trace.WriteLine($"LoadTraceAsync: Calling SetupNewSessionRequested event");
+    await (SetupNewSessionRequested?.Invoke(exeDocument, otherDocuments, profileData_) ?? Task.CompletedTask);
+    Trace.WriteLine($"LoadTraceAsync: Completed SetupNewSessionRequested event");
+  }
+
   private ILoadedDocument FindSessionDocuments(string imageName, out List<ILoadedDocument> otherDocuments) {
     ILoadedDocument exeDocument = null;
     otherDocuments = new List<ILoadedDocument>();
@@ -937,18 +1169,19 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     CollectTopModules(RawProfileData rawProfile, ProfileProcess mainProcess) {
     var moduleMap = new Dictionary<ProfileImage, int>();
     int pointerSize = rawProfile.TraceInfo.PointerSize;
-    var sampleRefs = CollectionsMarshal.AsSpan(rawProfile.Samples);
     var timer = Stopwatch.StartNew();
     int index = 0;
     int totalSamplesProcessed = 0;
     int mainProcessSamples = 0;
     int samplesWithStacks = 0;
     int samplesWithoutStacks = 0;
+    var frameImages = new ProfileImage[256];
+    long[] framePointers = new long[256];
 
     Trace.WriteLine($"TOP_MODULES_DEBUG: Starting top modules collection for process {mainProcess.ProcessId} ({mainProcess.ImageFileName})");
     Trace.WriteLine($"TOP_MODULES_DEBUG: Total samples in trace: {rawProfile.Samples.Count}");
 
-    foreach (ref var sample in sampleRefs) {
+    foreach (var sample in rawProfile.Samples) {
       totalSamplesProcessed++;
       var context = sample.GetContext(rawProfile);
 
@@ -981,15 +1214,18 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
       samplesWithStacks++;
       
-      foreach (long frame in stack.FramePointers) {
-        ProfileImage frameImage = null;
+      int frameCount = stack.FrameCount;
 
-        if (ETWEventProcessor.IsKernelAddress((ulong)frame, pointerSize)) {
-          frameImage = rawProfile.FindImageForIP(frame, ETWEventProcessor.KernelProcessId);
-        }
-        else {
-          frameImage = rawProfile.FindImageForIP(frame, context.ProcessId);
-        }
+      if (frameImages.Length < frameCount) {
+        frameImages = new ProfileImage[frameCount];
+        framePointers = new long[frameCount];
+      }
+
+      stack.CopyFrames(framePointers);
+      rawProfile.FindImagesForIPs(framePointers.AsSpan(0, frameCount), context.ProcessId, frameImages);
+
+      for (int i = 0; i < frameCount; i++) {
+        var frameImage = frameImages[i];
 
         if (frameImage != null) {
           moduleMap.AccumulateValue(frameImage, 1);
@@ -1035,7 +1271,9 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     return moduleList;
   }
 
-  private async Task LoadBinaryAndDebugFiles(RawProfileData rawProfile, ProfileProcess mainProcess,
+  // Starts the search for the debug files of the modules with samples, returning
+  // once the searches are started. The returned task completes when all searches are done.
+  private async Task<Task> LoadBinaryAndDebugFiles(RawProfileData rawProfile, ProfileProcess mainProcess,
                                              string mainImageName,
                                              SymbolFileSourceSettings symbolSettings,
                                              ProfileLoadProgressHandler progressCallback,
@@ -1058,6 +1296,18 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     var topModules = CollectTopModules(rawProfile, mainProcess);
     int moduleSampleCutOff = 0;
 
+    // Start the searches for the modules with the most samples first,
+    // with a limited number of concurrent downloads their debug files
+    // are available the earliest, which matters most with lazy symbolization.
+    var moduleRanks = new Dictionary<ProfileImage, int>();
+
+    for (int i = 0; i < topModules.Count; i++) {
+      moduleRanks[topModules[i].Image] = i;
+    }
+
+    imageList.Sort((a, b) => moduleRanks.GetValueOrDefault(a, int.MaxValue).
+                     CompareTo(moduleRanks.GetValueOrDefault(b, int.MaxValue)));
+
     if (symbolSettings.SkipLowSampleModules) {
       moduleSampleCutOff = (int)(symbolSettings.LowSampleModuleCutoff * rawProfile.Samples.Count);
     }
@@ -1104,34 +1354,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     DiagnosticLogger.LogInfo("[SymbolLoading] Skipping upfront binary downloads (lazy loading enabled). " +
                              "Binaries will be downloaded on-demand when viewing assembly.");
 
-    // Determine the compiler target from trace metadata instead of binaries.
-    // PointerSize tells us if it's a 64-bit or 32-bit OS.
-    // Note: Individual processes can be 32-bit (WoW64) on 64-bit OS.
-    // We default to the OS architecture here; per-module architecture is inferred
-    // from path (SysWOW64 = 32-bit) or determined when the binary is loaded on-demand.
-    var irMode = IRMode.Default;
-    if (rawProfile.TraceInfo.PointerSize == 8) {
-      // 64-bit system - could be x64 or ARM64, but x64 is far more common
-      // TODO: Could potentially detect ARM64 from other trace metadata if needed
-      irMode = IRMode.x86_64;
-      defaultArchitecture_ = Machine.Amd64;
-      DiagnosticLogger.LogInfo("[SymbolLoading] Detected 64-bit OS from trace metadata (PointerSize=8)");
-    }
-    else if (rawProfile.TraceInfo.PointerSize == 4) {
-      irMode = IRMode.x86_64; // x86 is supported under x86_64 mode
-      defaultArchitecture_ = Machine.I386;
-      DiagnosticLogger.LogInfo("[SymbolLoading] Detected 32-bit OS from trace metadata (PointerSize=4)");
-    }
-    else {
-      DiagnosticLogger.LogWarning($"[SymbolLoading] Unknown pointer size {rawProfile.TraceInfo.PointerSize}, defaulting to x86_64");
-      irMode = IRMode.x86_64;
-      defaultArchitecture_ = Machine.Amd64;
-    }
-
-    Trace.WriteLine($"Binary download skipped (lazy loading) - architecture detected from trace: {irMode}");
-
-    compilerInfoProvider_ = new ASMCompilerInfoProvider(irMode);
-    await (StartNewSessionRequested?.Invoke(mainImageName, SessionKind.FileSession, compilerInfoProvider_) ?? Task.CompletedTask);
+    await StartFileSessionAsync(rawProfile.TraceInfo, mainImageName);
 
     // Locate the needed debug files, in parallel. This will download them
     // from the symbol server if not yet on local machine and enabled.
@@ -1160,7 +1383,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     for (int i = 0; i < imageLimit; i++) {
       if (cancelableTask is {IsCanceled: true}) {
         DiagnosticLogger.LogInfo($"[SymbolLoading] PDB loading cancelled at image {i}/{imageLimit}");
-        return;
+        return Task.CompletedTask;
       }
 
       // Apply module filtering (same logic that was used for binary filtering)
@@ -1262,6 +1485,11 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
           return result;
         });
+
+        pendingDebugFiles_[imageList[i].Id] = pdbTaskList[i];
+        Interlocked.Increment(ref pendingDebugFileCount_);
+        pdbTaskList[i].ContinueWith(_ => Interlocked.Decrement(ref pendingDebugFileCount_),
+                                    TaskContinuationOptions.ExecuteSynchronously);
       }
       else {
         // No symbol file descriptor in ETL - this module won't have symbols
@@ -1272,77 +1500,34 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
     int pdbTasksStarted = pdbTaskList.Count(t => t != null);
     DiagnosticLogger.LogInfo($"[SymbolLoading] PDB download phase: Started {pdbTasksStarted} download tasks for {pdbCount} eligible modules");
+    return CompleteDebugFileSearchAsync(imageList, pdbTaskList, pdbSw, loadStartTime, cancelableTask);
+  }
 
-    // Wait for ALL PDB tasks to complete in parallel before processing results.
-    // Report progress incrementally as tasks complete (not just at the end).
+  private async Task CompleteDebugFileSearchAsync(List<ProfileImage> imageList,
+                                                  Task<DebugFileSearchResult>[] pdbTaskList,
+                                                  Stopwatch pdbSw, Stopwatch loadStartTime,
+                                                  CancelableTask cancelableTask) {
     var activePdbTasks = pdbTaskList.Where(t => t != null).ToArray();
+
     if (activePdbTasks.Length > 0) {
       DiagnosticLogger.LogInfo($"[SymbolLoading] Waiting for {activePdbTasks.Length} PDB downloads to complete in parallel...");
-
-      // Track completions and report progress incrementally
-      int pdbCompletedCount = 0;
-      int pdbTotalTasks = activePdbTasks.Length;
-
-      // Start a progress monitoring task that reports progress every 500ms
-      var pdbProgressCts = new CancellationTokenSource();
-      var pdbProgressTask = Task.Run(async () => {
-        int lastReported = -1;
-        while (!pdbProgressCts.Token.IsCancellationRequested) {
-          int current = Volatile.Read(ref pdbCompletedCount);
-          if (current != lastReported) {
-            UpdateProgress(progressCallback, ProfileLoadStage.SymbolLoading, pdbTotalTasks, current, "PDB downloads");
-            lastReported = current;
-          }
-          try {
-            await Task.Delay(500, pdbProgressCts.Token).ConfigureAwait(false);
-          }
-          catch (OperationCanceledException) {
-            break;
-          }
-        }
-      });
-
-      // Attach completion tracking to each task
-      var pdbTrackingTasks = activePdbTasks.Select(task =>
-        task.ContinueWith(_ => Interlocked.Increment(ref pdbCompletedCount), TaskContinuationOptions.ExecuteSynchronously)
-      ).ToArray();
-
-      // Wait for all downloads to complete
       await Task.WhenAll(activePdbTasks).ConfigureAwait(false);
-
-      // Stop progress monitoring
-      pdbProgressCts.Cancel();
-      try { await pdbProgressTask.ConfigureAwait(false); } catch { }
-
       DiagnosticLogger.LogInfo($"[SymbolLoading] All PDB downloads completed in {pdbSw.Elapsed.TotalSeconds:F1}s");
     }
 
-    // Note: Don't reset progress here - we're about to process results which is fast
-    // UpdateProgress is called per-module in the loop below
     int pdbsFound = 0;
     int pdbsProcessed = 0;
 
     // Process results (tasks already completed, so this is fast)
-    for (int i = 0; i < imageLimit; i++) {
+    for (int i = 0; i < imageList.Count; i++) {
       if (cancelableTask is {IsCanceled: true}) {
-        DiagnosticLogger.LogInfo($"[SymbolLoading] PDB download cancelled at image {i}/{imageLimit}");
+        DiagnosticLogger.LogInfo($"[SymbolLoading] PDB download cancelled at image {i}/{imageList.Count}");
         return;
       }
 
-      // Always update progress even for skipped modules
-      UpdateProgress(progressCallback, ProfileLoadStage.SymbolLoading, imageLimit, i,
-                     imageList[i].ModuleName);
-
       if (pdbTaskList[i] != null) {
         pdbsProcessed++;
-        var pdbTaskStart = Stopwatch.StartNew();
         var pdbPath = await pdbTaskList[i].ConfigureAwait(false);
-        var pdbTaskDuration = pdbTaskStart.Elapsed;
-
-        // Log slow PDB lookups (> 2 seconds)
-        if (pdbTaskDuration.TotalSeconds > 2) {
-          DiagnosticLogger.LogWarning($"[SymbolLoading] Slow PDB lookup ({pdbTaskDuration.TotalSeconds:F1}s): {imageList[i].ModuleName} - Found: {pdbPath.Found}");
-        }
 
         if (pdbPath.Found) {
           pdbsFound++;
@@ -1353,9 +1538,6 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     var totalPdbTime = pdbSw.Elapsed;
     DiagnosticLogger.LogInfo($"[SymbolLoading] PDB download complete: {pdbsFound}/{pdbsProcessed} found in {totalPdbTime.TotalSeconds:F1}s");
     DiagnosticLogger.LogInfo($"[SymbolLoading] === LoadBinaryAndDebugFiles completed in {loadStartTime.Elapsed.TotalSeconds:F1}s ===");
-    
-    // Report completion (current=total means 100%)
-    UpdateProgress(progressCallback, ProfileLoadStage.SymbolLoading, imageLimit, imageLimit);
     Trace.WriteLine($"PDB download time: {totalPdbTime}");
   }
 
@@ -1404,9 +1586,23 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
           return imageModule;
         }
 
+        if (deferDebugInfo_) {
+          // Lazy symbolization: don't wait for the debug file, frames are grouped
+          // by address bucket until SymbolizeAddressBucketsAsync loads it.
+          imageModule.DebugInfoPending = true;
+          return imageModule;
+        }
+
         // Time spent on debug info file lookup.
         // Always try to find PDB - it may be cached locally from the initial download phase.
+        // If the search started by LoadBinaryAndDebugFiles is still in progress, wait for it
+        // instead of starting another one, the result is then found in the symbol cache.
         var debugFileSw = Stopwatch.StartNew();
+
+        if (pendingDebugFiles_.TryGetValue(image.Id, out var pendingSearch)) {
+          await pendingSearch.ConfigureAwait(false);
+        }
+
         var debugInfoFile = await GetDebugInfoFile(imageModule.ModuleDocument.BinaryFile,
                                                    image, rawProfile, processId, symbolSettings);
         var debugFileTime = debugFileSw.Elapsed;
@@ -1426,6 +1622,7 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
         if (debugInfoFile != null && !debugInitialized) {
           Trace.TraceWarning($"CreateModuleBuilderAsync: Failed to load debug debugInfo for image: {image.FilePath}");
+          missingDebugInfo_ = true;
         }
 
         var totalTime = totalSw.Elapsed;
@@ -1452,6 +1649,172 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     }
   }
 
+  // Lazy symbolization: the stack frames of modules with pending debug info were resolved
+  // to address bucket functions. Load the debug info of the modules in the order of their
+  // sample weight and remap the frames in place to the functions, hottest functions first.
+  // The function profiles and call tree are recomputed periodically so that the symbols
+  // show up as they arrive, instead of all at the end.
+  private async Task<bool> SymbolizeAddressBucketsAsync(RawProfileData rawProfile, List<int> processIds,
+                                                        Task debugFilesTask,
+                                                        SymbolFileSourceSettings symbolSettings,
+                                                        CancelableTask cancelableTask) {
+    var sw = Stopwatch.StartNew();
+    var refreshSw = Stopwatch.StartNew();
+    var moduleWeights = profileData_.ModuleWeights;
+    var functionProfiles = profileData_.FunctionProfiles;
+    var modules = CollectAddressBucketFrames();
+    modules.Sort((a, b) => moduleWeights.GetValueOrDefault(b.Image.Id).
+                   CompareTo(moduleWeights.GetValueOrDefault(a.Image.Id)));
+    deferDebugInfo_ = false;
+    bool hasRemappedFrames = false;
+    int remappedFrames = 0;
+
+    Trace.WriteLine($"SymbolizeAddressBucketsAsync: Remapping frames of {modules.Count} modules");
+
+    TimeSpan FrameWeight(ResolvedProfileStackFrame frame) {
+      return functionProfiles.TryGetValue(frame.FrameDetails.Function, out var profile) ?
+        profile.Weight : TimeSpan.Zero;
+    }
+
+    foreach (var module in modules) {
+      if (cancelableTask is {IsCanceled: true}) {
+        return false;
+      }
+
+      if (!imageModuleMap_.TryGetValue(module.Image.Id, out var imageModule)) {
+        continue;
+      }
+
+      if (pendingDebugFiles_.TryGetValue(module.Image.Id, out var pendingSearch)) {
+        await pendingSearch.ConfigureAwait(false);
+      }
+
+      var debugInfoFile = await GetDebugInfoFile(imageModule.ModuleDocument.BinaryFile, module.Image,
+                                                 rawProfile, module.ProcessId, symbolSettings).ConfigureAwait(false);
+
+      if (cancelableTask is {IsCanceled: true}) {
+        return false; // Profile unloaded while the debug file was searched.
+      }
+
+      imageModule.DebugInfoPending = false;
+
+      if (debugInfoFile == null ||
+          !await imageModule.InitializeDebugInfo(debugInfoFile).ConfigureAwait(false)) {
+        Trace.WriteLine($"SymbolizeAddressBucketsAsync: No debug info for {module.Image.ModuleName}");
+        missingDebugInfo_ = true;
+        continue; // Keep the address buckets.
+      }
+
+      module.Frames.Sort((a, b) => FrameWeight(b).CompareTo(FrameWeight(a)));
+      var remappedModuleFrames = new List<(ResolvedProfileStackFrame, IRTextFunction,
+                                           ResolvedProfileStackFrameKey)>(module.Frames.Count);
+
+      foreach (var frame in module.Frames) {
+        var funcPair = imageModule.GetOrCreateFunction(frame.FrameRVA);
+        var frameDetails = new ResolvedProfileStackFrameKey(funcPair.DebugInfo, module.Image,
+                                                            imageModule.IsManaged);
+        remappedModuleFrames.Add((frame, funcPair.Function, frameDetails));
+      }
+
+      // No frame uses the address buckets anymore, remove them from the module functions.
+      profileData_.RemapStackFrames(remappedModuleFrames);
+      imageModule.RemoveAddressBucketFunctions();
+      remappedFrames += module.Frames.Count;
+      hasRemappedFrames = true;
+
+      if (refreshSw.ElapsedMilliseconds >= SymbolizationRefreshInterval) {
+        profileData_.RefreshFunctionProfile();
+        hasRemappedFrames = false;
+        refreshSw.Restart();
+      }
+    }
+
+    if (hasRemappedFrames) {
+      profileData_.RefreshFunctionProfile();
+    }
+
+    await debugFilesTask.ConfigureAwait(false);
+
+    if (cancelableTask is {IsCanceled: true}) {
+      return false;
+    }
+
+    if (rawProfile.HasPerformanceCounterData) {
+      ProcessPerformanceCounterEvents(rawProfile, processIds, symbolSettings, null, cancelableTask);
+      profileData_.NotifyFunctionsRemapped();
+    }
+
+    Trace.WriteLine($"SymbolizeAddressBucketsAsync: Remapped {remappedFrames} frames in {sw.Elapsed}");
+    return cancelableTask is not {IsCanceled: true};
+  }
+
+  // Collects the unique stack frames resolved to address bucket functions, by module.
+  private List<AddressBucketModule> CollectAddressBucketFrames() {
+    var modules = new Dictionary<ProfileImage, AddressBucketModule>();
+    var visitedFrames = new HashSet<ResolvedProfileStackFrame>();
+    var stacks = profileData_.Samples.Stacks;
+
+    for (int i = 0; i < stacks.Count; i++) {
+      var stack = stacks[i];
+
+      foreach (var frame in stack.StackFrames) {
+        var frameDetails = frame.FrameDetails;
+
+        if (frameDetails.IsUnknown || frameDetails.DebugInfo == null ||
+            !ProfileModuleBuilder.IsAddressBucketFunction(frameDetails.DebugInfo) ||
+            !visitedFrames.Add(frame)) {
+          continue;
+        }
+
+        if (!modules.TryGetValue(frameDetails.Image, out var module)) {
+          module = new AddressBucketModule(frameDetails.Image, stack.Context.ProcessId);
+          modules[frameDetails.Image] = module;
+        }
+
+        module.Frames.Add(frame);
+      }
+    }
+
+    return modules.ToValueList();
+  }
+
+  private sealed class AddressBucketModule(ProfileImage image, int processId) {
+    public ProfileImage Image { get; } = image;
+    public int ProcessId { get; } = processId;
+    public List<ResolvedProfileStackFrame> Frames { get; } = new();
+  }
+
+  private async Task StartFileSessionAsync(ProfileTraceInfo traceInfo, string mainImageName) {
+    // Determine the compiler target from trace metadata instead of binaries.
+    // PointerSize tells us if it's a 64-bit or 32-bit OS.
+    // Note: Individual processes can be 32-bit (WoW64) on 64-bit OS.
+    // We default to the OS architecture here; per-module architecture is inferred
+    // from path (SysWOW64 = 32-bit) or determined when the binary is loaded on-demand.
+    var irMode = IRMode.Default;
+    if (traceInfo.PointerSize == 8) {
+      // 64-bit system - could be x64 or ARM64, but x64 is far more common
+      // TODO: Could potentially detect ARM64 from other trace metadata if needed
+      irMode = IRMode.x86_64;
+      defaultArchitecture_ = Machine.Amd64;
+      DiagnosticLogger.LogInfo("[SymbolLoading] Detected 64-bit OS from trace metadata (PointerSize=8)");
+    }
+    else if (traceInfo.PointerSize == 4) {
+      irMode = IRMode.x86_64; // x86 is supported under x86_64 mode
+      defaultArchitecture_ = Machine.I386;
+      DiagnosticLogger.LogInfo("[SymbolLoading] Detected 32-bit OS from trace metadata (PointerSize=4)");
+    }
+    else {
+      DiagnosticLogger.LogWarning($"[SymbolLoading] Unknown pointer size {traceInfo.PointerSize}, defaulting to x86_64");
+      irMode = IRMode.x86_64;
+      defaultArchitecture_ = Machine.Amd64;
+    }
+
+    Trace.WriteLine($"Binary download skipped (lazy loading) - architecture detected from trace: {irMode}");
+
+    compilerInfoProvider_ = new ASMCompilerInfoProvider(irMode);
+    await (StartNewSessionRequested?.Invoke(mainImageName, SessionKind.FileSession, compilerInfoProvider_) ?? Task.CompletedTask);
+  }
+
   private async Task<DebugFileSearchResult> GetDebugInfoFile(BinaryFileSearchResult binaryFile,
                                                  ProfileImage image, RawProfileData rawProfile, int processId,
                                                  SymbolFileSourceSettings symbolSettings) {
@@ -1534,16 +1897,11 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
     }
 
     if (!imageModuleMap_.TryGetValue(queryImage.Id, out var imageModule)) {
-      // TODO: Why not lock on queryImage?
-      lock (imageLocks_[queryImage.Id % IMAGE_LOCK_COUNT]) {
-        if (imageModuleMap_.TryGetValue(queryImage.Id, out imageModule)) {
-          return imageModule;
-        }
-
-        // Fall back to sync version with deadlock risk - this is for compatibility
-        imageModule = CreateModuleBuilderAsync(queryImage, rawProfile, processId, symbolSettings).ConfigureAwait(false).GetAwaiter().GetResult();
-        imageModuleMap_.TryAdd(queryImage.Id, imageModule);
-      }
+      // Used by the performance counter processing, which can't await. The module is created
+      // by the async version on a thread pool thread, outside the image lock, so that waiting
+      // for a pending debug file download doesn't block the threads using the same lock.
+      imageModule = Task.Run(() => GetModuleBuilderAsync(rawProfile, queryImage, processId, symbolSettings))
+        .GetAwaiter().GetResult();
     }
 
     prevImage_ = queryImage;
@@ -1555,6 +1913,11 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
                                           SymbolFileSourceSettings symbolSettings,
                                           ProfileLoadProgressHandler progressCallback,
                                           CancelableTask cancelableTask) {
+    RegisterPerformanceCounters(rawProfile);
+    ProcessPerformanceCounterEvents(rawProfile, processIds, symbolSettings, progressCallback, cancelableTask);
+  }
+
+  private void RegisterPerformanceCounters(RawProfileData rawProfile) {
     // Register the counters found in the trace.
     foreach (var counter in rawProfile.PerformanceCounters) {
       profileData_.RegisterPerformanceCounter(counter);
@@ -1562,46 +1925,146 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
 
     // Try to register the metrics.
     int metricIndex = 1000;
-    int index = 0;
 
     foreach (var metric in options_.PerformanceMetrics) {
       if (metric.IsEnabled) {
         profileData_.RegisterPerformanceMetric(metricIndex++, metric);
       }
     }
+  }
 
-    //? TODO: Parallel
-    //? TODO: Use ref foreach
-    currentSampleIndex_ = 0;
-    Trace.WriteLine($"Start process PMC at {DateTime.Now}");
+  private void ProcessPerformanceCounterEvents(RawProfileData rawProfile, List<int> processIds,
+                                               SymbolFileSourceSettings symbolSettings,
+                                               ProfileLoadProgressHandler progressCallback,
+                                               CancelableTask cancelableTask) {
+    // If the PMU counters were used as sampling sources, there are no counter events
+    // and each sample counts once for every counter, the samples are used as a view
+    // of the counter events instead of creating the events.
+    bool useSamples = rawProfile.UsesSamplesAsPerformanceCounterEvents;
+    int eventCount = useSamples ? rawProfile.Samples.Count : rawProfile.PerformanceCountersEvents.Count;
+    Trace.WriteLine($"Start process PMC at {DateTime.Now}: {eventCount} " +
+                    (useSamples ? $"samples for {rawProfile.PerformanceCounters.Count} counters" : "events"));
     var sw = Stopwatch.StartNew();
 
-    foreach (var counter in rawProfile.PerformanceCountersEvents) {
-      if ((++index & PROGRESS_UPDATE_INTERVAL - 1) == 0) { // Update progress every 128K samples.
-        if (cancelableTask is {IsCanceled: true}) {
-          break;
+    // Split the events in multiple chunks like the samples, each chunk
+    // attributing the counters to the functions in its own tables.
+    int chunks = CoreSettingsProvider.GeneralSettings.CurrentCpuCoreLimit;
+#if DEBUG
+    chunks = 1;
+#endif
+    int chunkSize = useSamples ? rawProfile.ComputeSampleChunkLength(chunks) :
+      rawProfile.ComputePerfCounterChunkLength(chunks);
+    int chunkCount = Math.Max(1, (eventCount + chunkSize - 1) / Math.Max(1, chunkSize));
+    var chunkData = new PerformanceCounterChunkData[chunkCount];
+    var counterIds = rawProfile.PerformanceCounters.ConvertAll(counter => (short)counter.Id).ToArray();
+    int processedCount = 0;
+
+    Parallel.For(0, chunkCount, new ParallelOptions {MaxDegreeOfParallelism = chunks}, k => {
+      int start = Math.Min(k * chunkSize, eventCount);
+      int end = k == chunkCount - 1 ? eventCount : Math.Min((k + 1) * chunkSize, eventCount);
+      var data = new PerformanceCounterChunkData();
+      chunkData[k] = data;
+
+      // Clear thread-local caches to prevent stale data from previous trace loads.
+      prevImage_ = null;
+      prevProfileModuleBuilder_ = null;
+      RawProfileData.ClearThreadLocalCaches();
+
+      if (useSamples) {
+        int index = 0;
+
+        foreach (var sample in rawProfile.Samples.Enumerate(start, end)) {
+          if (!UpdatePerformanceCounterProgress(index++, eventCount, ref processedCount,
+                                                progressCallback, cancelableTask)) {
+            break;
+          }
+
+          // Reuse the stack resolved while processing the samples to find the function.
+          var context = sample.GetContext(rawProfile);
+
+          if (processIds.Contains(context.ProcessId)) {
+            var stack = sample.GetStack(rawProfile);
+            var resolvedStack = stack.IsUnknown ? null : stack.GetOptionalData() as ResolvedProfileStack;
+            AddPerformanceCounterSample(data, rawProfile, sample.IP, context, resolvedStack,
+                                        counterIds, symbolSettings);
+          }
         }
+      }
+      else {
+        int index = 0;
+
+        foreach (var counter in rawProfile.PerformanceCountersEvents.Enumerate(start, end)) {
+          if (!UpdatePerformanceCounterProgress(index++, eventCount, ref processedCount,
+                                                progressCallback, cancelableTask)) {
+            break;
+          }
+
+          var context = counter.GetContext(rawProfile);
 
-        UpdateProgress(progressCallback, ProfileLoadStage.PerfCounterProcessing,
-                       rawProfile.PerformanceCountersEvents.Count, index);
+          if (processIds.Contains(context.ProcessId)) {
+            AddPerformanceCounterSample(data, rawProfile, counter.IP, context, null,
+                                        new ReadOnlySpan<short>(in counter.CounterId), symbolSettings);
+          }
+        }
       }
+    });
 
-      var context = counter.GetContext(rawProfile);
+    MergePerformanceCounterChunks(chunkData);
+    Trace.WriteLine($"Done process PMC in {sw.Elapsed}");
+  }
 
-      if (!processIds.Contains(context.ProcessId)) {
-        continue;
+  private bool UpdatePerformanceCounterProgress(int chunkIndex, int eventCount, ref int processedCount,
+                                                ProfileLoadProgressHandler progressCallback,
+                                                CancelableTask cancelableTask) {
+    if ((chunkIndex + 1 & PROGRESS_UPDATE_INTERVAL - 1) != 0) {
+      return true;
+    }
+
+    if (cancelableTask is {IsCanceled: true}) {
+      return false;
+    }
+
+    UpdateProgress(progressCallback, ProfileLoadStage.PerfCounterProcessing, eventCount,
+                   Interlocked.Add(ref processedCount, PROGRESS_UPDATE_INTERVAL));
+    return true;
+  }
+
+  // Counts one event of each counter for the function and instruction at the IP.
+  private void AddPerformanceCounterSample(PerformanceCounterChunkData data, RawProfileData rawProfile,
+                                           long ip, ProfileContext context, ResolvedProfileStack resolvedStack,
+                                           ReadOnlySpan<short> counterIds,
+                                           SymbolFileSourceSettings symbolSettings) {
+    ProfileImage frameImage = null;
+    IRTextFunction function = null;
+    FunctionDebugInfo debugInfo = null;
+    long frameRva = 0;
+
+    // Use the leaf frame of the sample stack if it was resolved to a function at the IP.
+    if (resolvedStack is {FrameCount: > 0}) {
+      var frame = resolvedStack.StackFrames[0];
+      var frameDetails = frame.FrameDetails;
+
+      if (frame.FrameIP == ip && !frameDetails.IsUnknown && frameDetails.DebugInfo != null &&
+          !ProfileModuleBuilder.IsAddressBucketFunction(frameDetails.DebugInfo)) {
+        frameImage = frameDetails.Image;
+        function = frameDetails.Function;
+        debugInfo = frameDetails.DebugInfo;
+        frameRva = frame.FrameRVA;
       }
+    }
 
-      int managedBaseAddress = 0;
-      var frameImage = rawProfile.FindImageForIP(counter.IP, context);
+    bool isManaged = false;
+
+    if (frameImage == null) {
+      frameImage = rawProfile.FindImageForIP(ip, context);
 
       if (frameImage == null) {
         if (rawProfile.HasManagedMethods(context.ProcessId)) {
-          var managedFunc = rawProfile.FindManagedMethodForIP(counter.IP, context.ProcessId);
+          var managedFunc = rawProfile.FindManagedMethodForIP(ip, context.ProcessId);
 
           if (managedFunc != null) {
             frameImage = managedFunc.Image;
-            managedBaseAddress = 1;
+            isManaged = true;
           }
         }
 
@@ -1611,44 +2074,118 @@ public sealed class ETWProfileDataProvider : IProfileDataProvider, IDisposable {
         }
       }
 
-      if (frameImage != null) {
-        profileData_.AddModuleCounter(frameImage.ModuleName, counter.CounterId, 1);
-        var profileModuleBuilder = GetModuleBuilder(rawProfile, frameImage, context.ProcessId, symbolSettings);
+      if (frameImage == null) {
+        return;
+      }
 
-        if (profileModuleBuilder == null) {
-          continue;
+      frameRva = isManaged ? ip : ip - frameImage.BaseAddress;
+    }
+
+    foreach (short counterId in counterIds) {
+      data.AddModuleCounter(frameImage.ModuleName, counterId);
+    }
+
+    var profileModuleBuilder = GetModuleBuilder(rawProfile, frameImage, context.ProcessId, symbolSettings);
+
+    if (profileModuleBuilder == null || !profileModuleBuilder.HasDebugInfo) {
+      return;
+    }
+
+    if (function == null) {
+      var funcPair = profileModuleBuilder.GetOrCreateFunction(frameRva);
+      function = funcPair.Function;
+      debugInfo = funcPair.DebugInfo;
+    }
+
+    long offset = frameRva - debugInfo.RVA;
+    var profile = data.GetOrCreateFunctionProfile(function, debugInfo);
+
+    foreach (short counterId in counterIds) {
+      profile.AddCounterSample(offset, counterId, 1);
+    }
+  }
+
+  private void MergePerformanceCounterChunks(PerformanceCounterChunkData[] chunkData) {
+    // Collect the counters of each function from all chunks
+    // and merge them at once, with functions merged in parallel.
+    var mergedProfiles = new Dictionary<IRTextFunction, List<FunctionProfileData>>();
+
+    foreach (var data in chunkData) {
+      foreach (var pair in data.FunctionProfiles) {
+        ref var list = ref CollectionsMarshal.GetValueRefOrAddDefault(mergedProfiles, pair.Key, out bool exists);
+
+        if (!exists) {
+          list = new List<FunctionProfileData>(chunkData.Length + 1) {
+            profileData_.GetOrCreateFunctionProfile(pair.Key, pair.Value.FunctionDebugInfo)
+          };
         }
 
-        if (!profileModuleBuilder.HasDebugInfo) {
-          continue;
+        list.Add(pair.Value);
+      }
+
+      foreach (var pair in data.ModuleCounters) {
+        foreach (var counter in pair.Value.Counters) {
+          profileData_.AddModuleCounter(pair.Key, counter.CounterId, counter.Value);
         }
+      }
+    }
+
+    Parallel.ForEach(mergedProfiles.Values, list => FunctionProfileData.Merge(list));
+  }
+
+  // Samples of a morsel, in the store of the worker that processed it.
+  private readonly record struct SampleMorselRange(ProfileSampleStore Samples, int Start, int End);
+
+  // State of a sample processing worker, the statistics are logged
+  // once per worker instead of once per morsel.
+  private sealed class SampleWorkerState(ProfileSampleStore samples) {
+    public ProfileSampleStore Samples { get; } = samples;
+    public Stopwatch Stopwatch { get; } = Stopwatch.StartNew();
+    public int MorselCount { get; set; }
+    public int ResolvedStacks { get; set; }
+    public int KernelSamplesSkipped { get; set; }
+    public int OtherProcessSamplesSkipped { get; set; }
+    public TimeSpan TotalWeight { get; set; }
+    public TimeSpan ProfileWeight { get; set; }
+  }
 
-        long frameRva = managedBaseAddress != 0 ?
-          counter.IP : counter.IP - frameImage.BaseAddress;
+  private sealed class PerformanceCounterChunkData {
+    public Dictionary<IRTextFunction, FunctionProfileData> FunctionProfiles { get; } = new();
+    public Dictionary<string, PerformanceCounterValueSet> ModuleCounters { get; } = new();
 
-        var funcPair = profileModuleBuilder.GetOrCreateFunction(frameRva);
-        long funcRva = funcPair.DebugInfo.RVA;
-        long offset = frameRva - funcRva;
+    public FunctionProfileData GetOrCreateFunctionProfile(IRTextFunction function, FunctionDebugInfo debugInfo) {
+      ref var profile = ref CollectionsMarshal.GetValueRefOrAddDefault(FunctionProfiles, function, out bool exists);
 
-        var profile = profileData_.GetOrCreateFunctionProfile(funcPair.Function, funcPair.DebugInfo);
-        profile.AddCounterSample(offset, counter.CounterId, 1);
+      if (!exists) {
+        profile = new FunctionProfileData(debugInfo);
       }
 
-      // profileData_.Events.Add((counter, null));
+      return profile;
     }
 
-    Trace.WriteLine($"Done process PMC in {sw.Elapsed}");
+    public void AddModuleCounter(string moduleName, int counterId) {
+      ref var counterSet = ref CollectionsMarshal.GetValueRefOrAddDefault(ModuleCounters, moduleName, out bool exists);
+
+      if (!exists) {
+        counterSet = new PerformanceCounterValueSet();
+      }
+
+      counterSet.AddCounterSample(counterId, 1);
+    }
   }
 
   private BinaryFileDescriptor FromProfileImage(ProfileImage image, RawProfileData rawProfile, int processId) {
+    return FromProfileImage(image, rawProfile.FindProcess(processId), rawProfile.TraceInfo.PointerSize);
+  }
+
+  private BinaryFileDescriptor FromProfileImage(ProfileImage image, ProfileProcess process, int pointerSize) {
     // Architecture detection: Use process's IsWow64 flag from ETW ProcessStart events.
     // ProcessFlags.Wow64 indicates a 32-bit process running on 64-bit Windows.
     var architecture = defaultArchitecture_;
 
     // For kernel modules, use OS architecture (kernel is always native)
-    if (!ETWEventProcessor.IsKernelAddress((ulong)image.BaseAddress, rawProfile.TraceInfo.PointerSize)) {
+    if (!ETWEventProcessor.IsKernelAddress((ulong)image.BaseAddress, pointerSize)) {
       // User-mode module: check if the process is WoW64 (32-bit on 64-bit)
-      var process = rawProfile.FindProcess(processId);
       if (process != null && process.IsWow64) {
         architecture = Machine.I386;
       }
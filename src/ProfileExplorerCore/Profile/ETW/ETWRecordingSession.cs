@@ -304,7 +304,7 @@ public sealed class ETWRecordingSession : IDisposable {
       if (options_.RecordDotNetAssembly) {
         try {
           Trace.WriteLine("Start .NET profiler named pipe server");
-          pipeServer_ = new ProfilerNamedPipeServer();
+          pipeServer_ = new ProfilerNamedPipeServer(options_.UseSharedMemoryTransport);
         }
         catch (Exception ex) {
           Trace.TraceError($"Failed to start named pipe: {ex.Message}\n{ex.StackTrace}");
@@ -379,6 +379,11 @@ public sealed class ETWRecordingSession : IDisposable {
     procInfo.EnvironmentVariables["CORECLR_ENABLE_PROFILING"] = "1";
     procInfo.EnvironmentVariables["CORECLR_PROFILER"] = ProfilerGuid;
     procInfo.EnvironmentVariables["CORECLR_PROFILER_PATH"] = profilerPath_;
+
+    if (options_.UseSharedMemoryTransport) {
+      procInfo.EnvironmentVariables["PEX_SHARED_MEMORY_RING"] = "1";
+    }
+
     Trace.WriteLine($"Using managed profiler {profilerPath_}");
     return true;
   }
@@ -386,7 +391,8 @@ public sealed class ETWRecordingSession : IDisposable {
   private bool AttachProfiler(int processId) {
     try {
       Trace.WriteLine($"Attaching managed profiler to proc {processId}: {profilerPath_}");
-      byte[] profilerArgs = Array.Empty<byte>();
+      // The first byte enables the shared memory transport in the profiler.
+      byte[] profilerArgs = options_.UseSharedMemoryTransport ? new byte[] {1} : Array.Empty<byte>();
       diagClient_ = new DiagnosticsClient(processId);
       diagClient_.AttachProfiler(TimeSpan.FromSeconds(10),
                                  Guid.Parse(ProfilerGuid), profilerPath_, profilerArgs);
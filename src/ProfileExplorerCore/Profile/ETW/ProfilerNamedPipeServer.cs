@@ -1,10 +1,12 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Collections.Generic;
 using System.Diagnostics;
 using System.Runtime.InteropServices;
 using System.Text;
 using System.Threading;
+using System.Threading.Tasks;
 using ProfileExplorer.Core.Profile.Utils;
 
 namespace ProfileExplorer.Core.Profile.ETW;
@@ -18,9 +20,17 @@ public class ProfilerNamedPipeServer : IDisposable {
 
   public const string PipeName = "PEXProfilerPipe";
   private NamedPipeServer instance_;
+  private Dictionary<(int ProcessId, long Address), string> callTargetNames_;
+  private object callTargetLock_;
+  private bool allowSharedMemoryTransport_;
+  private SharedMemoryRingReader ringReader_;
+  private Task ringReaderTask_;
 
-  public ProfilerNamedPipeServer() {
+  public ProfilerNamedPipeServer(bool allowSharedMemoryTransport = false) {
     instance_ = new NamedPipeServer(PipeName);
+    callTargetNames_ = new Dictionary<(int ProcessId, long Address), string>();
+    callTargetLock_ = new object();
+    allowSharedMemoryTransport_ = allowSharedMemoryTransport;
   }
 
   public void Dispose() {
@@ -36,36 +46,8 @@ public class ProfilerNamedPipeServer : IDisposable {
     try {
       Trace.WriteLine("Start pipe reading thread");
 
-      instance_.ReceiveMessages((header, body) => {
-        if (cancellationToken.IsCancellationRequested) {
-          Trace.WriteLine($"Canceled {Environment.CurrentManagedThreadId}");
-          return;
-        }
-
-        switch ((MessageKind)header.Kind) {
-          case MessageKind.FunctionCode: {
-            var message = MemoryMarshal.Cast<byte, FunctionCodeMessage>(body)[0];
-            byte[] code = body.AsSpan().Slice(28, message.CodeSize).ToArray();
-            FunctionCodeReceived?.Invoke(message.FunctionId, message.ReJITId, message.ProcessId,
-                                         message.Address, message.CodeSize, code);
-            break;
-          }
-          case MessageKind.FunctionCallTarget: {
-            var message = MemoryMarshal.Cast<byte, FunctionCallTargetMessage>(body)[0];
-            var nameBytes = body.AsSpan().Slice(28, message.NameLength);
-
-            // Don't include the null terminator.
-            if (nameBytes[^1] == 0) {
-              nameBytes = nameBytes.Slice(0, nameBytes.Length - 1);
-            }
-
-            string name = Encoding.UTF8.GetString(nameBytes);
-            FunctionCallTargetsReceived?.Invoke(message.FunctionId, message.ReJITId, message.ProcessId,
-                                                message.Address, name);
-            break;
-          }
-        }
-      }, cancellationToken);
+      instance_.ReceiveMessages((header, body) => HandleMessage(header, body, cancellationToken),
+                                cancellationToken);
       return true;
     }
     catch (Exception ex) {
@@ -104,16 +86,141 @@ public class ProfilerNamedPipeServer : IDisposable {
   }
 
   public void Stop() {
+    StopRingReader();
     instance_.Dispose();
     instance_ = null;
   }
 
+  private void HandleMessage(NamedPipeServer.PipeMessageHeader header, byte[] body,
+                             CancellationToken cancellationToken) {
+    if (cancellationToken.IsCancellationRequested) {
+      Trace.WriteLine($"Canceled {Environment.CurrentManagedThreadId}");
+      return;
+    }
+
+    switch ((MessageKind)header.Kind) {
+      case MessageKind.FunctionCode: {
+        var message = MemoryMarshal.Cast<byte, FunctionCodeMessage>(body)[0];
+        byte[] code = body.AsSpan().Slice(28, message.CodeSize).ToArray();
+        FunctionCodeReceived?.Invoke(message.FunctionId, message.ReJITId, message.ProcessId,
+                                     message.Address, message.CodeSize, code);
+        break;
+      }
+      case MessageKind.FunctionCallTarget: {
+        var message = MemoryMarshal.Cast<byte, FunctionCallTargetMessage>(body)[0];
+        var nameBytes = body.AsSpan().Slice(28, message.NameLength);
+
+        // Don't include the null terminator.
+        if (nameBytes[^1] == 0) {
+          nameBytes = nameBytes.Slice(0, nameBytes.Length - 1);
+        }
+
+        string name = Encoding.UTF8.GetString(nameBytes);
+        FunctionCallTargetsReceived?.Invoke(message.FunctionId, message.ReJITId, message.ProcessId,
+                                            message.Address, name);
+        break;
+      }
+      case MessageKind.FunctionCallTargets: {
+        var message = MemoryMarshal.Cast<byte, FunctionCallTargetsMessage>(body)[0];
+        ReceiveCallTargets(message, body.AsSpan().Slice(20));
+        break;
+      }
+      case MessageKind.SharedMemoryRing: {
+        var message = MemoryMarshal.Cast<byte, SharedMemoryRingMessage>(body)[0];
+        message.Accepted = StartRingReader(message.ProcessId, cancellationToken) ? 1 : 0;
+        instance_.SendMessage((int)MessageKind.SharedMemoryRing, message);
+        break;
+      }
+    }
+  }
+
+  private bool StartRingReader(int processId, CancellationToken cancellationToken) {
+    // Only one profiled process connects to a pipe instance.
+    if (!allowSharedMemoryTransport_ || ringReader_ != null) {
+      return false;
+    }
+
+    ringReader_ = SharedMemoryRingReader.Open(processId);
+
+    if (ringReader_ == null) {
+      return false;
+    }
+
+    // After accepting the ring, the profiler sends the code messages
+    // through it starting with its next batch, the pipe is then used
+    // only for control messages.
+    Trace.WriteLine($"Using shared memory transport for proc {processId}");
+    var reader = ringReader_;
+    ringReaderTask_ = Task.Factory.StartNew(() => {
+      try {
+        reader.ReceiveMessages((header, body) => HandleMessage(header, body, cancellationToken),
+                               cancellationToken);
+      }
+      catch (Exception ex) {
+        Trace.WriteLine($"Failed to receive shared memory messages: {ex}");
+      }
+    }, TaskCreationOptions.LongRunning);
+    return true;
+  }
+
+  private void StopRingReader() {
+    if (ringReader_ == null) {
+      return;
+    }
+
+    // Let the reader consume what the profiler wrote before stopping.
+    ringReader_.Stop();
+    ringReaderTask_.Wait();
+    Trace.WriteLine($"Shared memory transport: {ringReader_.Statistics}");
+    ringReader_.Dispose();
+    ringReader_ = null;
+    ringReaderTask_ = null;
+  }
+
+  private void ReceiveCallTargets(FunctionCallTargetsMessage message, ReadOnlySpan<byte> targets) {
+    for (int i = 0; i < message.TargetCount; i++) {
+      long address = MemoryMarshal.Read<long>(targets);
+      int nameLength = MemoryMarshal.Read<int>(targets.Slice(8));
+      targets = targets.Slice(12);
+      string name;
+
+      // The profiler sends the name of a target address only once,
+      // later messages refer to it by address.
+      // Messages from the pipe and the shared memory ring are handled
+      // on different threads.
+      if (nameLength >= 0) {
+        name = Encoding.UTF8.GetString(targets.Slice(0, nameLength));
+        targets = targets.Slice(nameLength);
+
+        lock (callTargetLock_) {
+          callTargetNames_[(message.ProcessId, address)] = name;
+        }
+      }
+      else {
+        bool found;
+
+        lock (callTargetLock_) {
+          found = callTargetNames_.TryGetValue((message.ProcessId, address), out name);
+        }
+
+        if (!found) {
+          continue;
+        }
+      }
+
+      FunctionCallTargetsReceived?.Invoke(message.FunctionId, message.ReJITId, message.ProcessId,
+                                          address, name);
+    }
+  }
+
   private enum MessageKind {
     StartSession,
     EndSession,
     FunctionCode,
     FunctionCallTarget,
-    RequestFunctionCode
+    RequestFunctionCode,
+    FunctionCallTargets,
+    SharedMemoryRing
   }
 
   [StructLayout(LayoutKind.Sequential, Pack = 1)]
@@ -136,6 +243,23 @@ public class ProfilerNamedPipeServer : IDisposable {
     // UTF-8 name bytes start here at offset 28.
   }
 
+  [StructLayout(LayoutKind.Sequential, Pack = 1)]
+  private struct FunctionCallTargetsMessage {
+    public long FunctionId; // 0
+    public int ReJITId; // 8
+    public int ProcessId; // 12
+    public int TargetCount; // 16
+    // Targets start here at offset 20, each is an address,
+    // a name length (-1 if sent before) and the UTF-8 name bytes.
+  }
+
+  [StructLayout(LayoutKind.Sequential, Pack = 1)]
+  private struct SharedMemoryRingMessage {
+    public int ProcessId; // 0
+    public int Accepted; // 4
+    public long Capacity; // 8
+  }
+
   [StructLayout(LayoutKind.Sequential, Pack = 1)]
   private struct RequestFunctionCodeMessage {
     public long FunctionId; // 0
@@ -2,7 +2,6 @@
 // Licensed under the MIT license.
 using System;
 using System.Collections.Generic;
-using System.Threading.Tasks;
 using ProfileExplorer.Core.Profile.CallTree;
 using ProfileExplorer.Core.Profile.Data;
 
@@ -10,29 +9,64 @@ namespace ProfileExplorer.Core.Profile.Processing;
 
 public sealed class CallTreeProcessor : ProfileSampleProcessor {
   private List<ProfileCallTree> chunks_;
+  private List<long[]> stackHistograms_;
   private int maxChunks_;
+  private bool useStackHistogram_;
 
-  public CallTreeProcessor(int maxChunks) {
+  public CallTreeProcessor(int maxChunks, bool useStackHistogram = true) {
     chunks_ = new List<ProfileCallTree>();
+    stackHistograms_ = new List<long[]>();
     maxChunks_ = maxChunks;
+    useStackHistogram_ = useStackHistogram;
   }
 
   public ProfileCallTree CallTree { get; set; } = new();
 
+  // With useStackHistogram, the samples are first aggregated into a weight
+  // per unique stack and the call tree is built once per unique stack,
+  // otherwise the call tree is updated for each sample.
   public static ProfileCallTree Compute(ProfileData profile, ProfileSampleFilter filter,
+                                        int maxChunks = int.MaxValue,
+                                        bool useStackHistogram = true) {
+    var funcProcessor = new CallTreeProcessor(maxChunks, useStackHistogram);
+    funcProcessor.ProcessSampleChunk(profile, filter, maxChunks);
+    return funcProcessor.CallTree;
+  }
+
+  // Computes the call tree from the stack histogram of the filtered samples,
+  // the time range and thread filters are expected to be already applied.
+  public static ProfileCallTree Compute(ProfileData profile, ProfileStackHistogram histogram,
                                         int maxChunks = int.MaxValue) {
     var funcProcessor = new CallTreeProcessor(maxChunks);
-    funcProcessor.ProcessSampleChunk(profile, filter, maxChunks);
+    int trees = Math.Min(maxChunks, funcProcessor.DefaultThreadCount);
+    funcProcessor.BuildStackHistogramCallTrees(histogram.Weights, profile.Samples.Stacks, trees);
+    funcProcessor.Complete();
     return funcProcessor.CallTree;
   }
 
-  protected override void ProcessSample(ref ProfileSample sample, ResolvedProfileStack stack,
-                                        int sampleIndex, object chunkData) {
+  protected override void ProcessSample(int sampleIndex, TimeSpan weight, ResolvedProfileStack stack,
+                                        object chunkData) {
+    if (useStackHistogram_) {
+      var histogram = (long[])chunkData;
+      histogram[Samples.StackIds[sampleIndex]] += weight.Ticks;
+      return;
+    }
+
     var callTree = (ProfileCallTree)chunkData;
-    callTree.UpdateCallTree(ref sample, stack);
+    callTree.UpdateCallTree(weight, Samples.Stacks, Samples.StackIds[sampleIndex]);
   }
 
   protected override object InitializeChunk(int k, int samplesPerChunk) {
+    if (useStackHistogram_) {
+      var histogram = new long[Samples.Stacks.Count];
+
+      lock (stackHistograms_) {
+        stackHistograms_.Add(histogram);
+      }
+
+      return histogram;
+    }
+
     // Partition the node IDs into namespaces based on the chunk
     // of samples they are created from - this ensures that each
     // call tree will usue unique node IDs when compared to other call trees.
@@ -47,45 +81,59 @@ public sealed class CallTreeProcessor : ProfileSampleProcessor {
   }
 
   protected override void Complete() {
+    if (useStackHistogram_) {
+      SumStackHistograms();
+    }
+
     lock (chunks_) {
-      // Multi-threaded merging of partial call trees.
-      while (chunks_.Count > 1) {
-        int step = Math.Min(chunks_.Count, 2);
-        // Trace.WriteLine($"=> Merging {chunks_.Count} chunks, step {step}");
-
-        var tasks = new Task[chunks_.Count / step];
-        var newChunks = new List<ProfileCallTree>(chunks_.Count / step);
-
-        for (int i = 0; i < chunks_.Count / step; i++) {
-          int iCopy = i;
-          newChunks.Add(chunks_[iCopy * step]);
-
-          tasks[i] = Task.Run(() => {
-            for (int k = 1; k < step; k++) {
-              chunks_[iCopy * step].MergeWith(chunks_[iCopy * step + k]);
-            }
-          });
-        }
+      // Merge the partial call trees in a single pass, with the subtrees
+      // of different functions merged in parallel.
+      CallTree = ProfileCallTree.Merge(chunks_);
+#if DEBUG
+      CallTree.VerifyCycles();
+#endif
+    }
+  }
 
-        Task.WaitAll(tasks);
+  private void SumStackHistograms() {
+    // Sum up the per-chunk stack weights. Since all call tree updates
+    // are linear in the sample weight, updating the call tree once per unique stack
+    // with the total weight gives the same result as updating it for each sample.
+    var histogram = stackHistograms_[0];
 
-        // Handle any chunks that were not paired during the parallel phase.
-        // With a step of 2 this can happen only in the first round.
-        if (chunks_.Count % step != 0) {
-          int lastHandledIndex = chunks_.Count / step * step;
+    for (int i = 1; i < stackHistograms_.Count; i++) {
+      var otherHistogram = stackHistograms_[i];
 
-          for (int i = lastHandledIndex; i < chunks_.Count; i++) {
-            chunks_[0].MergeWith(chunks_[i]);
-          }
-        }
+      for (int stackId = 0; stackId < histogram.Length; stackId++) {
+        histogram[stackId] += otherHistogram[stackId];
+      }
+    }
+
+    BuildStackHistogramCallTrees(histogram, Samples.Stacks, stackHistograms_.Count);
+  }
 
-        chunks_ = newChunks;
+  private void BuildStackHistogramCallTrees(long[] histogram, ResolvedProfileStackTable stacks,
+                                            int maxTrees) {
+    // Build partial call trees for ranges of stacks in parallel,
+    // they get merged afterwards like the per-sample chunk trees.
+    int trees = Math.Max(1, maxTrees);
+    var scheduler = CreateMorselScheduler(0, histogram.Length, trees, MinStackMorselSize);
+
+    scheduler.Run(trees, k => {
+      int startNodeId = k * (int.MaxValue / (trees + 1));
+      var chunk = new ProfileCallTree(startNodeId);
+
+      lock (chunks_) {
+        chunks_.Add(chunk);
       }
 
-      CallTree = chunks_[0];
-#if DEBUG
-      CallTree.VerifyCycles();
-#endif
-    }
+      return chunk;
+    }, (start, end, chunk) => {
+      for (int stackId = start; stackId < end; stackId++) {
+        if (histogram[stackId] != 0) {
+          chunk.UpdateCallTree(TimeSpan.FromTicks(histogram[stackId]), stacks, stackId);
+        }
+      }
+    });
   }
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Generic;
 using System.Runtime.InteropServices;
 using System.Threading.Tasks;
@@ -68,48 +69,86 @@ public sealed class FunctionProfileProcessor : ProfileSampleProcessor {
     return chunk;
   }
 
-  protected override void ProcessSample(ref ProfileSample sample, ResolvedProfileStack stack,
-                                        int sampleIndex, object chunkData) {
-    if (filterStackFuncts_ != null) {
-      // Filtering of functions to a single instance is enabled,
-      // accept only samples that have the instance path nodes
-      // as a prefix of the call stack, this accounts for total weight.
-      if (stack.FrameCount < filterStackFuncts_.Count) {
-        return;
+  // Computes the function profiles from the stack histogram of the filtered samples,
+  // the time range and thread filters are expected to be already applied.
+  public static ProfileData Compute(ProfileData profile, ProfileStackHistogram histogram,
+                                    ProfileSampleFilter filter, int maxChunks = int.MaxValue) {
+    var funcProcessor = new FunctionProfileProcessor(filter);
+    funcProcessor.ProcessStackHistogram(profile.Samples.Stacks, histogram, maxChunks);
+    return funcProcessor.Profile;
+  }
+
+  private void ProcessStackHistogram(ResolvedProfileStackTable stacks, ProfileStackHistogram histogram,
+                                     int maxChunks) {
+    int workers = Math.Min(maxChunks, DefaultThreadCount);
+    int stacksPerWorker = (histogram.Count + workers - 1) / Math.Max(1, workers);
+    var scheduler = CreateMorselScheduler(0, histogram.Count, workers, MinStackMorselSize);
+
+    scheduler.Run(workers, k => InitializeChunk(k, stacksPerWorker), (start, end, chunkData) => {
+      for (int stackId = start; stackId < end; stackId++) {
+        if (histogram.HasStack(stackId)) {
+          ProcessStack(stacks[stackId], TimeSpan.FromTicks(histogram.Weights[stackId]),
+                       histogram.FirstSampleIndex[stackId], histogram.LastSampleIndex[stackId],
+                       (ChunkData)chunkData);
+        }
       }
+    }, CompleteChunk);
 
-      bool foundMatch = false;
+    Complete();
+  }
 
-      foreach (var stackFuncts in filterStackFuncts_) {
-        // Check if instance path nodes are a prefix of the call stack.
-        if (stack.FrameCount < stackFuncts.Count) {
-          continue;
-        }
+  protected override void ProcessSample(int sampleIndex, TimeSpan weight, ResolvedProfileStack stack,
+                                        object chunkData) {
+    ProcessStack(stack, weight, sampleIndex, sampleIndex, (ChunkData)chunkData);
+  }
 
-        bool isMatch = true;
+  private bool MatchesInstancePath(ResolvedProfileStack stack) {
+    // The frames are read from the root, copy them once
+    // instead of walking the stack table for each frame.
+    int frameCount = stack.FrameCount;
+    var frames = ArrayPool<ResolvedProfileStackFrame>.Shared.Rent(frameCount);
+    stack.StackFrames.CopyTo(frames);
+    bool foundMatch = false;
+
+    foreach (var stackFuncts in filterStackFuncts_) {
+      // Check if instance path nodes are a prefix of the call stack.
+      if (frameCount < stackFuncts.Count) {
+        continue;
+      }
 
-        for (int i = 0; i < stackFuncts.Count; i++) {
-          if (stackFuncts[i] !=
-              stack.StackFrames[stack.FrameCount - i - 1].FrameDetails.Function) {
-            isMatch = false;
-            break;
-          }
-        }
+      bool isMatch = true;
 
-        if (isMatch) {
-          foundMatch = true;
+      for (int i = 0; i < stackFuncts.Count; i++) {
+        if (stackFuncts[i] != frames[frameCount - i - 1].FrameDetails.Function) {
+          isMatch = false;
           break;
         }
       }
 
-      if (!foundMatch) {
+      if (isMatch) {
+        foundMatch = true;
+        break;
+      }
+    }
+
+    ArrayPool<ResolvedProfileStackFrame>.Shared.Return(frames, true);
+    return foundMatch;
+  }
+
+  private void ProcessStack(ResolvedProfileStack stack, TimeSpan weight,
+                            int firstSampleIndex, int lastSampleIndex, ChunkData data) {
+    if (filterStackFuncts_ != null) {
+      // Filtering of functions to a single instance is enabled,
+      // accept only samples that have the instance path nodes
+      // as a prefix of the call stack, this accounts for total weight.
+      if (stack.FrameCount < filterStackFuncts_.Count ||
+          !MatchesInstancePath(stack)) {
         return;
       }
     }
 
-    var data = (ChunkData)chunkData;
-    data.TotalWeight += sample.Weight;
-    data.ProfileWeight += sample.Weight;
+    data.TotalWeight += weight;
+    data.ProfileWeight += weight;
 
     bool isTopFrame = true;
     data.StackModules.Clear();
@@ -123,7 +162,7 @@ public sealed class FunctionProfileProcessor : ProfileSampleProcessor {
       var frameDetails = resolvedFrame.FrameDetails;
 
       if (isTopFrame && data.StackModules.Add(frameDetails.Image.Id)) {
-        data.ModuleWeights.AccumulateValue(frameDetails.Image.Id, sample.Weight);
+        data.ModuleWeights.AccumulateValue(frameDetails.Image.Id, weight);
       }
 
       long funcRva = frameDetails.DebugInfo.RVA;
@@ -140,17 +179,17 @@ public sealed class FunctionProfileProcessor : ProfileSampleProcessor {
 
       // Don't count the inclusive time for recursive functions multiple times.
       if (data.StackFunctions.Add(textFunction)) {
-        funcProfile.AddInstructionSample(offset, sample.Weight);
-        funcProfile.Weight += sample.Weight;
+        funcProfile.AddInstructionSample(offset, weight);
+        funcProfile.Weight += weight;
 
         // Set sample range covered by function.
-        funcProfile.SampleStartIndex = Math.Min(funcProfile.SampleStartIndex, sampleIndex);
-        funcProfile.SampleEndIndex = Math.Max(funcProfile.SampleEndIndex, sampleIndex);
+        funcProfile.SampleStartIndex = Math.Min(funcProfile.SampleStartIndex, firstSampleIndex);
+        funcProfile.SampleEndIndex = Math.Max(funcProfile.SampleEndIndex, lastSampleIndex);
       }
 
       // Count the exclusive time for the top frame function.
       if (isTopFrame) {
-        funcProfile.ExclusiveWeight += sample.Weight;
+        funcProfile.ExclusiveWeight += weight;
       }
 
       isTopFrame = false;
@@ -172,59 +211,32 @@ public sealed class FunctionProfileProcessor : ProfileSampleProcessor {
 
   protected override void Complete() {
     lock (chunks_) {
-      while (chunks_.Count > 1) {
-        int step = Math.Min(chunks_.Count, 2);
-        // Trace.WriteLine($"=> Merging {chunks_.Count} chunks, step {step}");
-
-        var tasks = new Task[chunks_.Count / step];
-        var newChunks = new List<ChunkData>(chunks_.Count / step);
-
-        for (int i = 0; i < chunks_.Count / step; i++) {
-          int iCopy = i;
-          newChunks.Add(chunks_[iCopy * step]);
-
-          tasks[i] = Task.Run(() => {
-            for (int k = 1; k < step; k++) {
-              var destChunk = chunks_[iCopy * step];
-              var sourceChunk = chunks_[iCopy * step + k];
-              MergeChuncks(destChunk, sourceChunk);
-            }
-          });
-        }
-
-        Task.WaitAll(tasks);
+      // Collect the profiles of each function from all chunks
+      // and merge them at once, with functions merged in parallel.
+      var functionProfiles = chunks_[0].FunctionProfiles;
+      var mergedProfiles = new Dictionary<IRTextFunction, List<FunctionProfileData>>(functionProfiles.Count);
 
-        // Handle any chuncks that were not paired during the parallel phase.
-        // With a step of 2 this can happen only in the first round.
-        if (chunks_.Count % step != 0) {
-          int lastHandledIndex = chunks_.Count / step * step;
+      foreach (var chunk in chunks_) {
+        foreach (var pair in chunk.FunctionProfiles) {
+          ref var list = ref CollectionsMarshal.GetValueRefOrAddDefault(mergedProfiles, pair.Key, out bool exists);
 
-          for (int i = lastHandledIndex; i < chunks_.Count; i++) {
-            MergeChuncks(chunks_[0], chunks_[i]);
+          if (!exists) {
+            list = new List<FunctionProfileData>(chunks_.Count);
           }
-        }
 
-        chunks_ = newChunks;
+          list.Add(pair.Value);
+        }
       }
 
-      lock (Profile) {
-        Profile.FunctionProfiles = chunks_[0].FunctionProfiles;
-      }
-    }
-  }
-
-  private static void MergeChuncks(ChunkData destChunk, ChunkData sourceChunk) {
-    foreach (var pair in sourceChunk.FunctionProfiles) {
-      ref var existingValue =
-        ref CollectionsMarshal.GetValueRefOrAddDefault(destChunk.FunctionProfiles, pair.Key,
-                                                       out bool exists);
+      // This also sorts the samples of profiles found in a single chunk.
+      Parallel.ForEach(mergedProfiles.Values, list => FunctionProfileData.Merge(list));
 
-      if (exists) {
-        existingValue.MergeWith(pair.Value);
+      foreach (var pair in mergedProfiles) {
+        functionProfiles[pair.Key] = pair.Value[0];
       }
-      else {
-        // Copy over func. profile if missing.
-        existingValue = pair.Value;
+
+      lock (Profile) {
+        Profile.FunctionProfiles = functionProfiles;
       }
     }
   }
@@ -1,5 +1,6 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+using System;
 using System.Collections.Generic;
 using System.Diagnostics;
 using ProfileExplorer.Core.Profile.CallTree;
@@ -10,7 +11,7 @@ using ProfileExplorer.Core.Utilities;
 namespace ProfileExplorer.Core.Profile.Processing;
 
 public sealed class FunctionSamplesProcessor : ProfileSampleProcessor {
-  private const int AllThreadsKey = -1;
+  public const int AllThreadsKey = -1;
   private Dictionary<int, List<SampleIndex>> threadListMap_;
   private List<ChunkData> chunks_;
   private ProfileCallTreeNode node_;
@@ -27,11 +28,38 @@ public sealed class FunctionSamplesProcessor : ProfileSampleProcessor {
             int maxChunks = int.MaxValue) {
     // Compute the list of samples associated with the function,
     // for each thread it was executed on.
+    if (filter == null || filter.IncludesAll) {
+      // Without a filter, take the samples from the index of the call tree
+      // if the node belongs to it, instead of checking the stack of each sample.
+      var sampleIndices = profile.GetCallTreeSampleIndex()?.GetSampleIndices(node);
+
+      if (sampleIndices != null) {
+        return CreateThreadListMap(profile.Samples, sampleIndices);
+      }
+    }
+
     var funcProcessor = new FunctionSamplesProcessor(node);
     funcProcessor.ProcessSampleChunk(profile, filter, maxChunks);
     return funcProcessor.threadListMap_;
   }
 
+  private static Dictionary<int, List<SampleIndex>>
+    CreateThreadListMap(ProfileSampleStore samples, int[] sampleIndices) {
+    int[] contextThreadIds = samples.ComputeContextThreadIds();
+    var contextIds = samples.ContextIds;
+    var allThreadsList = new List<SampleIndex>(sampleIndices.Length);
+    var threadListMap = new Dictionary<int, List<SampleIndex>>();
+    threadListMap[AllThreadsKey] = allThreadsList;
+
+    foreach (int sampleIndex in sampleIndices) {
+      var index = new SampleIndex(sampleIndex, samples.TimeAt(sampleIndex));
+      threadListMap.GetOrAddValue(contextThreadIds[contextIds[sampleIndex]]).Add(index);
+      allThreadsList.Add(index);
+    }
+
+    return threadListMap;
+  }
+
   protected override object InitializeChunk(int k, int samplesPerChunk) {
     var chunk = new ChunkData();
 
@@ -42,21 +70,19 @@ public sealed class FunctionSamplesProcessor : ProfileSampleProcessor {
     return chunk;
   }
 
-  protected override void ProcessSample(ref ProfileSample sample, ResolvedProfileStack stack,
-                                        int sampleIndex, object chunkData) {
+  protected override void ProcessSample(int sampleIndex, TimeSpan weight, ResolvedProfileStack stack,
+                                        object chunkData) {
     var data = (ChunkData)chunkData;
     var currentNode = node_;
     bool match = false;
 
-    for (int k = 0; k < stack.StackFrames.Count; k++) {
+    foreach (var stackFrame in stack.StackFrames) {
       if (currentNode == null || currentNode.IsGroup) {
         // Mismatch along the call path leading to the function.
         match = false;
         break;
       }
 
-      var stackFrame = stack.StackFrames[k];
-
       if (stackFrame.IsUnknown) {
         continue;
       }
@@ -76,7 +102,7 @@ public sealed class FunctionSamplesProcessor : ProfileSampleProcessor {
 
     if (match) {
       var threadList = data.ThreadListMap.GetOrAddValue(stack.Context.ThreadId);
-      var index = new SampleIndex(sampleIndex, sample.Time);
+      var index = new SampleIndex(sampleIndex, Samples.TimeAt(sampleIndex));
       threadList.Add(index);
       data.AllThreadsList.Add(index);
     }
@@ -106,38 +132,55 @@ public sealed class FunctionSamplesProcessor : ProfileSampleProcessor {
         threadListMap_[pair.Key] = new List<SampleIndex>(pair.Value);
       }
 
-      // The per-thread sample lists are already sorted,
-      // now put them in the correct order across all chunks.
-      foreach (var chunkList in chunkThreadListMap.Values) {
-        chunkList.Sort((a, b) => a[0].Index.CompareTo(b[0].Index));
-      }
-
-      var map = new Dictionary<int, int>();
-
-      // Merge the per-thread sample lists.
+      // The per-thread sample lists of each chunk are sorted, but the chunks
+      // processed interleaved ranges of samples, merge them in sample order.
       foreach (var pair in chunkThreadListMap) {
         var threadList = threadListMap_[pair.Key];
-        var chunkLists = pair.Value;
-
-        foreach (var list in chunkLists) {
-          threadList.AddRange(list);
-        }
-
-        for (int i = 1; i < threadList.Count; i++) {
-          int dist = threadList[i].Index - threadList[i - 1].Index;
-          map.AccumulateValue(dist, 1);
-        }
+        MergeSampleLists(pair.Value, threadList);
 
 #if DEBUG
         // Validate sample ordering.
-        for (int i = 1; i < chunkLists.Count; i++) {
-          Debug.Assert(chunkLists[i][0].Index > chunkLists[i - 1][^1].Index);
+        for (int i = 1; i < threadList.Count; i++) {
+          Debug.Assert(threadList[i].Index > threadList[i - 1].Index);
         }
 #endif
       }
     }
   }
 
+  private static void MergeSampleLists(List<List<SampleIndex>> lists, List<SampleIndex> mergedList) {
+    if (lists.Count == 1) {
+      mergedList.AddRange(lists[0]);
+      return;
+    }
+
+    // Queue of the lists by their next sample index. The samples of a list
+    // that come before the next sample of all other lists are copied as one run,
+    // runs are as long as a morsel of samples.
+    var queue = new PriorityQueue<int, int>(lists.Count);
+    var positions = new int[lists.Count];
+
+    for (int i = 0; i < lists.Count; i++) {
+      queue.Enqueue(i, lists[i][0].Index);
+    }
+
+    while (queue.TryDequeue(out int listIndex, out _)) {
+      var list = lists[listIndex];
+      int position = positions[listIndex];
+      int nextIndex = queue.TryPeek(out _, out int priority) ? priority : int.MaxValue;
+
+      while (position < list.Count && list[position].Index < nextIndex) {
+        mergedList.Add(list[position++]);
+      }
+
+      positions[listIndex] = position;
+
+      if (position < list.Count) {
+        queue.Enqueue(listIndex, list[position].Index);
+      }
+    }
+  }
+
   private class ChunkData {
     public List<SampleIndex> AllThreadsList;
     public Dictionary<int, List<SampleIndex>> ThreadListMap;
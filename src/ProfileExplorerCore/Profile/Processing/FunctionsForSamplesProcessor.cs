@@ -1,5 +1,6 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+using System;
 using System.Collections.Generic;
 using ProfileExplorer.Core.Profile.Data;
 
@@ -34,7 +35,7 @@ public sealed class FunctionsForSamplesProcessor : ProfileSampleProcessor {
     return chunk;
   }
 
-  protected override void ProcessSample(ref ProfileSample sample, ResolvedProfileStack stack, int sampleIndex,
+  protected override void ProcessSample(int sampleIndex, TimeSpan weight, ResolvedProfileStack stack,
                                         object chunkData) {
     var data = (ChunkData)chunkData;
 
@@ -1,26 +1,30 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
-using System.Collections.Generic;
-using System.Runtime.InteropServices;
-using System.Threading.Tasks;
 using ProfileExplorer.Core.Profile.Data;
 using ProfileExplorer.Core.Utilities;
 
 namespace ProfileExplorer.Core.Profile.Processing;
 
 // Provides support for running an analysis over samples, with filtering,
-// in parallel, by splitting the samples into multiple chunks, each
-// processed on a different thread.
+// in parallel, by splitting the samples into small ranges (morsels)
+// handed out to the worker threads on demand, see MorselScheduler.
+// Each worker accumulates its results in its own chunk data,
+// the chunks of all workers being merged at the end.
 public abstract class ProfileSampleProcessor {
+  private const int MinMorselSize = 4 * 1024;
+  private const int MaxMorselSize = 64 * 1024;
+  // Processing a unique stack costs more than a sample, use smaller morsels.
+  protected const int MinStackMorselSize = 256;
   protected virtual int DefaultThreadCount => CoreSettingsProvider.GeneralSettings.CurrentCpuCoreLimit;
+  protected ProfileSampleStore Samples { get; private set; }
 
   protected virtual object InitializeChunk(int k, int samplesPerChunk) {
     return null;
   }
 
-  protected abstract void ProcessSample(ref ProfileSample sample, ResolvedProfileStack stack,
-                                        int sampleIndex, object chunkData);
+  protected abstract void ProcessSample(int sampleIndex, TimeSpan weight, ResolvedProfileStack stack,
+                                        object chunkData);
 
   protected virtual void CompleteChunk(int k, object chunkData) {
   }
@@ -28,79 +32,69 @@ public abstract class ProfileSampleProcessor {
   protected virtual void Complete() {
   }
 
+  // Creates a scheduler for the range of items [start, end) processed by the workers,
+  // with morsels small enough to balance the load across the workers.
+  protected static MorselScheduler CreateMorselScheduler(int start, int end, int workerCount,
+                                                         int minMorselSize = MinMorselSize) {
+    int morselSize = MorselScheduler.ComputeMorselSize(end - start, workerCount, minMorselSize, MaxMorselSize);
+    return new MorselScheduler(start, end, morselSize);
+  }
+
   protected void ProcessSampleChunk(ProfileData profile, ProfileSampleFilter filter,
                                     int maxChunks = int.MaxValue) {
     int sampleStartIndex = filter.TimeRange?.StartSampleIndex ?? 0;
     int sampleEndIndex = filter.TimeRange?.EndSampleIndex ?? profile.Samples.Count;
+    Samples = profile.Samples;
     //Trace.WriteLine($"ProfileSampleProcessor: Sample range: {sampleStartIndex} - {sampleEndIndex}");
 
     int sampleCount = sampleEndIndex - sampleStartIndex;
-    int chunks = Math.Min(maxChunks, DefaultThreadCount);
-    //Trace.WriteLine($"ProfileSampleProcessor: Using {chunks} chunks");
+    int workers = Math.Min(maxChunks, DefaultThreadCount);
+    int samplesPerWorker = (int)Math.Ceiling((double)sampleCount / workers);
+    var scheduler = CreateMorselScheduler(sampleStartIndex, sampleEndIndex, workers);
+    //Trace.WriteLine($"ProfileSampleProcessor: Using {workers} workers, {scheduler.MorselCount} morsels");
     //var sw = Stopwatch.StartNew();
 
-    int chunkSize = sampleCount / chunks;
-    var taskScheduler = new ConcurrentExclusiveSchedulerPair(TaskScheduler.Default, chunks);
-    var taskFactory = new TaskFactory(taskScheduler.ConcurrentScheduler);
-    var tasks = new List<Task>();
-
-    for (int k = 0; k < chunks; k++) {
-      int start = Math.Min(sampleStartIndex + k * chunkSize, sampleEndIndex);
-      int end = k == chunks - 1 ? sampleEndIndex : Math.Min(sampleStartIndex + (k + 1) * chunkSize, sampleEndIndex);
-
-      // If a single thread is selected, only process the samples for that thread
-      // by going through the thread sample ranges.
-      var ranges = profile.ThreadSampleRanges.Ranges[-1];
-
-      if (filter.HasThreadFilter && filter.ThreadIds.Count == 1) {
-        ranges = profile.ThreadSampleRanges.Ranges[filter.ThreadIds[0]];
-        // Trace.WriteLine($"Filter single thread with {ranges.Count} ranges");
-      }
-
-      int kCopy = k; // Pass value copy.
-      tasks.Add(taskFactory.StartNew(() => {
-        int samplesPerChunk = (int)Math.Ceiling((double)sampleCount / chunks);
-        object chunkData = InitializeChunk(kCopy, samplesPerChunk);
-
-        // Find the ranges of samples that overlap with the filter time range.
-        int startRangeIndex = 0;
-        int endRangeIndex = ranges.Count - 1;
-
-        while (startRangeIndex < ranges.Count && ranges[startRangeIndex].EndIndex < start) {
-          startRangeIndex++;
-        }
-
-        while (endRangeIndex > 0 && ranges[endRangeIndex].StartIndex > end) {
-          endRangeIndex--;
-        }
-
-        // Walk each sample in the range and update the function profile.
-        bool hasThreadFilter = filter.HasThreadFilter;
-        var sampleSpan = CollectionsMarshal.AsSpan(profile.Samples);
-
-        for (int k = startRangeIndex; k <= endRangeIndex; k++) {
-          var range = ranges[k];
-          int startIndex = Math.Max(start, range.StartIndex);
-          int endIndex = Math.Min(end, range.EndIndex);
-
-          for (int i = startIndex; i < endIndex; i++) {
-            ref var stack = ref sampleSpan[i].Stack;
+    // If a single thread is selected, only process the samples for that thread
+    // by going through the thread sample ranges.
+    var ranges = profile.ThreadSampleRanges.Ranges[-1];
 
-            if (hasThreadFilter &&
-                !filter.ThreadIds.Contains(stack.Context.ThreadId)) {
-              continue;
-            }
+    if (filter.HasThreadFilter && filter.ThreadIds.Count == 1) {
+      ranges = profile.ThreadSampleRanges.Ranges[filter.ThreadIds[0]];
+      // Trace.WriteLine($"Filter single thread with {ranges.Count} ranges");
+    }
 
-            ref var sample = ref sampleSpan[i].Sample;
-            ProcessSample(ref sample, stack, i, chunkData);
+    // The sample columns are scanned sequentially, the stack is looked up
+    // in the dense stack table only for samples accepted by the filter.
+    bool hasThreadFilter = filter.HasThreadFilter;
+    var samples = profile.Samples;
+    var stacks = samples.Stacks;
+    int[] contextThreadIds = hasThreadFilter ? samples.ComputeContextThreadIds() : null;
+
+    scheduler.Run(workers, k => InitializeChunk(k, samplesPerWorker), (start, end, chunkData) => {
+      // Find the ranges of samples that overlap with the morsel sample range.
+      int startRangeIndex = ThreadSampleRanges.FindRangeIndex(ranges, start);
+      int endRangeIndex = Math.Min(ThreadSampleRanges.FindRangeIndex(ranges, end), ranges.Count - 1);
+      var stackIds = samples.StackIds;
+      var weights = samples.Weights;
+      var contextIds = samples.ContextIds;
+
+      // Walk each sample in the range and update the chunk results.
+      for (int k = startRangeIndex; k <= endRangeIndex; k++) {
+        var range = ranges[k];
+        int startIndex = Math.Max(start, range.StartIndex);
+        int endIndex = Math.Min(end, range.EndIndex);
+
+        for (int i = startIndex; i < endIndex; i++) {
+          if (hasThreadFilter &&
+              !filter.ThreadIds.Contains(contextThreadIds[contextIds[i]])) {
+            continue;
           }
-        }
 
-        CompleteChunk(kCopy, chunkData);
-      }));
-    }
+          ProcessSample(i, TimeSpan.FromTicks(weights[i]), stacks[stackIds[i]], chunkData);
+        }
+      }
+    }, CompleteChunk);
 
-    Task.WhenAll(tasks.ToArray()).Wait();
     Complete();
 
     //sw.Stop();
@@ -55,7 +55,9 @@ public class NamedPipeServer : IDisposable {
     byte[] buffer = new byte[HeaderSize];
 
     while (pipeStream_.IsConnected && !cancellationToken.IsCancellationRequested) {
-      int bytesRead = reader_.Read(buffer);
+      // The profiler batches many messages in one pipe write, a read may
+      // return only part of a message, wait for the rest of it.
+      int bytesRead = pipeStream_.ReadAtLeast(buffer, HeaderSize, false);
 
       if (bytesRead == 0) {
         break;
@@ -71,7 +73,7 @@ public class NamedPipeServer : IDisposable {
       if (header.Size > HeaderSize) {
         int messageSize = header.Size - HeaderSize;
         bodyBuffer = new byte[messageSize];
-        bytesRead = reader_.Read(bodyBuffer);
+        bytesRead = pipeStream_.ReadAtLeast(bodyBuffer, messageSize, false);
 
         if (bytesRead != messageSize) {
           throw new Exception($"Invalid message body, read {bytesRead} vs expected {messageSize}");
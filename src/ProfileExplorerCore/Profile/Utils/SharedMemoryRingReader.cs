@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.InteropServices;
+using System.Threading;
+
+namespace ProfileExplorer.Core.Profile.Utils;
+
+// Reader for the single-producer, single-consumer ring that the managed
+// profiler writes in a named shared memory section, carrying the same
+// framed messages as the named pipe. Layout must match SharedMemoryRing.h.
+public sealed unsafe class SharedMemoryRingReader : IDisposable {
+  private const uint RingMagic = 0x52584550; // "PEXR"
+  private const int RingVersion = 1;
+  private const int HeaderSize = 256;
+  private const int CapacityOffset = 8;
+  private const int WritePositionOffset = 64;
+  private const int WriteCountOffset = 72;
+  private const int WriteWaitsOffset = 80;
+  private const int ReadPositionOffset = 128;
+  private static readonly int MessageHeaderSize = Marshal.SizeOf<NamedPipeServer.PipeMessageHeader>();
+  private MemoryMappedFile mappedFile_;
+  private MemoryMappedViewAccessor view_;
+  private byte* basePtr_;
+  private byte* data_;
+  private long capacity_;
+  private long startPosition_;
+  private long readPosition_;
+  private long messagesRead_;
+  private long readWaits_;
+  private volatile bool stopRequested_;
+  private Stopwatch stopwatch_;
+
+  private SharedMemoryRingReader() {
+  }
+
+  public static string MakeName(int processId) {
+    return $"Local\\PEXProfilerRing_{processId}";
+  }
+
+  public static SharedMemoryRingReader Open(int processId) {
+    SharedMemoryRingReader reader = null;
+
+    try {
+      reader = new SharedMemoryRingReader();
+      reader.mappedFile_ = MemoryMappedFile.OpenExisting(MakeName(processId), MemoryMappedFileRights.ReadWrite);
+      reader.view_ = reader.mappedFile_.CreateViewAccessor(0, 0, MemoryMappedFileAccess.ReadWrite);
+      byte* ptr = null;
+      reader.view_.SafeMemoryMappedViewHandle.AcquirePointer(ref ptr);
+      reader.basePtr_ = ptr + reader.view_.PointerOffset;
+
+      if (reader.ReadHeader()) {
+        return reader;
+      }
+    }
+    catch (Exception ex) {
+      Trace.WriteLine($"Failed to open shared memory ring for proc {processId}: {ex.Message}");
+    }
+
+    reader?.Dispose();
+    return null;
+  }
+
+  public SharedMemoryRingStatistics Statistics =>
+    new(messagesRead_, readPosition_ - startPosition_, readWaits_,
+        basePtr_ != null ? Volatile.Read(ref *(long*)(basePtr_ + WriteCountOffset)) : 0,
+        basePtr_ != null ? Volatile.Read(ref *(long*)(basePtr_ + WriteWaitsOffset)) : 0,
+        stopwatch_?.Elapsed ?? TimeSpan.Zero);
+
+  // Reads messages until canceled, or until Stop is called and
+  // all the data written so far has been consumed.
+  public void ReceiveMessages(NamedPipeServer.MessageReceivedDelegate action,
+                              CancellationToken cancellationToken) {
+    stopwatch_ = Stopwatch.StartNew();
+    byte[] headerBuffer = new byte[MessageHeaderSize];
+
+    while (ReadExactly(headerBuffer, cancellationToken)) {
+      var header = MemoryMarshal.Cast<byte, NamedPipeServer.PipeMessageHeader>(headerBuffer)[0];
+      byte[] bodyBuffer = null;
+
+      if (header.Size > MessageHeaderSize) {
+        bodyBuffer = new byte[header.Size - MessageHeaderSize];
+
+        if (!ReadExactly(bodyBuffer, cancellationToken)) {
+          break;
+        }
+      }
+
+      messagesRead_++;
+      action(header, bodyBuffer);
+    }
+
+    stopwatch_.Stop();
+  }
+
+  public void Stop() {
+    stopRequested_ = true;
+  }
+
+  public void Dispose() {
+    if (basePtr_ != null) {
+      view_.SafeMemoryMappedViewHandle.ReleasePointer();
+      basePtr_ = null;
+      data_ = null;
+    }
+
+    view_?.Dispose();
+    mappedFile_?.Dispose();
+    view_ = null;
+    mappedFile_ = null;
+  }
+
+  private bool ReadHeader() {
+    uint magic = *(uint*)basePtr_;
+    int version = *(int*)(basePtr_ + 4);
+    capacity_ = *(long*)(basePtr_ + CapacityOffset);
+
+    if (magic != RingMagic || version != RingVersion ||
+        capacity_ <= 0 || HeaderSize + capacity_ > (long)view_.Capacity) {
+      Trace.WriteLine($"Invalid shared memory ring, version {version}, capacity {capacity_}");
+      return false;
+    }
+
+    data_ = basePtr_ + HeaderSize;
+    readPosition_ = Volatile.Read(ref *(long*)(basePtr_ + ReadPositionOffset));
+    startPosition_ = readPosition_;
+    return true;
+  }
+
+  private bool ReadExactly(Span<byte> buffer, CancellationToken cancellationToken) {
+    var spinWait = new SpinWait();
+    bool waited = false;
+
+    while (buffer.Length > 0) {
+      long writePosition = Volatile.Read(ref *(long*)(basePtr_ + WritePositionOffset));
+      long available = writePosition - readPosition_;
+
+      if (available == 0) {
+        if (cancellationToken.IsCancellationRequested || stopRequested_) {
+          return false;
+        }
+
+        if (!waited) {
+          readWaits_++;
+          waited = true;
+        }
+
+        // The profiler may not write anything for a long time,
+        // SpinWait falls back to sleeping after a few iterations.
+        spinWait.SpinOnce(sleep1Threshold: 20);
+        continue;
+      }
+
+      spinWait.Reset();
+      waited = false;
+      long offset = readPosition_ % capacity_;
+      int length = (int)Math.Min(Math.Min(buffer.Length, available), capacity_ - offset);
+      new ReadOnlySpan<byte>(data_ + offset, length).CopyTo(buffer);
+      buffer = buffer.Slice(length);
+      readPosition_ += length;
+
+      // Publish the freed space only after the data was copied out.
+      Volatile.Write(ref *(long*)(basePtr_ + ReadPositionOffset), readPosition_);
+    }
+
+    return true;
+  }
+}
+
+public readonly record struct SharedMemoryRingStatistics(long MessagesRead, long BytesRead, long ReadWaits,
+                                                         long Writes, long WriteWaits, TimeSpan Duration) {
+  public double MegabytesPerSecond =>
+    Duration.TotalSeconds > 0 ? BytesRead / (1024.0 * 1024.0) / Duration.TotalSeconds : 0;
+
+  public override string ToString() {
+    return $"{MessagesRead} messages, {BytesRead / 1024} KB in {Writes} writes, " +
+           $"{MegabytesPerSecond:F2} MB/s, reader waits {ReadWaits}, writer waits {WriteWaits}";
+  }
+}
@@ -1,11 +1,15 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
 using System.Linq.Expressions;
 using System.Runtime.CompilerServices;
 using System.Text;
+using System.Threading.Tasks;
 
 namespace ProfileExplorer.Core;
 
@@ -13,6 +17,11 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
   public static readonly long MAX_PRELOADED_FILE_SIZE = 256 * 1024 * 1024; // 256 MB
   private static readonly int STREAM_BUFFER_SIZE = 16 * 1024;
   private static readonly int MAX_LINE_LENGTH = 2000;
+  private static readonly int MIN_PARALLEL_CHUNK_SIZE = 1024 * 1024;
+  private static readonly long MAX_PARALLEL_CHUNK_SIZE = 256 * 1024 * 1024;
+  private static readonly SearchValues<byte> BLANK_LINE_BYTES = SearchValues.Create(" \t\v\f"u8);
+  private string filePath_;
+  private byte[] textData_;
   private StreamReader dataReader_;
   private Stream dataStream_;
   private long dataStreamSize_;
@@ -35,6 +44,7 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
   private long previousOffset_;
 
   public SectionReaderBase(string filePath, bool expectSectionHeaders = true) {
+    filePath_ = filePath;
     expectSectionHeaders_ = expectSectionHeaders;
     dataStreamSize_ = new FileInfo(filePath).Length;
 
@@ -53,16 +63,33 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
   }
 
   public SectionReaderBase(byte[] textData, bool expectSectionHeaders = true) {
+    textData_ = textData;
     expectSectionHeaders_ = expectSectionHeaders;
     dataStream_ = new MemoryStream(textData);
     dataStreamSize_ = textData.Length;
     Initialize();
   }
 
+  public const long DefaultParallelSummaryMinFileSize = 32 * 1024 * 1024; // 32 MB
+
+  // Files at least this large are indexed in parallel over chunks of the text
+  // if the reader supports it, see GenerateParallelSummary.
+  public long ParallelSummaryMinFileSize { get; set; } = DefaultParallelSummaryMinFileSize;
+
   // Main function for reading the text source and producing a summary
   // with all functions and their sections.
   public IRTextSummary GenerateSummary(ProgressInfoHandler progressHandler,
                                        SectionTextHandler sectionTextHandler) {
+    if (sectionTextHandler == null && SupportsParallelSummary &&
+        dataStreamSize_ > 0 && dataStreamSize_ >= ParallelSummaryMinFileSize &&
+        IsAsciiCompatibleText(dataStream_)) {
+      var parallelSummary = GenerateParallelSummary(progressHandler);
+
+      if (parallelSummary != null) {
+        return parallelSummary;
+      }
+    }
+
     var summary = GenerateSummaryImpl(progressHandler, sectionTextHandler);
 
     if (summary.Functions.Count == 0 && expectSectionHeaders_) {
@@ -158,6 +185,18 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     }
   }
 
+  // Readers with lines that don't need preprocessing can enable building
+  // the summary in parallel from the raw text, with IsCandidateLine
+  // used to find the lines that must be checked with the methods below.
+  protected virtual bool SupportsParallelSummary => false;
+
+  // Returns true if the line, in the encoding of the text, may be a section,
+  // function or block start, a function end or a metadata line. False positives
+  // are fine, the line is then decoded and checked with the string methods.
+  protected virtual bool IsCandidateLine(ReadOnlySpan<byte> line) {
+    return true;
+  }
+
   // Methods to be implemented by an IR reader implementation.
   protected abstract bool IsSectionStart(string line);
   protected abstract bool SectionStartIsFunctionStart(string line);
@@ -245,6 +284,25 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     return encoding;
   }
 
+  private static bool IsAsciiCompatibleText(Stream stream) {
+    // The parallel summary splits lines and checks candidate lines on the raw bytes,
+    // which only works for UTF-8 and single-byte encodings. Detect UTF-16/32 text
+    // by its byte order mark or, without one, by the zero bytes of ASCII chars.
+    const int CheckedBytes = 4096;
+    long position = stream.Position;
+    Span<byte> buffer = stackalloc byte[CheckedBytes];
+    stream.Position = 0;
+    int length = stream.ReadAtLeast(buffer, CheckedBytes, false);
+    stream.Position = position;
+    var text = buffer.Slice(0, length);
+
+    if (length >= 2 && ((text[0] == 0xFF && text[1] == 0xFE) || (text[0] == 0xFE && text[1] == 0xFF))) {
+      return false;
+    }
+
+    return text.IndexOf((byte)0) < 0;
+  }
+
   private void Initialize() {
     dataStreamEncoding_ = DetectUTF8Encoding(dataStream_, Encoding.ASCII);
     dataReader_ = new StreamReader(dataStream_, dataStreamEncoding_,
@@ -262,10 +320,164 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     hasMetadataLines_ = false;
     prevLineCount_ = 0;
     lineIndex_ = 0;
+    currentLine_ = null;
+    textOffset_ = 0;
+    previousOffset_ = 0;
+    nextInitialOffset_ = 0;
+  }
+
+  private unsafe IRTextSummary GenerateParallelSummary(ProgressInfoHandler progressHandler) {
+    // Split the text into chunks at line boundaries and scan them in parallel
+    // for the lines that may start or end a section, all other lines are only counted.
+    // Finding the sections then needs a single pass over the candidate lines,
+    // done by the same code as when reading the text line by line.
+    List<SummaryLine>[] chunkLines;
+
+    if (textData_ != null) {
+      fixed (byte* data = textData_) {
+        chunkLines = ScanSummaryLines(data, progressHandler);
+      }
+    }
+    else {
+      try {
+        using var stream = File.Open(filePath_, FileMode.Open, FileAccess.Read, FileShare.ReadWrite);
+        using var mappedFile = MemoryMappedFile.CreateFromFile(stream, null, 0, MemoryMappedFileAccess.Read,
+                                                               HandleInheritability.None, true);
+        using var view = mappedFile.CreateViewAccessor(0, dataStreamSize_, MemoryMappedFileAccess.Read);
+        byte* ptr = null;
+        view.SafeMemoryMappedViewHandle.AcquirePointer(ref ptr);
+
+        try {
+          chunkLines = ScanSummaryLines(ptr + view.PointerOffset, progressHandler);
+        }
+        finally {
+          view.SafeMemoryMappedViewHandle.ReleasePointer();
+        }
+      }
+      catch (Exception ex) {
+        Trace.WriteLine($"Failed to map {filePath_} for parallel summary: {ex.Message}");
+        return null;
+      }
+    }
+
+    if (chunkLines == null) {
+      return null;
+    }
+
+    var summary = GenerateSummaryImpl(null, null, new SummaryLineCursor(chunkLines));
+
+    if (summary.Functions.Count == 0 && expectSectionHeaders_) {
+      // Same as in GenerateSummary, the scanned lines don't depend on it.
+      expectSectionHeaders_ = false;
+      ResetSummaryState();
+      summary = GenerateSummaryImpl(null, null, new SummaryLineCursor(chunkLines));
+    }
+
+    progressHandler?.Invoke(this, new SectionReaderProgressInfo(dataStreamSize_, dataStreamSize_));
+    return summary;
+  }
+
+  private unsafe List<SummaryLine>[] ScanSummaryLines(byte* data, ProgressInfoHandler progressHandler) {
+    long size = dataStreamSize_;
+    long chunkCount = Math.Clamp(size / MIN_PARALLEL_CHUNK_SIZE, 1, Environment.ProcessorCount * 4);
+    chunkCount = Math.Max(chunkCount, (size + MAX_PARALLEL_CHUNK_SIZE - 1) / MAX_PARALLEL_CHUNK_SIZE);
+    long[] chunkStarts = new long[chunkCount + 1];
+    chunkStarts[chunkCount] = size;
+
+    // Move each chunk start after the next new line.
+    for (int i = 1; i < chunkCount; i++) {
+      long position = Math.Max(size * i / chunkCount, chunkStarts[i - 1]);
+      var text = new ReadOnlySpan<byte>(data + position, (int)Math.Min(size - position, int.MaxValue));
+      int newLineIndex = text.IndexOf((byte)'\n');
+      chunkStarts[i] = newLineIndex >= 0 ? position + newLineIndex + 1 : size;
+    }
+
+    // A chunk is scanned as a span, which can't be larger than 2 GB. Without new lines
+    // to split it further, like a huge single line, use the serial reader instead.
+    for (int i = 0; i < chunkCount; i++) {
+      if (chunkStarts[i + 1] - chunkStarts[i] > int.MaxValue) {
+        return null;
+      }
+    }
+
+    var chunkLines = new List<SummaryLine>[chunkCount];
+    var dataAddress = (nint)data;
+    object progressLock = new();
+    long bytesScanned = 0;
+
+    Parallel.For(0, chunkCount, i => {
+      chunkLines[i] = ScanSummaryLines((byte*)dataAddress, chunkStarts[i], chunkStarts[i + 1]);
+
+      if (progressHandler != null) {
+        lock (progressLock) {
+          bytesScanned += chunkStarts[i + 1] - chunkStarts[i];
+          progressHandler(this, new SectionReaderProgressInfo(bytesScanned, size));
+        }
+      }
+    });
+
+    return chunkLines;
+  }
+
+  private unsafe List<SummaryLine> ScanSummaryLines(byte* data, long start, long end) {
+    // Lines end with \n, \r\n or \r, same as for StreamReader.ReadLine.
+    var lines = new List<SummaryLine>();
+    var text = new ReadOnlySpan<byte>(data + start, (int)(end - start));
+    var preamble = dataStreamEncoding_.Preamble;
+    int position = 0;
+    var run = new SummaryLine();
+
+    while (position < text.Length) {
+      var remaining = text.Slice(position);
+      int lineLength = remaining.IndexOfAny((byte)'\r', (byte)'\n');
+      int nextPosition = position + remaining.Length;
+
+      if (lineLength >= 0) {
+        nextPosition = position + lineLength + 1;
+
+        if (remaining[lineLength] == '\r' && lineLength + 1 < remaining.Length &&
+            remaining[lineLength + 1] == '\n') {
+          nextPosition++;
+        }
+      }
+      else {
+        lineLength = remaining.Length;
+      }
+
+      var line = remaining.Slice(0, lineLength);
+
+      if (start + position == 0 && line.StartsWith(preamble)) {
+        line = line.Slice(preamble.Length);
+      }
+
+      position = nextPosition;
+
+      if (IsCandidateLine(line)) {
+        if (run.LineCount > 0) {
+          lines.Add(run);
+          run = new SummaryLine();
+        }
+
+        lines.Add(new SummaryLine(dataStreamEncoding_.GetString(line), 1, start + position));
+      }
+      else {
+        run.LineCount++;
+        run.EndOffset = start + position;
+        run.HasNonBlankLines = run.HasNonBlankLines ||
+                               line.IndexOfAnyExcept(BLANK_LINE_BYTES) >= 0;
+      }
+    }
+
+    if (run.LineCount > 0) {
+      lines.Add(run);
+    }
+
+    return lines;
   }
 
   private IRTextSummary GenerateSummaryImpl(ProgressInfoHandler progressHandler,
-                                            SectionTextHandler sectionTextHandler) {
+                                            SectionTextHandler sectionTextHandler,
+                                            SummaryLineCursor summaryLines = null) {
     // Scan the document once to find the section boundaries,
     // any before/after text associated with the sections
     // and build the function -> sections hierarchy.
@@ -278,7 +490,7 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
       }
     };
 
-    var section = FindNextSection(sectionTextHandler);
+    var section = FindNextSection(sectionTextHandler, summaryLines);
     updateProgress();
 
     while (section != null) {
@@ -291,7 +503,7 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
       section.OutputBefore = GetAdditionalOutput();
       ResetAdditionalOutput();
       previousSection = section;
-      section = FindNextSection(sectionTextHandler);
+      section = FindNextSection(sectionTextHandler, summaryLines);
       updateProgress();
     }
 
@@ -455,6 +667,15 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
   }
 
   private void AddOptionalOutputLine(string line, long initialOffset) {
+    bool isBlankLine = string.IsNullOrWhiteSpace(line);
+    AddOptionalOutputLines(1, !isBlankLine, initialOffset);
+
+    if (!isBlankLine && IsMetadataLine(line)) {
+      hasMetadataLines_ = true;
+    }
+  }
+
+  private void AddOptionalOutputLines(int lineCount, bool hasNonBlankLines, long initialOffset) {
     if (optionalOutput_ == null) {
       // Start a new optional section.
       long offset = TextOffset();
@@ -463,15 +684,33 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     }
 
     optionalOutput_.DataEndOffset = TextOffset();
-    optionalOutput_.EndLine = lineIndex_;
+    optionalOutput_.EndLine = lineIndex_ + lineCount - 1;
 
-    if (!string.IsNullOrWhiteSpace(line)) {
+    if (hasNonBlankLines) {
       optionalOutputNeeded_ = true;
+    }
+  }
 
-      if (IsMetadataLine(line)) {
-        hasMetadataLines_ = true;
+  // Returns the next candidate line scanned by GenerateParallelSummary,
+  // the lines before it are added to the section or to the optional output,
+  // the same way they would be when reading each line.
+  private string NextCandidateLine(SummaryLineCursor summaryLines, bool inSection, long initialOffset) {
+    while (summaryLines.Next(out var line)) {
+      previousOffset_ = textOffset_;
+      textOffset_ = line.EndOffset;
+
+      if (line.Text != null) {
+        return line.Text;
+      }
+
+      if (!inSection) {
+        AddOptionalOutputLines(line.LineCount, line.HasNonBlankLines, initialOffset);
       }
+
+      lineIndex_ += line.LineCount;
     }
+
+    return null;
   }
 
   private IRPassOutput GetAdditionalOutput() {
@@ -489,7 +728,8 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     hasMetadataLines_ = false;
   }
 
-  private IRTextSection FindNextSection(SectionTextHandler sectionTextHandler) {
+  private IRTextSection FindNextSection(SectionTextHandler sectionTextHandler,
+                                        SummaryLineCursor summaryLines) {
     prevLineCount_ = 0;
 
     while (true) {
@@ -498,7 +738,8 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
       if (currentLine_ == null ||
           !IsFunctionEnd(currentLine_) ||
           !FunctionEndIsFunctionStart(currentLine_)) {
-        currentLine_ = NextLine();
+        currentLine_ = summaryLines != null ?
+          NextCandidateLine(summaryLines, false, initialOffset) : NextLine();
       }
 
       if (currentLine_ == null) {
@@ -556,7 +797,8 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
       int metadataLines = 0;
 
       while (true) {
-        currentLine_ = NextLine();
+        currentLine_ = summaryLines != null ?
+          NextCandidateLine(summaryLines, true, 0) : NextLine();
 
         if (currentLine_ == null) {
           sectionEndLine = lineIndex_ + 1;
@@ -735,6 +977,48 @@ public abstract class SectionReaderBase : IRSectionReader, IDisposable {
     }
   }
 
+  // Line found by GenerateParallelSummary, or a run of lines
+  // that are not candidates if Text is null.
+  private struct SummaryLine {
+    public string Text;
+    public int LineCount;
+    public long EndOffset; // Offset after the last line, including the new line.
+    public bool HasNonBlankLines;
+
+    public SummaryLine(string text, int lineCount, long endOffset) {
+      Text = text;
+      LineCount = lineCount;
+      EndOffset = endOffset;
+    }
+  }
+
+  private class SummaryLineCursor {
+    private List<SummaryLine>[] chunkLines_;
+    private int chunkIndex_;
+    private int lineIndex_;
+
+    public SummaryLineCursor(List<SummaryLine>[] chunkLines) {
+      chunkLines_ = chunkLines;
+    }
+
+    public bool Next(out SummaryLine line) {
+      while (chunkIndex_ < chunkLines_.Length) {
+        var lines = chunkLines_[chunkIndex_];
+
+        if (lineIndex_ < lines.Count) {
+          line = lines[lineIndex_++];
+          return true;
+        }
+
+        chunkIndex_++;
+        lineIndex_ = 0;
+      }
+
+      line = default;
+      return false;
+    }
+  }
+
   // Simple TextReader that can be used with a span or a substring.
   private class SpanStringReader : TextReader {
     private ReadOnlyMemory<char> data_;
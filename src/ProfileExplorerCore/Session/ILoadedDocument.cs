@@ -45,6 +45,7 @@ public interface ILoadedDocument : IDisposable {
 
   public void AddDummyFunctions(List<string> funcNames);
   IRTextFunction AddDummyFunction(string name);
+  void RemoveDummyFunctions(HashSet<IRTextFunction> functions);
   void SaveSectionState(object stateObject, IRTextSection section);
   object LoadSectionState(IRTextSection section);
   ILoadedDocumentState SerializeDocument();
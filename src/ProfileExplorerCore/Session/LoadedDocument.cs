@@ -109,6 +109,10 @@ public class LoadedDocument : ILoadedDocument {
     return func;
   }
 
+  public void RemoveDummyFunctions(HashSet<IRTextFunction> functions) {
+    summary_.RemoveFunctions(functions);
+  }
+
   public void AddDummyFunctions(List<string> funcNames) {
     foreach (string name in funcNames) {
       if (summary_.FindFunction(name) == null) {
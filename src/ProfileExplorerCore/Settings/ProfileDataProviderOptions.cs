@@ -38,6 +38,10 @@ public class ProfileDataProviderOptions : SettingsBase {
   public List<ProfileDataReport> PreviousRecordingSessions { get; set; }
   [ProtoMember(12)][OptionValue()]
   public List<ProfileDataReport> PreviousLoadedSessions { get; set; }
+  [ProtoMember(13)][OptionValue(false)]
+  public bool CacheResolvedProfile { get; set; }
+  [ProtoMember(14)][OptionValue(false)]
+  public bool LazySymbolization { get; set; }
   public bool HasBinaryNameAllowedList => BinaryNameAllowedListEnabled && BinaryNameAllowedList.Count > 0;
   public bool HasBinarySearchPaths => BinarySearchPathsEnabled && BinarySearchPaths.Count > 0;
 
@@ -6,6 +6,7 @@ using System.Collections.Generic;
 using System.Linq;
 using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using ProfileExplorer.Core.Collections;
 using ProfileExplorer.Core.Controls;
 using ProfileExplorer.Core.IR;
 
@@ -274,6 +275,15 @@ public static class CollectionExtensionMethods {
     currentValue.Item2 = newValue2;
   }
 
+  [MethodImpl(MethodImplOptions.AggressiveInlining)]
+  public static void
+    AccumulateValue<K>(this TinyDictionary<K, (TimeSpan, TimeSpan)> dict, K key,
+                       TimeSpan value1, TimeSpan value2) {
+    ref var currentValue = ref dict.GetValueRefOrAddDefault(key, out bool exists);
+    currentValue.Item1 = TimeSpan.FromTicks(currentValue.Item1.Ticks + value1.Ticks);
+    currentValue.Item2 = TimeSpan.FromTicks(currentValue.Item2.Ticks + value2.Ticks);
+  }
+
   [MethodImpl(MethodImplOptions.AggressiveInlining)]
   public static int CollectMaxValue<K>(this Dictionary<K, int> dict, K key, int value) {
     ref int currentValue = ref CollectionsMarshal.GetValueRefOrAddDefault(dict, key, out bool exists);
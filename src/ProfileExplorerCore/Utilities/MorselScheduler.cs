@@ -0,0 +1,89 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace ProfileExplorer.Core.Utilities;
+
+// Hands out an index range (samples, stacks, etc.) to worker threads in small
+// consecutive morsels, taken on demand: a worker that finished a morsel takes the next one.
+// Compared to splitting the range into one equal chunk per thread, a part of the range
+// that is expensive to process (deep or unresolved stacks) gets spread over
+// all the workers instead of keeping a single thread busy while the others are idle.
+// Morsels are taken in increasing order, the morsels of a worker are increasing too.
+public sealed class MorselScheduler {
+  private const int MorselsPerWorker = 16;
+  private readonly int start_;
+  private readonly int end_;
+  private int nextMorsel_;
+
+  public MorselScheduler(int start, int end, int morselSize) {
+    Debug.Assert(morselSize > 0 && end >= start);
+    start_ = start;
+    end_ = end;
+    MorselSize = morselSize;
+
+    // An empty range has one empty morsel, so that a worker still runs.
+    MorselCount = Math.Max(1, (int)(((long)end - start + morselSize - 1) / morselSize));
+  }
+
+  public int MorselSize { get; }
+  public int MorselCount { get; }
+
+  // Picks a morsel size giving each worker a few morsels to balance the load,
+  // while keeping the per-morsel overhead low. With alignment, the morsel size
+  // is a multiple of it (segments of compressed lists).
+  public static int ComputeMorselSize(int count, int workerCount, int minSize, int maxSize,
+                                      int alignment = 1) {
+    int size = count / Math.Max(1, workerCount * MorselsPerWorker);
+    size = Math.Clamp(size, minSize, Math.Max(minSize, maxSize));
+    return (size + alignment - 1) / alignment * alignment;
+  }
+
+  public bool TryTake(out int start, out int end, out int morselIndex) {
+    morselIndex = Interlocked.Increment(ref nextMorsel_) - 1;
+
+    if (morselIndex >= MorselCount) {
+      start = end = end_;
+      return false;
+    }
+
+    start = (int)Math.Min(start_ + (long)morselIndex * MorselSize, end_);
+    end = (int)Math.Min((long)start + MorselSize, end_);
+    return true;
+  }
+
+  // Processes all morsels with up to workerCount workers, the calling thread being one of them.
+  // Each worker has its own state, created when it takes its first morsel,
+  // and completed after it found no more morsels to take.
+  public void Run<T>(int workerCount, Func<int, T> initializeWorker,
+                     Action<int, int, T> processMorsel, Action<int, T> completeWorker = null) {
+    workerCount = Math.Clamp(workerCount, 1, MorselCount);
+    var tasks = new Task[workerCount - 1];
+
+    for (int k = 1; k < workerCount; k++) {
+      int worker = k;
+      tasks[k - 1] = Task.Run(() => RunWorker(worker, initializeWorker, processMorsel, completeWorker));
+    }
+
+    RunWorker(0, initializeWorker, processMorsel, completeWorker);
+    Task.WaitAll(tasks);
+  }
+
+  private void RunWorker<T>(int worker, Func<int, T> initializeWorker,
+                            Action<int, int, T> processMorsel, Action<int, T> completeWorker = null) {
+    if (!TryTake(out int start, out int end, out _)) {
+      return; // Other workers took all morsels.
+    }
+
+    var state = initializeWorker(worker);
+
+    do {
+      processMorsel(start, end, state);
+    } while (TryTake(out start, out end, out _));
+
+    completeWorker?.Invoke(worker, state);
+  }
+}
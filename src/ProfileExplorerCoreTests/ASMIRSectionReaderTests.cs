@@ -77,6 +77,62 @@ x264_frame_init_lowres:
     verifyFunctionBody(init, "  sub sp,sp,#0x40\r\n");
   }
 
+  [TestMethod]
+  public void GenerateSummary_ParallelSummaryMatchesLineByLine() {
+    var builder = new StringBuilder();
+
+    for (int i = 0; i < 200; i++) {
+      if (i % 7 == 0) {
+        builder.Append("; comment\r\n\r\n");
+      }
+
+      builder.Append($"func_{i % 150}:\r\n");
+
+      for (int k = 0; k < i % 5; k++) {
+        builder.Append(k == 3 ? "  label: b x\n" : $"  mov r{k},r{k + 1}\n");
+      }
+
+      if (i % 3 == 0) {
+        builder.Append("\n");
+      }
+    }
+
+    byte[] bytes = Encoding.UTF8.GetBytes(builder.ToString());
+    var expected = new ASMIRSectionReader(bytes, true) {
+      ParallelSummaryMinFileSize = long.MaxValue
+    }.GenerateSummary(null, null);
+    var actual = new ASMIRSectionReader(bytes, true) {
+      ParallelSummaryMinFileSize = 0
+    }.GenerateSummary(null, null);
+
+    Action<IRPassOutput, IRPassOutput> verifyOutput = (expectedOutput, actualOutput) => {
+      Assert.AreEqual(expectedOutput == null, actualOutput == null);
+
+      if (expectedOutput != null) {
+        Assert.AreEqual(expectedOutput.DataStartOffset, actualOutput.DataStartOffset);
+        Assert.AreEqual(expectedOutput.DataEndOffset, actualOutput.DataEndOffset);
+        Assert.AreEqual(expectedOutput.StartLine, actualOutput.StartLine);
+        Assert.AreEqual(expectedOutput.EndLine, actualOutput.EndLine);
+      }
+    };
+
+    Assert.IsTrue(expected.Functions.Count > 100);
+    Assert.AreEqual(expected.Functions.Count, actual.Functions.Count);
+
+    for (int i = 0; i < expected.Functions.Count; i++) {
+      var expectedFunc = expected.Functions[i];
+      var actualFunc = actual.Functions[i];
+      Assert.AreEqual(expectedFunc.Name, actualFunc.Name);
+      Assert.AreEqual(expectedFunc.SectionCount, actualFunc.SectionCount);
+
+      for (int k = 0; k < expectedFunc.SectionCount; k++) {
+        verifyOutput(expectedFunc.Sections[k].Output, actualFunc.Sections[k].Output);
+        verifyOutput(expectedFunc.Sections[k].OutputBefore, actualFunc.Sections[k].OutputBefore);
+        verifyOutput(expectedFunc.Sections[k].OutputAfter, actualFunc.Sections[k].OutputAfter);
+      }
+    }
+  }
+
   private (IRTextSummary, List<SectionReaderText>, List<SectionReaderProgressInfo>) GenerateSummaryFor(byte[] input) {
     var reader = new ASMIRSectionReader(input, true);
     var capturedText = new List<SectionReaderText>();
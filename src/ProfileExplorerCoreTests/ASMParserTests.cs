@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Compilers.Architecture;
+using ProfileExplorer.Core.Compilers.ASM;
+using ProfileExplorer.Core.IR;
+using ProfileExplorer.Core.IR.Tags;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ASMParserTests {
+  private static readonly ASMCompilerIRInfo IRInfo = new(IRMode.x86_64);
+
+  // Same text format as Disassembler.DisassembleToText, with the location
+  // of each instruction recorded like it's done while disassembling.
+  private static (string Text, List<DisassembledInstruction> Instructions) Disassemble(
+    params (long Address, int Size, string Opcode, string Operands, bool IsTargetName)[] lines) {
+    var builder = new StringBuilder();
+    var instructions = new List<DisassembledInstruction>();
+
+    for (int line = 0; line < lines.Length; line++) {
+      var instr = lines[line];
+      int lineOffset = builder.Length;
+      string addressString = $"{instr.Address:X}:    ";
+      builder.Append(addressString);
+      int opcodeOffset = builder.Length;
+      builder.Append(instr.Opcode);
+      builder.Append("  ");
+      int operandsOffset = builder.Length;
+      builder.Append(instr.Operands);
+      instructions.Add(new DisassembledInstruction(instr.Address, instr.Size, new TextLocation(lineOffset, line, 0),
+                                                   addressString.Length - 5, opcodeOffset, instr.Opcode.Length,
+                                                   operandsOffset, instr.Operands.Length,
+                                                   instr.IsTargetName ? operandsOffset : 0,
+                                                   instr.IsTargetName ? instr.Operands.Length : 0));
+      builder.AppendLine();
+    }
+
+    return (builder.ToString(), instructions);
+  }
+
+  private static ASMParser CreateParser(string text, long functionSize) {
+    var func = new IRTextFunction("test");
+    var section = new IRTextSection(func, func.Name, IRPassOutput.Empty);
+    return new ASMParser(IRInfo, null, RegisterTables.SelectRegisterTable(IRInfo.Mode),
+                         text, section, functionSize);
+  }
+
+  // The column is not compared, the lexer computes it off by one after the first line.
+  private static void AssertSameLocation(TextLocation expected, TextLocation actual) {
+    Assert.AreEqual(expected.Offset, actual.Offset);
+    Assert.AreEqual(expected.Line, actual.Line);
+  }
+
+  private static void AssertSameElement(IRElement expected, IRElement actual) {
+    AssertSameLocation(expected.TextLocation, actual.TextLocation);
+    Assert.AreEqual(expected.TextLength, actual.TextLength, expected.ToString());
+  }
+
+  [TestMethod]
+  public void BuildFromInstructionsMatchesParsedText() {
+    var (text, instructions) = Disassemble(
+      (0x140001000, 1, "push", "rbx", false),
+      (0x140001001, 4, "sub", "rsp, 0x20", false),
+      (0x140001005, 3, "mov", "rbx, rcx", false),
+      (0x140001008, 3, "test", "rcx, rcx", false),
+      (0x14000100B, 2, "je", "0x14000101A", false),
+      (0x14000100D, 3, "mov", "eax, dword ptr [rbx + 8]", false),
+      (0x140001010, 3, "add", "eax, 1", false),
+      (0x140001013, 3, "cmp", "eax, 0x10", false),
+      (0x140001016, 2, "jl", "0x140001010", false),
+      (0x140001018, 2, "xor", "eax, eax", false),
+      (0x14000101A, 5, "call", "Foo::Bar", true),
+      (0x14000101F, 7, "mov", "rax, qword ptr [rip + 0x100]", false),
+      (0x140001026, 4, "add", "rsp, 0x20", false),
+      (0x14000102A, 1, "pop", "rbx", false),
+      (0x14000102B, 1, "ret", "", false));
+    long functionSize = 0x2C;
+
+    var expected = CreateParser(text, functionSize).Parse();
+    var actual = CreateParser(text, functionSize).Build(instructions);
+
+    // The jl into the middle of a block splits it, same as when parsing.
+    Assert.AreEqual(5, expected.Blocks.Count);
+    Assert.AreEqual(expected.Blocks.Count, actual.Blocks.Count);
+    Assert.AreEqual(expected.InstructionCount, actual.InstructionCount);
+
+    for (int i = 0; i < expected.Blocks.Count; i++) {
+      var expectedBlock = expected.Blocks[i];
+      var actualBlock = actual.Blocks[i];
+      Assert.AreEqual(expectedBlock.Number, actualBlock.Number);
+      AssertSameElement(expectedBlock.Label, actualBlock.Label);
+      CollectionAssert.AreEqual(expectedBlock.Successors.Select(b => b.Number).ToList(),
+                                actualBlock.Successors.Select(b => b.Number).ToList());
+      CollectionAssert.AreEqual(expectedBlock.Predecessors.Select(b => b.Number).ToList(),
+                                actualBlock.Predecessors.Select(b => b.Number).ToList());
+      Assert.AreEqual(expectedBlock.Tuples.Count, actualBlock.Tuples.Count);
+
+      for (int k = 0; k < expectedBlock.Tuples.Count; k++) {
+        var expectedInstr = (InstructionIR)expectedBlock.Tuples[k];
+        var actualInstr = (InstructionIR)actualBlock.Tuples[k];
+        Assert.AreEqual(expectedInstr.Kind, actualInstr.Kind);
+        Assert.AreEqual(expectedInstr.Opcode, actualInstr.Opcode);
+        Assert.AreEqual(expectedInstr.OpcodeText.ToString(), actualInstr.OpcodeText.ToString());
+        AssertSameLocation(expectedInstr.OpcodeLocation, actualInstr.OpcodeLocation);
+        AssertSameLocation(expectedInstr.TextLocation, actualInstr.TextLocation);
+        Assert.AreEqual(expectedInstr.Sources.Count, actualInstr.Sources.Count, expectedInstr.ToString());
+        Assert.AreEqual(expectedInstr.Destinations.Count, actualInstr.Destinations.Count);
+
+        for (int op = 0; op < expectedInstr.Sources.Count; op++) {
+          var expectedOp = expectedInstr.Sources[op];
+          var actualOp = actualInstr.Sources[op];
+          Assert.AreEqual(expectedOp.Kind, actualOp.Kind);
+          AssertSameElement(expectedOp, actualOp);
+
+          if (expectedOp.IsVariable) {
+            Assert.AreEqual(expectedOp.Name, actualOp.Name);
+            Assert.AreEqual(expectedOp.GetTag<RegisterTag>()?.Register,
+                            actualOp.GetTag<RegisterTag>()?.Register);
+          }
+          else if (expectedOp.IsIntConstant) {
+            Assert.AreEqual(expectedOp.IntValue, actualOp.IntValue);
+          }
+          else if (expectedOp.IsLabelAddress) {
+            Assert.AreEqual(((BlockLabelIR)expectedOp.Value).Parent.Number,
+                            ((BlockLabelIR)actualOp.Value).Parent.Number);
+          }
+        }
+      }
+    }
+
+    var expectedMetadata = expected.GetTag<AssemblyMetadataTag>();
+    var actualMetadata = actual.GetTag<AssemblyMetadataTag>();
+    Assert.AreEqual(expectedMetadata.FunctionSize, actualMetadata.FunctionSize);
+    CollectionAssert.AreEqual(expectedMetadata.AddressToElementMap.Keys.ToList(),
+                              actualMetadata.AddressToElementMap.Keys.ToList());
+
+    foreach (var pair in expectedMetadata.AddressToElementMap) {
+      var actualInstr = actualMetadata.AddressToElementMap[pair.Key];
+      AssertSameElement(pair.Value, actualInstr);
+      Assert.AreEqual(expectedMetadata.ElementSizeMap[pair.Value], actualMetadata.ElementSizeMap[actualInstr]);
+      Assert.AreEqual(expectedMetadata.ElementToOffsetMap[pair.Value], actualMetadata.ElementToOffsetMap[actualInstr]);
+    }
+  }
+
+  [TestMethod]
+  public void BuildParsesUnprefixedNumbersAsDecimal() {
+    var (text, instructions) = Disassemble(
+      (0x1000, 3, "add", "eax, 10", false),
+      (0x1003, 3, "sub", "eax, -0x10", false),
+      (0x1006, 1, "ret", "", false));
+    var function = CreateParser(text, 7).Build(instructions);
+
+    var add = (InstructionIR)function.Blocks[0].Tuples[0];
+    var sub = (InstructionIR)function.Blocks[0].Tuples[1];
+    Assert.AreEqual(10, add.Sources[1].IntValue);
+    Assert.AreEqual(-16, sub.Sources[1].IntValue);
+  }
+
+  [TestMethod]
+  public void BuildKeepsDemangledCallTargetName() {
+    string name = "std::map<int, char>::insert";
+    var (text, instructions) = Disassemble(
+      (0x1000, 5, "call", name, true),
+      (0x1005, 1, "ret", "", false));
+    var function = CreateParser(text, 6).Build(instructions);
+
+    var call = (InstructionIR)function.Blocks[0].Tuples[0];
+    Assert.AreEqual(InstructionKind.Call, call.Kind);
+    Assert.AreEqual(1, call.Sources.Count);
+    Assert.AreEqual(name, call.Sources[0].Name);
+    Assert.AreEqual(name, text.Substring(call.Sources[0].TextLocation.Offset, call.Sources[0].TextLength));
+  }
+}
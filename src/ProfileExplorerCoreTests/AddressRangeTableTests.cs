@@ -0,0 +1,76 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Collections;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class AddressRangeTableTests {
+  private static AddressRangeTable CreateTable(int count, Random random, out long[] starts, out long[] ends) {
+    starts = new long[count];
+    ends = new long[count];
+    long position = 0;
+
+    for (int i = 0; i < count; i++) {
+      position += random.Next(0, 50);
+      starts[i] = position;
+      ends[i] = position + random.Next(0, 30);
+    }
+
+    return new AddressRangeTable(starts, ends);
+  }
+
+  private static bool Contains(long[] starts, long[] ends, int index, long address) {
+    return address >= starts[index] && address <= ends[index];
+  }
+
+  [TestMethod]
+  public void FindMatchesLinearScan() {
+    var random = new Random(42);
+
+    // Sizes below and above the vectorized linear search threshold.
+    foreach (int count in new[] {0, 1, 7, 64, 65, 1000}) {
+      var table = CreateTable(count, random, out long[] starts, out long[] ends);
+      long[] addresses = new long[200];
+
+      for (int i = 0; i < addresses.Length; i++) {
+        addresses[i] = random.Next(-10, (int)(count > 0 ? ends[^1] : 0) + 10);
+      }
+
+      int[] indices = new int[addresses.Length];
+      table.Find(addresses, indices);
+
+      for (int i = 0; i < addresses.Length; i++) {
+        long address = addresses[i];
+        bool expectedFound = false;
+        int lowerBound = -1;
+
+        for (int k = 0; k < count; k++) {
+          expectedFound |= Contains(starts, ends, k, address);
+          lowerBound = starts[k] <= address ? k : lowerBound;
+        }
+
+        Assert.AreEqual(lowerBound, AddressRangeTable.FindLastAtOrBefore(starts, address));
+        Assert.AreEqual(expectedFound, table.Find(address) >= 0);
+        Assert.AreEqual(expectedFound, indices[i] >= 0, $"count {count}, address {address}");
+
+        if (indices[i] >= 0) {
+          Assert.IsTrue(Contains(starts, ends, indices[i], address));
+        }
+      }
+    }
+  }
+
+  [TestMethod]
+  public void FindHandlesNestedRanges() {
+    var table = new AddressRangeTable(new long[] {0x1000, 0x1010, 0x1020},
+                                      new long[] {0x10FF, 0x101F, 0x102F});
+    Assert.AreEqual(1, table.Find(0x1015));
+    Assert.AreEqual(2, table.Find(0x1020));
+    Assert.AreEqual(0, table.Find(0x1050)); // After the nested ranges, inside the outer one.
+    Assert.AreEqual(-1, table.Find(0x1100));
+    Assert.AreEqual(-1, table.Find(0xFFF));
+  }
+}
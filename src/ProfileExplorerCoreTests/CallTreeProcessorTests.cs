@@ -0,0 +1,132 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.CallTree;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.Processing;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class CallTreeProcessorTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+
+  private static ProfileData CreateProfile() {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    var funcs = new[] {"main", "foo", "bar", "baz"}.
+      Select(name => new IRTextFunction(name)).ToArray();
+    var stacks = new[] {
+      MakeStack(10, funcs, 0, 1, 2),
+      MakeStack(10, funcs, 0, 1, 3),
+      MakeStack(20, funcs, 0, 1, 2),
+      MakeStack(20, funcs, 0, 3)
+    };
+
+    for (int i = 0; i < 100; i++) {
+      var stack = stacks[i % stacks.Length];
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1 + i % 3), false, 0), stack));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    return profile;
+  }
+
+  // Frames are given by function index from the root.
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction[] funcs, params int[] rootFirstFuncs) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstFuncs.Length]);
+    var stack = new ResolvedProfileStack(rootFirstFuncs.Length, context);
+
+    for (int i = rootFirstFuncs.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      int funcIndex = rootFirstFuncs[i];
+      long rva = 0x100 * (funcIndex + 1);
+      var info = new FunctionDebugInfo(funcs[funcIndex].Name, rva, 16);
+      stack.AddFrame(funcs[funcIndex], Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+
+  private static void AssertSameTree(ProfileCallTreeNode expected, ProfileCallTreeNode actual) {
+    Assert.AreEqual(expected.FunctionName, actual.FunctionName);
+    Assert.AreEqual(expected.Weight, actual.Weight, expected.FunctionName);
+    Assert.AreEqual(expected.ExclusiveWeight, actual.ExclusiveWeight, expected.FunctionName);
+    Assert.AreEqual(expected.ThreadWeights.Count, actual.ThreadWeights.Count, expected.FunctionName);
+
+    foreach (var pair in expected.ThreadWeights) {
+      Assert.AreEqual(pair.Value, actual.ThreadWeights[pair.Key], expected.FunctionName);
+    }
+
+    int expectedChildren = expected.HasChildren ? expected.Children.Count : 0;
+    int actualChildren = actual.HasChildren ? actual.Children.Count : 0;
+    Assert.AreEqual(expectedChildren, actualChildren, expected.FunctionName);
+
+    if (expected.HasChildren) {
+      foreach (var child in expected.Children) {
+        var actualChild = actual.Children.First(c => c.Function == child.Function);
+        AssertSameTree(child, actualChild);
+      }
+    }
+  }
+
+  [TestMethod]
+  public void StackHistogramMatchesPerSampleCallTree() {
+    var profile = CreateProfile();
+    var perSampleTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 4, false);
+    var histogramTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 4, true);
+
+    Assert.AreEqual(1, histogramTree.RootNodes.Count);
+    Assert.AreEqual(perSampleTree.TotalRootNodesWeight, histogramTree.TotalRootNodesWeight);
+    AssertSameTree(perSampleTree.RootNodes[0], histogramTree.RootNodes[0]);
+  }
+
+  [TestMethod]
+  public void StackHistogramHonorsThreadFilter() {
+    var profile = CreateProfile();
+    var filter = new ProfileSampleFilter(20);
+    var perSampleTree = CallTreeProcessor.Compute(profile, filter, 4, false);
+    var histogramTree = CallTreeProcessor.Compute(profile, filter, 4, true);
+
+    AssertSameTree(perSampleTree.RootNodes[0], histogramTree.RootNodes[0]);
+    Assert.IsTrue(histogramTree.RootNodes[0].ThreadWeights.Keys.All(threadId => threadId == 20));
+  }
+
+  [TestMethod]
+  public void MergedChunksMatchSingleChunkCallTree() {
+    var profile = CreateProfile();
+    var singleTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 1, false);
+    var mergedTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 16, false);
+    AssertSameTree(singleTree.RootNodes[0], mergedTree.RootNodes[0]);
+
+    // Nodes moved from other chunk trees point to their new parent
+    // and are found by function and by ID.
+    var worklist = new Stack<ProfileCallTreeNode>(mergedTree.RootNodes);
+    int nodeCount = 0;
+
+    while (worklist.TryPop(out var node)) {
+      nodeCount++;
+      Assert.AreSame(node, mergedTree.FindNode(node.Id));
+      Assert.IsTrue(mergedTree.GetCallTreeNodes(node.Function).Contains(node));
+
+      if (node.HasChildren) {
+        foreach (var child in node.Children) {
+          Assert.AreSame(node, child.Caller);
+          worklist.Push(child);
+        }
+      }
+    }
+
+    Assert.AreEqual(5, nodeCount);
+    Assert.IsNull(mergedTree.FindNode(-1));
+  }
+}
@@ -0,0 +1,164 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.CallTree;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.Processing;
+using ProfileExplorer.Core.Profile.Timeline;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class CallTreeSampleIndexTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+
+  private static ProfileData CreateProfile() {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    var funcs = new[] {"main", "foo", "bar", "baz"}.
+      Select(name => new IRTextFunction(name)).ToArray();
+    var stacks = new[] {
+      MakeStack(10, funcs, 0, 1, 2),
+      MakeStack(10, funcs, 0, 1, 3),
+      MakeStack(20, funcs, 0, 1, 2),
+      MakeStack(20, funcs, 0, 3),
+      MakeStack(30, funcs, 0, 1)
+    };
+
+    for (int i = 0; i < 100; i++) {
+      var stack = stacks[i * 7 % stacks.Length];
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1 + i % 3), false, 0), stack));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    profile.CallTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 4, true);
+    return profile;
+  }
+
+  // Frames are given by function index from the root.
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction[] funcs, params int[] rootFirstFuncs) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstFuncs.Length]);
+    var stack = new ResolvedProfileStack(rootFirstFuncs.Length, context);
+
+    for (int i = rootFirstFuncs.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      int funcIndex = rootFirstFuncs[i];
+      long rva = 0x100 * (funcIndex + 1);
+      var info = new FunctionDebugInfo(funcs[funcIndex].Name, rva, 16);
+      stack.AddFrame(funcs[funcIndex], Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+
+  private static IEnumerable<ProfileCallTreeNode> EnumerateNodes(ProfileCallTreeNode node) {
+    yield return node;
+
+    if (node.HasChildren) {
+      foreach (var child in node.Children) {
+        foreach (var childNode in EnumerateNodes(child)) {
+          yield return childNode;
+        }
+      }
+    }
+  }
+
+  private static void AssertSameThreadSamples(Dictionary<int, List<SampleIndex>> expected,
+                                              Dictionary<int, List<SampleIndex>> actual) {
+    CollectionAssert.AreEquivalent(expected.Keys, actual.Keys);
+
+    foreach (var pair in expected) {
+      CollectionAssert.AreEqual(pair.Value, actual[pair.Key], $"thread {pair.Key}");
+    }
+  }
+
+  [TestMethod]
+  public void NodeSamplesMatchStackScan() {
+    var profile = CreateProfile();
+    var index = profile.GetCallTreeSampleIndex();
+    var nodes = profile.CallTree.RootNodes.SelectMany(EnumerateNodes).ToList();
+    Assert.AreEqual(nodes.Count, index.NodeCount);
+
+    // A time range over all samples is not handled by the index
+    // and falls back to matching the stack of each sample.
+    var scanFilter = new ProfileSampleFilter {
+      TimeRange = new SampleTimeRangeInfo(profile.Samples.TimeAt(0),
+                                          profile.Samples.TimeAt(profile.Samples.Count - 1),
+                                          0, profile.Samples.Count, -1)
+    };
+
+    foreach (var node in nodes) {
+      var expected = FunctionSamplesProcessor.Compute(node, profile, scanFilter, 4);
+      var actual = FunctionSamplesProcessor.Compute(node, profile, new ProfileSampleFilter());
+      AssertSameThreadSamples(expected, actual);
+
+      // The samples make up the node's total weight.
+      int[] sampleIndices = index.GetSampleIndices(node);
+      var weight = sampleIndices.Aggregate(TimeSpan.Zero, (sum, i) => sum + profile.Samples.WeightAt(i));
+      Assert.AreEqual(node.Weight, weight, node.FunctionName);
+      Assert.AreEqual(sampleIndices.Length, index.GetSampleCount(node));
+    }
+  }
+
+  [TestMethod]
+  public void FilteredTreeNodeSamplesMatchStackScan() {
+    // The call tree of thread 10 doesn't have the main > baz path of thread 20,
+    // its samples still belong to main like with the stack scan.
+    var profile = CreateProfile();
+    profile.CallTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(10), 4, true);
+    var nodes = profile.CallTree.RootNodes.SelectMany(EnumerateNodes).ToList();
+    var mainNode = profile.CallTree.RootNodes.Single();
+    Assert.IsNull(mainNode.Children.FirstOrDefault(node => node.FunctionName == "baz"));
+
+    var scanFilter = new ProfileSampleFilter {
+      TimeRange = new SampleTimeRangeInfo(profile.Samples.TimeAt(0),
+                                          profile.Samples.TimeAt(profile.Samples.Count - 1),
+                                          0, profile.Samples.Count, -1)
+    };
+
+    foreach (var node in nodes) {
+      var expected = FunctionSamplesProcessor.Compute(node, profile, scanFilter, 4);
+      var actual = FunctionSamplesProcessor.Compute(node, profile, new ProfileSampleFilter());
+      AssertSameThreadSamples(expected, actual);
+    }
+
+    Assert.AreEqual(profile.Samples.Count, profile.GetCallTreeSampleIndex().GetSampleCount(mainNode));
+  }
+
+  [TestMethod]
+  public void GroupNodeSamplesAreUnionOfInstances() {
+    var profile = CreateProfile();
+    var index = profile.GetCallTreeSampleIndex();
+    var bazFunc = profile.CallTree.RootNodes.SelectMany(EnumerateNodes).
+      First(node => node.FunctionName == "baz").Function;
+    var instances = profile.CallTree.GetCallTreeNodes(bazFunc);
+    Assert.AreEqual(2, instances.Count);
+
+    var groupNode = new ProfileCallTreeGroupNode(instances[0].FunctionDebugInfo, instances[0].Function, instances);
+    int[] expected = instances.SelectMany(index.GetSampleIndices).OrderBy(i => i).ToArray();
+    CollectionAssert.AreEqual(expected, index.GetSampleIndices(groupNode));
+  }
+
+  [TestMethod]
+  public void IndexIsRebuiltForNewCallTree() {
+    var profile = CreateProfile();
+    var index = profile.GetCallTreeSampleIndex();
+    Assert.AreSame(index, profile.GetCallTreeSampleIndex());
+
+    var previousRoot = profile.CallTree.RootNodes[0];
+    profile.CallTree = CallTreeProcessor.Compute(profile, new ProfileSampleFilter(), 4, true);
+    var newIndex = profile.GetCallTreeSampleIndex();
+    Assert.AreNotSame(index, newIndex);
+    Assert.IsNull(newIndex.GetSampleIndices(previousRoot));
+    Assert.AreEqual(profile.Samples.Count, newIndex.GetSampleCount(profile.CallTree.RootNodes[0]));
+  }
+}
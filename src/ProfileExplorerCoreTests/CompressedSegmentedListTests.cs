@@ -188,6 +188,78 @@ public class CompressedSegmentedListTests {
     }
   }
 
+  [TestMethod]
+  public void TestCodecs() {
+    var codecs = new ISegmentCodec<TestObject>[] {
+      BrotliSegmentCodec<TestObject>.Instance, ColumnarSegmentCodec<TestObject>.Instance
+    };
+
+    foreach (var codec in codecs) {
+      var list = new CompressedSegmentedList<TestObject>(1000, codec: codec);
+      int count = 10500;
+      TestObject.Counter = 0;
+
+      for (int i = 0; i < count; i++) {
+        list.Add(TestObject.Create());
+      }
+
+      // Compress the partially filled last segment, then add more values to it.
+      list.CompressRange(0, count - 1);
+      list.Wait();
+      list.Add(TestObject.Create());
+      count++;
+
+      var values = new TestObject[count];
+      list.CopyTo(values, 0);
+      int counter = 0;
+
+      foreach (var item in values) {
+        Assert.AreEqual(item.a, counter);
+        Assert.AreEqual(item.d, counter + 3);
+        counter += 4;
+      }
+
+      // Ranges ending at a segment boundary.
+      Assert.AreEqual(2000, list.Enumerate(1000, 3000).Count());
+      Assert.AreEqual(count - 10000, list.Enumerate(10000, count).Count());
+      Assert.AreEqual(0, list.Enumerate(count, count).Count());
+      Assert.AreEqual(values[2999].a, list.Enumerate(1000, 3000).Last().a);
+      list.Dispose();
+    }
+  }
+
+  [TestMethod]
+  public void TestUpdateRecentValues() {
+    // Like setting the stack of a recent sample while parsing a trace,
+    // values in the previous, compressed segments are updated by index while adding.
+    var list = new CompressedSegmentedList<TestObject>(1000);
+    int count = 20000;
+    TestObject.Counter = 0;
+
+    for (int i = 0; i < count; i++) {
+      list.Add(TestObject.Create());
+
+      if (i >= 1500 && i % 7 == 0) {
+        list.GetValueRef(i - 1500).d = -1;
+        list[i - 1200] = list[i - 1200] with {c = -1};
+      }
+    }
+
+    int index = 0;
+
+    foreach (var item in list) {
+      bool updatedRef = index < count - 1500 && (index + 1500) % 7 == 0;
+      bool updatedSet = index < count - 1200 && index + 1200 >= 1500 && (index + 1200) % 7 == 0;
+      Assert.AreEqual(index * 4, item.a);
+      Assert.AreEqual(updatedSet ? -1 : index * 4 + 2, item.c);
+      Assert.AreEqual(updatedRef ? -1 : index * 4 + 3, item.d);
+      index++;
+    }
+
+    Assert.AreEqual(count, index);
+    list.Dispose();
+  }
+
   [TestMethod]
   public void TestGuid() {
     var list = new CompressedSegmentedList<TestGuidObject>();
@@ -0,0 +1,81 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Binary;
+
+namespace ProfileExplorer.CoreTests;
+
+/// <summary>
+/// Measures the disassembly throughput of the code sections of a large system module,
+/// decoding one instruction per Capstone call vs. batches of instructions.
+/// Requires capstone.dll next to the tests, otherwise the benchmark is skipped.
+/// </summary>
+[TestClass]
+public class DisassemblerBenchmarks {
+  // Code sections also contain data and padding, where disassembly stops,
+  // so disassemble them in chunks like functions instead of a single range.
+  private const int ChunkSize = 4096;
+
+  [TestMethod]
+  [TestCategory("Benchmark")]
+  public void Benchmark_InstructionBatching() {
+    string modulePath = Path.Combine(Environment.SystemDirectory, "ntdll.dll");
+
+    if (!File.Exists(modulePath)) {
+      Assert.Inconclusive($"Module {modulePath} not found");
+    }
+
+    Disassembler disassembler;
+
+    try {
+      disassembler = Disassembler.CreateForBinary(modulePath, null, null);
+    }
+    catch (DllNotFoundException) {
+      Assert.Inconclusive("Capstone disassembler not available");
+      return;
+    }
+
+    using var peInfo = new PEBinaryInfoProvider(modulePath);
+    Assert.IsTrue(peInfo.Initialize());
+    var ranges = new List<(long StartRVA, long Size)>();
+
+    foreach (var section in peInfo.CodeSectionHeaders) {
+      for (long offset = 0; offset < section.VirtualSize; offset += ChunkSize) {
+        ranges.Add((section.VirtualAddress + offset, Math.Min(ChunkSize, section.VirtualSize - offset)));
+      }
+    }
+
+    using (disassembler) {
+      disassembler.InstructionBatchSize = 1;
+      var (singleCount, singleTime) = Disassemble(disassembler, ranges);
+      disassembler.InstructionBatchSize = Disassembler.DefaultInstructionBatchSize;
+      var (batchCount, batchTime) = Disassemble(disassembler, ranges);
+
+      Console.WriteLine($"Disassembled {Path.GetFileName(modulePath)}, {ranges.Count} chunks:");
+      Console.WriteLine($"  one instruction per call: {singleCount / singleTime.TotalSeconds:F0} instrs/sec");
+      Console.WriteLine($"  batch of {Disassembler.DefaultInstructionBatchSize}: " +
+                        $"{batchCount / batchTime.TotalSeconds:F0} instrs/sec");
+      Assert.AreEqual(singleCount, batchCount);
+      Assert.IsTrue(batchCount > 0);
+    }
+  }
+
+  private static (long Count, TimeSpan Time) Disassemble(Disassembler disassembler,
+                                                         List<(long StartRVA, long Size)> ranges) {
+    var instructions = new List<DisassembledInstruction>();
+    var stopwatch = Stopwatch.StartNew();
+    long count = 0;
+
+    foreach (var range in ranges) {
+      instructions.Clear();
+      disassembler.DisassembleToText(range.StartRVA, range.Size, instructions);
+      count += instructions.Count;
+    }
+
+    return (count, stopwatch.Elapsed);
+  }
+}
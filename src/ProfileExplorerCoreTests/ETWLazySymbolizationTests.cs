@@ -0,0 +1,133 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Concurrent;
+using System.Collections.Generic;
+using System.Linq;
+using System.Reflection;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Compilers.Architecture;
+using ProfileExplorer.Core.Compilers.ASM;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.ETW;
+using ProfileExplorer.Core.Profile.Processing;
+using ProfileExplorer.Core.Settings;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ETWLazySymbolizationTests {
+  private static readonly BindingFlags NonPublic =
+    BindingFlags.Instance | BindingFlags.NonPublic;
+  private const int ProcessId = 1100;
+  private const int ThreadId = 2100;
+
+  [TestMethod]
+  public async Task FramesGroupedByAddressBucketThenRemapped() {
+    var rawProfile = new RawProfileData("synthetic.etl");
+    rawProfile.TraceInfo.PointerSize = 8;
+    var process = rawProfile.GetOrCreateProcess(ProcessId);
+    process.Name = process.ImageFileName = "lazy.exe";
+    rawProfile.AddThreadToProcess(ProcessId, new ProfileThread(ThreadId, ProcessId, null));
+    var context = new ProfileContext(ProcessId, ThreadId, 0);
+    typeof(RawProfileData).GetMethod("AddContext", NonPublic)!.Invoke(rawProfile, new object[] {context});
+    var image = new ProfileImage("lazy.exe", "lazy.exe", 0x10000, 0x10000, 0x10000, 0, 0);
+    rawProfile.AddImageToProcess(ProcessId, image);
+    rawProfile.LoadingCompleted();
+
+    var provider = new ETWProfileDataProvider();
+    SetField(provider, "report_", new ProfileDataReport());
+    SetField(provider, "options_", new ProfileDataProviderOptions {LazySymbolization = true});
+    SetField(provider, "compilerInfoProvider_", new ASMCompilerInfoProvider(IRMode.x86_64));
+    SetField(provider, "deferDebugInfo_", true);
+    var profile = (ProfileData)typeof(ETWProfileDataProvider).GetField("profileData_", NonPublic)!.
+      GetValue(provider)!;
+
+    // Leaf frames in the same and in another address bucket, all called from main.
+    var stacks = new List<ResolvedProfileStack>();
+
+    foreach (long leafIp in new long[] {0x10510, 0x10580, 0x10610}) {
+      var stack = new ProfileStack {ContextId = 1, FramePointers = new[] {leafIp, 0x10A00}};
+      stacks.Add(await (Task<ResolvedProfileStack>)typeof(ETWProfileDataProvider).
+                   GetMethod("ProcessUnresolvedStackAsync", NonPublic)!.
+                   Invoke(provider, new object[] {stack, context, rawProfile, new SymbolFileSourceSettings()})!);
+    }
+
+    var leafFuncs = stacks.Select(stack => stack.StackFrames[0].FrameDetails.Function).ToList();
+    Assert.AreSame(leafFuncs[0], leafFuncs[1]);
+    Assert.AreNotSame(leafFuncs[0], leafFuncs[2]);
+    Assert.AreEqual("[500-5FF]", leafFuncs[0].Name);
+    Assert.IsTrue(ProfileModuleBuilder.IsAddressBucketFunction(stacks[0].StackFrames[0].FrameDetails.DebugInfo));
+
+    for (int i = 0; i < 30; i++) {
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1), false, 0), stacks[i % 3]));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    profile.FilterFunctionProfile(new ProfileSampleFilter());
+    Assert.AreEqual(TimeSpan.FromMilliseconds(20), profile.FunctionProfiles[leafFuncs[0]].Weight);
+
+    // Without debug info for the module, the address buckets are kept.
+    int remapCount = 0;
+    profile.FunctionsRemapped += (sender, e) => remapCount++;
+    bool completed = await (Task<bool>)typeof(ETWProfileDataProvider).
+      GetMethod("SymbolizeAddressBucketsAsync", NonPublic)!.
+      Invoke(provider, new object[] {rawProfile, new List<int> {ProcessId}, Task.CompletedTask,
+                                     new SymbolFileSourceSettings(), null})!;
+    Assert.IsTrue(completed);
+    Assert.AreEqual(0, remapCount);
+    Assert.AreSame(leafFuncs[0], stacks[0].StackFrames[0].FrameDetails.Function);
+    var moduleMap = (ConcurrentDictionary<int, ProfileModuleBuilder>)typeof(ETWProfileDataProvider).
+      GetField("imageModuleMap_", NonPublic)!.GetValue(provider)!;
+    Assert.IsFalse(moduleMap[image.Id].DebugInfoPending);
+
+    // Remap the frames of the first bucket to two functions, like after loading the debug info,
+    // the stacks sharing the frame instances see the new functions.
+    var foo = new IRTextFunction("foo");
+    var bar = new IRTextFunction("bar");
+    var fooInfo = new FunctionDebugInfo(foo.Name, 0x500, 0x40);
+    var barInfo = new FunctionDebugInfo(bar.Name, 0x540, 0x80);
+    profile.RemapStackFrames(new List<(ResolvedProfileStackFrame, IRTextFunction, ResolvedProfileStackFrameKey)> {
+      (stacks[0].StackFrames[0], foo, new ResolvedProfileStackFrameKey(fooInfo, image, false)),
+      (stacks[1].StackFrames[0], bar, new ResolvedProfileStackFrameKey(barInfo, image, false))
+    });
+    profile.RefreshFunctionProfile();
+
+    Assert.AreEqual(1, remapCount);
+    Assert.IsFalse(profile.FunctionProfiles.ContainsKey(leafFuncs[0]));
+    Assert.AreEqual(TimeSpan.FromMilliseconds(10), profile.FunctionProfiles[foo].Weight);
+    Assert.AreEqual(TimeSpan.FromMilliseconds(10), profile.FunctionProfiles[bar].Weight);
+
+    var rootNode = profile.CallTree.RootNodes.Single();
+    Assert.AreEqual(TimeSpan.FromMilliseconds(30), rootNode.Weight);
+    CollectionAssert.AreEquivalent(new[] {foo, bar, leafFuncs[2]},
+                                   rootNode.Children.Select(node => node.Function).ToArray());
+
+    // Once remapped, the address buckets are removed from the module functions,
+    // the remaining functions keep their numbers.
+    var moduleBuilder = moduleMap[image.Id];
+    var summary = moduleBuilder.ModuleDocument.Summary;
+    var mainBucket = stacks[0].StackFrames[1].FrameDetails.Function;
+    var other = moduleBuilder.ModuleDocument.AddDummyFunction("other");
+    Assert.AreSame(leafFuncs[0], summary.FindFunction("[500-5FF]"));
+    moduleBuilder.RemoveAddressBucketFunctions();
+
+    Assert.AreSame(other, summary.Functions.Single());
+    Assert.AreSame(other, summary.GetFunctionWithId(other.Number));
+    Assert.AreSame(other.Sections[0], summary.GetSectionWithId(other.Sections[0].Id));
+    Assert.IsNull(summary.FindFunction(leafFuncs[0].Name));
+    Assert.IsNull(summary.GetFunctionWithId(mainBucket.Number));
+
+    var newBucket = moduleBuilder.GetOrCreateAddressBucketFunction(0x500).Function;
+    Assert.AreNotSame(leafFuncs[0], newBucket);
+    Assert.IsTrue(newBucket.Number > other.Number);
+    Assert.AreSame(newBucket, summary.GetFunctionWithId(newBucket.Number));
+  }
+
+  private static void SetField(object obj, string name, object value) =>
+    typeof(ETWProfileDataProvider).GetField(name, NonPublic)!.SetValue(obj, value);
+}
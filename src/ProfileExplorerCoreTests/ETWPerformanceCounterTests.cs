@@ -0,0 +1,99 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Reflection;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Compilers.Architecture;
+using ProfileExplorer.Core.Compilers.ASM;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.ETW;
+using ProfileExplorer.Core.Settings;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ETWPerformanceCounterTests {
+  private static readonly BindingFlags NonPublic =
+    BindingFlags.Instance | BindingFlags.NonPublic;
+  private const int ProcessId = 1200;
+  private const int ThreadId = 2200;
+  private const int MainSampleCount = 5000;
+  private const int LibSampleCount = 1000;
+
+  [TestMethod]
+  public void SamplesUsedAsEventsOfSamplingCounters() {
+    // PMU counters used as sampling sources have no counter events,
+    // each sample is counted once for every counter.
+    var rawProfile = CreateRawProfile(addCounterEvents: false);
+    Assert.IsTrue(rawProfile.UsesSamplesAsPerformanceCounterEvents);
+    Assert.IsTrue(rawProfile.HasPerformanceCounterData);
+
+    var profile = ProcessPerformanceCounters(rawProfile);
+    Assert.AreEqual(MainSampleCount, profile.ModuleCounters["main.exe"][1]);
+    Assert.AreEqual(MainSampleCount, profile.ModuleCounters["main.exe"][2]);
+    Assert.AreEqual(LibSampleCount, profile.ModuleCounters["lib.dll"][1]);
+    Assert.AreEqual(LibSampleCount, profile.ModuleCounters["lib.dll"][2]);
+    Assert.AreEqual(2, profile.ModuleCounters["main.exe"].Count);
+  }
+
+  [TestMethod]
+  public void CounterEventsAttributedToModules() {
+    var rawProfile = CreateRawProfile(addCounterEvents: true);
+    Assert.IsFalse(rawProfile.UsesSamplesAsPerformanceCounterEvents);
+    Assert.IsTrue(rawProfile.HasPerformanceCounterData);
+
+    var profile = ProcessPerformanceCounters(rawProfile);
+    Assert.AreEqual(MainSampleCount, profile.ModuleCounters["main.exe"][1]);
+    Assert.AreEqual(LibSampleCount, profile.ModuleCounters["lib.dll"][1]);
+    Assert.AreEqual(1, profile.ModuleCounters["main.exe"].Count);
+  }
+
+  private static RawProfileData CreateRawProfile(bool addCounterEvents) {
+    var rawProfile = new RawProfileData("synthetic.etl");
+    rawProfile.TraceInfo.PointerSize = 8;
+    var process = rawProfile.GetOrCreateProcess(ProcessId);
+    process.Name = process.ImageFileName = "main.exe";
+    rawProfile.AddThreadToProcess(ProcessId, new ProfileThread(ThreadId, ProcessId, null));
+    var context = new ProfileContext(ProcessId, ThreadId, 0);
+    int contextId = (int)typeof(RawProfileData).GetMethod("AddContext", NonPublic)!.
+      Invoke(rawProfile, new object[] {context})!;
+    rawProfile.AddImageToProcess(ProcessId, new ProfileImage("main.exe", "main.exe", 0x10000, 0x10000,
+                                                             0x10000, 0, 0));
+    rawProfile.AddImageToProcess(ProcessId, new ProfileImage("lib.dll", "lib.dll", 0x30000, 0x30000,
+                                                             0x10000, 0, 0));
+    rawProfile.AddPerformanceCounter(new PerformanceCounter(1, "InstructionRetired"));
+    rawProfile.AddPerformanceCounter(new PerformanceCounter(2, "BranchMispredictions"));
+
+    // Interleave the samples of the two modules, so that each chunk sees both.
+    for (int i = 0; i < MainSampleCount + LibSampleCount; i++) {
+      long ip = i % 6 == 5 ? 0x30100 + i % 64 : 0x10100 + i % 256;
+      var time = TimeSpan.FromMilliseconds(i);
+      rawProfile.AddSample(new ProfileSample(ip, time, TimeSpan.FromMilliseconds(1), false, contextId));
+
+      if (addCounterEvents) {
+        rawProfile.AddPerformanceCounterEvent(new PerformanceCounterEvent(ip, time, contextId, 1));
+      }
+    }
+
+    rawProfile.LoadingCompleted();
+    return rawProfile;
+  }
+
+  private static ProfileData ProcessPerformanceCounters(RawProfileData rawProfile) {
+    var provider = new ETWProfileDataProvider();
+    SetField(provider, "report_", new ProfileDataReport());
+    SetField(provider, "options_", new ProfileDataProviderOptions {LazySymbolization = true});
+    SetField(provider, "compilerInfoProvider_", new ASMCompilerInfoProvider(IRMode.x86_64));
+    SetField(provider, "deferDebugInfo_", true);
+
+    typeof(ETWProfileDataProvider).GetMethod("ProcessPerformanceCounters", NonPublic)!.
+      Invoke(provider, new object[] {rawProfile, new List<int> {ProcessId}, new SymbolFileSourceSettings(),
+                                     null, null});
+    return (ProfileData)typeof(ETWProfileDataProvider).GetField("profileData_", NonPublic)!.GetValue(provider)!;
+  }
+
+  private static void SetField(object obj, string name, object value) =>
+    typeof(ETWProfileDataProvider).GetField(name, NonPublic)!.SetValue(obj, value);
+}
@@ -0,0 +1,110 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.Linq;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Providers;
+
+namespace ProfileExplorer.CoreTests;
+
+/// <summary>
+/// Compares demangling the function names of a large trace from many threads
+/// through the DemangledNameCache against taking the global undname lock
+/// for every name, like PDBDebugInfoProvider.DemangleFunctionName used to.
+/// The demangler is simulated so that the benchmark doesn't depend on DbgHelp.
+/// </summary>
+[TestClass]
+public class FunctionNameDemanglingBenchmarks {
+  private const int FunctionCount = 20000;
+  private const int LookupsPerFunction = 20;
+  private const int DemanglerSpinIterations = 200;
+  private static readonly FunctionNameDemanglingOptions[] OptionsKinds = {
+    FunctionNameDemanglingOptions.Default,
+    FunctionNameDemanglingOptions.OnlyName,
+    FunctionNameDemanglingOptions.OnlyName | FunctionNameDemanglingOptions.NoReturnType |
+    FunctionNameDemanglingOptions.NoSpecialKeywords
+  };
+  private static readonly object demanglerLock_ = new();
+  private static int demanglerCalls_;
+
+  private static string[] CreateMangledNames() {
+    return Enumerable.Range(0, FunctionCount).
+      Select(i => $"?Method{i}@CClass{i % 97}@@UEAAXXZ").ToArray();
+  }
+
+  // Stand-in for DbgHelp UnDecorateSymbolName, which must run under a global lock
+  // and takes a few microseconds per name.
+  private static string Demangle(string name, FunctionNameDemanglingOptions options) {
+    lock (demanglerLock_) {
+      demanglerCalls_++;
+      Thread.SpinWait(DemanglerSpinIterations);
+      return FormatName(name, options);
+    }
+  }
+
+  private static string FormatName(string name, FunctionNameDemanglingOptions options) {
+    int classStart = name.IndexOf('@') + 1;
+    string className = name.Substring(classStart, name.IndexOf("@@", StringComparison.Ordinal) - classStart);
+    string scopedName = $"{className}::{name.Substring(1, classStart - 2)}";
+    return options.HasFlag(FunctionNameDemanglingOptions.OnlyName) ? scopedName :
+      $"public: virtual void __cdecl {scopedName}(void)";
+  }
+
+  [TestMethod]
+  public void ParallelLookupsMatchDemangler() {
+    var cache = new DemangledNameCache();
+    demanglerCalls_ = 0;
+    string[] names = CreateMangledNames();
+
+    Parallel.For(0, names.Length * LookupsPerFunction, i => {
+      string name = names[i % names.Length];
+      var options = OptionsKinds[i / names.Length % OptionsKinds.Length];
+      Assert.AreEqual(FormatName(name, options), cache.GetOrAdd(name, options, Demangle));
+    });
+
+    int expectedEntries = names.Length * OptionsKinds.Length;
+    Assert.AreEqual(expectedEntries, cache.Count);
+    // Threads racing on the same name may both demangle it, but only once each.
+    Assert.IsTrue(cache.MissCount < expectedEntries * 2);
+
+    // Cache hits return the same string instance and don't call the demangler.
+    string first = cache.GetOrAdd(names[0], OptionsKinds[0], Demangle);
+    int calls = demanglerCalls_;
+    Assert.AreSame(first, cache.GetOrAdd(names[0], OptionsKinds[0], Demangle));
+    Assert.AreEqual(calls, demanglerCalls_);
+  }
+
+  [TestMethod]
+  [TestCategory("Benchmark")]
+  public void Benchmark_ParallelDemangling() {
+    string[] names = CreateMangledNames();
+    int lookupCount = names.Length * LookupsPerFunction;
+    var options = OptionsKinds[^1];
+
+    var lockedTime = Measure(() => {
+      Parallel.For(0, lookupCount, i => Demangle(names[i % names.Length], options));
+    });
+
+    var cache = new DemangledNameCache();
+    var cachedTime = Measure(() => {
+      Parallel.For(0, lookupCount, i => cache.GetOrAdd(names[i % names.Length], options, Demangle));
+    });
+
+    Console.WriteLine($"Demangled {lookupCount} names of {names.Length} functions " +
+                      $"on {Environment.ProcessorCount} threads:");
+    Console.WriteLine($"  global lock:  {lockedTime.TotalMilliseconds:F1} ms");
+    Console.WriteLine($"  cached:       {cachedTime.TotalMilliseconds:F1} ms " +
+                      $"({cache.MissCount} misses)");
+    Assert.AreEqual(names.Length, cache.Count);
+  }
+
+  private static TimeSpan Measure(Action action) {
+    var stopwatch = Stopwatch.StartNew();
+    action();
+    return stopwatch.Elapsed;
+  }
+}
@@ -0,0 +1,120 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class InstructionProfileTableTests {
+  [TestMethod]
+  public void MergedChunksMatchAccumulatedSamples() {
+    var random = new Random(42);
+    var expectedWeights = new Dictionary<long, long>();
+    var expectedCounters = new Dictionary<(long, int), long>();
+    var tables = new List<InstructionProfileTable>();
+
+    // Enough samples per chunk to merge pending samples into the columns multiple times.
+    for (int chunk = 0; chunk < 5; chunk++) {
+      var table = new InstructionProfileTable();
+      tables.Add(table);
+
+      for (int i = 0; i < 1000; i++) {
+        long offset = random.Next(300) * 2;
+
+        if (random.Next(4) == 0) {
+          int counterId = random.Next(1, 4);
+          table.AddCounter(offset, counterId, 1);
+          expectedCounters[(offset, counterId)] = expectedCounters.GetValueOrDefault((offset, counterId)) + 1;
+        }
+        else {
+          table.AddWeight(offset, TimeSpan.FromTicks(10 + i));
+          expectedWeights[offset] = expectedWeights.GetValueOrDefault(offset) + 10 + i;
+        }
+      }
+    }
+
+    var merged = InstructionProfileTable.Merge(tables);
+    Assert.AreSame(tables[0], merged);
+    Assert.AreEqual(expectedWeights.Count, merged.WeightCount);
+    Assert.IsTrue(merged.HasCounters);
+
+    var weights = merged.Weights.ToList();
+    CollectionAssert.AreEqual(expectedWeights.Keys.OrderBy(offset => offset).ToList(),
+                              weights.Select(pair => pair.Offset).ToList());
+
+    foreach (var pair in weights) {
+      Assert.AreEqual(expectedWeights[pair.Offset], pair.Weight.Ticks);
+      Assert.IsTrue(merged.TryGetWeight(pair.Offset, out var weight));
+      Assert.AreEqual(pair.Weight, weight);
+    }
+
+    Assert.IsFalse(merged.TryGetWeight(1, out _));
+    Assert.AreEqual(expectedCounters.Count, merged.Counters.Sum(pair => pair.Counters.Count));
+
+    foreach (var pair in merged.Counters) {
+      foreach (var counter in pair.Counters.Counters) {
+        Assert.AreEqual(expectedCounters[(pair.Offset, counter.CounterId)], counter.Value);
+      }
+    }
+
+    var totals = merged.ComputeTotalCounters();
+
+    for (int counterId = 1; counterId < 4; counterId++) {
+      long expectedTotal = expectedCounters.Where(pair => pair.Key.Item2 == counterId).Sum(pair => pair.Value);
+      Assert.AreEqual(expectedTotal, totals.FindCounterValue(counterId));
+    }
+  }
+
+  [TestMethod]
+  public void FunctionProfileMergeCombinesChunks() {
+    var first = new FunctionProfileData();
+    first.AddInstructionSample(0x20, TimeSpan.FromTicks(5));
+    first.AddInstructionSample(0x10, TimeSpan.FromTicks(1));
+    first.Weight = TimeSpan.FromTicks(6);
+
+    var second = new FunctionProfileData();
+    second.AddInstructionSample(0x10, TimeSpan.FromTicks(2));
+    second.AddCounterSample(0x30, 7, 3);
+    second.Weight = TimeSpan.FromTicks(2);
+
+    var merged = FunctionProfileData.Merge(new List<FunctionProfileData> {first, second});
+    Assert.AreSame(first, merged);
+    Assert.AreEqual(TimeSpan.FromTicks(8), merged.Weight);
+    Assert.AreEqual(3, merged.Instructions.Count);
+    Assert.AreEqual(2, merged.Instructions.WeightCount);
+    Assert.IsTrue(merged.HasPerformanceCounters);
+    Assert.IsTrue(merged.Instructions.TryGetWeight(0x10, out var weight));
+    Assert.AreEqual(TimeSpan.FromTicks(3), weight);
+    Assert.AreEqual(3, merged.ComputeFunctionTotalCounters().FindCounterValue(7));
+
+    merged.Reset();
+    Assert.AreEqual(0, merged.Instructions.Count);
+    Assert.IsFalse(merged.HasPerformanceCounters);
+  }
+
+  [TestMethod]
+  public void RowAccessorsSeePendingSamples() {
+    var table = new InstructionProfileTable();
+    table.AddWeight(0x20, TimeSpan.FromTicks(5));
+    table.AddCounter(0x10, 2, 4);
+    table.AddWeight(0x10, TimeSpan.FromTicks(1));
+
+    // Rows are read by index without another accessor compacting the table first.
+    Assert.AreEqual(0x10, table.GetOffset(0));
+    Assert.AreEqual(TimeSpan.FromTicks(1), table.GetWeight(0));
+    Assert.AreEqual(0x20, table.GetOffset(1));
+
+    var counters = new PerformanceCounterValueSet();
+    Assert.AreSame(counters, table.GetCounters(0, counters));
+    Assert.AreEqual(4, counters.FindCounterValue(2));
+    Assert.IsNull(table.GetCounters(1, counters));
+
+    table.AddCounter(0x20, 2, 3);
+    Assert.AreEqual(3, table.GetCounters(1, counters).FindCounterValue(2));
+    Assert.AreEqual(1, counters.Count);
+  }
+}
@@ -0,0 +1,179 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Graph;
+using ProfileExplorer.Core.IR;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class LayeredGraphLayoutTests {
+  private const double Tolerance = 1e-6;
+
+  // Flow graph with a diamond, a loop with a back edge, an edge
+  // spanning multiple layers and a block looping on itself.
+  private static LayeredGraphLayout CreateFlowGraph() {
+    var layout = new LayeredGraphLayout(GraphKind.FlowGraph);
+
+    for (int i = 0; i < 8; i++) {
+      var (width, height) = LayeredGraphLayout.EstimateNodeSize($"B{i}");
+      layout.AddNode($"n{i}", $"B{i}", width, height);
+    }
+
+    (int From, int To)[] edges = {
+      (0, 1), (0, 2), (1, 3), (2, 3), (3, 4), (4, 5), (5, 4), (5, 6), (0, 7), (6, 7), (6, 6)
+    };
+
+    foreach (var (from, to) in edges) {
+      layout.AddEdge($"n{from}", $"n{to}", to <= from ? Edge.EdgeKind.Dashed : Edge.EdgeKind.Default);
+    }
+
+    return layout;
+  }
+
+  private static bool IsOnNodeBorder(Node node, Tuple<double, double> point) {
+    return Math.Abs(point.Item1 - node.CenterX) <= node.Width / 2 + Tolerance &&
+           Math.Abs(point.Item2 - node.CenterY) <= node.Height / 2 + Tolerance;
+  }
+
+  [TestMethod]
+  public void LayoutSeparatesNodesAndConnectsEdges() {
+    var layout = CreateFlowGraph();
+    var graph = layout.CreateGraph(layout.Compute(), new Dictionary<string, TaggedObject>());
+    Assert.AreEqual(8, graph.Nodes.Count);
+    Assert.AreEqual(11, graph.Edges.Count);
+
+    foreach (var node in graph.Nodes) {
+      Assert.IsTrue(node.CenterX - node.Width / 2 >= -Tolerance && node.CenterX + node.Width / 2 <= graph.Width + Tolerance);
+      Assert.IsTrue(node.CenterY - node.Height / 2 >= -Tolerance && node.CenterY + node.Height / 2 <= graph.Height + Tolerance);
+
+      foreach (var other in graph.Nodes) {
+        if (other != node) {
+          bool overlaps = Math.Abs(node.CenterX - other.CenterX) < (node.Width + other.Width) / 2 &&
+                          Math.Abs(node.CenterY - other.CenterY) < (node.Height + other.Height) / 2;
+          Assert.IsFalse(overlaps, $"{node.Label} overlaps {other.Label}");
+        }
+      }
+    }
+
+    // The entry block is at the top, the exit block at the bottom.
+    Assert.AreEqual(graph.Nodes.Min(n => n.CenterY), graph.Nodes[0].CenterY);
+    Assert.AreEqual(graph.Nodes.Max(n => n.CenterY), graph.Nodes[7].CenterY);
+
+    foreach (var edge in graph.Edges) {
+      var points = edge.LinePoints;
+      Assert.AreEqual(1, points.Length % 3, "edges are drawn as cubic B-splines");
+      Assert.IsTrue(IsOnNodeBorder(edge.NodeFrom, points[0]), $"{edge.NodeFrom.Label} -> {edge.NodeTo.Label}");
+      Assert.IsTrue(IsOnNodeBorder(edge.NodeTo, points[^1]), $"{edge.NodeFrom.Label} -> {edge.NodeTo.Label}");
+
+      // Forward edges go down, back edges of the loop go up.
+      if (edge.NodeFrom != edge.NodeTo) {
+        Assert.AreEqual(edge.Style == Edge.EdgeKind.Dashed, points[^1].Item2 < points[0].Item2);
+      }
+    }
+  }
+
+  [TestMethod]
+  public void LayoutIsReusedFromFileCache() {
+    var layout = CreateFlowGraph();
+    var layoutData = layout.Compute();
+    byte[] hash = layout.ComputeStructureHash();
+    CollectionAssert.AreEqual(hash, CreateFlowGraph().ComputeStructureHash());
+
+    // Any change to the structure gives another layout.
+    var changedLayout = CreateFlowGraph();
+    changedLayout.AddEdge("n1", "n7");
+    CollectionAssert.AreNotEqual(hash, changedLayout.ComputeStructureHash());
+
+    string directory = Path.Combine(Path.GetTempPath(), $"LayeredGraphLayoutTests_{Guid.NewGuid()}");
+
+    try {
+      Assert.IsNull(GraphLayoutData.Load(hash, directory));
+      Assert.IsTrue(layoutData.Save(hash, directory));
+      var loadedData = GraphLayoutData.Load(hash, directory);
+      Assert.IsNotNull(loadedData);
+      Assert.AreEqual(layoutData.Width, loadedData.Width);
+      Assert.AreEqual(layoutData.Height, loadedData.Height);
+      CollectionAssert.AreEqual(layoutData.NodeX, loadedData.NodeX);
+      CollectionAssert.AreEqual(layoutData.NodeY, loadedData.NodeY);
+      Assert.AreEqual(layoutData.EdgePoints.Length, loadedData.EdgePoints.Length);
+
+      for (int i = 0; i < layoutData.EdgePoints.Length; i++) {
+        CollectionAssert.AreEqual(layoutData.EdgePoints[i], loadedData.EdgePoints[i]);
+      }
+
+      // A layout is only applied to a graph with the same nodes and edges.
+      Assert.IsNotNull(CreateFlowGraph().CreateGraph(loadedData, null));
+      Assert.IsNull(changedLayout.CreateGraph(loadedData, null));
+    }
+    finally {
+      Directory.Delete(directory, true);
+    }
+  }
+
+  [TestMethod]
+  public void TrimCacheDirectoryDeletesLeastRecentlyUsedLayouts() {
+    var layoutData = CreateFlowGraph().Compute();
+    string directory = Path.Combine(Path.GetTempPath(), $"LayeredGraphLayoutTests_{Guid.NewGuid()}");
+    byte[][] hashes = {new byte[] {1}, new byte[] {2}, new byte[] {3}};
+
+    try {
+      var time = DateTime.UtcNow.AddHours(-1);
+
+      foreach (byte[] hash in hashes) {
+        Assert.IsTrue(layoutData.Save(hash, directory));
+        File.SetLastWriteTimeUtc(GraphLayoutData.MakeCacheFilePath(hash, directory), time);
+        time = time.AddMinutes(1);
+      }
+
+      // Loading the oldest layout makes it the most recently used one.
+      Assert.IsNotNull(GraphLayoutData.Load(hashes[0], directory));
+      long fileSize = new FileInfo(GraphLayoutData.MakeCacheFilePath(hashes[0], directory)).Length;
+
+      Assert.AreEqual(0, GraphLayoutData.TrimCacheDirectory(directory, 3 * fileSize));
+      Assert.AreEqual(1, GraphLayoutData.TrimCacheDirectory(directory, 2 * fileSize));
+      Assert.IsNotNull(GraphLayoutData.Load(hashes[0], directory));
+      Assert.IsNull(GraphLayoutData.Load(hashes[1], directory));
+      Assert.IsNotNull(GraphLayoutData.Load(hashes[2], directory));
+    }
+    finally {
+      Directory.Delete(directory, true);
+    }
+  }
+
+  [TestMethod]
+  public void RelayoutKeepsPreviousNodeOrder() {
+    static LayeredGraphLayout CreateTree(bool addNode) {
+      var layout = new LayeredGraphLayout(GraphKind.DominatorTree);
+      string[] labels = addNode ? new[] {"B0", "B1", "B2", "B3", "B4"} : new[] {"B0", "B1", "B2", "B3"};
+
+      foreach (string label in labels) {
+        var (width, height) = LayeredGraphLayout.EstimateNodeSize(label);
+        layout.AddNode(label, label, width, height);
+      }
+
+      for (int i = 1; i < labels.Length; i++) {
+        layout.AddEdge("B0", labels[i]);
+      }
+
+      return layout;
+    }
+
+    var layout = CreateTree(false);
+    var positions = layout.GetNodePositions(layout.Compute());
+    Assert.IsTrue(positions["B1"] < positions["B2"] && positions["B2"] < positions["B3"]);
+
+    // Previous layout with the children in reverse order, which is kept
+    // for the new graph, with the new node placed next to the node before it.
+    positions["B1"] = 3;
+    positions["B3"] = 1;
+    var newLayout = CreateTree(true);
+    var newPositions = newLayout.GetNodePositions(newLayout.Compute(null, positions));
+    Assert.IsTrue(newPositions["B3"] < newPositions["B2"] && newPositions["B2"] < newPositions["B1"]);
+    Assert.IsTrue(newPositions["B3"] < newPositions["B4"] && newPositions["B4"] < newPositions["B2"]);
+  }
+}
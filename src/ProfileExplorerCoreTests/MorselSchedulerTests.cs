@@ -0,0 +1,164 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Threading;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.Processing;
+using ProfileExplorer.Core.Utilities;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class MorselSchedulerTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) {Id = 1};
+
+  [TestMethod]
+  public void EachIndexProcessedOnce() {
+    const int start = 3;
+    const int end = 100_003;
+    var scheduler = new MorselScheduler(start, end, 1000);
+    Assert.AreEqual(100, scheduler.MorselCount);
+
+    int[] visits = new int[end];
+    var workerMorsels = new List<List<int>>();
+
+    scheduler.Run(8, k => {
+      var morsels = new List<int>();
+
+      lock (workerMorsels) {
+        workerMorsels.Add(morsels);
+      }
+
+      return morsels;
+    }, (morselStart, morselEnd, morsels) => {
+      morsels.Add(morselStart);
+
+      for (int i = morselStart; i < morselEnd; i++) {
+        Interlocked.Increment(ref visits[i]);
+      }
+    });
+
+    Assert.IsTrue(visits.Take(start).All(count => count == 0));
+    Assert.IsTrue(visits.Skip(start).All(count => count == 1));
+    Assert.AreEqual(100, workerMorsels.Sum(morsels => morsels.Count));
+
+    // The morsels of each worker are taken in increasing order.
+    foreach (var morsels in workerMorsels) {
+      CollectionAssert.AreEqual(morsels.OrderBy(i => i).ToList(), morsels);
+    }
+  }
+
+  [TestMethod]
+  public void EmptyRangeRunsOneWorker() {
+    var scheduler = new MorselScheduler(10, 10, 64);
+    int initialized = 0;
+    int processed = 0;
+    int completed = 0;
+
+    scheduler.Run(4, k => Interlocked.Increment(ref initialized),
+                  (start, end, _) => processed += end - start,
+                  (k, _) => Interlocked.Increment(ref completed));
+
+    Assert.AreEqual(1, initialized);
+    Assert.AreEqual(0, processed);
+    Assert.AreEqual(1, completed);
+  }
+
+  [TestMethod]
+  public void MorselSizeClampedAndAligned() {
+    Assert.AreEqual(100, MorselScheduler.ComputeMorselSize(1000, 4, 100, 1000));
+    Assert.AreEqual(1000, MorselScheduler.ComputeMorselSize(100_000_000, 4, 100, 1000));
+    Assert.AreEqual(15625, MorselScheduler.ComputeMorselSize(1_000_000, 4, 100, 100_000));
+    Assert.AreEqual(16384, MorselScheduler.ComputeMorselSize(1_000_000, 4, 100, 100_000, 2048));
+  }
+
+  [TestMethod]
+  public void ProcessorsMatchSingleWorker() {
+    // Enough samples for multiple morsels per worker, the per-worker
+    // results cover interleaved sample ranges and must merge in order.
+    var profile = CreateProfile(100_000, out var funcs);
+    var filter = new ProfileSampleFilter();
+
+    var expectedProfile = FunctionProfileProcessor.Compute(profile, filter, 1);
+    var actualProfile = FunctionProfileProcessor.Compute(profile, filter, 4);
+    Assert.AreEqual(expectedProfile.TotalWeight, actualProfile.TotalWeight);
+
+    foreach (var func in funcs) {
+      var expected = expectedProfile.FunctionProfiles[func];
+      var actual = actualProfile.FunctionProfiles[func];
+      Assert.AreEqual(expected.Weight, actual.Weight, func.Name);
+      Assert.AreEqual(expected.ExclusiveWeight, actual.ExclusiveWeight, func.Name);
+      Assert.AreEqual(expected.SampleStartIndex, actual.SampleStartIndex, func.Name);
+      Assert.AreEqual(expected.SampleEndIndex, actual.SampleEndIndex, func.Name);
+    }
+
+    var expectedTree = CallTreeProcessor.Compute(profile, filter, 1, false);
+    var actualTree = CallTreeProcessor.Compute(profile, filter, 4, false);
+    Assert.AreEqual(expectedTree.TotalRootNodesWeight, actualTree.TotalRootNodesWeight);
+
+    foreach (var func in funcs) {
+      Assert.AreEqual(expectedTree.GetCallTreeNodes(func).Count, actualTree.GetCallTreeNodes(func).Count, func.Name);
+      Assert.AreEqual(expectedTree.GetCombinedCallTreeNodeWeight(func),
+                      actualTree.GetCombinedCallTreeNodeWeight(func), func.Name);
+    }
+
+    CollectionAssert.AreEquivalent(FunctionsForSamplesProcessor.Compute(filter, profile, 1).ToList(),
+                                   FunctionsForSamplesProcessor.Compute(filter, profile, 4).ToList());
+
+    var barNode = expectedTree.GetCallTreeNodes(funcs[2])[0];
+    var expectedSamples = FunctionSamplesProcessor.Compute(barNode, profile, filter, 1);
+    var actualSamples = FunctionSamplesProcessor.Compute(barNode, profile, filter, 4);
+    CollectionAssert.AreEquivalent(expectedSamples.Keys, actualSamples.Keys);
+
+    foreach (var pair in expectedSamples) {
+      CollectionAssert.AreEqual(pair.Value, actualSamples[pair.Key], $"thread {pair.Key}");
+    }
+  }
+
+  private static ProfileData CreateProfile(int sampleCount, out IRTextFunction[] funcs) {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    funcs = new[] {"main", "foo", "bar", "baz"}.
+      Select(name => new IRTextFunction(name)).ToArray();
+    var stacks = new[] {
+      MakeStack(10, funcs, 0, 1, 2),
+      MakeStack(10, funcs, 0, 1, 3),
+      MakeStack(20, funcs, 0, 1, 2),
+      MakeStack(20, funcs, 0, 3),
+      MakeStack(30, funcs, 0, 1)
+    };
+
+    for (int i = 0; i < sampleCount; i++) {
+      var stack = stacks[i * 7 % stacks.Length];
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1 + i % 3), false, 0), stack));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    return profile;
+  }
+
+  // Frames are given by function index from the root.
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction[] funcs, params int[] rootFirstFuncs) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstFuncs.Length]);
+    var stack = new ResolvedProfileStack(rootFirstFuncs.Length, context);
+
+    for (int i = rootFirstFuncs.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      int funcIndex = rootFirstFuncs[i];
+      long rva = 0x100 * (funcIndex + 1);
+      var info = new FunctionDebugInfo(funcs[funcIndex].Name, rva, 16);
+      stack.AddFrame(funcs[funcIndex], Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+}
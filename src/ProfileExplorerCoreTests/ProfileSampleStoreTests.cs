@@ -0,0 +1,111 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ProfileSampleStoreTests {
+  private static ProfileSample MakeSample(long ip, int timeMs, int weightMs) {
+    return new ProfileSample(ip, TimeSpan.FromMilliseconds(timeMs),
+                             TimeSpan.FromMilliseconds(weightMs), false, 0);
+  }
+
+  [TestMethod]
+  public void AddAndReadColumns() {
+    var store = new ProfileSampleStore();
+    var context = new ProfileContext(1, 10, 0);
+    var stackA = new ResolvedProfileStack(0, context);
+    var stackB = new ResolvedProfileStack(0, context);
+
+    store.Add((MakeSample(0x100, 1, 5), stackA));
+    store.Add((MakeSample(0x200, 2, 7), stackB));
+    store.Add((MakeSample(0x300, 3, 9), stackA));
+
+    Assert.AreEqual(3, store.Count);
+    Assert.AreEqual(2, store.Stacks.Count);
+    Assert.AreEqual(1, store.Contexts.Count);
+    Assert.AreSame(stackA, store.StackAt(0));
+    Assert.AreSame(stackB, store.StackAt(1));
+    Assert.AreSame(stackA, store.StackAt(2));
+    Assert.AreEqual(0x200, store.IPs[1]);
+    Assert.AreEqual(TimeSpan.FromMilliseconds(7), store.WeightAt(1));
+    Assert.AreEqual(TimeSpan.FromMilliseconds(3), store[2].Sample.Time);
+    Assert.AreSame(stackA, store[2].Stack);
+  }
+
+  [TestMethod]
+  public void SortByTimeKeepsColumnsAligned() {
+    var store = new ProfileSampleStore();
+    var contextA = new ProfileContext(1, 10, 0);
+    var contextB = new ProfileContext(1, 20, 0);
+    var stackA = new ResolvedProfileStack(0, contextA);
+    var stackB = new ResolvedProfileStack(0, contextB);
+
+    store.Add((MakeSample(0x300, 30, 3), stackB));
+    store.Add((MakeSample(0x100, 10, 1), stackA));
+    store.Add((MakeSample(0x200, 20, 2), stackB));
+    store.SortByTime();
+
+    for (int i = 0; i < store.Count; i++) {
+      Assert.AreEqual(TimeSpan.FromMilliseconds((i + 1) * 10), store.TimeAt(i));
+      Assert.AreEqual(TimeSpan.FromMilliseconds(i + 1), store.WeightAt(i));
+      Assert.AreEqual(0x100 * (i + 1), store.IPs[i]);
+    }
+
+    Assert.AreSame(stackA, store.StackAt(0));
+    Assert.AreEqual(10, store.ContextAt(0).ThreadId);
+    Assert.AreEqual(20, store.ContextAt(1).ThreadId);
+  }
+
+  [TestMethod]
+  public void AddRangeSharesStackTable() {
+    var store = new ProfileSampleStore();
+    var chunkA = new ProfileSampleStore(store.Stacks);
+    var chunkB = new ProfileSampleStore(store.Stacks);
+    var contextA = new ProfileContext(1, 10, 0);
+    var contextB = new ProfileContext(1, 20, 0);
+    var stackA = new ResolvedProfileStack(0, contextA);
+    var stackB = new ResolvedProfileStack(0, contextB);
+    int stackIdA = store.Stacks.Register(stackA);
+    int stackIdB = store.Stacks.Register(stackB);
+
+    chunkA.Add(MakeSample(0x100, 1, 1), stackIdA, contextA);
+    chunkB.Add(MakeSample(0x200, 2, 1), stackIdB, contextB);
+    chunkB.Add(MakeSample(0x300, 3, 1), stackIdA, contextA);
+    store.AddRange(chunkA);
+    store.AddRange(chunkB);
+
+    Assert.AreEqual(3, store.Count);
+    Assert.AreEqual(2, store.Stacks.Count);
+    Assert.AreSame(stackB, store.StackAt(1));
+    Assert.AreEqual(20, store.ContextAt(1).ThreadId);
+    Assert.AreEqual(10, store.ContextAt(2).ThreadId);
+    Assert.AreEqual(store.Stacks.Register(stackA), stackIdA);
+  }
+
+  [TestMethod]
+  public void AddRangeOfInterleavedMorselsKeepsTimeOrder() {
+    var store = new ProfileSampleStore();
+    var workerA = new ProfileSampleStore(store.Stacks);
+    var workerB = new ProfileSampleStore(store.Stacks);
+    var contextA = new ProfileContext(1, 10, 0);
+    var contextB = new ProfileContext(1, 20, 0);
+    int stackId = store.Stacks.Register(new ResolvedProfileStack(0, contextA));
+
+    // Worker A processed morsels 0 and 2, worker B morsel 1.
+    workerA.Add(MakeSample(0x100, 1, 1), stackId, contextA);
+    workerA.Add(MakeSample(0x200, 2, 1), stackId, contextA);
+    workerB.Add(MakeSample(0x300, 3, 1), stackId, contextB);
+    workerA.Add(MakeSample(0x400, 4, 1), stackId, contextA);
+    store.AddRange(workerA, 0, 2);
+    store.AddRange(workerB, 0, 1);
+    store.AddRange(workerA, 2, 1);
+
+    CollectionAssert.AreEqual(new long[] {0x100, 0x200, 0x300, 0x400}, store.IPs.ToArray());
+    Assert.AreEqual(20, store.ContextAt(2).ThreadId);
+    Assert.AreEqual(10, store.ContextAt(3).ThreadId);
+  }
+}
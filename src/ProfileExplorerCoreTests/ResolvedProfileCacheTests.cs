@@ -0,0 +1,87 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ResolvedProfileCacheTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+
+  private static ProfileData CreateProfile() {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    var funcs = new[] {"main", "foo", "bar"}.
+      Select(name => new IRTextFunction(name)).ToArray();
+    var stacks = new[] {
+      MakeStack(10, funcs, 0, 1, 2),
+      MakeStack(10, funcs, 0, 1),
+      MakeStack(20, funcs, 0, 2)
+    };
+
+    for (int i = 0; i < 30; i++) {
+      profile.Samples.Add((new ProfileSample(0x1000 + i, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1 + i % 2), false, 0),
+                           stacks[i % stacks.Length]));
+    }
+
+    return profile;
+  }
+
+  // Frames are given by function index from the root.
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction[] funcs, params int[] rootFirstFuncs) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstFuncs.Length]);
+    var stack = new ResolvedProfileStack(rootFirstFuncs.Length, context);
+
+    for (int i = rootFirstFuncs.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      int funcIndex = rootFirstFuncs[i];
+      long rva = 0x100 * (funcIndex + 1);
+      var info = new FunctionDebugInfo(funcs[funcIndex].Name, rva, 16);
+      stack.AddFrame(funcs[funcIndex], Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+
+  [TestMethod]
+  public void RestoredSamplesMatchProfile() {
+    var profile = CreateProfile();
+    var key = new ResolvedProfileCacheKey {TracePath = "trace.etl"};
+    var cache = ResolvedProfileCache.Create(key, profile, new ProfileDataReport());
+    Assert.AreEqual(3, cache.Functions.Count);
+
+    var functions = cache.Functions.Select(f => new IRTextFunction(f.DebugInfo.Name)).ToArray();
+    var restored = new ProfileData();
+    cache.RestoreSamples(restored, functions);
+
+    Assert.AreEqual(profile.Samples.Count, restored.Samples.Count);
+    Assert.AreEqual(profile.Samples.Stacks.Count, restored.Samples.Stacks.Count);
+    CollectionAssert.AreEqual(profile.Samples.IPs.ToArray(), restored.Samples.IPs.ToArray());
+    CollectionAssert.AreEqual(profile.Samples.Times.ToArray(), restored.Samples.Times.ToArray());
+    CollectionAssert.AreEqual(profile.Samples.Weights.ToArray(), restored.Samples.Weights.ToArray());
+    CollectionAssert.AreEqual(profile.Samples.StackIds.ToArray(), restored.Samples.StackIds.ToArray());
+
+    for (int i = 0; i < profile.Samples.Count; i++) {
+      var expected = profile.Samples.StackAt(i);
+      var actual = restored.Samples.StackAt(i);
+      Assert.AreEqual(expected.Context, actual.Context);
+      Assert.AreEqual(profile.Samples.ContextAt(i), restored.Samples.ContextAt(i));
+      Assert.AreEqual(expected.FrameCount, actual.FrameCount);
+
+      for (int k = 0; k < expected.FrameCount; k++) {
+        Assert.AreEqual(expected.StackFrames[k].FrameRVA, actual.StackFrames[k].FrameRVA);
+        Assert.AreEqual(expected.StackFrames[k].FrameDetails.Function.Name,
+                        actual.StackFrames[k].FrameDetails.Function.Name);
+      }
+    }
+  }
+}
@@ -0,0 +1,104 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class ResolvedProfileStackTableTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+
+  // Frames are given from the root, the resolved stack stores them from the top.
+  private static ResolvedProfileStack MakeStack(int threadId, params long[] rootFirstRvas) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstRvas.Length]);
+    var stack = new ResolvedProfileStack(rootFirstRvas.Length, context);
+
+    for (int i = rootFirstRvas.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      long rva = rootFirstRvas[i];
+      var func = new IRTextFunction($"func_{rva:X}");
+      var info = new FunctionDebugInfo(func.Name, rva, 16);
+      stack.AddFrame(func, Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+
+  [TestMethod]
+  public void SharedPrefixIsStoredOnce() {
+    ResolvedProfileStack.ResetCaches();
+    var table = new ResolvedProfileStackTable();
+    int stackA = table.Register(MakeStack(10, 0x100, 0x200, 0x300));
+    int stackB = table.Register(MakeStack(10, 0x100, 0x200, 0x400));
+    int stackC = table.Register(MakeStack(10, 0x100));
+
+    Assert.AreEqual(3, table.Count);
+    Assert.AreEqual(4, table.NodeCount);
+    Assert.AreEqual(3, table.GetNodeDepth(table.GetStackNode(stackA)));
+    Assert.AreEqual(1, table.GetNodeDepth(table.GetStackNode(stackC)));
+    Assert.AreEqual(table.GetParentNode(table.GetStackNode(stackA)),
+                    table.GetParentNode(table.GetStackNode(stackB)));
+    Assert.AreEqual(ResolvedProfileStackTable.RootNodeId,
+                    table.GetParentNode(table.GetStackNode(stackC)));
+  }
+
+  [TestMethod]
+  public void StackPathIsRootFirst() {
+    ResolvedProfileStack.ResetCaches();
+    var table = new ResolvedProfileStackTable();
+    int stackId = table.Register(MakeStack(10, 0x100, 0x200, 0x300));
+    Span<int> path = stackalloc int[3];
+
+    Assert.AreEqual(3, table.GetStackPath(stackId, path));
+    Assert.AreEqual(0x100, table.GetNodeFrame(path[0]).FrameRVA);
+    Assert.AreEqual(0x200, table.GetNodeFrame(path[1]).FrameRVA);
+    Assert.AreEqual(0x300, table.GetNodeFrame(path[2]).FrameRVA);
+  }
+
+  [TestMethod]
+  public void SameFramesOnOtherThreadShareStackNode() {
+    ResolvedProfileStack.ResetCaches();
+    var table = new ResolvedProfileStackTable();
+    var stackA = MakeStack(10, 0x100, 0x200);
+    var stackB = MakeStack(20, 0x100, 0x200);
+    int stackIdA = table.Register(stackA);
+    int stackIdB = table.Register(stackB);
+
+    Assert.AreNotEqual(stackIdA, stackIdB);
+    Assert.AreEqual(table.GetStackNode(stackIdA), table.GetStackNode(stackIdB));
+    Assert.AreEqual(2, table.NodeCount);
+    Assert.AreEqual(20, table[stackIdB].Context.ThreadId);
+  }
+
+  [TestMethod]
+  public void RegisteredStackReadsFramesFromTable() {
+    ResolvedProfileStack.ResetCaches();
+    var table = new ResolvedProfileStackTable();
+    var stack = MakeStack(10, 0x100, 0x200, 0x300);
+    var expected = new ResolvedProfileStackFrame[3];
+    stack.StackFrames.CopyTo(expected);
+    table.Register(stack);
+
+    // The frame list is dropped, the frames come from the prefix tree, top frame first.
+    Assert.AreSame(table, stack.StackTable);
+    Assert.AreEqual(3, stack.FrameCount);
+    Assert.AreEqual(0x300, stack.StackFrames[0].FrameRVA);
+    Assert.AreEqual(0x100, stack.StackFrames[2].FrameRVA);
+    int index = 0;
+
+    foreach (var frame in stack.StackFrames) {
+      Assert.AreSame(expected[index++], frame);
+    }
+
+    Assert.AreEqual(3, index);
+    var frames = new ResolvedProfileStackFrame[3];
+    Assert.AreEqual(3, stack.StackFrames.CopyTo(frames));
+    CollectionAssert.AreEqual(expected, frames);
+  }
+}
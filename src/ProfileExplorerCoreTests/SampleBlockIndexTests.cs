@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.Data;
+using ProfileExplorer.Core.Profile.Processing;
+using ProfileExplorer.Core.Profile.Timeline;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class SampleBlockIndexTests {
+  private const int BlockSize = 16;
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+
+  private static ProfileData CreateProfile() {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    var funcs = new[] {"main", "foo", "bar", "baz"}.
+      Select(name => new IRTextFunction(name)).ToArray();
+    var stacks = new[] {
+      MakeStack(10, funcs, 0, 1, 2),
+      MakeStack(10, funcs, 0, 1, 3),
+      MakeStack(20, funcs, 0, 1, 2),
+      MakeStack(20, funcs, 0, 3)
+    };
+
+    for (int i = 0; i < 100; i++) {
+      var stack = stacks[i * 7 % stacks.Length];
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromMilliseconds(i),
+                                             TimeSpan.FromMilliseconds(1 + i % 3), false, 0), stack));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    return profile;
+  }
+
+  // Frames are given by function index from the root.
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction[] funcs, params int[] rootFirstFuncs) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[rootFirstFuncs.Length]);
+    var stack = new ResolvedProfileStack(rootFirstFuncs.Length, context);
+
+    for (int i = rootFirstFuncs.Length - 1, frameIndex = 0; i >= 0; i--, frameIndex++) {
+      int funcIndex = rootFirstFuncs[i];
+      long rva = 0x100 * (funcIndex + 1);
+      var info = new FunctionDebugInfo(funcs[funcIndex].Name, rva, 16);
+      stack.AddFrame(funcs[funcIndex], Image.BaseAddress + rva, rva, frameIndex,
+                     new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    }
+
+    return stack;
+  }
+
+  private static ProfileSampleFilter MakeTimeRangeFilter(ProfileData profile, int startIndex, int endIndex) {
+    return new ProfileSampleFilter {
+      TimeRange = new SampleTimeRangeInfo(profile.Samples.TimeAt(startIndex),
+                                          profile.Samples.TimeAt(endIndex - 1),
+                                          startIndex, endIndex, -1)
+    };
+  }
+
+  private static void AssertSameFunctionProfiles(ProfileData expected, ProfileData actual) {
+    Assert.AreEqual(expected.TotalWeight, actual.TotalWeight);
+    Assert.AreEqual(expected.ProfileWeight, actual.ProfileWeight);
+    Assert.AreEqual(expected.FunctionProfiles.Count, actual.FunctionProfiles.Count);
+    CollectionAssert.AreEquivalent(expected.ModuleWeights, actual.ModuleWeights);
+
+    foreach ((var func, var expectedData) in expected.FunctionProfiles) {
+      var actualData = actual.FunctionProfiles[func];
+      Assert.AreEqual(expectedData.Weight, actualData.Weight, func.Name);
+      Assert.AreEqual(expectedData.ExclusiveWeight, actualData.ExclusiveWeight, func.Name);
+      Assert.AreEqual(expectedData.SampleStartIndex, actualData.SampleStartIndex, func.Name);
+      Assert.AreEqual(expectedData.SampleEndIndex, actualData.SampleEndIndex, func.Name);
+    }
+  }
+
+  [TestMethod]
+  public void HistogramMatchesSamplesForTimeRange() {
+    var profile = CreateProfile();
+    var index = SampleBlockIndex.Build(profile.Samples, BlockSize);
+    Assert.AreEqual(7, index.BlockCount);
+
+    // Ranges within a block, across two partial blocks and covering full blocks.
+    foreach ((int start, int end) in new[] {(3, 9), (10, 20), (5, 91), (16, 64), (0, 100)}) {
+      var filter = MakeTimeRangeFilter(profile, start, end);
+      var expected = FunctionProfileProcessor.Compute(profile, filter, 1);
+      var actual = FunctionProfileProcessor.Compute(profile, index.ComputeHistogram(filter), filter, 2);
+      AssertSameFunctionProfiles(expected, actual);
+    }
+  }
+
+  [TestMethod]
+  public void HistogramHonorsThreadFilter() {
+    var profile = CreateProfile();
+    var index = SampleBlockIndex.Build(profile.Samples, BlockSize);
+    var filter = MakeTimeRangeFilter(profile, 7, 83);
+    filter.AddThread(20);
+
+    var expected = FunctionProfileProcessor.Compute(profile, filter, 1);
+    var histogram = index.ComputeHistogram(filter);
+    var actual = FunctionProfileProcessor.Compute(profile, histogram, filter, 2);
+    AssertSameFunctionProfiles(expected, actual);
+
+    for (int stackId = 0; stackId < histogram.Count; stackId++) {
+      if (histogram.HasStack(stackId)) {
+        Assert.AreEqual(20, profile.Samples.Stacks[stackId].Context.ThreadId);
+      }
+    }
+  }
+}
@@ -0,0 +1,140 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core;
+using ProfileExplorer.Core.Binary;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class SampleTimeIndexTests {
+  private static readonly ProfileImage Image =
+    new("app.exe", "app.exe", 0x10000, 0x10000, 0x10000, 0, 0x1234) { Id = 1 };
+  private static readonly int[] ThreadIds = {-1, 10, 20};
+
+  // Samples of two threads running in alternating runs of random length,
+  // some samples sharing the same time.
+  private static ProfileData CreateProfile() {
+    ResolvedProfileStack.ResetCaches();
+    var profile = new ProfileData();
+    profile.Modules[Image.Id] = Image;
+    var func = new IRTextFunction("main");
+    var stacks = new[] {MakeStack(10, func), MakeStack(20, func)};
+    var random = new Random(7);
+    long time = 0;
+    int thread = 0;
+
+    for (int i = 0; i < 5000; i++) {
+      if (random.Next(8) == 0) {
+        thread = 1 - thread;
+      }
+
+      time += random.Next(3) * TimeSpan.TicksPerMillisecond;
+      profile.Samples.Add((new ProfileSample(0, TimeSpan.FromTicks(time),
+                                             TimeSpan.FromMilliseconds(1 + i % 3), false, 0), stacks[thread]));
+    }
+
+    profile.ComputeThreadSampleRanges();
+    return profile;
+  }
+
+  private static ResolvedProfileStack MakeStack(int threadId, IRTextFunction func) {
+    var context = new ProfileContext(1, threadId, 0);
+    var rawStack = new ProfileStack(contextId: 1, framePtrs: new long[1]);
+    var stack = new ResolvedProfileStack(1, context);
+    var info = new FunctionDebugInfo(func.Name, 0x100, 16);
+    stack.AddFrame(func, Image.BaseAddress + 0x100, 0x100, 0,
+                   new ResolvedProfileStackFrameKey(info, Image, false), rawStack, 8);
+    return stack;
+  }
+
+  private static bool IsThreadSample(ProfileData profile, int threadId, int index) {
+    return threadId == -1 || profile.Samples.ContextAt(index).ThreadId == threadId;
+  }
+
+  [TestMethod]
+  public void FindSampleMatchesScan() {
+    var profile = CreateProfile();
+    var samples = profile.Samples;
+    var endTime = samples.TimeAt(samples.Count - 1);
+
+    foreach (int threadId in ThreadIds) {
+      var index = profile.GetSampleTimeIndex(threadId);
+      Assert.AreSame(index, profile.GetSampleTimeIndex(threadId));
+
+      for (long ms = -1; ms <= endTime.TotalMilliseconds + 1; ms += 7) {
+        var time = TimeSpan.FromMilliseconds(ms);
+        int expectedFirst = Enumerable.Range(0, samples.Count).
+          FirstOrDefault(i => samples.TimeAt(i) >= time && IsThreadSample(profile, threadId, i), -1);
+        int expectedLast = Enumerable.Range(0, samples.Count).
+          LastOrDefault(i => samples.TimeAt(i) <= time && IsThreadSample(profile, threadId, i), -1);
+        Assert.AreEqual(expectedFirst, index.FindFirstSampleAtOrAfter(time), $"thread {threadId} at {ms}");
+        Assert.AreEqual(expectedLast, index.FindLastSampleAtOrBefore(time), $"thread {threadId} at {ms}");
+      }
+    }
+  }
+
+  [TestMethod]
+  public void SlicesMatchScan() {
+    var profile = CreateProfile();
+    var samples = profile.Samples;
+    var startTime = samples.TimeAt(0);
+
+    foreach (int threadId in ThreadIds) {
+      var index = profile.GetSampleTimeIndex(threadId);
+      Assert.IsTrue(index.LevelCount > 2);
+
+      // Slices aligned to the buckets, of the size of a few level 0 buckets
+      // or smaller, and larger ones using the upper levels.
+      long bucketTicks = index.BucketDuration(0).Ticks;
+
+      foreach (long sliceTicks in new[] {bucketTicks / 3, bucketTicks * 4, bucketTicks * 64}) {
+        var slices = index.ComputeSlices(startTime, sliceTicks, 1000);
+        int[] expectedCounts = new int[slices.Length];
+        long[] expectedWeights = new long[slices.Length];
+
+        for (int i = 0; i < samples.Count; i++) {
+          int sliceIndex = (int)((samples.TimeAt(i) - startTime).Ticks / sliceTicks);
+
+          if (IsThreadSample(profile, threadId, i) && sliceIndex < slices.Length) {
+            expectedCounts[sliceIndex]++;
+            expectedWeights[sliceIndex] += samples.Weights[i];
+          }
+        }
+
+        for (int i = 0; i < slices.Length; i++) {
+          Assert.AreEqual(expectedCounts[i], slices[i].SampleCount, $"thread {threadId} slice {i}");
+          Assert.AreEqual(expectedWeights[i], slices[i].Weight.Ticks, $"thread {threadId} slice {i}");
+
+          if (slices[i].SampleCount > 0) {
+            Assert.IsTrue(IsThreadSample(profile, threadId, slices[i].FirstSampleIndex));
+          }
+        }
+      }
+
+      // Unaligned slices still include all samples.
+      var threadSamples = Enumerable.Range(0, samples.Count).Count(i => IsThreadSample(profile, threadId, i));
+      var unalignedSlices = index.ComputeSlices(startTime, bucketTicks * 5.3, 10000);
+      Assert.AreEqual(threadSamples, unalignedSlices.Sum(slice => slice.SampleCount));
+
+      // Buckets crossing the boundaries of unaligned slices are split between them.
+      var unalignedStart = startTime + TimeSpan.FromTicks(bucketTicks * 7 / 3);
+
+      foreach (double sliceTicks in new[] {bucketTicks * 5.3, bucketTicks * 41.7}) {
+        var slices = index.ComputeSlices(unalignedStart, sliceTicks, 200);
+
+        for (int sliceIndex = 0; sliceIndex < slices.Length; sliceIndex++) {
+          var sliceSamples = Enumerable.Range(0, samples.Count).Where(i =>
+            IsThreadSample(profile, threadId, i) &&
+            Math.Floor((samples.TimeAt(i).Ticks - unalignedStart.Ticks) / sliceTicks) == sliceIndex).ToList();
+          Assert.AreEqual(sliceSamples.Count, slices[sliceIndex].SampleCount, $"thread {threadId} slice {sliceIndex}");
+          Assert.AreEqual(sliceSamples.Sum(i => samples.Weights[i]), slices[sliceIndex].Weight.Ticks);
+          Assert.AreEqual(sliceSamples.Count > 0 ? sliceSamples[0] : -1, slices[sliceIndex].FirstSampleIndex);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,147 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Diagnostics;
+using System.Runtime.CompilerServices;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Collections;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class SegmentCodecTests {
+  private const int SegmentLength = 2048;
+
+  // Samples of a few threads, with increasing times, IPs in a few modules
+  // and repeating stacks, similar to the samples of a trace.
+  private static ProfileSample[] CreateSamples(int count, int seed = 7) {
+    var random = new Random(seed);
+    long[] moduleBases = {0x7FF6_1234_0000, 0x7FFA_8000_0000, 0x7FFB_2000_0000, -0x7FFF_0000_0000};
+    var samples = new ProfileSample[count];
+    long time = 123_456_789;
+
+    for (int i = 0; i < count; i++) {
+      time += random.Next(100, 10000);
+      long ip = moduleBases[random.Next(moduleBases.Length)] + random.Next(0x100000);
+      samples[i] = new ProfileSample(ip, TimeSpan.FromTicks(time), TimeSpan.FromTicks(10000),
+                                     ip < 0, random.Next(1, 5)) {
+        StackId = random.Next(1, 1000)
+      };
+    }
+
+    return samples;
+  }
+
+  private static T[] RoundTrip<T>(ISegmentCodec<T> codec, T[] values) where T : struct {
+    byte[] data = codec.Compress(values);
+    var result = new T[values.Length];
+    codec.Decompress(data, result);
+    return result;
+  }
+
+  [TestMethod]
+  public void ColumnarCodecRoundTripsSamples() {
+    var samples = CreateSamples(SegmentLength);
+    CollectionAssert.AreEqual(samples, RoundTrip(ColumnarSegmentCodec<ProfileSample>.Instance, samples));
+
+    byte[] data = ColumnarSegmentCodec<ProfileSample>.Instance.Compress(samples);
+    Assert.IsTrue(data.Length < SegmentLength * Unsafe.SizeOf<ProfileSample>() / 3);
+  }
+
+  [TestMethod]
+  public void ColumnarCodecRoundTripsPackedStruct() {
+    // PerformanceCounterEvent is 22 bytes, the last column has only 2 bytes.
+    var random = new Random(11);
+    var events = new PerformanceCounterEvent[SegmentLength];
+
+    for (int i = 0; i < events.Length; i++) {
+      long ip = i % 7 == 0 ? long.MinValue + i : (i % 5 == 0 ? long.MaxValue - i : random.NextInt64());
+      events[i] = new PerformanceCounterEvent(ip, TimeSpan.FromTicks(i * 1000L), random.Next(1, 3),
+                                              (short)(i % 3 == 0 ? -1 : random.Next(short.MaxValue)));
+    }
+
+    CollectionAssert.AreEqual(events, RoundTrip(ColumnarSegmentCodec<PerformanceCounterEvent>.Instance, events));
+  }
+
+  [TestMethod]
+  public void ColumnarCodecRoundTripsEdgeCases() {
+    var codec = ColumnarSegmentCodec<TestGuidObject>.Instance;
+    Assert.AreEqual(0, RoundTrip(codec, Array.Empty<TestGuidObject>()).Length);
+
+    var single = new[] {TestGuidObject.Create()};
+    CollectionAssert.AreEqual(single, RoundTrip(codec, single));
+
+    // Random values need all 32 bits of each column.
+    var values = new TestGuidObject[SegmentLength];
+
+    for (int i = 0; i < values.Length; i++) {
+      values[i] = TestGuidObject.Create();
+    }
+
+    CollectionAssert.AreEqual(values, RoundTrip(codec, values));
+
+    // Identical values need no bits.
+    var constant = new TestObject[SegmentLength];
+    Array.Fill(constant, new TestObject {a = -1, b = 0, c = int.MaxValue, d = int.MinValue});
+    Assert.IsTrue(ColumnarSegmentCodec<TestObject>.Instance.Compress(constant).Length < 64);
+    CollectionAssert.AreEqual(constant, RoundTrip(ColumnarSegmentCodec<TestObject>.Instance, constant));
+  }
+
+  [TestMethod]
+  public void BrotliCodecRoundTripsSamples() {
+    var samples = CreateSamples(SegmentLength);
+    CollectionAssert.AreEqual(samples, RoundTrip(BrotliSegmentCodec<ProfileSample>.Instance, samples));
+  }
+
+  [TestMethod]
+  [TestCategory("Benchmark")]
+  public void Benchmark_SegmentCodecs() {
+    const int segmentCount = 500;
+    var samples = CreateSamples(SegmentLength * segmentCount);
+    var segments = new ProfileSample[segmentCount][];
+
+    for (int i = 0; i < segmentCount; i++) {
+      segments[i] = samples.AsSpan(i * SegmentLength, SegmentLength).ToArray();
+    }
+
+    // Warm up the JIT-compiled codec before measuring.
+    Measure("Columnar", ColumnarSegmentCodec<ProfileSample>.Instance, segments, false);
+    Console.WriteLine($"{segmentCount} segments of {SegmentLength} samples:");
+    Measure("Brotli", BrotliSegmentCodec<ProfileSample>.Instance, segments);
+    Measure("Columnar", ColumnarSegmentCodec<ProfileSample>.Instance, segments);
+  }
+
+  private static void Measure(string name, ISegmentCodec<ProfileSample> codec, ProfileSample[][] segments,
+                              bool print = true) {
+    var data = new byte[segments.Length][];
+    var decoded = new ProfileSample[SegmentLength];
+    long rawSize = (long)segments.Length * SegmentLength * Unsafe.SizeOf<ProfileSample>();
+    long compressedSize = 0;
+
+    var stopwatch = Stopwatch.StartNew();
+
+    for (int i = 0; i < segments.Length; i++) {
+      data[i] = codec.Compress(segments[i]);
+      compressedSize += data[i].Length;
+    }
+
+    var compressTime = stopwatch.Elapsed;
+    stopwatch.Restart();
+
+    for (int i = 0; i < segments.Length; i++) {
+      codec.Decompress(data[i], decoded);
+    }
+
+    var decompressTime = stopwatch.Elapsed;
+    CollectionAssert.AreEqual(segments[^1], decoded);
+
+    if (!print) {
+      return;
+    }
+
+    Console.WriteLine($"  {name}: ratio {(double)rawSize / compressedSize:F2}, " +
+                      $"compress {rawSize / compressTime.TotalSeconds / 1e9:F2} GB/s, " +
+                      $"decompress {rawSize / decompressTime.TotalSeconds / 1e9:F2} GB/s");
+  }
+}
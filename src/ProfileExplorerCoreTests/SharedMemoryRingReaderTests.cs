@@ -0,0 +1,76 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.IO.MemoryMappedFiles;
+using System.Threading;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Profile.Utils;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class SharedMemoryRingReaderTests {
+  private const int HeaderSize = 256;
+  private const int Capacity = 64;
+
+  [TestInitialize]
+  public void Initialize() {
+    // Named memory-mapped files are supported only on Windows.
+    if (!OperatingSystem.IsWindows()) {
+      Assert.Inconclusive("Shared memory transport requires Windows");
+    }
+  }
+
+  [TestMethod]
+  public void ReadsMessagesWrappingAroundRing() {
+    // Same layout the profiler creates, with the positions placed
+    // near the end of the data area so that the messages wrap around.
+    int processId = Environment.ProcessId;
+    using var mappedFile = MemoryMappedFile.CreateNew(SharedMemoryRingReader.MakeName(processId),
+                                                      HeaderSize + Capacity);
+    using var view = mappedFile.CreateViewAccessor();
+    long startPosition = 10 * Capacity + 50;
+    view.Write(0, 0x52584550u);
+    view.Write(4, 1);
+    view.Write(8, (long)Capacity);
+    view.Write(128, startPosition);
+
+    var messages = new List<byte[]>();
+    messages.Add(CreateMessage(2, new byte[] {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}));
+    messages.Add(CreateMessage(3, new byte[] {11, 12, 13}));
+    long position = startPosition;
+
+    foreach (byte[] message in messages) {
+      foreach (byte value in message) {
+        view.Write(HeaderSize + position % Capacity, value);
+        position++;
+      }
+    }
+
+    view.Write(64, position);
+
+    using var reader = SharedMemoryRingReader.Open(processId);
+    Assert.IsNotNull(reader);
+    reader.Stop(); // Consume what was written, then return.
+
+    var received = new List<(int Kind, byte[] Body)>();
+    reader.ReceiveMessages((header, body) => received.Add((header.Kind, body)), CancellationToken.None);
+
+    Assert.AreEqual(2, received.Count);
+    Assert.AreEqual(2, received[0].Kind);
+    CollectionAssert.AreEqual(new byte[] {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}, received[0].Body);
+    Assert.AreEqual(3, received[1].Kind);
+    CollectionAssert.AreEqual(new byte[] {11, 12, 13}, received[1].Body);
+    Assert.AreEqual(position, view.ReadInt64(128));
+    Assert.AreEqual(2, reader.Statistics.MessagesRead);
+  }
+
+  private static byte[] CreateMessage(int kind, byte[] body) {
+    byte[] message = new byte[8 + body.Length];
+    BitConverter.GetBytes(kind).CopyTo(message, 0);
+    BitConverter.GetBytes(message.Length).CopyTo(message, 4);
+    body.CopyTo(message, 8);
+    return message;
+  }
+}
@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Linq;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Profile.Data;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class StackFrameArenaTests {
+  private static readonly long[] KernelFrames = {unchecked((long)0xFFFFF80012340000), unchecked((long)0xFFFFF80012350000)};
+  private static readonly long[] UserFrames = {0x10100, 0x10200, 0x10300};
+
+  [TestMethod]
+  public void IdenticalStacksStoredOnce() {
+    var arena = new StackFrameArena();
+    int id1 = arena.Add(new long[] {1, 2, 3});
+    int id2 = arena.Add(new long[] {1, 2, 4});
+    int id3 = arena.Add(new long[] {1, 2, 3});
+    int id4 = arena.Add(new long[] {1, 2});
+
+    Assert.AreEqual(id1, id3);
+    Assert.AreNotEqual(id1, id2);
+    Assert.AreNotEqual(id1, id4);
+    Assert.AreEqual(3, arena.Count);
+    CollectionAssert.AreEqual(new long[] {1, 2, 4}, arena.GetFrames(id2).ToArray());
+    Assert.AreEqual(2, arena.GetFrameCount(id4));
+  }
+
+  [TestMethod]
+  public void EmptyStackHasNoFrames() {
+    var arena = new StackFrameArena();
+    Assert.AreEqual(StackFrameArena.EmptyStackId, arena.Add(ReadOnlySpan<long>.Empty));
+    Assert.AreEqual(0, arena.GetFrames(StackFrameArena.EmptyStackId).Length);
+    Assert.AreEqual(0, arena.Count);
+  }
+
+  [TestMethod]
+  public void ManyStacksAcrossBlocks() {
+    // Enough stacks to grow the hash table and allocate multiple frame blocks,
+    // including a stack larger than the initial block.
+    const int stackCount = 50000;
+    var arena = new StackFrameArena();
+    var ids = new int[stackCount];
+
+    for (int i = 0; i < stackCount; i++) {
+      ids[i] = arena.Add(CreateStack(i));
+    }
+
+    long[] largeStack = Enumerable.Range(0, 10000).Select(i => (long)i * 3).ToArray();
+    int largeId = arena.Add(largeStack);
+
+    for (int i = 0; i < stackCount; i++) {
+      Assert.AreEqual(ids[i], arena.Add(CreateStack(i)));
+    }
+
+    arena.LoadingCompleted();
+    Assert.AreEqual(stackCount + 1, arena.Count);
+    CollectionAssert.AreEqual(largeStack, arena.GetFrames(largeId).ToArray());
+
+    for (int i = 0; i < stackCount; i += 997) {
+      CollectionAssert.AreEqual(CreateStack(i), arena.GetFrames(ids[i]).ToArray());
+    }
+  }
+
+  [TestMethod]
+  public void KernelAndUserPartsPairedWithoutConcatenation() {
+    var rawProfile = new RawProfileData("synthetic.etl");
+    int kernelId = rawProfile.AddStackFrames(KernelFrames);
+    int userId = rawProfile.AddStackFrames(UserFrames);
+    int stackId = rawProfile.AddStack(1, kernelId, userId);
+    int userOnlyStackId = rawProfile.AddStack(1, StackFrameArena.EmptyStackId, userId);
+
+    Assert.AreEqual(stackId, rawProfile.AddStack(1, kernelId, userId));
+    Assert.AreNotEqual(stackId, rawProfile.AddStack(2, kernelId, userId));
+    Assert.AreNotEqual(stackId, userOnlyStackId);
+    Assert.AreEqual(userId, rawProfile.AddStackFrames(UserFrames.ToArray()));
+    rawProfile.LoadingCompleted();
+
+    // Kernel frames come first, followed by the user mode frames.
+    var stack = rawProfile.FindStack(stackId);
+    Assert.IsFalse(stack.IsUnknown);
+    Assert.AreEqual(5, stack.FrameCount);
+    Assert.AreEqual(KernelFrames.Length, stack.UserModeTransitionIndex);
+    Assert.AreEqual(KernelFrames[1], stack.GetFrame(1));
+    Assert.AreEqual(UserFrames[0], stack.GetFrame(2));
+
+    var frames = new long[stack.FrameCount];
+    stack.CopyFrames(frames);
+    CollectionAssert.AreEqual(KernelFrames.Concat(UserFrames).ToArray(), frames);
+
+    var userOnlyStack = rawProfile.FindStack(userOnlyStackId);
+    Assert.AreEqual(0, userOnlyStack.UserModeTransitionIndex);
+    Assert.AreEqual(UserFrames.Length, userOnlyStack.FrameCount);
+    Assert.AreEqual(userId, userOnlyStack.UserStackId);
+  }
+
+  private static long[] CreateStack(int index) {
+    // Stacks of varying length sharing the root frames.
+    var frames = new long[1 + index % 40];
+
+    for (int i = 0; i < frames.Length; i++) {
+      frames[i] = 0x7FF6_0000_0000 + (index + i) * 16L;
+    }
+
+    return frames;
+  }
+}
@@ -0,0 +1,123 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+using System;
+using System.Collections.Generic;
+using System.IO;
+using Microsoft.VisualStudio.TestTools.UnitTesting;
+using ProfileExplorer.Core.Binary;
+
+namespace ProfileExplorer.CoreTests;
+
+[TestClass]
+public class SymbolFileCacheTests {
+  private string cacheDir_;
+
+  [TestInitialize]
+  public void Setup() {
+    cacheDir_ = Path.Combine(Path.GetTempPath(), $"SymbolFileCacheTests_{Guid.NewGuid():N}");
+  }
+
+  [TestCleanup]
+  public void Cleanup() {
+    if (Directory.Exists(cacheDir_)) {
+      Directory.Delete(cacheDir_, true);
+    }
+  }
+
+  private static List<FunctionDebugInfo> CreateFunctions() {
+    var list = new List<FunctionDebugInfo> {
+      new("outer", 0x1000, 0x100),
+      new("inner", 0x1020, 0x10),
+      new("?foo@@YAXXZ", 0x2000, 0x40),
+      new(null, 0x3000, 0x8),
+      new("Ünïcode", 0x4000, 0x20)
+    };
+
+    list.Sort();
+    return list;
+  }
+
+  [TestMethod]
+  public void MappedLookupMatchesFunctionList() {
+    var symbolFile = new SymbolFileDescriptor("test.pdb", Guid.NewGuid(), 3);
+    var funcs = CreateFunctions();
+    Assert.IsTrue(SymbolFileCache.Serialize(symbolFile, funcs, true, cacheDir_));
+
+    using var symCache = SymbolFileCache.Open(symbolFile, cacheDir_);
+    Assert.IsNotNull(symCache);
+    Assert.AreEqual(funcs.Count, symCache.FunctionCount);
+    Assert.IsTrue(symCache.HasOverlappingFunctions);
+
+    foreach (long rva in new long[] {0x0, 0x1000, 0x1025, 0x10FF, 0x1100, 0x2010, 0x3004, 0x401F, 0x5000}) {
+      var expected = FunctionDebugInfo.BinarySearch(funcs, rva, true);
+      var actual = symCache.FindFunctionByRVA(rva);
+      Assert.AreEqual(expected?.Name, actual?.Name, $"RVA {rva:X}");
+      Assert.AreEqual(expected, actual, $"RVA {rva:X}");
+    }
+
+    // Functions are created once and shared by all queries.
+    Assert.AreSame(symCache.FindFunctionByRVA(0x2000), symCache.FindFunctionByRVA(0x2020));
+    CollectionAssert.AreEqual(funcs, symCache.CreateFunctionList());
+  }
+
+  [TestMethod]
+  public void SharedCacheMappedUntilLastReferenceDisposed() {
+    var symbolFile = new SymbolFileDescriptor("test.pdb", Guid.NewGuid(), 1);
+    Assert.IsTrue(SymbolFileCache.Serialize(symbolFile, CreateFunctions(), false, cacheDir_));
+
+    var symCache = SymbolFileCache.Open(symbolFile, cacheDir_);
+    var sharedCache = symCache.AddReference();
+    Assert.AreSame(symCache, sharedCache);
+
+    // The provider that mapped the file is disposed first.
+    symCache.Dispose();
+    Assert.AreEqual("outer", sharedCache.FindFunctionByRVA(0x1010).Name);
+
+    sharedCache.Dispose();
+    Assert.IsNull(symCache.AddReference());
+  }
+
+  [TestMethod]
+  public void MismatchedSymbolFileIsRejected() {
+    var symbolFile = new SymbolFileDescriptor("test.pdb", Guid.NewGuid(), 1);
+    Assert.IsTrue(SymbolFileCache.Serialize(symbolFile, CreateFunctions(), false, cacheDir_));
+
+    // Same file name, different age maps to another cache file.
+    Assert.IsNull(SymbolFileCache.Open(new SymbolFileDescriptor("test.pdb", symbolFile.Id, 2), cacheDir_));
+
+    using var symCache = SymbolFileCache.Open(symbolFile, cacheDir_);
+    Assert.IsNotNull(symCache);
+    Assert.IsFalse(symCache.HasOverlappingFunctions);
+  }
+
+  [TestMethod]
+  public void CorruptedFunctionIndexIsRejected() {
+    // Offsets in the file for "test.pdb" with 5 functions:
+    // header (64) + name (8), RVAs at 72, sizes at 112, name offsets at 136.
+    const int RVAsOffset = 72;
+    const int NameOffsetsOffset = 136;
+    var symbolFile = new SymbolFileDescriptor("test.pdb", Guid.NewGuid(), 1);
+    string cachePath = null;
+
+    void CorruptAndCheck(int offset, long value, int valueSize) {
+      Assert.IsTrue(SymbolFileCache.Serialize(symbolFile, CreateFunctions(), false, cacheDir_));
+      cachePath ??= Directory.GetFiles(cacheDir_)[0];
+      byte[] data = File.ReadAllBytes(cachePath);
+      BitConverter.GetBytes(value).AsSpan(0, valueSize).CopyTo(data.AsSpan(offset));
+      File.WriteAllBytes(cachePath, data);
+      Assert.IsNull(SymbolFileCache.Open(symbolFile, cacheDir_));
+    }
+
+    // Name offset outside the name pool.
+    CorruptAndCheck(NameOffsetsOffset + 8, 1000, sizeof(int));
+    // Last name offset not matching the name pool size.
+    CorruptAndCheck(NameOffsetsOffset + 5 * sizeof(int), 1, sizeof(int));
+    // RVAs not sorted.
+    CorruptAndCheck(RVAsOffset + 8, 0x9000, sizeof(long));
+
+    // Rebuilt cache is accepted again.
+    Assert.IsTrue(SymbolFileCache.Serialize(symbolFile, CreateFunctions(), false, cacheDir_));
+    using var symCache = SymbolFileCache.Open(symbolFile, cacheDir_);
+    Assert.IsNotNull(symCache);
+  }
+}
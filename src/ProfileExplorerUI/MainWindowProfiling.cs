@@ -75,7 +75,7 @@ public partial class MainWindow : Window, IUISession {
 
     if (result != null) {
       result.Report = report;
-      sessionState_.ProfileData = result;
+      await SetSessionProfileData(result);
       UpdateWindowTitle();
       UnloadProfilingDebugInfo();
       Trace.WriteLine($"LoadProfileData: Successfully set profile data in session");
@@ -112,7 +112,7 @@ public partial class MainWindow : Window, IUISession {
 
     if (result != null) {
       result.Report = report;
-      sessionState_.ProfileData = result;
+      await SetSessionProfileData(result);
       UpdateWindowTitle();
       UnloadProfilingDebugInfo();
     }
@@ -122,6 +122,38 @@ public partial class MainWindow : Window, IUISession {
     return result != null;
   }
 
+  // The previous profile stops its background symbolization
+  // and is no longer referenced by the window through its event.
+  private async Task SetSessionProfileData(ProfileData profileData) {
+    var previousProfile = sessionState_.ProfileData;
+
+    if (previousProfile != null && previousProfile != profileData) {
+      previousProfile.FunctionsRemapped -= ProfileFunctionsRemapped;
+      await previousProfile.CancelSymbolizationAsync();
+    }
+
+    sessionState_.ProfileData = profileData;
+
+    if (profileData != null) {
+      profileData.FunctionsRemapped -= ProfileFunctionsRemapped;
+      profileData.FunctionsRemapped += ProfileFunctionsRemapped;
+    }
+  }
+
+  private void ProfileFunctionsRemapped(object sender, EventArgs e) {
+    // With lazy symbolization, the profile was recomputed on a background
+    // thread with newly loaded symbols, show the new function names.
+    Dispatcher.BeginInvoke(async () => {
+      if (sender != ProfileData) {
+        return; // Another profile was loaded meanwhile.
+      }
+
+      allThreadsProfile_ = null;
+      await SectionPanel.RefreshProfile();
+      await RefreshProfilingPanels();
+    });
+  }
+
   public async Task<bool> FilterProfileSamples(ProfileFilterState state) {
     using var cancelableTask = await updateProfileTask_.CancelCurrentAndCreateTaskAsync();
 
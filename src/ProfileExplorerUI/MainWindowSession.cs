@@ -724,6 +724,7 @@ public partial class MainWindow : Window, IUISession {
 
     // Wait for any pending tasks to complete.
     await sessionState_.CancelPendingTasks();
+    await SetSessionProfileData(null);
 
     // Close all documents and notify all panels.
     NotifyPanelsOfSessionEnd();
@@ -939,7 +939,7 @@ public static class ProfilingUtils {
       if (tuple.TextLocation.Line >= startLine &&
           tuple.TextLocation.Line <= endLine) {
         if (metadataTag.ElementToOffsetMap.TryGetValue(tuple, out long offset) &&
-            funcProfile.InstructionWeight.TryGetValue(offset, out var weight)) {
+            funcProfile.Instructions.TryGetWeight(offset, out var weight)) {
           weightSum += weight;
           count++;
         }
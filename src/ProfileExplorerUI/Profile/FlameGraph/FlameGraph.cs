@@ -1,6 +1,7 @@
 ﻿// Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
 using System;
+using System.Buffers;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.Windows;
@@ -309,9 +310,11 @@ public sealed class FlameGraph {
   private void AddSample(FlameGraphNode rootNode, ProfileSample sample, ResolvedProfileStack stack) {
     var node = rootNode;
     int depth = 0;
+    var frames = ArrayPool<ResolvedProfileStackFrame>.Shared.Rent(stack.FrameCount);
+    int frameCount = stack.StackFrames.CopyTo(frames);
 
-    for (int k = stack.FrameCount - 1; k >= 0; k--) {
-      var resolvedFrame = stack.StackFrames[k];
+    for (int k = frameCount - 1; k >= 0; k--) {
+      var resolvedFrame = frames[k];
       
       if (resolvedFrame.FrameDetails.Function == null) {
         continue;
@@ -363,6 +366,8 @@ public sealed class FlameGraph {
       node = targetNode;
       depth++;
     }
+
+    ArrayPool<ResolvedProfileStackFrame>.Shared.Return(frames, true);
   }
 
   private FlameGraphNode Build(FlameGraphNode flameNode,
@@ -573,87 +573,40 @@ public partial class ActivityView : FrameworkElement, INotifyPropertyChanged {
       return new List<SliceList>();
     }
 
-    startTime_ = profile.Samples[0].Sample.Time;
-    endTime_ = profile.Samples[^1].Sample.Time;
+    startTime_ = profile.Samples.TimeAt(0);
+    endTime_ = profile.Samples.TimeAt(profile.Samples.Count - 1);
     double slices = (maxWidth_ / sliceWidth_) * (prevMaxWidth_ / maxWidth_);
 
     var timeDiff = endTime_ - startTime_;
     double timePerSlice = timeDiff.Ticks / slices;
-    double timePerSliceReciproc = 1.0 / timePerSlice;
-    var sliceSeriesDict = new Dictionary<int, SliceList>();
-
-    int sampleIndex = 0;
-    int prevSliceIndex = -1;
-    SliceList prevSliceList = null;
-    var currentSlice = new Slice(TimeSpan.Zero, -1, 0);
-    var dummySlice = new Slice(TimeSpan.Zero, -1, 0);
-
-    var ranges = profile.ThreadSampleRanges.Ranges[threadId];
-    var sampleSpan = CollectionsMarshal.AsSpan(profile.Samples);
-
-    foreach (var range in ranges) {
-      sampleIndex = range.StartIndex;
-
-      for (int k = range.StartIndex; k < range.EndIndex; k++) {
-        // if (threadId != -1 && stack.Context.ThreadId != threadId) {
-        //   sampleIndex++;
-        //   continue;
-        // }
-
-        ref var sample = ref sampleSpan[k].Sample;
-        int sliceIndex = (int)((sample.Time - startTime_).Ticks * timePerSliceReciproc);
-
-        //int queryThreadId = stack.Context.ThreadId;
-        int queryThreadId = 0;
-
-        if (sliceIndex != prevSliceIndex) {
-          if (currentSlice.FirstSampleIndex != -1 && prevSliceList != null) {
-            prevSliceList.Slices.Add(currentSlice);
-            prevSliceList.TotalWeight += currentSlice.Weight;
-            prevSliceList.MaxWeight = TimeSpan.FromTicks(Math.Max(prevSliceList.MaxWeight.Ticks,
-                                                                  currentSlice.Weight.Ticks));
-          }
-
-          if (!sliceSeriesDict.TryGetValue(queryThreadId, out var sliceList)) {
-            sliceList = new SliceList(queryThreadId, (int)Math.Ceiling(slices)) {
-              TimePerSlice = TimeSpan.FromTicks((long)timePerSlice),
-              MaxSlices = (int)slices
-            };
 
-            sliceSeriesDict[queryThreadId] = sliceList;
-          }
+    // The slices are computed from the time index of the thread samples,
+    // with a cost depending on the number of slices instead of samples.
+    var timeIndex = profile.GetSampleTimeIndex(threadId);
+    var timeSlices = timeIndex?.ComputeSlices(startTime_, timePerSlice, (int)slices + 1);
+    int lastSliceIndex = timeSlices != null ? Array.FindLastIndex(timeSlices, slice => slice.SampleCount > 0) : -1;
 
-          prevSliceIndex = sliceIndex;
-          prevSliceList = sliceList;
+    if (lastSliceIndex < 0) {
+      // Other code assumes there is at least one slice list, make a dummy one.
+      return new List<SliceList> {new(threadId)};
+    }
 
-          if (sliceIndex >= sliceList.Slices.Count) {
-            for (int i = sliceList.Slices.Count; i < sliceIndex; i++) {
-              sliceList.Slices.Add(dummySlice);
-            }
-          }
+    var sliceList = new SliceList(0, (int)Math.Ceiling(slices)) {
+      TimePerSlice = TimeSpan.FromTicks((long)timePerSlice),
+      MaxSlices = (int)slices
+    };
 
-          currentSlice = new Slice(TimeSpan.Zero, sampleIndex, 0);
-        }
+    for (int i = 0; i <= lastSliceIndex; i++) {
+      var timeSlice = timeSlices[i];
+      sliceList.Slices.Add(new Slice(timeSlice.Weight, timeSlice.FirstSampleIndex, timeSlice.SampleCount));
 
-        currentSlice.Weight += sample.Weight;
-        currentSlice.SampleCount++;
-        sampleIndex++;
+      if (timeSlice.SampleCount > 0) {
+        sliceList.TotalWeight += timeSlice.Weight;
+        sliceList.MaxWeight = TimeSpan.FromTicks(Math.Max(sliceList.MaxWeight.Ticks, timeSlice.Weight.Ticks));
       }
     }
 
-    if (currentSlice.FirstSampleIndex != -1 && prevSliceList != null) {
-      prevSliceList.Slices.Add(currentSlice);
-      prevSliceList.TotalWeight += currentSlice.Weight;
-      prevSliceList.MaxWeight = TimeSpan.FromTicks(Math.Max(prevSliceList.MaxWeight.Ticks,
-                                                            currentSlice.Weight.Ticks));
-    }
-
-    if (sliceSeriesDict.Count == 0) {
-      // Other code assumes there is at least one slice list, make a dummy one.
-      return new List<SliceList> {new(threadId)};
-    }
-
-    return sliceSeriesDict.ToValueList();
+    return new List<SliceList> {sliceList};
   }
 
   private void UpdateFilterState() {
@@ -1126,58 +1079,27 @@ public partial class ActivityView : FrameworkElement, INotifyPropertyChanged {
   }
 
   private int TimeToSampleIndex(TimeSpan time, TimeSpan timeRange) {
+    // Find the first sample of the thread at or after the time, within the time range.
     var queryTime = time + startTime_;
-    int sliceIndex = (int)(time.Ticks / slices_[0].TimePerSlice.Ticks);
-    timeRange += startTime_;
-
-    for (int i = sliceIndex; i < slices_[0].Slices.Count; i++) {
-      var slice = slices_[0].Slices[i];
-
-      if (slice.FirstSampleIndex >= 0) {
-        for (int sampleIndex = slice.FirstSampleIndex;
-             sampleIndex < slice.FirstSampleIndex + slice.SampleCount; sampleIndex++) {
-          if (profile_.Samples[sampleIndex].Sample.Time >= queryTime) {
-            if (!IsSingleThreadView || profile_.Samples[sampleIndex].Stack.Context.ThreadId == ThreadId) {
-              return sampleIndex;
-            }
-          }
-        }
-      }
+    int sampleIndex = profile_.GetSampleTimeIndex(ThreadId)?.FindFirstSampleAtOrAfter(queryTime) ?? -1;
 
-      if ((i + 1) * slices_[0].TimePerSlice > timeRange) {
-        break; // Early stop.
-      }
+    if (sampleIndex < 0 || profile_.Samples.TimeAt(sampleIndex) > queryTime + timeRange) {
+      return 0;
     }
 
-    return 0;
+    return sampleIndex;
   }
 
   private int TimeToSampleIndexBack(TimeSpan time, TimeSpan timeRange) {
+    // Find the last sample of the thread at or before the time, within the time range.
     var queryTime = time + startTime_;
-    int sliceIndex = (int)(time.Ticks / slices_[0].TimePerSlice.Ticks);
-    sliceIndex = Math.Min(sliceIndex, slices_[0].Slices.Count - 1);
-    timeRange += startTime_;
-
-    for (int i = sliceIndex; i >= 0; i--) {
-      var slice = slices_[0].Slices[i];
-
-      if (slice.FirstSampleIndex >= 0) {
-        for (int sampleIndex = slice.FirstSampleIndex + slice.SampleCount - 1; sampleIndex >= slice.FirstSampleIndex;
-             sampleIndex--) {
-          if (profile_.Samples[sampleIndex].Sample.Time <= queryTime) {
-            if (!IsSingleThreadView || profile_.Samples[sampleIndex].Stack.Context.ThreadId == ThreadId) {
-              return sampleIndex;
-            }
-          }
-        }
-      }
+    int sampleIndex = profile_.GetSampleTimeIndex(ThreadId)?.FindLastSampleAtOrBefore(queryTime) ?? -1;
 
-      if ((sliceIndex - i + 1) * slices_[0].TimePerSlice > timeRange) {
-        break; // Early stop.
-      }
+    if (sampleIndex < 0 || profile_.Samples.TimeAt(sampleIndex) < queryTime - timeRange) {
+      return 0;
     }
 
-    return 0;
+    return sampleIndex;
   }
 
   private double EstimateCpuUsage(Slice slice, TimeSpan timePerSlice, TimeSpan samplingInterval) {
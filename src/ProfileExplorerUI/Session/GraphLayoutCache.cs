@@ -1,8 +1,10 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+using System;
 using System.Collections.Generic;
 using System.Diagnostics;
 using System.Threading;
+using System.Threading.Tasks;
 using ProfileExplorer.Core;
 using ProfileExplorer.Core.Graph;
 using ProfileExplorer.Core.IR;
@@ -11,120 +13,147 @@ using ProfileExplorer.Core.Utilities;
 namespace ProfileExplorer.UI;
 
 public class GraphLayoutCache {
+  // The cache directory is trimmed after the first layout saved
+  // by the session, then after each batch of new layouts.
+  private const int TrimCacheDirectoryInterval = 256;
+  private static int savedLayoutCount_;
   private GraphKind graphKind_;
-  private Dictionary<IRTextSection, CompressedString> graphLayout_;
-  private Dictionary<byte[], CompressedString> shapeGraphLayout_;
+  private Dictionary<IRTextSection, GraphLayoutData> graphLayout_;
+  private Dictionary<string, GraphLayoutData> shapeGraphLayout_;
+  private Dictionary<IRTextFunction, Dictionary<string, double>> functionNodePositions_;
+  private string cacheDirectoryPath_;
   private ReaderWriterLockSlim rwLock_;
 
   public GraphLayoutCache(GraphKind graphKind) {
     graphKind_ = graphKind;
-    shapeGraphLayout_ = new Dictionary<byte[], CompressedString>();
-    graphLayout_ = new Dictionary<IRTextSection, CompressedString>();
+    shapeGraphLayout_ = new Dictionary<string, GraphLayoutData>();
+    graphLayout_ = new Dictionary<IRTextSection, GraphLayoutData>();
+    functionNodePositions_ = new Dictionary<IRTextFunction, Dictionary<string, double>>();
+    cacheDirectoryPath_ = GraphLayoutData.DefaultCacheDirectoryPath;
     rwLock_ = new ReaderWriterLockSlim();
   }
 
   public Graph GenerateGraph<T, U>(T element, IRTextSection section, CancelableTask task,
                                    U options = null) where T : class where U : class {
-    GraphVizPrinter printer = null;
-    string graphText;
-
-    try {
-      rwLock_.EnterUpgradeableReadLock();
-
-      //? TODO: Currently only FunctionIR graphs (flow, dominator, etc) are cached.
-      bool useCache = typeof(T) == typeof(FunctionIR);
+    // The graph is laid out in-process, recording its nodes and edges
+    // is cheap compared to the layout and needed to create the Graph object
+    // even when a cached layout is found.
+    var printer = GraphPrinterFactory.CreateInstance(graphKind_, element, options);
+    var layout = printer.CreateLayout(graphKind_);
+
+    if (layout == null) {
+      // Recording the graph failed for some reason, like running out of memory.
+      return null;
+    }
 
-      if (useCache && graphLayout_.TryGetValue(section, out var graphData)) {
+    //? TODO: Currently only FunctionIR graphs (flow, dominator, etc) are cached.
+    bool useCache = typeof(T) == typeof(FunctionIR);
+    GraphLayoutData layoutData = null;
+    byte[] structureHash = null;
+    string structureKey = null;
+    Dictionary<string, double> previousPositions = null;
+    bool isSectionCached = false;
+
+    if (useCache) {
+      // Check if a graph with the same structure was laid out before, since
+      // the resulting layout will be identical even though the function is not.
+      // The structure is looked up using a SHA256 hash, also used to name
+      // the layout file saved by a previous session.
+      structureHash = layout.ComputeStructureHash();
+      structureKey = Convert.ToHexString(structureHash);
+
+      try {
+        rwLock_.EnterReadLock();
+
+        if (graphLayout_.TryGetValue(section, out layoutData)) {
+          isSectionCached = true;
 #if DEBUG
-        Trace.TraceInformation($"Graph cache: Loading cached section graph for {section}");
+          Trace.TraceInformation($"Graph cache: Loading cached section graph for {section}");
 #endif
-        graphText = graphData.ToString();
-      }
-      else {
-        // Check if the same Graphviz input was used before, since
-        // the resulting graph will be identical even though the function is not.
-        printer ??= GraphPrinterFactory.CreateInstance(graphKind_, element, options);
-        string inputText = printer.PrintGraph();
-
-        if (string.IsNullOrEmpty(inputText)) {
-          // Printing the graph failed for some reason, like running out of memory.
-          return null;
         }
-
-        // The input text is looked up using a SHA256 hash that basically makes each
-        // input unique, use justs 32 bytes of memory and faster to look up.
-        byte[] inputTextHash = CompressionUtils.CreateSHA256(inputText);
-
-        if (useCache && shapeGraphLayout_.TryGetValue(inputTextHash, out var shapeGraphData)) {
+        else if (shapeGraphLayout_.TryGetValue(structureKey, out layoutData)) {
 #if DEBUG
           Trace.TraceInformation($"Graph cache: Loading cached graph layout for {section}");
 #endif
-          // Associate graph layout with the section.
-          graphText = shapeGraphData.ToString(); // Decompress.
-          CacheGraphLayoutAndShape(section, shapeGraphData);
         }
-        else {
-          // This is a new graph layout that must be computed through Graphviz.
+        else if (section?.ParentFunction != null) {
+          // Start from the node order of the last graph of the same function,
+          // so the graph doesn't change more than needed between sections.
+          functionNodePositions_.TryGetValue(section.ParentFunction, out previousPositions);
+        }
+      }
+      finally {
+        rwLock_.ExitReadLock();
+      }
+
+      // The layout files are read and written outside the lock,
+      // a graph laid out twice by concurrent requests is harmless.
+      if (layoutData == null) {
+        layoutData = GraphLayoutData.Load(structureHash, cacheDirectoryPath_);
+      }
+
+      if (layoutData != null && !isSectionCached) {
+        CacheGraphLayout(section, structureKey, layoutData, null);
+      }
+    }
+
+    if (layoutData == null) {
 #if DEBUG
-          Trace.TraceInformation($"Graph cache: Compute new graph layout for {section}");
+      Trace.TraceInformation($"Graph cache: Compute new graph layout for {section}");
 #endif
-          graphText = printer.CreateGraph(inputText, task);
+      layoutData = layout.Compute(task, previousPositions);
 
-          if (string.IsNullOrEmpty(graphText)) {
-            Trace.TraceWarning($"Graph cache: Failed to create graph for {section}");
-            return null; // Failed or canceled by user.
-          }
+      if (layoutData == null) {
+        Trace.TraceWarning($"Graph cache: Failed to create graph for {section}");
+        return null; // Failed or canceled by user.
+      }
 
-          if (useCache) {
-            CacheGraphLayoutAndShape(section, graphText, inputTextHash);
-          }
-        }
+      if (useCache) {
+        CacheGraphLayout(section, structureKey, layoutData, layout.GetNodePositions(layoutData));
+        SaveGraphLayout(layoutData, structureHash);
       }
     }
-    finally {
-      rwLock_.ExitUpgradeableReadLock();
-    }
 
-    // Parse the graph layout output from Graphviz to build
-    // the actual Graph object with nodes and edges.
-    printer ??= GraphPrinterFactory.CreateInstance(graphKind_, element, options);
-    var blockNodeMap = printer.CreateNodeDataMap();
-    var blockNodeGroupsMap = printer.CreateNodeDataGroupsMap();
-    var graphReader = new GraphvizReader(graphKind_, graphText, blockNodeMap);
-    var layoutGraph = graphReader.ReadGraph();
+    // Build the actual Graph object with nodes and edges.
+    var layoutGraph = layout.CreateGraph(layoutData, printer.CreateNodeDataMap());
 
     if (layoutGraph != null) {
       layoutGraph.GraphOptions = options;
-      layoutGraph.DataNodeGroupsMap = blockNodeGroupsMap;
+      layoutGraph.DataNodeGroupsMap = printer.CreateNodeDataGroupsMap();
     }
 
     return layoutGraph;
   }
 
+  private void SaveGraphLayout(GraphLayoutData layoutData, byte[] structureHash) {
+    string directoryPath = cacheDirectoryPath_;
+
+    Task.Run(() => {
+      layoutData.Save(structureHash, directoryPath);
+
+      if (Interlocked.Increment(ref savedLayoutCount_) % TrimCacheDirectoryInterval == 1) {
+        GraphLayoutData.TrimCacheDirectory(directoryPath);
+      }
+    });
+  }
+
   public void ClearCache() {
     graphLayout_.Clear();
     shapeGraphLayout_.Clear();
+    functionNodePositions_.Clear();
   }
 
-  private void CacheGraphLayoutAndShape(IRTextSection section, CompressedString shapeGraphData) {
+  private void CacheGraphLayout(IRTextSection section, string structureKey, GraphLayoutData layoutData,
+                                Dictionary<string, double> nodePositions) {
     // Acquire the write lock before updating shared data.
     try {
       rwLock_.EnterWriteLock();
-      graphLayout_.Add(section, shapeGraphData);
-    }
-    finally {
-      rwLock_.ExitWriteLock();
-    }
-  }
-
-  private void CacheGraphLayoutAndShape(IRTextSection section, string graphText, byte[] inputTextHash) {
-    var compressedGraphText = new CompressedString(graphText);
+      graphLayout_[section] = layoutData;
+      shapeGraphLayout_[structureKey] = layoutData;
 
-    // Acquire the write lock before updating shared data.
-    try {
-      rwLock_.EnterWriteLock();
-      graphLayout_[section] = compressedGraphText;
-      shapeGraphLayout_[inputTextHash] = compressedGraphText;
+      if (nodePositions != null && section.ParentFunction != null) {
+        functionNodePositions_[section.ParentFunction] = nodePositions;
+      }
     }
     finally {
       rwLock_.ExitWriteLock();
@@ -37,15 +37,12 @@ class CallGraphUtils {
     };
 
     var printer = new CallGraphPrinter(cg, options);
-    string result = printer.PrintGraph();
-    string graphText = printer.CreateGraph(result, new CancelableTask());
+    var layoutGraph = printer.CreateLayoutGraph(GraphKind.CallGraph, new CancelableTask());
 
-    if (string.IsNullOrEmpty(graphText)) {
+    if (layoutGraph == null) {
       return new Graph(GraphKind.CallGraph);
     }
 
-    var graphReader = new GraphvizReader(GraphKind.CallGraph, graphText, printer.CreateNodeDataMap());
-    var layoutGraph = graphReader.ReadGraph();
     layoutGraph.GraphOptions = options;
     return layoutGraph;
   }